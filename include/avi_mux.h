@@ -0,0 +1,71 @@
+/**
+ * Streaming AVI (MJPEG) muxer.
+ *
+ * Memory use is the muxer struct, whatever the recording length: frames go
+ * straight to the file and their idx1 entries to a side file next to it
+ * (clip.avi -> clip.idx), which is copied behind the movi list on close.
+ *
+ * Every AVI_MUX_SYNC_MS of recorded time the header sizes and frame count
+ * are patched and both files synced, so after a power cut the AVI plays up
+ * to the last sync point without any repair. avi_mux_repair goes further:
+ * it takes the frames the side file vouches for, picks up complete frames
+ * written after its last sync, truncates the torn tail and closes the file
+ * properly. A side file that still exists marks an unclosed recording.
+ *
+ * No platform dependencies beyond stdio and POSIX truncate, so the muxer and
+ * the repair run on the host against recorded or truncated files
+ * (test/test_avi_mux).
+ */
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AVI_MUX_HEADER_SIZE 224                     // through the movi fourcc; frame data follows
+#define AVI_MUX_SYNC_MS     2000
+#define AVI_MUX_MAX_BYTES   (1000UL * 1024 * 1024)  // AVI 1.0 players stop near 1 GB; start a new file
+#define AVI_MUX_PATH_MAX    64
+#define AVI_MUX_INDEX_ENTRY 16                      // idx1 bytes per frame
+
+typedef struct {
+  FILE *f;
+  FILE *idx;
+  char path[AVI_MUX_PATH_MAX];
+  uint16_t width;
+  uint16_t height;
+  uint32_t frame_us;      // nominal period, replaced by the measured one once there are frames
+  uint32_t frames;
+  uint32_t end;           // file offset after the last frame
+  uint32_t max_frame;
+  int64_t first_ts_us;
+  int64_t last_ts_us;
+  int64_t synced_ts_us;
+  uint32_t syncs;
+} avi_mux_t;
+
+/* The side index path for an AVI path. */
+void avi_mux_index_path(const char *path, char *out, size_t len);
+
+/* Creates path and its side index and writes a header for an empty recording. */
+bool avi_mux_open(avi_mux_t *m, const char *path, uint16_t width, uint16_t height, uint32_t frame_us);
+
+/*
+ * Appends one JPEG frame captured at ts_us (any monotonic microsecond
+ * clock). False when writing failed or the file would pass AVI_MUX_MAX_BYTES;
+ * the recording stays valid up to the previous frame either way.
+ */
+bool avi_mux_write(avi_mux_t *m, const uint8_t *jpg, size_t len, int64_t ts_us);
+
+/* Patches the header and syncs both files; avi_mux_write does it on its own schedule. */
+bool avi_mux_sync(avi_mux_t *m);
+
+/* Appends idx1, finalises the header and removes the side index. */
+bool avi_mux_close(avi_mux_t *m);
+
+/*
+ * Recovers an unclosed recording from its side index; frames is set to the
+ * number kept. False if there is nothing to repair or the file is not one
+ * of ours.
+ */
+bool avi_mux_repair(const char *path, uint32_t *frames);
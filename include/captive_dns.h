@@ -0,0 +1,18 @@
+/**
+ * Captive-portal DNS responder.
+ *
+ * Runs in its own task blocked on a UDP socket and answers every A query with
+ * the AP address, so replies leave as soon as the query arrives instead of
+ * waiting for loop() to poll.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+/* ip is the IPv4 address to answer with, in network byte order. */
+esp_err_t captive_dns_start(uint16_t port, uint32_t ip);
+
+/* Appends a JSON object with query/latency counters; returns chars written. */
+int captive_dns_stats_json(char *buf, size_t len);
@@ -0,0 +1,122 @@
+/**
+ * Frame capture front end.
+ *
+ * Every consumer (HTTP streams and stills, RTSP, multicast, substreams)
+ * takes frames through here rather than from esp_camera directly, so
+ * per-frame policy sees each captured frame exactly once: the JPEG rate
+ * controller, which retunes the sensor's quality setting, and the
+ * resolution switch, which needs to know when no frame buffer is in use.
+ * The same view lets the capture supervisor notice a wedged camera from any
+ * consumer's failures and restart it while sessions stay open, and lets a
+ * recorded file stand in for the camera (replay.h) without consumers
+ * noticing.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_camera.h"
+#include "rate_control.h"
+#include "replay.h"
+
+#define CAPTURE_QUIESCE_MS         2000   // max wait for consumers to return their frames
+#define CAPTURE_MAX_FB_COUNT       3
+#define CAPTURE_FAIL_LIMIT         3      // failed captures in a row before a recovery
+#define CAPTURE_STALL_MS           5000   // a capture pending this long without a frame
+#define CAPTURE_RECOVER_QUIESCE_MS 6000   // esp_camera_fb_get gives up after ~4 s
+#define CAPTURE_RETRY_MS           5000   // first retry while OFFLINE, doubling
+#define CAPTURE_RETRY_MAX_MS       60000
+#define CAPTURE_XCLK_COUNT         3
+
+typedef enum {
+  CAPTURE_OK,
+  CAPTURE_SWITCHING,   // a planned switch holds new captures back; a gap, not an error
+  CAPTURE_RECOVERING,  // the supervisor is restarting the camera; a gap, not an error
+  CAPTURE_OFFLINE,     // every XCLK option failed; retried later
+} capture_state_t;
+
+/* XCLK options tried at boot and by the supervisor, in order. */
+extern const int capture_xclk_hz[CAPTURE_XCLK_COUNT];
+
+/*
+ * Remembers the configuration the camera was started with, for reallocation
+ * and recovery, and starts the supervisor.
+ */
+esp_err_t capture_init(const camera_config_t *config);
+
+capture_state_t capture_state();
+
+/*
+ * Waits up to about a second while a resolution switch or a recovery is in
+ * progress, then returns NULL, with capture_state() saying which; NULL at
+ * once while OFFLINE.
+ */
+camera_fb_t *capture_fb_get();
+void capture_fb_return(camera_fb_t *fb);
+
+/*
+ * Changes the JPEG frame size under running consumers: new captures wait,
+ * frames in use are returned, stale frames are drained, and the frame buffers
+ * are reallocated (camera restarted with the sensor settings carried over)
+ * when the new size does not fit the current allocation. Consumers keep
+ * their sessions and see frames of the new size once capture resumes.
+ */
+esp_err_t capture_set_framesize(framesize_t framesize);
+
+/*
+ * Restarts the camera with count frame buffers, under running consumers the
+ * same way as a reallocating resolution switch. One buffer also means
+ * CAMERA_GRAB_WHEN_EMPTY.
+ */
+esp_err_t capture_set_fb_count(size_t count);
+size_t capture_get_fb_count();
+
+/*
+ * Switches the frame source under running consumers, at a frame boundary
+ * like a resolution switch: replay the given file, or, with NULL, go back to
+ * the camera. Replayed frames bypass rate control and the supervisor.
+ */
+esp_err_t capture_set_source(const replay_config_t *replay);
+
+typedef int (*capture_batch_fn_t)(sensor_t *s, void *arg);
+
+/*
+ * Runs fn (0 for success) on the sensor at a frame boundary: new captures
+ * wait and every frame in use has been returned, as for a resolution
+ * switch. The frames captured before or during fn are discarded, so no
+ * consumer sees one made under half-applied settings. fn's own time goes
+ * to burst_us, the whole stop to gap_us.
+ */
+esp_err_t capture_sensor_batch(capture_batch_fn_t fn, void *arg, uint32_t *burst_us, uint32_t *gap_us);
+
+/*
+ * Sets the XCLK the camera runs at and is restarted with. While the sensor
+ * is slowed for idle, the new clock takes effect when it is sped up again.
+ */
+esp_err_t capture_set_xclk(int mhz);
+
+/*
+ * Slows the sensor to mhz while the device idles (a clock at or above the
+ * camera's own is ignored), or with 0 puts it back on the camera's XCLK,
+ * whichever that is after restarts and recoveries. The setting survives a
+ * camera restart. Without wait, returns ESP_ERR_TIMEOUT instead of waiting
+ * for a switch or recovery to finish.
+ */
+esp_err_t capture_set_idle_xclk(int mhz, bool wait);
+
+/*
+ * Changes whenever the camera was restarted, its frame size switched or its
+ * XCLK changed, i.e. whenever cached register values may no longer hold.
+ */
+uint32_t capture_sensor_epoch();
+
+/* Re-applies a saved sensor status, e.g. after the camera was restarted. */
+void capture_restore_status(sensor_t *s, const camera_status_t *status);
+
+void capture_rate_get_config(rate_control_config_t *config);
+/* Starts (or stops, with RATE_CONTROL_OFF) rate control from the current quality. */
+esp_err_t capture_rate_set_config(const rate_control_config_t *config);
+
+int capture_rate_json(char *buf, size_t len);
+int capture_stats_json(char *buf, size_t len);
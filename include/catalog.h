@@ -0,0 +1,107 @@
+/**
+ * Time index of the recordings.
+ *
+ * One file per card (CATALOG_FILE in the recording directory) holding a
+ * header and one fixed-width record per closed segment, appended in time
+ * order, so the segments covering a moment are found by binary search over
+ * the file: a handful of 48-byte reads, with no directory walk and no AVI
+ * opened. Each segment also gets a seek table next to it (000012.avi ->
+ * 000012.sek): a header and one 12-byte entry per frame with its time and
+ * where its JPEG lies in the AVI, so the frame nearest a moment is a second
+ * binary search and a single Range request away.
+ *
+ * Times are "catalog time", microseconds: Unix time when the wall clock was
+ * set (CATALOG_WALL on the entry), otherwise a count that carries on from
+ * the previous entry across reboots so the file stays ordered either way.
+ *
+ * All integers are little endian. No platform dependencies beyond stdio and
+ * POSIX truncate, like avi_mux.h, so catalogs can be read and checked on the
+ * host (test/test_catalog).
+ */
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CATALOG_FILE          "catalog.bin"
+#define CATALOG_HEADER_SIZE   16
+#define CATALOG_ENTRY_SIZE    48
+#define CATALOG_SEEK_HEADER   24
+#define CATALOG_SEEK_ENTRY    12
+
+// catalog_entry_t.flags
+#define CATALOG_WALL          0x0001   // times are Unix time
+#define CATALOG_MOTION        0x0002   // motion_frames > 0
+#define CATALOG_REPAIRED      0x0004   // closed by avi_mux_repair after a power cut
+#define CATALOG_SHIFTED       0x0008   // moved later to stay after the previous entry (clock went back)
+
+// catalog_frame_t.size
+#define CATALOG_FRAME_MOTION  0x80000000u
+#define CATALOG_FRAME_SIZE    0x7fffffffu
+
+typedef struct {
+  int64_t start_us;        // first frame, catalog time
+  int64_t end_us;          // last frame
+  uint32_t seq;            // the segment: <seq>.avi and <seq>.sek
+  uint32_t frames;
+  uint32_t bytes;          // AVI file size
+  uint32_t index_offset;   // of its idx1 chunk
+  uint32_t motion_frames;
+  uint16_t width;
+  uint16_t height;
+  uint16_t flags;
+} catalog_entry_t;
+
+typedef struct {
+  uint32_t dt_us;          // after the segment's first frame
+  uint32_t offset;         // of the JPEG data in the AVI
+  uint32_t size;           // JPEG bytes, CATALOG_FRAME_MOTION if the scene changed
+} catalog_frame_t;
+
+/*
+ * Makes path a valid catalog: creates it, drops a torn last record, or
+ * starts it over if it is not a catalog. Sets the record count and, if
+ * there is one, the last record.
+ */
+bool catalog_check(const char *path, uint32_t *count, catalog_entry_t *last);
+
+/*
+ * Appends e, made durable before returning. If e starts before the last
+ * record ends it is moved later and flagged CATALOG_SHIFTED, which keeps
+ * the file sorted by both start and end.
+ */
+bool catalog_append(const char *path, catalog_entry_t *e);
+
+/* Records in an open catalog. */
+uint32_t catalog_count(FILE *f);
+bool catalog_read(FILE *f, uint32_t i, catalog_entry_t *e);
+
+/* The first record of count that ends at or after t_us; count if none does. */
+uint32_t catalog_find(FILE *f, uint32_t count, int64_t t_us);
+
+/* The seek table path for an AVI path. */
+void catalog_seek_path(const char *avi_path, char *out, size_t len);
+
+/* Starts a seek table for a segment; takes start_us, width, height and flags from e. */
+FILE *catalog_seek_create(const char *path, const catalog_entry_t *e);
+bool catalog_seek_append(FILE *f, const catalog_frame_t *frame);
+
+/* Makes the entries appended so far durable; the recorder does it at each AVI sync. */
+bool catalog_seek_sync(FILE *f);
+
+/* Reads a seek table header into start_us, width, height and flags of e; frames is the number of whole entries. */
+bool catalog_seek_info(FILE *f, catalog_entry_t *e, uint32_t *frames);
+
+/*
+ * Fills e, all but seq, bytes and index_offset, from the header and first
+ * frames entries of a seek table (fewer if it is shorter): the record of a
+ * segment a power cut left unclosed. False for zero frames.
+ */
+bool catalog_seek_summary(FILE *f, uint32_t frames, catalog_entry_t *e);
+
+/* Reads entry i of a seek table. */
+bool catalog_seek_read(FILE *f, uint32_t i, catalog_frame_t *frame);
+
+/* The frame of the first frames entries nearest dt_us after the first one. */
+bool catalog_seek_nearest(FILE *f, uint32_t frames, uint32_t dt_us, uint32_t *index, catalog_frame_t *frame);
@@ -0,0 +1,48 @@
+/**
+ * Change detection on compressed frames.
+ *
+ * Keeps a thumbnail of the luma DC coefficients (one value per MCU) of the
+ * last changed frame a session sent and compares each new frame against it,
+ * so a stream can skip frames of a static scene without decoding any pixels.
+ * Unchanged frames are still let through every CHANGE_GATE_KEEPALIVE_MS so
+ * viewers and proxies see the stream is alive.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "jpeg_dct.h"
+
+#define CHANGE_GATE_DC_THRESHOLD     48    // dequantised luma DC step (8 per grey level)
+#define CHANGE_GATE_MIN_PERMILLE     4     // share of MCUs that must change
+#define CHANGE_GATE_KEEPALIVE_MS     2000
+
+typedef enum {
+  CHANGE_GATE_SKIP,
+  CHANGE_GATE_CHANGED,
+  CHANGE_GATE_KEEPALIVE,
+} change_gate_result_t;
+
+typedef struct {
+  jpeg_info_t *info;
+  int16_t *ref;            // luma DC per MCU of the last frame sent
+  int16_t *cur;            // same for the frame being checked
+  uint32_t ref_mcus;
+  uint16_t ref_width;
+  uint16_t ref_height;
+  int64_t last_sent_us;
+  uint32_t sent;
+  uint32_t skipped;
+  uint32_t skipped_run;    // skipped since the last frame sent
+  uint32_t keepalives;
+  uint64_t bytes_saved;
+} change_gate_t;
+
+esp_err_t change_gate_init(change_gate_t *gate);
+void change_gate_free(change_gate_t *gate);
+
+/* Decides whether a frame goes out; frames that cannot be parsed always do. */
+change_gate_result_t change_gate_check(change_gate_t *gate, const uint8_t *jpg, size_t len, int64_t now_us);
+
+int change_gate_stats_json(char *buf, size_t len);
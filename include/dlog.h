@@ -0,0 +1,66 @@
+/**
+ * Deferred binary logger for hot paths.
+ *
+ * A call stores the format string's address and up to DLOG_MAX_ARGS integer
+ * arguments in a lock-free ring and returns; a low-priority task formats the
+ * records later and writes them to the enabled sinks (Serial, a file on
+ * SPIFFS, and an in-memory tail served on /logs). Producers never block: when
+ * the ring is full the record is dropped and counted.
+ *
+ * Like log_i, dlog_i compiles to nothing when the build's log level is below
+ * INFO, so release builds pay nothing for it; dlog_e is always kept.
+ *
+ * Formats must be string literals, and arguments are stored as 32-bit
+ * integers, so only %d/%u/%x/%c style conversions are allowed. No %s, no
+ * floating point, no 64-bit values.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp32-hal-log.h"
+
+#define DLOG_MAX_ARGS   6
+#define DLOG_RING_SLOTS 256   // power of two
+#define DLOG_TAIL_BYTES 4096  // text kept for /logs
+
+#define DLOG_SINK_SERIAL (1 << 0)
+#define DLOG_SINK_SPIFFS (1 << 1)
+#define DLOG_SINK_MEMORY (1 << 2)
+
+typedef enum {
+  DLOG_ERROR,
+  DLOG_INFO,
+} dlog_level_t;
+
+/* Starts the drain task. Records written before this are dropped. */
+esp_err_t dlog_init(uint8_t sinks);
+
+void dlog_write(dlog_level_t level, const char *fmt, uint8_t nargs, const uint32_t *args);
+
+uint8_t dlog_get_sinks();
+void dlog_set_sinks(uint8_t sinks);
+
+/* Copies the in-memory tail, oldest line first; returns bytes copied. */
+size_t dlog_tail(char *buf, size_t len);
+
+int dlog_stats_json(char *buf, size_t len);
+
+template<typename... T> static inline void dlog_i(const char *fmt, T... args) {
+  static_assert(sizeof...(T) <= DLOG_MAX_ARGS, "too many dlog arguments");
+#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
+  const uint32_t a[] = {0, (uint32_t)args...};
+  dlog_write(DLOG_INFO, fmt, sizeof...(T), a + 1);
+#else
+  (void)fmt;
+  const int unused[] = {0, ((void)args, 0)...};
+  (void)unused;
+#endif
+}
+
+template<typename... T> static inline void dlog_e(const char *fmt, T... args) {
+  static_assert(sizeof...(T) <= DLOG_MAX_ARGS, "too many dlog arguments");
+  const uint32_t a[] = {0, (uint32_t)args...};
+  dlog_write(DLOG_ERROR, fmt, sizeof...(T), a + 1);
+}
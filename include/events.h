@@ -0,0 +1,46 @@
+/**
+ * Server-Sent Events push channel (/events).
+ *
+ * One long-lived connection per client replaces polling /status and /info.
+ * A single task serves every client and sends only what changed since that
+ * client's last message:
+ *
+ *   event: settings   sensor settings whose value changed (cached sensor
+ *                     status, never an SCCB read)
+ *   event: metrics    /info sections whose JSON changed, at most every
+ *                     metrics_ms
+ *   event: <type>     discrete events from events_publish(), e.g. motion
+ *
+ * Updates between two messages are coalesced, so a client never receives
+ * more than max_hz messages per second however often things change.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+#define EVENTS_MAX_CLIENTS    3
+#define EVENTS_DEFAULT_HZ     2
+#define EVENTS_MAX_HZ         20
+#define EVENTS_METRICS_MS     5000
+#define EVENTS_PING_MS        15000
+#define EVENTS_RING           16    // discrete events kept for slow clients
+#define EVENTS_DATA_MAX       160
+
+esp_err_t events_init();
+
+/*
+ * Takes over the request as an async SSE session. Returns ESP_ERR_NO_MEM if
+ * all client slots are taken; the caller then still owns req.
+ */
+esp_err_t events_attach(httpd_req_t *req, uint8_t max_hz, uint32_t metrics_ms);
+
+/* True while fd carries an SSE session. */
+bool events_holds(int fd);
+
+/* Queues a discrete event; data is a JSON object, truncated to EVENTS_DATA_MAX. */
+void events_publish(const char *type, const char *data);
+
+int events_stats_json(char *buf, size_t len);
@@ -0,0 +1,130 @@
+/**
+ * Compressed-domain access to baseline JPEG frames.
+ *
+ * Parses the headers of a baseline (SOF0) JPEG and decodes its Huffman-coded
+ * scan into quantised DCT coefficients, one MCU at a time, without any IDCT.
+ * This is what per-client frame work (change detection, cropping, flips,
+ * scaling) is built on. No platform dependencies.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define JPEG_MAX_COMPONENTS 3
+#define JPEG_MAX_MCU_BLOCKS 10  // baseline limit on blocks per MCU
+
+extern const uint8_t jpeg_zigzag[64];    // zigzag index -> natural (row-major) index
+extern const uint8_t jpeg_unzigzag[64];  // natural index -> zigzag index
+
+typedef struct {
+  uint8_t bits[17];        // number of codes of each length 1..16
+  uint8_t vals[256];
+  uint16_t count;
+  int32_t maxcode[18];
+  int32_t valoffset[17];
+  uint8_t look_len[512];   // 9-bit fast lookup; 0 = code longer than 9 bits
+  uint8_t look_sym[512];
+} jpeg_huff_t;
+
+typedef struct {
+  uint8_t id;
+  uint8_t h, v;            // sampling factors
+  uint8_t tq;              // quantisation table
+  uint8_t td, ta;          // DC / AC Huffman tables
+  uint16_t bw, bh;         // blocks across / down, padded to whole MCUs
+} jpeg_component_t;
+
+typedef struct {
+  uint16_t width;
+  uint16_t height;
+  uint8_t ncomp;
+  jpeg_component_t comp[JPEG_MAX_COMPONENTS];
+  uint8_t hmax, vmax;
+  uint16_t mcus_x, mcus_y;
+  uint8_t mcu_blocks;      // blocks per MCU
+  uint16_t restart_interval;
+  const uint8_t *qt[4];    // 64 entries each in zigzag order, NULL if absent
+  jpeg_huff_t dc[2];
+  jpeg_huff_t ac[2];
+  const uint8_t *scan;     // entropy-coded data
+  size_t scan_len;
+} jpeg_info_t;
+
+/* Returns false for anything other than an 8-bit baseline JPEG. */
+bool jpeg_parse(const uint8_t *jpg, size_t len, jpeg_info_t *info);
+
+/*
+ * Dimensions from the first SOF marker of any JPEG, without parsing the
+ * tables: cheap enough to run on every captured frame.
+ */
+bool jpeg_size(const uint8_t *jpg, size_t len, uint16_t *width, uint16_t *height);
+
+typedef struct {
+  const jpeg_info_t *info;
+  const uint8_t *p;
+  const uint8_t *end;
+  uint32_t acc;            // MSB-aligned bit buffer
+  int bits;
+  bool marker;             // hit a marker; feeding zeros
+  int16_t pred[JPEG_MAX_COMPONENTS];
+  uint32_t mcu;            // MCUs decoded so far
+} jpeg_scan_reader_t;
+
+void jpeg_scan_begin(jpeg_scan_reader_t *r, const jpeg_info_t *info);
+
+/* Reader position at an MCU boundary, for revisiting MCUs out of order. */
+typedef struct {
+  const uint8_t *p;
+  uint32_t acc;
+  int8_t bits;
+  bool marker;
+  int16_t pred[JPEG_MAX_COMPONENTS];
+} jpeg_scan_pos_t;
+
+void jpeg_scan_tell(const jpeg_scan_reader_t *r, jpeg_scan_pos_t *pos);
+void jpeg_scan_seek(jpeg_scan_reader_t *r, const jpeg_scan_pos_t *pos, uint32_t mcu);
+
+/*
+ * Decodes the next MCU. blocks receives info->mcu_blocks blocks of 64
+ * coefficients in zigzag order with absolute (un-predicted) DC values,
+ * ordered component by component, row-major inside each component. Pass
+ * NULL to only keep the DC values, in dc[]. Returns false on corrupt data.
+ */
+bool jpeg_scan_mcu(jpeg_scan_reader_t *r, int16_t (*blocks)[64], int16_t *dc);
+
+/* Huffman code per symbol, built from a decoder table; size 0 = not coded. */
+typedef struct {
+  uint16_t code[256];
+  uint8_t size[256];
+} jpeg_huff_enc_t;
+
+void jpeg_huff_enc_build(jpeg_huff_enc_t *enc, const jpeg_huff_t *h);
+
+typedef struct {
+  uint8_t *start;
+  uint8_t *p;
+  uint8_t *end;
+  uint32_t acc;
+  int bits;
+  bool overflow;
+} jpeg_bit_writer_t;
+
+void jpeg_bw_init(jpeg_bit_writer_t *w, uint8_t *buf, size_t cap);
+
+/*
+ * Huffman-codes one block (zigzag order, coef[0] ignored) with dc_diff as the
+ * DC difference. False if a symbol is missing from the tables.
+ */
+bool jpeg_encode_block(jpeg_bit_writer_t *w, const int16_t *coef, int dc_diff, const jpeg_huff_enc_t *dc, const jpeg_huff_enc_t *ac);
+
+/* Pads the last byte, appends EOI; returns bytes written or 0 on overflow. */
+size_t jpeg_bw_finish(jpeg_bit_writer_t *w);
+
+/*
+ * Writes SOI through SOS for a frame with info's tables and components but
+ * the given dimensions, without restart markers. transpose swaps sampling
+ * factors and transposes the quantisation tables. Returns bytes written, 0
+ * if cap is too small.
+ */
+size_t jpeg_write_header(uint8_t *out, size_t cap, const jpeg_info_t *info, uint16_t width, uint16_t height, bool transpose);
@@ -0,0 +1,70 @@
+/**
+ * Per-client JPEG transforms in the compressed domain.
+ *
+ * Each transform walks the source scan as quantised coefficients and writes
+ * a new baseline JPEG with the same quantisation and Huffman tables; no
+ * pixels are decoded. Crops and orientation changes work on whole MCUs and
+ * are lossless; downscaling recombines coefficients and requantises.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "jpeg_dct.h"
+
+typedef struct {
+  uint16_t x, y, w, h;     // pixels
+} jpeg_rect_t;
+
+typedef enum {
+  JPEG_ORIENT_NONE,
+  JPEG_ORIENT_HFLIP,
+  JPEG_ORIENT_VFLIP,
+  JPEG_ORIENT_ROT90,       // clockwise
+  JPEG_ORIENT_ROT180,
+  JPEG_ORIENT_ROT270,
+} jpeg_orient_t;
+
+/* Working state for one session; large, so allocate it once per client. */
+typedef struct {
+  jpeg_info_t info;
+  jpeg_huff_enc_t dc_enc[2];
+  jpeg_huff_enc_t ac_enc[2];
+  int16_t blocks[JPEG_MAX_MCU_BLOCKS][64];
+  jpeg_scan_pos_t *mcu_pos;  // per-MCU checkpoints for reordering
+  uint32_t mcu_pos_cap;
+  int16_t *rows;             // two MCU rows of coefficients for downscaling
+  size_t rows_cap;
+  float half[2][8][4];       // 4x4 DCT halves -> 8x8 DCT, see jpeg_downscale
+} jpeg_xform_t;
+
+void jpeg_xform_init(jpeg_xform_t *x);
+void jpeg_xform_free(jpeg_xform_t *x);
+
+/* Parses "x,y,w,h"; false if malformed or empty. */
+bool jpeg_rect_parse(const char *s, jpeg_rect_t *rect);
+
+/*
+ * Crops jpg to the smallest MCU-aligned rectangle covering roi (clipped to
+ * the frame). Only the DC predictions and the headers change. Returns the
+ * output length, 0 if the frame cannot be cropped or out is too small.
+ */
+size_t jpeg_crop(jpeg_xform_t *x, const uint8_t *jpg, size_t len, const jpeg_rect_t *roi, uint8_t *out, size_t cap);
+
+/* Parses hflip, vflip, rot90, rot180 or rot270. */
+bool jpeg_orient_parse(const char *s, jpeg_orient_t *orient);
+const char *jpeg_orient_name(jpeg_orient_t orient);
+
+/*
+ * Mirrors or rotates jpg. Partial edge MCUs that would move away from the
+ * right or bottom edge are trimmed, as they cannot be moved losslessly.
+ * Returns the output length, 0 on failure.
+ */
+size_t jpeg_orient(jpeg_xform_t *x, const uint8_t *jpg, size_t len, jpeg_orient_t orient, uint8_t *out, size_t cap);
+
+/*
+ * Halves both dimensions: each 2x2 group of blocks becomes one block built
+ * from their low-frequency 4x4 coefficients. Returns the output length, 0 on
+ * failure.
+ */
+size_t jpeg_downscale(jpeg_xform_t *x, const uint8_t *jpg, size_t len, uint8_t *out, size_t cap);
@@ -0,0 +1,31 @@
+/**
+ * Multicast frame datagrams.
+ *
+ * Builds the datagrams src/mcast_stream.cpp sends for one JPEG. No platform
+ * dependencies: host tests in test/test_mcast_frag, and
+ * tools/mcast_loopback_test.py drives this same code through
+ * tools/mcast_frag_dump.cpp.
+ *
+ * Datagram layout (big endian, MCAST_HEADER_LEN bytes, then payload):
+ *   u16 magic 'NJ'   u8 version   u8 flags (bit0: last fragment)
+ *   u32 frame_id     u16 frag_index   u16 frag_count
+ *   u32 frame_len    u32 frag_offset  u32 capture time (ms)
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MCAST_MAGIC        0x4E4A
+#define MCAST_VERSION      1
+#define MCAST_HEADER_LEN   24
+#define MCAST_FLAG_LAST    0x01
+
+/* Datagrams needed for a frame of len bytes with `payload` bytes in each. */
+uint16_t mcast_frag_count(size_t len, uint16_t payload);
+
+/*
+ * Writes datagram `index` of the frame into pkt, which must hold
+ * MCAST_HEADER_LEN + payload bytes, and returns its length.
+ */
+size_t mcast_frag_build(uint8_t *pkt, const uint8_t *frame, size_t len, uint32_t frame_id, uint32_t ts_ms, uint16_t payload, uint16_t index);
@@ -0,0 +1,30 @@
+/**
+ * Multicast UDP frame distribution.
+ *
+ * Sends each JPEG once to a multicast group on the STA network, split into
+ * sequence-numbered datagrams, so radio and CPU cost do not grow with the
+ * number of viewers. The datagram layout is in mcast_frag.h;
+ * tools/mcast_receiver.py reassembles the frames.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "mcast_frag.h"
+
+typedef struct {
+  bool enabled;
+  uint32_t group;      // network byte order
+  uint16_t port;
+  uint8_t ttl;
+  uint8_t max_fps;     // 0 = camera rate
+  uint16_t payload;    // datagram payload bytes after the header
+} mcast_config_t;
+
+esp_err_t mcast_stream_init();
+
+void mcast_stream_get_config(mcast_config_t *config);
+esp_err_t mcast_stream_set_config(const mcast_config_t *config);
+
+int mcast_stream_stats_json(char *buf, size_t len);
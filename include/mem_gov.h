@@ -0,0 +1,51 @@
+/**
+ * Memory pressure governor.
+ *
+ * Allocation failures here (frame2bmp, frame2jpg, substream frames) come from
+ * fragmentation, not from the heap total running out, so the governor watches
+ * the largest free block of the internal and PSRAM heaps and keeps their low
+ * water marks. Under pressure it degrades in steps, each one including the
+ * previous ones:
+ *
+ *   NO_BMP           /bmp is refused; it needs a whole RGB888 frame in one block
+ *   FEW_SUBSTREAMS   only the half-size substream is derived and served
+ *   SHALLOW_RING     one camera frame buffer instead of the boot count, and
+ *                    no substreams
+ *
+ * The level rises one step per sample while a threshold is crossed and falls
+ * one step after MEM_GOV_RECOVER_MS clear of the thresholds plus a margin.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#define MEM_GOV_SAMPLE_MS        1000
+#define MEM_GOV_RECOVER_MS       10000
+#define MEM_GOV_MARGIN_PCT       25            // recovery needs this much above a threshold
+#define MEM_GOV_INTERNAL_FEW     (24 * 1024)   // largest internal block, FEW_SUBSTREAMS below
+#define MEM_GOV_INTERNAL_SHALLOW (12 * 1024)
+#define MEM_GOV_PSRAM_FEW        (384 * 1024)  // largest PSRAM block, when PSRAM is present
+#define MEM_GOV_PSRAM_SHALLOW    (160 * 1024)
+
+typedef enum {
+  MEM_GOV_NORMAL,
+  MEM_GOV_NO_BMP,
+  MEM_GOV_FEW_SUBSTREAMS,
+  MEM_GOV_SHALLOW_RING,
+  MEM_GOV_LEVELS,
+} mem_gov_level_t;
+
+esp_err_t mem_gov_init();
+
+mem_gov_level_t mem_gov_level();
+
+/* Admission checks for the degradable features; a refusal is counted. */
+bool mem_gov_allow_bmp();
+bool mem_gov_allow_substream(uint8_t variant);
+
+/* An allocation failed; counts it and samples at once. */
+void mem_gov_report_oom();
+
+int mem_gov_stats_json(char *buf, size_t len);
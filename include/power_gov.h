@@ -0,0 +1,36 @@
+/**
+ * Load-aware power governor.
+ *
+ * Two states. ACTIVE holds the CPU at full clock, turns WiFi modem sleep off
+ * and runs the sensor at its configured XCLK. IDLE lets the CPU drop to its
+ * minimum clock, enables modem sleep and slows the sensor clock, which lowers
+ * the capture rate. Streaming sessions (HTTP, RTSP, multicast) hold the
+ * governor ACTIVE; any new connection kicks it ACTIVE for a short linger so
+ * control requests and the first frame of a new stream are served at speed.
+ * The step up runs synchronously on the task that needs it, before that
+ * task captures its first frame.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#define POWER_GOV_LINGER_MS     3000  // stay ACTIVE this long after the last activity
+#define POWER_GOV_IDLE_XCLK_MHZ 8
+#define POWER_GOV_IDLE_CPU_MHZ  80
+#define POWER_GOV_MAX_CPU_MHZ   240
+
+esp_err_t power_gov_init();
+
+/* A streaming session starts / ends. Sessions nest; acquire steps up at once. */
+void power_gov_acquire();
+void power_gov_release();
+
+/* A connection or request arrived; steps up and restarts the linger. */
+void power_gov_kick();
+
+/* Reports how long a new stream took to send its first frame. */
+void power_gov_first_frame(uint32_t us);
+
+int power_gov_stats_json(char *buf, size_t len);
@@ -0,0 +1,81 @@
+/**
+ * Named sensor profiles.
+ *
+ * A profile is compiled once, when it is saved, into a short list of
+ * register writes: each register once, with its bits merged, grouped by
+ * register bank so the burst switches banks at most once, and in the order
+ * the registers first appeared within a bank. It is saved either from the
+ * sensor's current tuning (profiles_snapshot: the exposure, gain, white
+ * balance and pixel correction registers of the OV2640) or from text, one
+ * "reg [mask] val" per line, with the banked register numbers /reg uses.
+ * Compiled profiles live in SPIFFS under PROFILES_DIR and in RAM.
+ *
+ * Applying diffs the list against a shadow of the sensor's registers and
+ * writes only what differs (gain, exposure and the AWB gains always), in one
+ * capture_sensor_batch at a frame boundary; the registers the shadow does
+ * not know are read beforehand, while frames still flow. Other register
+ * writers (/control, /reg, /pll, /resolution) invalidate the shadow, and so
+ * does any camera restart or frame size switch (capture_sensor_epoch).
+ *
+ * QS (the JPEG quality register) belongs to the rate controller and cannot
+ * be part of a profile. A camera restart restores the sensor status, not
+ * the profile: apply it again.
+ *
+ * Publishes "profile" events when one is applied.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#define PROFILES_DIR       "/profile"
+#define PROFILES_MAX       8
+#define PROFILES_NAME_MAX  16    // with the terminator; SPIFFS names are 32 bytes
+#define PROFILES_REGS_MAX  64
+#define PROFILES_TEXT_MAX  2048  // uploaded profile source
+
+typedef struct {
+  uint16_t reg;      // bank in bit 8, as for sensor_t set_reg
+  uint8_t mask;
+  uint8_t val;
+} profile_reg_t;
+
+typedef struct {
+  uint16_t regs;     // in the profile
+  uint16_t reads;    // registers the shadow did not know
+  uint16_t writes;
+  uint16_t skipped;  // already at the profile's value
+  uint32_t burst_us; // the writes
+  uint32_t gap_us;   // no frames delivered, including the discarded ones
+} profile_result_t;
+
+/* Loads the compiled profiles from SPIFFS; call once it is mounted. */
+esp_err_t profiles_init();
+
+/* Saves the sensor's current tuning registers as name. */
+esp_err_t profiles_snapshot(const char *name);
+
+/*
+ * Compiles profile source into name; on ESP_ERR_INVALID_ARG bad_line is the
+ * first line that is not a valid register write (0 for a bad name, or for
+ * too many registers).
+ */
+esp_err_t profiles_compile(const char *name, const char *text, int *bad_line);
+
+/*
+ * Writes what differs between the profile and the sensor, at a frame
+ * boundary. ESP_ERR_NOT_FOUND for no such profile, ESP_ERR_INVALID_ARG for
+ * one saved on another sensor.
+ */
+esp_err_t profiles_apply(const char *name, profile_result_t *result);
+
+esp_err_t profiles_delete(const char *name);
+
+/* Someone else wrote sensor registers: the shadow no longer holds. */
+void profiles_invalidate();
+
+/* The profiles, or with name set one profile's register list. */
+int profiles_json(const char *name, char *buf, size_t len);
+
+int profiles_stats_json(char *buf, size_t len);
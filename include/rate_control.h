@@ -0,0 +1,59 @@
+/**
+ * Closed-loop JPEG rate control.
+ *
+ * Holds the encoded frame size at a bytes-per-frame or bitrate target by
+ * adjusting the sensor's JPEG quality setting. Frame sizes are averaged over
+ * a sliding window; the quality only moves when the average leaves a dead
+ * band around the target, and after each move the controller waits for the
+ * frames already in flight before it measures again. The size response to
+ * a quality change is learnt from the previous adjustment. No platform
+ * dependencies, so frame size traces can be replayed through it on the
+ * host (test/test_rate_control).
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RATE_CONTROL_WINDOW   8     // frames averaged
+#define RATE_CONTROL_MIN_FRAMES 4   // frames measured before acting
+#define RATE_CONTROL_SETTLE   2     // frames ignored after a quality change
+#define RATE_CONTROL_BAND_PCT 12    // dead band around the target
+#define RATE_CONTROL_MAX_STEP 8     // largest quality change per adjustment
+
+typedef enum {
+  RATE_CONTROL_OFF,
+  RATE_CONTROL_BYTES_PER_FRAME,
+  RATE_CONTROL_KBPS,
+} rate_control_mode_t;
+
+typedef struct {
+  rate_control_mode_t mode;
+  uint32_t target;         // bytes per frame or kbit/s
+  uint8_t min_quality;     // best quality allowed (lower value = better)
+  uint8_t max_quality;
+} rate_control_config_t;
+
+typedef struct {
+  uint32_t len[RATE_CONTROL_WINDOW];
+  int64_t ts_us[RATE_CONTROL_WINDOW];
+  uint8_t head;
+  uint8_t count;
+  uint8_t settle;
+  uint8_t quality;
+  uint32_t avg_bytes;      // window average
+  uint32_t fps_x10;        // window frame rate
+  uint32_t kbps;
+  uint32_t target_bytes;   // current per-frame target
+  uint32_t adjustments;
+  float elasticity;        // -dlog(size)/dlog(quality), learnt
+  uint32_t prev_avg;       // average and quality before the last change
+  uint8_t prev_quality;
+} rate_control_t;
+
+void rate_control_reset(rate_control_t *rc, uint8_t quality);
+
+/* Feeds one frame; returns the quality to use, rc->quality if unchanged. */
+uint8_t rate_control_update(rate_control_t *rc, const rate_control_config_t *cfg, uint32_t len, int64_t ts_us);
+
+const char *rate_control_mode_name(rate_control_mode_t mode);
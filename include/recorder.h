@@ -0,0 +1,55 @@
+/**
+ * SD card recorder.
+ *
+ * Takes frames through the capture front end at a capped rate and writes
+ * them as AVI segments of RECORDER_DIR, numbered on from the highest one on
+ * the card. A segment is closed and the next one started after segment_s,
+ * when the frame size changes or when the file reaches the AVI size limit.
+ *
+ * Each frame is copied out of the camera buffer before it is written, so a
+ * slow card delays the recording, never the viewers. At init, recordings a
+ * power cut left unclosed are repaired (avi_mux.h).
+ *
+ * Every segment gets a seek table as it is written and a catalog record
+ * when it closes (catalog.h), with the frames where the change gate saw
+ * the scene move flagged as motion.
+ *
+ * Publishes "recording" events: started, stopped, segment (one closed),
+ * repaired and error.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "catalog.h"
+
+#define RECORDER_DIR           "/sdcard/rec"
+#define RECORDER_SEGMENT_NAME  "%06u.avi"
+#define RECORDER_CATALOG       RECORDER_DIR "/" CATALOG_FILE
+#define RECORDER_WALL_MIN_S    1704067200     // 2024-01-01: a clock before this was never set
+#define RECORDER_FRAME_MAX     (256 * 1024)   // PSRAM copy buffer, held while recording
+#define RECORDER_DEFAULT_FPS   10
+#define RECORDER_MAX_FPS       30
+#define RECORDER_SEGMENT_S     300
+#define RECORDER_MAX_SEGMENT_S 3600
+
+typedef struct {
+  bool enabled;
+  uint8_t fps;
+  uint16_t segment_s;
+} recorder_config_t;
+
+/* Repairs unclosed recordings and starts the (idle) recorder; call once the card is mounted. */
+esp_err_t recorder_init();
+
+void recorder_get_config(recorder_config_t *config);
+esp_err_t recorder_set_config(const recorder_config_t *config);
+
+/*
+ * Catalog time of an esp_timer timestamp: Unix time once the clock is set
+ * (wall then true), otherwise carrying on from the catalog's last record.
+ */
+int64_t recorder_clock_us(int64_t mono_us, bool *wall);
+
+int recorder_stats_json(char *buf, size_t len);
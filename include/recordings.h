@@ -0,0 +1,50 @@
+/**
+ * Recording download over HTTP.
+ *
+ *   GET  /recordings              files in RECORDER_DIR with their sizes
+ *   GET  /recordings?from=&to=    catalogued segments overlapping a span of
+ *                                 catalog time, in ms; either end may be left out
+ *   GET  /recordings?at=          the recorded frame nearest a moment: file,
+ *                                 frame number and the byte range of its JPEG
+ *   GET  /recordings?bench=<f>    reads f off the card without sending it,
+ *                                 for the raw read rate to compare with
+ *   GET  /recordings/<f>          the file; a single Range gives 206
+ *   HEAD /recordings/<f>          headers only: length, Accept-Ranges
+ *
+ * Downloads and benchmarks are detached from the port-80 server task and run
+ * on one worker below both servers' priorities, so a long download neither
+ * blocks /status nor takes time from /stream; a second one gets 503 with
+ * Retry-After. The worker reads into a PSRAM buffer with the file's stdio
+ * buffering off, in RECORDINGS_ALIGN-aligned pieces of whole clusters, which
+ * saves stdio's copy. It is not zero-copy: SDMMC cannot DMA into PSRAM, so
+ * the driver bounces the sectors through internal RAM on the way.
+ *
+ * Catalog lookups are binary searches over catalog.h files, a few small
+ * reads each, and are answered on the server task.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+#define RECORDINGS_BUF_SIZE    (32 * 1024)
+#define RECORDINGS_BUF_ALIGN   64         // PSRAM cache line
+#define RECORDINGS_ALIGN       4096       // file offsets reads are aligned to, a cluster multiple
+#define RECORDINGS_NAME_MAX    32
+#define RECORDINGS_SPAN_MAX    256        // segments one ?from=&to= lists; "more" says there are others
+#define RECORDINGS_DOWNLOADS   1          // served at a time, one worker
+
+esp_err_t recordings_init();
+
+/* GET /recordings, including ?from=&to=, ?at= and ?bench=. */
+esp_err_t recordings_list(httpd_req_t *req);
+
+/* GET and HEAD /recordings/<file>. */
+esp_err_t recordings_serve(httpd_req_t *req);
+
+/* True while the worker owns the connection on fd. */
+bool recordings_holds(int fd);
+
+int recordings_stats_json(char *buf, size_t len);
@@ -0,0 +1,69 @@
+/**
+ * Replay frame source.
+ *
+ * Plays a recorded MJPEG or AVI file into the capture front end in place of
+ * the camera, so every consumer sees the same frames, with the same JPEG
+ * sizes, on every run: stream, motion and recording throughput can then be
+ * compared between builds on identical input.
+ *
+ * Files are read through stdio, so any VFS mount works: "/sdcard/..." for
+ * the card, "/spiffs/..." for flash. Accepted inputs:
+ *
+ *   AVI     MJPEG video; '00dc'/'00db' chunks of the movi list in file order,
+ *           timed by the avih frame period. An unfinished file (movi size 0)
+ *           plays up to where it ends.
+ *   MJPEG   concatenated JPEGs, or a saved /stream response: parts carrying
+ *           X-Timestamp replay at their recorded spacing, anything else at
+ *           the configured fps.
+ *
+ * REPLAY_TIMED publishes each frame at its recorded time; REPLAY_FAST
+ * publishes the next frame as soon as a consumer has taken the current one,
+ * so the rate is set by the fastest consumer and the file read speed.
+ *
+ * Frames are shared: everyone waiting when a frame is published gets that
+ * same frame, like a live camera with enough buffers.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_camera.h"
+
+#define REPLAY_SLOTS       3              // published frame plus two held by consumers or being read
+#define REPLAY_FRAME_MAX   (256 * 1024)   // per slot, PSRAM; larger frames are skipped
+#define REPLAY_READ_CHUNK  (16 * 1024)    // MJPEG scanner read-ahead
+#define REPLAY_DEFAULT_FPS 10
+#define REPLAY_PATH_MAX    64
+
+typedef enum {
+  REPLAY_TIMED,
+  REPLAY_FAST,
+} replay_pace_t;
+
+typedef struct {
+  char path[REPLAY_PATH_MAX];
+  replay_pace_t pace;
+  bool loop;
+  uint8_t fps;             // for files without timing; 0 = REPLAY_DEFAULT_FPS
+} replay_config_t;
+
+/*
+ * Opens and probes the file, allocates the slots and starts the reader.
+ * ESP_ERR_NOT_FOUND if the file cannot be opened, ESP_ERR_NOT_SUPPORTED if
+ * it is neither AVI nor starts like a JPEG stream.
+ */
+esp_err_t replay_open(const replay_config_t *config);
+
+/* Stops the reader and frees the slots; no frame may still be held. */
+void replay_close();
+
+/*
+ * The next frame: the published one if no consumer has taken it yet,
+ * otherwise the next to be published. NULL after timeout_ms, which is also
+ * what consumers see once a file without loop has ended.
+ */
+camera_fb_t *replay_fb_get(uint32_t timeout_ms);
+void replay_fb_return(camera_fb_t *fb);
+
+int replay_stats_json(char *buf, size_t len);
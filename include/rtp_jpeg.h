@@ -0,0 +1,50 @@
+/**
+ * RTP payload format for JPEG (RFC 2435).
+ *
+ * Splits a baseline JPEG into its quantisation tables and entropy-coded scan
+ * and packetises the scan into RTP/JPEG packets. The JFIF/EXIF headers and
+ * Huffman tables are dropped (receivers rebuild them from the RTP/JPEG
+ * header), and the quantisation tables travel in-band with Q=255 in the
+ * first packet of every frame. No platform dependencies; host tests in
+ * test/test_rtp_jpeg.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RTP_JPEG_PAYLOAD_TYPE 26
+#define RTP_JPEG_CLOCK_HZ     90000
+#define RTP_HEADER_LEN        12
+#define RTP_JPEG_HEADROOM     4  // writable bytes in front of each packet passed to the callback
+
+typedef struct {
+  uint8_t type;               // 0 = 4:2:2, 1 = 4:2:0; +64 when restart markers are present
+  uint16_t width;
+  uint16_t height;
+  uint16_t restart_interval;
+  const uint8_t *qt[2];       // luma, chroma; 64 bytes each in zigzag order
+  const uint8_t *scan;        // entropy-coded data following the SOS header
+  size_t scan_len;
+} rtp_jpeg_frame_t;
+
+/* Returns false if the JPEG cannot be carried as RTP/JPEG type 0/1. */
+bool rtp_jpeg_parse(const uint8_t *jpg, size_t len, rtp_jpeg_frame_t *frame);
+
+/*
+ * Called once per packet; return non-zero to abort the frame. The
+ * RTP_JPEG_HEADROOM bytes before pkt may be used for transport framing.
+ */
+typedef int (*rtp_jpeg_send_cb)(void *ctx, uint8_t *pkt, size_t len);
+
+typedef struct {
+  uint16_t seq;
+  uint32_t ssrc;
+  size_t mtu;                 // max RTP packet size including the RTP header
+} rtp_jpeg_stream_t;
+
+/*
+ * Sends one frame as consecutive packets with the marker bit on the last.
+ * Returns the number of packets sent, or -1 if cb aborted.
+ */
+int rtp_jpeg_send_frame(rtp_jpeg_stream_t *stream, const rtp_jpeg_frame_t *frame, uint32_t timestamp, rtp_jpeg_send_cb cb, void *ctx);
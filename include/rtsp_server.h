@@ -0,0 +1,17 @@
+/**
+ * RTSP server streaming camera frames as RTP/JPEG (RFC 2435).
+ *
+ * Supports OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, GET_PARAMETER and TEARDOWN
+ * with unicast RTP over UDP or interleaved over the RTSP connection
+ * (RTP/AVP/TCP). Each client runs in its own task and pulls frames from the
+ * camera while playing.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+esp_err_t rtsp_server_start(uint16_t port);
+
+int rtsp_server_stats_json(char *buf, size_t len);
@@ -0,0 +1,50 @@
+/**
+ * Streaming session table.
+ *
+ * Every MJPEG viewer and RTSP client registers here for the life of its
+ * connection, so per-client numbers no longer have to be derived from
+ * shared state: who is connected, over which interface, how fast frames
+ * reach them and how long each frame takes to push into the socket. The
+ * send-time histogram is what points at the viewer eating the airtime.
+ *
+ * Slots are owned by the session's own task; only the kick flag and the
+ * table snapshot cross tasks.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#define SESSIONS_MAX          8
+#define SESSIONS_HIST_BUCKETS 8   // send time <1, <2, <5, <10, <20, <50, <100, >=100 ms
+#define SESSIONS_ERROR_MAX    32
+
+typedef enum {
+  SESSION_MJPEG,
+  SESSION_RTSP,
+} session_kind_t;
+
+esp_err_t sessions_init();
+
+/*
+ * Registers the connection on sock; detail names what it watches (variant,
+ * transport). Returns the slot, or -1 when the table is full, in which case
+ * the session runs untracked and the other calls ignore it.
+ */
+int sessions_open(session_kind_t kind, int sock, const char *detail);
+void sessions_close(int slot);
+
+/* One frame went out: bytes written and the time the socket took. Returns the averaged frame interval, us. */
+uint32_t sessions_frame(int slot, size_t bytes, uint32_t send_us);
+void sessions_error(int slot, const char *what, esp_err_t err);
+
+/* True once the session was kicked; its loop should end. */
+bool sessions_kicked(int slot);
+
+/* Shuts the session's socket down so even a blocked send returns. */
+esp_err_t sessions_kick(uint32_t id);
+
+/* The table, for /sessions. */
+int sessions_json(char *buf, size_t len);
+int sessions_stats_json(char *buf, size_t len);
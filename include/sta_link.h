@@ -0,0 +1,25 @@
+/**
+ * Event-driven STA link supervisor.
+ *
+ * Reconnects to the router from WiFi events with exponential backoff and
+ * jitter instead of polling, and records how long the link was down so the
+ * numbers can be shown on /info. Stream handlers use the link state to pause
+ * STA sessions while the link is down.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+esp_err_t sta_link_begin(const char *ssid, const char *password);
+
+bool sta_link_is_up();
+
+/* Blocks until the link is up or timeout_ms passes; returns the link state. */
+bool sta_link_wait_up(uint32_t timeout_ms);
+
+/* Current STA address in network byte order, 0 while down. */
+uint32_t sta_link_ip();
+
+int sta_link_stats_json(char *buf, size_t len);
@@ -0,0 +1,54 @@
+/**
+ * Stream admission control.
+ *
+ * Each /stream session is charged its measured per-frame send time times its
+ * frame rate against an airtime budget. A viewer that would push the total
+ * over budget is offered the low-fps tier if that fits and it is enabled,
+ * and is otherwise refused so it can retry later.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef enum {
+  STREAM_TIER_FULL,
+  STREAM_TIER_LOW,
+} stream_tier_t;
+
+typedef struct {
+  int slot;                     // -1 when not admitted
+  stream_tier_t tier;
+  uint32_t frame_interval_us;   // 0 = as fast as the camera delivers
+} stream_ticket_t;
+
+typedef struct {
+  uint8_t max_viewers;
+  uint8_t airtime_pct;          // share of each second the streams may use
+  uint8_t full_fps;             // rate assumed for a full-tier viewer
+  uint8_t low_fps;              // rate cap for the low tier
+  bool low_tier;                // offer low tier instead of refusing
+  uint8_t retry_after_s;
+} stream_admission_config_t;
+
+void stream_admission_init(uint8_t max_viewers);
+
+void stream_admission_get_config(stream_admission_config_t *config);
+esp_err_t stream_admission_set_config(const stream_admission_config_t *config);
+
+/*
+ * Returns true and fills ticket if the session may start. On refusal
+ * retry_after_s is set to the suggested Retry-After value.
+ */
+bool stream_admission_request(bool want_low, stream_ticket_t *ticket, uint32_t *retry_after_s);
+
+/* Reports how long the session took to push one frame to the socket. */
+void stream_admission_frame(stream_ticket_t *ticket, uint32_t send_us);
+
+void stream_admission_release(stream_ticket_t *ticket);
+
+/* Gives back a ticket whose session never started; counted as refused, not admitted. */
+void stream_admission_cancel(stream_ticket_t *ticket);
+
+int stream_admission_stats_json(char *buf, size_t len);
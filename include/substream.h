@@ -0,0 +1,55 @@
+/**
+ * Reduced-resolution substreams derived from the camera frames.
+ *
+ * A single producer task captures a frame and scales it down in the DCT
+ * domain, once per capture, for every variant that has a subscriber; each
+ * variant is derived from the next larger one. While nobody is subscribed
+ * the task sleeps and captures nothing. Frames are reference counted so any
+ * number of viewers can send the same one.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include "esp_err.h"
+
+typedef enum {
+  SUBSTREAM_HALF,     // "sub": half width and height
+  SUBSTREAM_QUARTER,  // "sub4": quarter width and height
+  SUBSTREAM_COUNT,
+} substream_id_t;
+
+typedef struct {
+  uint8_t *buf;
+  size_t len;
+  uint16_t width;
+  uint16_t height;
+  struct timeval timestamp;  // of the source capture
+  uint32_t seq;
+  uint32_t refs;
+} substream_frame_t;
+
+esp_err_t substream_init();
+
+/* Maps a ?variant= value to a substream; false for "main" or unknown names. */
+bool substream_parse(const char *name, substream_id_t *id);
+const char *substream_name(substream_id_t id);
+
+/*
+ * Derives only the first variants variants (0 stops the producer); viewers
+ * of the others get no new frames until the limit is raised again.
+ */
+void substream_set_limit(uint8_t variants);
+
+void substream_subscribe(substream_id_t id);
+void substream_unsubscribe(substream_id_t id);
+
+/*
+ * Waits for a frame with a sequence number other than last_seq. Returns NULL
+ * on timeout; release returned frames with substream_release().
+ */
+substream_frame_t *substream_next(substream_id_t id, uint32_t last_seq, uint32_t timeout_ms);
+void substream_release(substream_frame_t *frame);
+
+int substream_stats_json(char *buf, size_t len);
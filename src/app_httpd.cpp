@@ -20,6 +20,24 @@
 #include "sdkconfig.h"
 #include "camera_index.h"
 #include "board_config.h"
+#include "captive_dns.h"
+#include "sta_link.h"
+#include "stream_admission.h"
+#include "rtsp_server.h"
+#include "mcast_stream.h"
+#include "change_gate.h"
+#include "jpeg_xform.h"
+#include "substream.h"
+#include "capture.h"
+#include "power_gov.h"
+#include "dlog.h"
+#include "events.h"
+#include "mem_gov.h"
+#include "sessions.h"
+#include "recorder.h"
+#include "recordings.h"
+#include "profiles.h"
+#include "lwip/sockets.h"
 #include <Arduino.h>
 #include <WiFi.h>
 
@@ -44,20 +62,132 @@ typedef struct {
 #define PART_BOUNDARY "123456789000000000000987654321"
 static const char *_STREAM_CONTENT_TYPE = "multipart/x-mixed-replace;boundary=" PART_BOUNDARY;
 static const char *_STREAM_BOUNDARY = "\r\n--" PART_BOUNDARY "\r\n";
-static const char *_STREAM_PART = "Content-Type: image/jpeg\r\nContent-Length: %u\r\nX-Timestamp: %d.%06d\r\n\r\n";
+// Part headers are the base line set, any optional sets, then a blank line.
+static const char *_STREAM_PART = "Content-Type: image/jpeg\r\nContent-Length: %u\r\nX-Timestamp: %d.%06d\r\n";
+static const char *_STREAM_PART_GATED = "X-Frames-Skipped: %u\r\nX-Bytes-Saved: %llu\r\n";
+// Sent on the first part and whenever the source frame size changes.
+static const char *_STREAM_PART_RESOLUTION = "X-Resolution: %ux%u\r\n";
+// All in esp_timer microseconds, the clock X-Timestamp and /clock use. The
+// send-complete time of a frame is only known after it went out, so each part
+// carries the one of the frame before it.
+static const char *_STREAM_PART_LATENCY = "X-Frame-Seq: %u\r\nX-Dequeue-Us: %lld\r\nX-Send-Us: %lld\r\nX-Prev-Sent-Us: %lld\r\n";
 
 httpd_handle_t stream_httpd = NULL;
 httpd_handle_t camera_httpd = NULL;
 
+/*
+ * Per-server tuning. The control server shares core 0 with the WiFi/lwIP
+ * tasks at normal priority; the stream server and its workers get core 1 and
+ * a higher priority so /status polling never steals frame time. Short send
+ * timeouts plus LRU purge make dead viewers give their slot back in seconds
+ * instead of waiting for TCP to time out, and linger 0 drops their unsent
+ * data instead of retransmitting it to nobody.
+ *
+ * The control server also holds SSE clients and a download for minutes at a
+ * time, and those look idle to LRU purge. Its budget is their slots plus
+ * CONTROL_UI_SOCKETS, and instead of LRU purge control_open_fn closes the
+ * oldest page/API connection only, so a browser opening one never evicts
+ * /events or a download.
+ */
 typedef struct {
-  size_t size;   //number of values used for filtering
-  size_t index;  //current value index
-  size_t count;  //value count
-  int sum;
-  int *values;  //array to be filled with values
-} ra_filter_t;
+  uint16_t server_port;
+  uint16_t ctrl_port;
+  BaseType_t core_id;
+  unsigned task_priority;
+  size_t stack_size;
+  uint16_t max_open_sockets;
+  uint16_t backlog_conn;
+  bool lru_purge_enable;
+  uint16_t recv_wait_timeout;
+  uint16_t send_wait_timeout;
+  bool keep_alive_enable;
+  bool linger_zero;
+} httpd_profile_t;
+
+// A changes_only session that skipped this many frames in a row and then
+// sees a change publishes a "motion" event on /events.
+#define MOTION_STILL_FRAMES 5
+
+#define STREAM_WORKERS     3
+#define STREAM_WORKER_PRIO 6
+#define STREAM_WORKER_CORE 1
+#define STREAM_WORKER_STACK 6144
+
+#define CONTROL_UI_SOCKETS 4
+#define CONTROL_SOCKETS    (CONTROL_UI_SOCKETS + EVENTS_MAX_CLIENTS + RECORDINGS_DOWNLOADS)
+
+static const httpd_profile_t control_profile = {
+  .server_port = 80,
+  .ctrl_port = 32768,
+  .core_id = 0,
+  .task_priority = 5,
+  .stack_size = 6144,
+  .max_open_sockets = CONTROL_SOCKETS,
+  .backlog_conn = 5,
+  .lru_purge_enable = false,  // control_open_fn purges
+  .recv_wait_timeout = 5,
+  .send_wait_timeout = 5,
+  .keep_alive_enable = false,
+  .linger_zero = false,
+};
+
+static const httpd_profile_t stream_profile = {
+  .server_port = 81,
+  .ctrl_port = 32769,
+  .core_id = STREAM_WORKER_CORE,
+  .task_priority = STREAM_WORKER_PRIO,
+  .stack_size = 4096,
+  .max_open_sockets = STREAM_WORKERS + 2,  // room to answer 503 while full
+  .backlog_conn = 2,
+  .lru_purge_enable = true,
+  .recv_wait_timeout = 2,
+  .send_wait_timeout = 2,
+  .keep_alive_enable = true,
+  .linger_zero = true,
+};
+
+// Per-session options parsed from the /stream query.
+typedef struct {
+  bool changes_only;  // skip frames that match the last one sent
+  bool crop;
+  jpeg_rect_t roi;
+  jpeg_orient_t orient;
+  bool substream;     // send a derived variant instead of the main stream
+  substream_id_t variant;
+  bool latency;       // per-frame pipeline timestamps in the part headers
+} stream_opts_t;
+
+// Per-client compressed-domain transform state and output buffers.
+typedef struct {
+  jpeg_xform_t *xform;
+  uint8_t *buf[2];  // ping-pong between chained transforms
+  size_t cap[2];
+} client_xform_t;
+
+// Throughput per transform: crop, then one slot per orientation.
+#define XFORM_KINDS (1 + JPEG_ORIENT_ROT270)
+
+typedef struct {
+  uint32_t frames;
+  uint32_t failed;
+  uint64_t bytes_in;
+  uint64_t us;
+} xform_stats_t;
+
+static xform_stats_t xform_stats[XFORM_KINDS];
+static portMUX_TYPE xform_lock = portMUX_INITIALIZER_UNLOCKED;
+
+typedef struct {
+  httpd_req_t *req;
+  stream_ticket_t ticket;
+  stream_opts_t opts;
+} stream_job_t;
 
-static ra_filter_t ra_filter;
+static QueueHandle_t stream_queue = NULL;
+static SemaphoreHandle_t stream_idle_workers = NULL;
+
+// How long a stream on the STA interface waits for the link to come back.
+#define STA_STREAM_RESUME_MS 10000
 
 static esp_err_t camera_not_ready(httpd_req_t *req) {
   httpd_resp_set_type(req, "application/json");
@@ -66,35 +196,16 @@ static esp_err_t camera_not_ready(httpd_req_t *req) {
   return httpd_resp_send(req, "{\"error\":\"camera not initialized\"}", HTTPD_RESP_USE_STRLEN);
 }
 
-static ra_filter_t *ra_filter_init(ra_filter_t *filter, size_t sample_size) {
-  memset(filter, 0, sizeof(ra_filter_t));
-
-  filter->values = (int *)malloc(sample_size * sizeof(int));
-  if (!filter->values) {
-    return NULL;
-  }
-  memset(filter->values, 0, sample_size * sizeof(int));
-
-  filter->size = sample_size;
-  return filter;
-}
-
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-static int ra_filter_run(ra_filter_t *filter, int value) {
-  if (!filter->values) {
-    return value;
-  }
-  filter->sum -= filter->values[filter->index];
-  filter->values[filter->index] = value;
-  filter->sum += filter->values[filter->index];
-  filter->index++;
-  filter->index = filter->index % filter->size;
-  if (filter->count < filter->size) {
-    filter->count++;
-  }
-  return filter->sum / filter->count;
+// A feature the memory governor has shed; it comes back once the heap recovers.
+static esp_err_t memory_pressure(httpd_req_t *req) {
+  char retry[12];
+  snprintf(retry, sizeof(retry), "%u", MEM_GOV_RECOVER_MS / 1000);
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_set_status(req, "503 Service Unavailable");
+  httpd_resp_set_hdr(req, "Retry-After", retry);
+  return httpd_resp_send(req, "{\"error\":\"memory pressure\"}", HTTPD_RESP_USE_STRLEN);
 }
-#endif
 
 #if defined(LED_GPIO_NUM)
 void enable_led(bool en) {  // Turn LED On or Off
@@ -113,14 +224,15 @@ static esp_err_t bmp_handler(httpd_req_t *req) {
   if (!esp_camera_sensor_get()) {
     return camera_not_ready(req);
   }
+  if (!mem_gov_allow_bmp()) {
+    return memory_pressure(req);
+  }
   camera_fb_t *fb = NULL;
   esp_err_t res = ESP_OK;
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
   uint64_t fr_start = esp_timer_get_time();
-#endif
-  fb = esp_camera_fb_get();
+  fb = capture_fb_get();
   if (!fb) {
-    log_e("Camera capture failed");
+    dlog_e("Camera capture failed");
     httpd_resp_send_500(req);
     return ESP_FAIL;
   }
@@ -136,18 +248,17 @@ static esp_err_t bmp_handler(httpd_req_t *req) {
   uint8_t *buf = NULL;
   size_t buf_len = 0;
   bool converted = frame2bmp(fb, &buf, &buf_len);
-  esp_camera_fb_return(fb);
+  capture_fb_return(fb);
   if (!converted) {
-    log_e("BMP Conversion failed");
+    dlog_e("BMP Conversion failed");
+    mem_gov_report_oom();
     httpd_resp_send_500(req);
     return ESP_FAIL;
   }
   res = httpd_resp_send(req, (const char *)buf, buf_len);
   free(buf);
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
   uint64_t fr_end = esp_timer_get_time();
-#endif
-  log_i("BMP: %llums, %uB", (uint64_t)((fr_end - fr_start) / 1000), buf_len);
+  dlog_i("BMP: %ums, %uB", (uint32_t)((fr_end - fr_start) / 1000), buf_len);
   return res;
 }
 
@@ -163,27 +274,193 @@ static size_t jpg_encode_stream(void *arg, size_t index, const void *data, size_
   return len;
 }
 
+/*
+ * Reads an optional query parameter; false if there is no query or key. A
+ * value too long for val comes back as "", which no option accepts, so it
+ * is refused rather than dropped.
+ */
+static bool query_value(httpd_req_t *req, const char *key, char *val, size_t val_len) {
+  size_t len = httpd_req_get_url_query_len(req) + 1;
+  if (len == 1) {
+    return false;
+  }
+  char *query = (char *)malloc(len);
+  if (!query) {
+    return false;
+  }
+  esp_err_t err = httpd_req_get_url_query_str(req, query, len);
+  if (err == ESP_OK) {
+    err = httpd_query_key_value(query, key, val, val_len);
+  }
+  free(query);
+  if (err == ESP_ERR_HTTPD_RESULT_TRUNC) {
+    val[0] = '\0';
+    return true;
+  }
+  return err == ESP_OK;
+}
+
+/* An optional 0/1 query flag into *on; false if it is something else. */
+static bool query_flag(httpd_req_t *req, const char *key, bool *on) {
+  char val[4];
+  *on = false;
+  if (!query_value(req, key, val, sizeof(val))) {
+    return true;
+  }
+  *on = !strcmp(val, "1");
+  return *on || !strcmp(val, "0");
+}
+
+static bool client_xform_init(client_xform_t *cx) {
+  memset(cx, 0, sizeof(*cx));
+  cx->xform = (jpeg_xform_t *)malloc(sizeof(jpeg_xform_t));
+  if (!cx->xform) {
+    return false;
+  }
+  jpeg_xform_init(cx->xform);
+  return true;
+}
+
+static void client_xform_free(client_xform_t *cx) {
+  if (cx->xform) {
+    jpeg_xform_free(cx->xform);
+  }
+  free(cx->xform);
+  free(cx->buf[0]);
+  free(cx->buf[1]);
+  memset(cx, 0, sizeof(*cx));
+}
+
+static uint8_t *client_xform_buf(client_xform_t *cx, int i, size_t len) {
+  size_t need = len + 2048;  // header and padding headroom
+  if (cx->cap[i] < need) {
+    free(cx->buf[i]);
+    cx->buf[i] = (uint8_t *)malloc(need);
+    cx->cap[i] = cx->buf[i] ? need : 0;
+  }
+  return cx->buf[i];
+}
+
+static void xform_account(int kind, size_t bytes_in, size_t out_len, int64_t us) {
+  portENTER_CRITICAL(&xform_lock);
+  if (out_len) {
+    xform_stats[kind].frames++;
+    xform_stats[kind].bytes_in += bytes_in;
+    xform_stats[kind].us += us;
+  } else {
+    xform_stats[kind].failed++;
+  }
+  portEXIT_CRITICAL(&xform_lock);
+}
+
+/*
+ * Applies the session's transforms to a JPEG: crop first, so the orientation
+ * pass only walks the kept area. Returns the output length with *out pointing
+ * into one of cx's buffers, or 0 if the frame could not be transformed.
+ */
+static size_t client_xform_apply(client_xform_t *cx, const stream_opts_t *opts, const uint8_t *jpg, size_t len, const uint8_t **out) {
+  int next = 0;
+  if (opts->crop) {
+    uint8_t *buf = client_xform_buf(cx, next, len);
+    int64_t start = esp_timer_get_time();
+    size_t out_len = buf ? jpeg_crop(cx->xform, jpg, len, &opts->roi, buf, cx->cap[next]) : 0;
+    xform_account(0, len, out_len, esp_timer_get_time() - start);
+    if (!out_len) {
+      return 0;
+    }
+    jpg = buf;
+    len = out_len;
+    next ^= 1;
+  }
+  if (opts->orient != JPEG_ORIENT_NONE) {
+    uint8_t *buf = client_xform_buf(cx, next, len);
+    int64_t start = esp_timer_get_time();
+    size_t out_len = buf ? jpeg_orient(cx->xform, jpg, len, opts->orient, buf, cx->cap[next]) : 0;
+    xform_account(opts->orient, len, out_len, esp_timer_get_time() - start);
+    if (!out_len) {
+      return 0;
+    }
+    jpg = buf;
+    len = out_len;
+  }
+  *out = jpg;
+  return len;
+}
+
+static int xform_stats_json(char *buf, size_t len) {
+  xform_stats_t s[XFORM_KINDS];
+  portENTER_CRITICAL(&xform_lock);
+  memcpy(s, xform_stats, sizeof(s));
+  portEXIT_CRITICAL(&xform_lock);
+
+  int n = snprintf(buf, len, "{");
+  for (int i = 0; i < XFORM_KINDS && n < (int)len; i++) {
+    uint32_t avg_us = s[i].frames ? s[i].us / s[i].frames : 0;
+    uint32_t kb_per_s = s[i].us ? s[i].bytes_in * 1000 / s[i].us : 0;  // bytes/us * 1000 = kB/s
+    n += snprintf(
+      buf + n, len - n, "%s\"%s\":{\"frames\":%u,\"failed\":%u,\"avg_us\":%u,\"kb_per_s\":%u}", i ? "," : "",
+      i ? jpeg_orient_name((jpeg_orient_t)i) : "crop", s[i].frames, s[i].failed, avg_us, kb_per_s
+    );
+  }
+  if (n < (int)len) {
+    n += snprintf(buf + n, len - n, "}");
+  }
+  return n;
+}
+
+/*
+ * Reads "roi" and "orient" from the query; false with a 400 sent if either
+ * is malformed.
+ */
+static bool parse_xform_opts(httpd_req_t *req, stream_opts_t *opts) {
+  char val[32];
+  opts->crop = false;
+  opts->orient = JPEG_ORIENT_NONE;
+  if (query_value(req, "roi", val, sizeof(val))) {
+    if (!jpeg_rect_parse(val, &opts->roi)) {
+      httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "roi must be x,y,w,h");
+      return false;
+    }
+    opts->crop = true;
+  }
+  if (query_value(req, "orient", val, sizeof(val)) && !jpeg_orient_parse(val, &opts->orient)) {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "orient must be hflip, vflip, rot90, rot180 or rot270");
+    return false;
+  }
+  return true;
+}
+
 static esp_err_t capture_handler(httpd_req_t *req) {
   if (!esp_camera_sensor_get()) {
     return camera_not_ready(req);
   }
   camera_fb_t *fb = NULL;
   esp_err_t res = ESP_OK;
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
+  stream_opts_t opts = {};
+  client_xform_t cx;
+  if (!parse_xform_opts(req, &opts)) {
+    return ESP_FAIL;
+  }
+  bool transformed = opts.crop || opts.orient != JPEG_ORIENT_NONE;
+  if (transformed && !client_xform_init(&cx)) {
+    return httpd_resp_send_500(req);
+  }
   int64_t fr_start = esp_timer_get_time();
-#endif
 
 #if defined(LED_GPIO_NUM)
   enable_led(true);
-  vTaskDelay(150 / portTICK_PERIOD_MS);  // The LED needs to be turned on ~150ms before the call to esp_camera_fb_get()
-  fb = esp_camera_fb_get();              // or it won't be visible in the frame. A better way to do this is needed.
+  vTaskDelay(150 / portTICK_PERIOD_MS);  // The LED needs to be turned on ~150ms before the call to capture_fb_get()
+  fb = capture_fb_get();              // or it won't be visible in the frame. A better way to do this is needed.
   enable_led(false);
 #else
-  fb = esp_camera_fb_get();
+  fb = capture_fb_get();
 #endif
 
   if (!fb) {
-    log_e("Camera capture failed");
+    dlog_e("Camera capture failed");
+    if (transformed) {
+      client_xform_free(&cx);
+    }
     httpd_resp_send_500(req);
     return ESP_FAIL;
   }
@@ -196,54 +473,108 @@ static esp_err_t capture_handler(httpd_req_t *req) {
   snprintf(ts, 32, "%lld.%06ld", fb->timestamp.tv_sec, fb->timestamp.tv_usec);
   httpd_resp_set_hdr(req, "X-Timestamp", (const char *)ts);
 
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
   size_t fb_len = 0;
-#endif
-  if (fb->format == PIXFORMAT_JPEG) {
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
+  if (transformed) {
+    const uint8_t *out = NULL;
+    size_t out_len = fb->format == PIXFORMAT_JPEG ? client_xform_apply(&cx, &opts, fb->buf, fb->len, &out) : 0;
+    fb_len = out_len;
+    if (out_len) {
+      res = httpd_resp_send(req, (const char *)out, out_len);
+    } else {
+      res = httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "roi outside the frame or frame not transformable");
+    }
+    client_xform_free(&cx);
+  } else if (fb->format == PIXFORMAT_JPEG) {
     fb_len = fb->len;
-#endif
     res = httpd_resp_send(req, (const char *)fb->buf, fb->len);
   } else {
     jpg_chunking_t jchunk = {req, 0};
     res = frame2jpg_cb(fb, 80, jpg_encode_stream, &jchunk) ? ESP_OK : ESP_FAIL;
     httpd_resp_send_chunk(req, NULL, 0);
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
     fb_len = jchunk.len;
-#endif
   }
-  esp_camera_fb_return(fb);
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
+  capture_fb_return(fb);
   int64_t fr_end = esp_timer_get_time();
-#endif
-  log_i("JPG: %uB %ums", (uint32_t)(fb_len), (uint32_t)((fr_end - fr_start) / 1000));
+  dlog_i("JPG: %uB %ums", (uint32_t)(fb_len), (uint32_t)((fr_end - fr_start) / 1000));
   return res;
 }
 
-static esp_err_t stream_handler(httpd_req_t *req) {
+// Local address the request arrived on, in network byte order.
+static uint32_t req_local_ip(httpd_req_t *req) {
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  if (getsockname(httpd_req_to_sockfd(req), (struct sockaddr *)&addr, &addr_len) != 0 || addr.sin_family != AF_INET) {
+    return 0;
+  }
+  return addr.sin_addr.s_addr;
+}
+
+/*
+ * Holds an STA stream while the link is down. The session resumes if the link
+ * returns with the same address (the TCP connection may survive a short
+ * drop); otherwise it is closed so the client reconnects on the new address.
+ */
+static esp_err_t sta_stream_pause(uint32_t session_ip) {
+  log_i("STA link down, pausing stream");
+  if (sta_link_wait_up(STA_STREAM_RESUME_MS) && sta_link_ip() == session_ip) {
+    log_i("STA link back, resuming stream");
+    return ESP_OK;
+  }
+  log_i("STA link not restored on same address, closing stream");
+  return ESP_FAIL;
+}
+
+static esp_err_t stream_handler(httpd_req_t *req, stream_ticket_t *ticket, const stream_opts_t *opts) {
   if (!esp_camera_sensor_get()) {
     return camera_not_ready(req);
   }
   camera_fb_t *fb = NULL;
+  substream_frame_t *sf = NULL;
+  uint32_t sub_seq = 0;
   struct timeval _timestamp;
   esp_err_t res = ESP_OK;
   size_t _jpg_buf_len = 0;
   uint8_t *_jpg_buf = NULL;
-  char part_buf[128];
+  char part_buf[320];
   uint8_t consecutive_failures = 0;
-
-  static int64_t last_frame = 0;
-  if (!last_frame) {
-    last_frame = esp_timer_get_time();
+  change_gate_t gate;
+  bool gated = opts->changes_only && change_gate_init(&gate) == ESP_OK;
+  client_xform_t cx;
+  bool transformed = opts->crop || opts->orient != JPEG_ORIENT_NONE;
+  if (transformed && !client_xform_init(&cx)) {
+    if (gated) {
+      change_gate_free(&gate);
+    }
+    return httpd_resp_send_500(req);  // not the untransformed stream instead
   }
+  uint32_t local_ip = req_local_ip(req);
+  bool on_sta = local_ip && local_ip != (uint32_t)WiFi.softAPIP();
+  int64_t stream_start = esp_timer_get_time();
+  bool first_sent = false;
+  uint32_t frame_seq = 0;
+  int64_t prev_sent_us = 0;
+  uint16_t frame_w = 0, frame_h = 0;
+  int64_t last_frame = stream_start;
 
   res = httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
   if (res != ESP_OK) {
     return res;
   }
+  int session = sessions_open(SESSION_MJPEG, httpd_req_to_sockfd(req), opts->substream ? substream_name(opts->variant) : "main");
 
   httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
   httpd_resp_set_hdr(req, "X-Framerate", "60");
+  httpd_resp_set_hdr(req, "X-Stream-Tier", ticket->tier == STREAM_TIER_LOW ? "low" : "full");
+  if (gated) {
+    httpd_resp_set_hdr(req, "X-Changes-Only", "1");
+  }
+  if (opts->latency) {
+    httpd_resp_set_hdr(req, "X-Latency-Clock", "esp_timer_us");
+  }
+  if (opts->substream) {
+    httpd_resp_set_hdr(req, "X-Stream-Variant", substream_name(opts->variant));
+    substream_subscribe(opts->variant);
+  }
 
 #if defined(LED_GPIO_NUM)
   isStreaming = true;
@@ -251,10 +582,45 @@ static esp_err_t stream_handler(httpd_req_t *req) {
 #endif
 
   while (true) {
-    fb = esp_camera_fb_get();
-    if (!fb) {
-      log_e("Camera capture failed");
-      consecutive_failures++;
+    if (sessions_kicked(session)) {
+      res = ESP_FAIL;
+      break;
+    }
+    if (on_sta && !sta_link_is_up()) {
+      res = sta_stream_pause(local_ip);
+      if (res != ESP_OK) {
+        sessions_error(session, "sta link", res);
+        break;
+      }
+      last_frame = esp_timer_get_time();
+    }
+    int64_t fr_start = esp_timer_get_time();
+    if (opts->substream) {
+      sf = substream_next(opts->variant, sub_seq, 1000);
+    } else {
+      fb = capture_fb_get();
+    }
+    int64_t dequeue_us = esp_timer_get_time();
+    uint16_t width = frame_w, height = frame_h;
+    if (sf) {
+      consecutive_failures = 0;
+      sub_seq = sf->seq;
+      width = sf->width;
+      height = sf->height;
+      _timestamp = sf->timestamp;
+      _jpg_buf = sf->buf;
+      _jpg_buf_len = sf->len;
+    } else if (!fb) {
+      // During a planned switch or while the supervisor restarts the
+      // camera the viewer just sees a gap.
+      capture_state_t st = capture_state();
+      if (st == CAPTURE_SWITCHING || st == CAPTURE_RECOVERING) {
+        consecutive_failures = 0;
+      } else {
+        dlog_e("Camera capture failed");
+        consecutive_failures++;
+        sessions_error(session, "capture", ESP_FAIL);
+      }
       if (consecutive_failures >= 5) {
         res = ESP_FAIL;
       } else {
@@ -263,14 +629,18 @@ static esp_err_t stream_handler(httpd_req_t *req) {
       }
     } else {
       consecutive_failures = 0;
+      width = fb->width;
+      height = fb->height;
       _timestamp.tv_sec = fb->timestamp.tv_sec;
       _timestamp.tv_usec = fb->timestamp.tv_usec;
       if (fb->format != PIXFORMAT_JPEG) {
         bool jpeg_converted = frame2jpg(fb, 80, &_jpg_buf, &_jpg_buf_len);
-        esp_camera_fb_return(fb);
+        capture_fb_return(fb);
         fb = NULL;
         if (!jpeg_converted) {
-          log_e("JPEG compression failed");
+          dlog_e("JPEG compression failed");
+          mem_gov_report_oom();
+          sessions_error(session, "jpeg", ESP_ERR_NO_MEM);
           res = ESP_FAIL;
         }
       } else {
@@ -278,41 +648,118 @@ static esp_err_t stream_handler(httpd_req_t *req) {
         _jpg_buf = fb->buf;
       }
     }
+    const uint8_t *send_buf = _jpg_buf;
+    size_t send_len = _jpg_buf_len;
+    if (res == ESP_OK && transformed) {
+      const uint8_t *out;
+      size_t out_len = client_xform_apply(&cx, opts, _jpg_buf, _jpg_buf_len, &out);
+      if (out_len) {
+        send_buf = out;
+        send_len = out_len;
+      } else {
+        // Never the whole frame instead: end the stream, with a 400 if nothing went out yet.
+        sessions_error(session, "xform", ESP_FAIL);
+        if (!first_sent) {
+          httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "roi outside the frame or frame not transformable");
+        }
+        if (fb) {
+          capture_fb_return(fb);
+          fb = NULL;
+        } else if (sf) {
+          substream_release(sf);
+          sf = NULL;
+        } else {
+          free(_jpg_buf);
+        }
+        _jpg_buf = NULL;
+        res = ESP_FAIL;
+        break;
+      }
+    }
+    uint32_t still_frames = gated ? gate.skipped_run : 0;
+    change_gate_result_t gate_res = res == ESP_OK && gated ? change_gate_check(&gate, send_buf, send_len, esp_timer_get_time()) : CHANGE_GATE_CHANGED;
+    if (gated && gate_res == CHANGE_GATE_CHANGED && still_frames >= MOTION_STILL_FRAMES) {
+      char motion[32];
+      snprintf(motion, sizeof(motion), "{\"still_frames\":%u}", still_frames);
+      events_publish("motion", motion);
+    }
+    if (gate_res == CHANGE_GATE_SKIP) {
+      if (fb) {
+        capture_fb_return(fb);
+        fb = NULL;
+      } else if (sf) {
+        substream_release(sf);
+        sf = NULL;
+      } else {
+        free(_jpg_buf);
+      }
+      _jpg_buf = NULL;
+      continue;
+    }
+    int64_t send_start = esp_timer_get_time();
     if (res == ESP_OK) {
       res = httpd_resp_send_chunk(req, _STREAM_BOUNDARY, strlen(_STREAM_BOUNDARY));
     }
     if (res == ESP_OK) {
-      size_t hlen = snprintf((char *)part_buf, 128, _STREAM_PART, _jpg_buf_len, _timestamp.tv_sec, _timestamp.tv_usec);
+      size_t hlen = snprintf(part_buf, sizeof(part_buf), _STREAM_PART, send_len, _timestamp.tv_sec, _timestamp.tv_usec);
+      if (gated) {
+        hlen += snprintf(part_buf + hlen, sizeof(part_buf) - hlen, _STREAM_PART_GATED, gate.skipped, gate.bytes_saved);
+      }
+      if (width != frame_w || height != frame_h) {
+        hlen += snprintf(part_buf + hlen, sizeof(part_buf) - hlen, _STREAM_PART_RESOLUTION, width, height);
+        frame_w = width;
+        frame_h = height;
+      }
+      if (opts->latency) {
+        hlen += snprintf(part_buf + hlen, sizeof(part_buf) - hlen, _STREAM_PART_LATENCY, frame_seq, dequeue_us, send_start, prev_sent_us);
+      }
+      hlen += snprintf(part_buf + hlen, sizeof(part_buf) - hlen, "\r\n");
       res = httpd_resp_send_chunk(req, (const char *)part_buf, hlen);
     }
     if (res == ESP_OK) {
-      res = httpd_resp_send_chunk(req, (const char *)_jpg_buf, _jpg_buf_len);
+      res = httpd_resp_send_chunk(req, (const char *)send_buf, send_len);
     }
     if (fb) {
-      esp_camera_fb_return(fb);
+      capture_fb_return(fb);
       fb = NULL;
       _jpg_buf = NULL;
+    } else if (sf) {
+      substream_release(sf);
+      sf = NULL;
+      _jpg_buf = NULL;
     } else if (_jpg_buf) {
       free(_jpg_buf);
       _jpg_buf = NULL;
     }
     if (res != ESP_OK) {
-      log_e("Send frame failed");
+      dlog_e("Send frame failed");
+      if (!sessions_kicked(session)) {
+        sessions_error(session, "send", res);
+      }
       break;
     }
     int64_t fr_end = esp_timer_get_time();
+    uint32_t send_us = (uint32_t)(fr_end - send_start);
+    prev_sent_us = fr_end;
+    frame_seq++;
+    if (!first_sent) {
+      first_sent = true;
+      power_gov_first_frame((uint32_t)(fr_end - stream_start));
+    }
+    stream_admission_frame(ticket, send_us);
+    if (ticket->frame_interval_us && fr_end - fr_start < ticket->frame_interval_us) {
+      vTaskDelay(pdMS_TO_TICKS((ticket->frame_interval_us - (fr_end - fr_start)) / 1000));
+      fr_end = esp_timer_get_time();
+    }
 
-    int64_t frame_time = fr_end - last_frame;
+    uint32_t frame_time = (uint32_t)((fr_end - last_frame) / 1000);
     last_frame = fr_end;
-
-    frame_time /= 1000;
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-    uint32_t avg_frame_time = ra_filter_run(&ra_filter, frame_time);
-#endif
-    log_i(
-      "MJPG: %uB %ums (%.1ffps), AVG: %ums (%.1ffps)", (uint32_t)(_jpg_buf_len), (uint32_t)frame_time, 1000.0 / (uint32_t)frame_time, avg_frame_time,
-      1000.0 / avg_frame_time
-    );
+    uint32_t avg_frame_time = sessions_frame(session, send_len, send_us) / 1000;
+    if (!avg_frame_time) {
+      avg_frame_time = frame_time;  // untracked session
+    }
+    uint32_t avg_fps_x10 = avg_frame_time ? 10000 / avg_frame_time : 0;
+    dlog_i("MJPG: %uB %ums, AVG: %ums (%u.%ufps)", send_len, frame_time, avg_frame_time, avg_fps_x10 / 10, avg_fps_x10 % 10);
   }
 
 #if defined(LED_GPIO_NUM)
@@ -320,9 +767,110 @@ static esp_err_t stream_handler(httpd_req_t *req) {
   enable_led(false);
 #endif
 
+  sessions_close(session);
+  if (opts->substream) {
+    substream_unsubscribe(opts->variant);
+  }
+  if (transformed) {
+    client_xform_free(&cx);
+  }
+  if (gated) {
+    log_i("Stream closed: %u frames sent, %u skipped, %llu bytes saved", gate.sent, gate.skipped, gate.bytes_saved);
+    change_gate_free(&gate);
+  }
   return res;
 }
 
+/*
+ * The stream server only accepts and dispatches: each /stream request is
+ * detached from the server task and run on a pinned worker, so a stalled
+ * viewer never blocks the accept loop or the LRU purge.
+ */
+static void stream_worker(void *arg) {
+  stream_job_t job;
+  while (true) {
+    if (xQueueReceive(stream_queue, &job, portMAX_DELAY) != pdTRUE) {
+      continue;
+    }
+    power_gov_acquire();
+    stream_handler(job.req, &job.ticket, &job.opts);
+    power_gov_release();
+    stream_admission_release(&job.ticket);
+    httpd_req_async_handler_complete(job.req);
+    xSemaphoreGive(stream_idle_workers);
+  }
+}
+
+static esp_err_t stream_reject(httpd_req_t *req, uint32_t retry_after_s) {
+  char retry[12];
+  snprintf(retry, sizeof(retry), "%u", retry_after_s);
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_status(req, "503 Service Unavailable");
+  httpd_resp_set_hdr(req, "Retry-After", retry);
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, "{\"error\":\"stream budget exhausted\"}", HTTPD_RESP_USE_STRLEN);
+}
+
+static esp_err_t stream_dispatch(httpd_req_t *req) {
+  char tier[8];
+  bool want_low = query_value(req, "tier", tier, sizeof(tier));
+  if (want_low && strcmp(tier, "low") && strcmp(tier, "full")) {
+    return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "tier must be low or full");
+  }
+  want_low = want_low && !strcmp(tier, "low");
+
+  stream_job_t job;
+  if (!query_flag(req, "changes_only", &job.opts.changes_only) || !query_flag(req, "latency", &job.opts.latency)) {
+    return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "changes_only and latency must be 0 or 1");
+  }
+  if (!parse_xform_opts(req, &job.opts)) {
+    return ESP_FAIL;
+  }
+  char variant[8];
+  job.opts.substream = false;
+  if (query_value(req, "variant", variant, sizeof(variant)) && strcmp(variant, "main")) {
+    if (!substream_parse(variant, &job.opts.variant)) {
+      return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "variant must be main, sub or sub4");
+    }
+    if (!mem_gov_allow_substream(job.opts.variant)) {
+      return memory_pressure(req);
+    }
+    job.opts.substream = true;
+  }
+  uint32_t retry_after_s = 1;
+  if (!stream_admission_request(want_low, &job.ticket, &retry_after_s)) {
+    return stream_reject(req, retry_after_s);
+  }
+  if (xSemaphoreTake(stream_idle_workers, 0) != pdTRUE) {
+    stream_admission_cancel(&job.ticket);
+    return stream_reject(req, 1);
+  }
+  if (httpd_req_async_handler_begin(req, &job.req) != ESP_OK) {
+    stream_admission_cancel(&job.ticket);
+    xSemaphoreGive(stream_idle_workers);
+    return httpd_resp_send_500(req);
+  }
+  xQueueSend(stream_queue, &job, portMAX_DELAY);
+  return ESP_OK;
+}
+
+static bool start_stream_workers() {
+  stream_admission_init(STREAM_WORKERS);
+  stream_queue = xQueueCreate(STREAM_WORKERS, sizeof(stream_job_t));
+  stream_idle_workers = xSemaphoreCreateCounting(STREAM_WORKERS, STREAM_WORKERS);
+  if (!stream_queue || !stream_idle_workers) {
+    return false;
+  }
+  for (int i = 0; i < STREAM_WORKERS; i++) {
+    char name[16];
+    snprintf(name, sizeof(name), "stream_w%d", i);
+    if (xTaskCreatePinnedToCore(stream_worker, name, STREAM_WORKER_STACK, NULL, STREAM_WORKER_PRIO, NULL, STREAM_WORKER_CORE) != pdPASS) {
+      return false;
+    }
+  }
+  return true;
+}
+
 static esp_err_t parse_get(httpd_req_t *req, char **obuf) {
   char *buf = NULL;
   size_t buf_len = 0;
@@ -368,11 +916,26 @@ static esp_err_t cmd_handler(httpd_req_t *req) {
   int res = 0;
 
   if (!strcmp(variable, "framesize")) {
+    // Streams stay open; the camera may restart, so s is not used after this.
     if (s->pixformat == PIXFORMAT_JPEG) {
-      res = s->set_framesize(s, (framesize_t)val);
+      res = capture_set_framesize((framesize_t)val) == ESP_OK ? 0 : -1;
     }
   } else if (!strcmp(variable, "quality")) {
+    // A manual quality takes over from the rate controller.
+    rate_control_config_t rc;
+    capture_rate_get_config(&rc);
+    if (rc.mode != RATE_CONTROL_OFF) {
+      rc.mode = RATE_CONTROL_OFF;
+      capture_rate_set_config(&rc);
+    }
     res = s->set_quality(s, val);
+  } else if (!strcmp(variable, "rate_bytes") || !strcmp(variable, "rate_kbps")) {
+    // Target bytes per frame or kbit/s; 0 turns rate control off.
+    rate_control_config_t rc;
+    capture_rate_get_config(&rc);
+    rc.mode = val <= 0 ? RATE_CONTROL_OFF : !strcmp(variable, "rate_bytes") ? RATE_CONTROL_BYTES_PER_FRAME : RATE_CONTROL_KBPS;
+    rc.target = val > 0 ? val : 0;
+    res = capture_rate_set_config(&rc) == ESP_OK ? 0 : -1;
   } else if (!strcmp(variable, "contrast")) {
     res = s->set_contrast(s, val);
   } else if (!strcmp(variable, "brightness")) {
@@ -430,6 +993,7 @@ static esp_err_t cmd_handler(httpd_req_t *req) {
     log_i("Unknown command: %s", variable);
     res = -1;
   }
+  profiles_invalidate();
 
   if (res < 0) {
     return httpd_resp_send_500(req);
@@ -444,7 +1008,7 @@ static int print_reg(char *p, sensor_t *s, uint16_t reg, uint32_t mask) {
 }
 
 static esp_err_t status_handler(httpd_req_t *req) {
-  static char json_response[1024];
+  static char json_response[1536];
 
   sensor_t *s = esp_camera_sensor_get();
   if (!s) {
@@ -511,6 +1075,8 @@ static esp_err_t status_handler(httpd_req_t *req) {
   p += sprintf(p, "\"vflip\":%u,", s->status.vflip);
   p += sprintf(p, "\"dcw\":%u,", s->status.dcw);
   p += sprintf(p, "\"colorbar\":%u", s->status.colorbar);
+  p += sprintf(p, ",\"rate_ctl\":");
+  p += capture_rate_json(p, json_response + sizeof(json_response) - p);
 #if defined(LED_GPIO_NUM)
   p += sprintf(p, ",\"led_intensity\":%u", led_duty);
 #else
@@ -540,12 +1106,16 @@ static esp_err_t xclk_handler(httpd_req_t *req) {
   int xclk = atoi(_xclk);
   log_i("Set XCLK: %d MHz", xclk);
 
-  sensor_t *s = esp_camera_sensor_get();
-  if (!s) {
+  if (!esp_camera_sensor_get()) {
     return camera_not_ready(req);
   }
-  int res = s->set_xclk(s, LEDC_TIMER_0, xclk);
-  if (res) {
+  // Through capture, so an idle slowdown or a camera restart does not undo it.
+  esp_err_t err = capture_set_xclk(xclk);
+  if (err == ESP_ERR_INVALID_ARG) {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "bad xclk");
+    return ESP_FAIL;
+  }
+  if (err != ESP_OK) {
     return httpd_resp_send_500(req);
   }
 
@@ -580,6 +1150,7 @@ static esp_err_t reg_handler(httpd_req_t *req) {
     return camera_not_ready(req);
   }
   int res = s->set_reg(s, reg, mask, val);
+  profiles_invalidate();
   if (res) {
     return httpd_resp_send_500(req);
   }
@@ -652,6 +1223,7 @@ static esp_err_t pll_handler(httpd_req_t *req) {
     return camera_not_ready(req);
   }
   int res = s->set_pll(s, bypass, mul, sys, root, pre, seld5, pclken, pclk);
+  profiles_invalidate();
   if (res) {
     return httpd_resp_send_500(req);
   }
@@ -690,6 +1262,7 @@ static esp_err_t win_handler(httpd_req_t *req) {
     return camera_not_ready(req);
   }
   int res = s->set_res_raw(s, startX, startY, endX, endY, offsetX, offsetY, totalX, totalY, outputX, outputY, scale, binning);  // codespell:ignore totaly
+  profiles_invalidate();
   if (res) {
     return httpd_resp_send_500(req);
   }
@@ -698,8 +1271,337 @@ static esp_err_t win_handler(httpd_req_t *req) {
   return httpd_resp_send(req, NULL, 0);
 }
 
+static esp_err_t admission_handler(httpd_req_t *req) {
+  static char json[512];
+  char query[128];
+
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+    stream_admission_config_t c;
+    stream_admission_get_config(&c);
+    c.max_viewers = parse_get_var(query, "max_viewers", c.max_viewers);
+    c.airtime_pct = parse_get_var(query, "airtime_pct", c.airtime_pct);
+    c.full_fps = parse_get_var(query, "full_fps", c.full_fps);
+    c.low_fps = parse_get_var(query, "low_fps", c.low_fps);
+    c.low_tier = parse_get_var(query, "low_tier", c.low_tier);
+    c.retry_after_s = parse_get_var(query, "retry_after", c.retry_after_s);
+    if (stream_admission_set_config(&c) != ESP_OK) {
+      httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid admission config");
+      return ESP_FAIL;
+    }
+  }
+
+  stream_admission_stats_json(json, sizeof(json));
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, json, strlen(json));
+}
+
+static esp_err_t multicast_handler(httpd_req_t *req) {
+  static char json[384];
+  char query[128];
+
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+    mcast_config_t c;
+    char group[16];
+    mcast_stream_get_config(&c);
+    c.enabled = parse_get_var(query, "enable", c.enabled);
+    if (httpd_query_key_value(query, "group", group, sizeof(group)) == ESP_OK) {
+      c.group = inet_addr(group);
+    }
+    c.port = parse_get_var(query, "port", c.port);
+    c.ttl = parse_get_var(query, "ttl", c.ttl);
+    c.max_fps = parse_get_var(query, "fps", c.max_fps);
+    c.payload = parse_get_var(query, "payload", c.payload);
+    if (mcast_stream_set_config(&c) != ESP_OK) {
+      httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid multicast config");
+      return ESP_FAIL;
+    }
+  }
+
+  mcast_stream_stats_json(json, sizeof(json));
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, json, strlen(json));
+}
+
+static int sink_flag(char *query, const char *key, uint8_t sinks, uint8_t bit) {
+  return parse_get_var(query, key, (sinks & bit) != 0) ? (sinks | bit) : (sinks & ~bit);
+}
+
+/* Streaming session table; ?kick=<id> shuts that session's connection down first. */
+static esp_err_t sessions_handler(httpd_req_t *req) {
+  static char json[4096];
+  char val[12];
+
+  if (query_value(req, "kick", val, sizeof(val)) && sessions_kick(strtoul(val, NULL, 10)) != ESP_OK) {
+    httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "no such session");
+    return ESP_FAIL;
+  }
+  int len = sessions_json(json, sizeof(json));
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  return httpd_resp_send(req, json, len < (int)sizeof(json) ? len : sizeof(json) - 1);
+}
+
+/* SD recorder; ?enable=0|1, fps= and segment_s= change it. */
+static esp_err_t record_handler(httpd_req_t *req) {
+  static char json[512];
+  char query[96];
+
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+    recorder_config_t c;
+    recorder_get_config(&c);
+    c.enabled = parse_get_var(query, "enable", c.enabled);
+    c.fps = parse_get_var(query, "fps", c.fps);
+    c.segment_s = parse_get_var(query, "segment_s", c.segment_s);
+    esp_err_t err = recorder_set_config(&c);
+    if (err != ESP_OK) {
+      httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, err == ESP_ERR_INVALID_STATE ? "no SD card" : "invalid recorder config");
+      return ESP_FAIL;
+    }
+  }
+
+  recorder_stats_json(json, sizeof(json));
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  return httpd_resp_send(req, json, strlen(json));
+}
+
+/* In-place %XX decoding, for file paths passed in a query. */
+static void url_decode(char *s) {
+  char *out = s;
+  for (; *s; s++) {
+    if (*s == '%' && isxdigit((uint8_t)s[1]) && isxdigit((uint8_t)s[2])) {
+      char hex[3] = {s[1], s[2], 0};
+      *out++ = (char)strtol(hex, NULL, 16);
+      s += 2;
+    } else {
+      *out++ = *s == '+' ? ' ' : *s;
+    }
+  }
+  *out = 0;
+}
+
+/*
+ * Frame source. ?file=/sdcard/clip.avi replays a recording to every consumer,
+ * with pace=timed|fast, loop=0|1 and fps= for files without timing;
+ * ?camera=1 goes back to the sensor.
+ */
+static esp_err_t replay_handler(httpd_req_t *req) {
+  static char json[512];
+  char query[160];
+
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+    replay_config_t c = {};
+    char pace[8];
+    esp_err_t err = ESP_OK;
+    if (httpd_query_key_value(query, "file", c.path, sizeof(c.path)) == ESP_OK) {
+      url_decode(c.path);
+      c.pace = httpd_query_key_value(query, "pace", pace, sizeof(pace)) == ESP_OK && !strcmp(pace, "fast") ? REPLAY_FAST : REPLAY_TIMED;
+      c.loop = parse_get_var(query, "loop", 1);
+      c.fps = parse_get_var(query, "fps", 0);
+      err = capture_set_source(&c);
+    } else if (parse_get_var(query, "camera", 0)) {
+      err = capture_set_source(NULL);
+    }
+    if (err == ESP_ERR_NOT_FOUND) {
+      httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "cannot open the file");
+      return ESP_FAIL;
+    }
+    if (err == ESP_ERR_NOT_SUPPORTED) {
+      httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "not an MJPEG or AVI file");
+      return ESP_FAIL;
+    }
+    if (err != ESP_OK) {
+      httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, esp_err_to_name(err));
+      return ESP_FAIL;
+    }
+  }
+
+  replay_stats_json(json, sizeof(json));
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  return httpd_resp_send(req, json, strlen(json));
+}
+
+/* SSE push channel; ?max_hz= caps the message rate, ?metrics_ms= the metrics period. */
+static esp_err_t events_handler(httpd_req_t *req) {
+  char val[12];
+  uint8_t max_hz = query_value(req, "max_hz", val, sizeof(val)) ? atoi(val) : EVENTS_DEFAULT_HZ;
+  uint32_t metrics_ms = query_value(req, "metrics_ms", val, sizeof(val)) ? atoi(val) : EVENTS_METRICS_MS;
+  if (events_attach(req, max_hz, metrics_ms) != ESP_OK) {
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_set_hdr(req, "Retry-After", "5");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    return httpd_resp_send(req, "event slots exhausted", HTTPD_RESP_USE_STRLEN);
+  }
+  return ESP_OK;
+}
+
+/* Recent deferred log lines as text; serial/spiffs/memory=0|1 pick the sinks. */
+static esp_err_t logs_handler(httpd_req_t *req) {
+  static char text[DLOG_TAIL_BYTES];
+  char query[64];
+
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+    uint8_t sinks = dlog_get_sinks();
+    sinks = sink_flag(query, "serial", sinks, DLOG_SINK_SERIAL);
+    sinks = sink_flag(query, "spiffs", sinks, DLOG_SINK_SPIFFS);
+    sinks = sink_flag(query, "memory", sinks, DLOG_SINK_MEMORY);
+    dlog_set_sinks(sinks);
+  }
+
+  size_t len = dlog_tail(text, sizeof(text));
+  httpd_resp_set_type(req, "text/plain");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, text, len);
+}
+
+/*
+ * Device clock for latency probes: the esp_timer time the response is built,
+ * in the same microseconds as X-Timestamp and the latency part headers.
+ * Clients estimate their offset from the round trip of several requests.
+ */
+/* ?set=<Unix ms> sets the wall clock, which recordings are catalogued by once set. */
+static esp_err_t clock_handler(httpd_req_t *req) {
+  char val[24];
+  if (query_value(req, "set", val, sizeof(val))) {
+    int64_t ms = strtoll(val, NULL, 10);
+    struct timeval tv = {(time_t)(ms / 1000), (suseconds_t)(ms % 1000 * 1000)};
+    if (tv.tv_sec < RECORDER_WALL_MIN_S || settimeofday(&tv, NULL) != 0) {
+      httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid time");
+      return ESP_FAIL;
+    }
+  }
+  bool wall;
+  char json[96];
+  int len = snprintf(json, sizeof(json), "{\"us\":%lld,\"catalog_ms\":%lld,\"wall\":%s}", esp_timer_get_time(), recorder_clock_us(esp_timer_get_time(), &wall) / 1000, wall ? "true" : "false");
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  return httpd_resp_send(req, json, len);
+}
+
+static esp_err_t profile_error(httpd_req_t *req, esp_err_t err) {
+  if (err == ESP_ERR_INVALID_STATE) {
+    return camera_not_ready(req);
+  }
+  if (err == ESP_ERR_NOT_FOUND) {
+    httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "no such profile");
+  } else if (err == ESP_ERR_INVALID_ARG) {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid profile, or one saved on another sensor");
+  } else if (err == ESP_ERR_NOT_SUPPORTED) {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "snapshots need an OV2640");
+  } else if (err == ESP_ERR_NO_MEM) {
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "all profile slots are used");
+  } else {
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, esp_err_to_name(err));
+  }
+  return ESP_FAIL;
+}
+
+/*
+ * Sensor profiles. ?apply=<name> switches to one at the next frame boundary,
+ * ?save=<name> stores the current tuning, ?delete=<name> removes one and
+ * ?show=<name> lists its registers; with no query, the profiles.
+ */
+static esp_err_t profile_handler(httpd_req_t *req) {
+  static char json[PROFILES_REGS_MAX * 20 + 128];
+  char query[64];
+  char name[PROFILES_NAME_MAX];
+  const char *show = NULL;
+
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+    esp_err_t err = ESP_OK;
+    if (httpd_query_key_value(query, "apply", name, sizeof(name)) == ESP_OK) {
+      profile_result_t r;
+      err = profiles_apply(name, &r);
+      if (err == ESP_OK) {
+        int len = snprintf(
+          json, sizeof(json), "{\"name\":\"%s\",\"regs\":%u,\"reads\":%u,\"writes\":%u,\"skipped\":%u,\"burst_us\":%u,\"gap_ms\":%u}", name, r.regs, r.reads,
+          r.writes, r.skipped, r.burst_us, r.gap_us / 1000
+        );
+        httpd_resp_set_type(req, "application/json");
+        httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+        httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+        return httpd_resp_send(req, json, len);
+      }
+    } else if (httpd_query_key_value(query, "save", name, sizeof(name)) == ESP_OK) {
+      err = profiles_snapshot(name);
+      show = name;
+    } else if (httpd_query_key_value(query, "delete", name, sizeof(name)) == ESP_OK) {
+      err = profiles_delete(name);
+    } else if (httpd_query_key_value(query, "show", name, sizeof(name)) == ESP_OK) {
+      show = name;
+    }
+    if (err != ESP_OK) {
+      return profile_error(req, err);
+    }
+  }
+
+  int len = profiles_json(show, json, sizeof(json));
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  return httpd_resp_send(req, json, len < (int)sizeof(json) ? len : sizeof(json) - 1);
+}
+
+/* POST /profile?name=<name>: the body is profile source, one "reg [mask] val" per line. */
+static esp_err_t profile_upload_handler(httpd_req_t *req) {
+  char name[PROFILES_NAME_MAX];
+  if (!query_value(req, "name", name, sizeof(name))) {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "name is required");
+    return ESP_FAIL;
+  }
+  if (req->content_len == 0 || req->content_len > PROFILES_TEXT_MAX) {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "profile source is empty or too long");
+    return ESP_FAIL;
+  }
+  char *text = (char *)malloc(req->content_len + 1);
+  if (!text) {
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+  size_t got = 0;
+  while (got < req->content_len) {
+    int n = httpd_req_recv(req, text + got, req->content_len - got);
+    if (n == HTTPD_SOCK_ERR_TIMEOUT) {
+      continue;
+    }
+    if (n <= 0) {
+      free(text);
+      return ESP_FAIL;
+    }
+    got += n;
+  }
+  text[got] = 0;
+
+  int bad_line;
+  esp_err_t err = profiles_compile(name, text, &bad_line);
+  free(text);
+  if (err == ESP_ERR_INVALID_ARG && bad_line) {
+    char msg[48];
+    snprintf(msg, sizeof(msg), "bad register write on line %d", bad_line);
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, msg);
+    return ESP_FAIL;
+  }
+  if (err != ESP_OK) {
+    return profile_error(req, err);
+  }
+
+  static char json[PROFILES_REGS_MAX * 20 + 128];
+  int len = profiles_json(name, json, sizeof(json));
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  return httpd_resp_send(req, json, len < (int)sizeof(json) ? len : sizeof(json) - 1);
+}
+
 static esp_err_t info_handler(httpd_req_t *req) {
-  static char json[1536];
+  static char json[8192];
   char *p = json;
 
   *p++ = '{';
@@ -729,6 +1631,43 @@ static esp_err_t info_handler(httpd_req_t *req) {
   }
   p += sprintf(p, "\"http_port\":80,");
   p += sprintf(p, "\"stream_port\":81,");
+  p += sprintf(p, "\"dns\":");
+  p += captive_dns_stats_json(p, json + sizeof(json) - p);
+  p += sprintf(p, ",\"sta_link\":");
+  p += sta_link_stats_json(p, json + sizeof(json) - p);
+  p += sprintf(p, ",\"admission\":");
+  p += stream_admission_stats_json(p, json + sizeof(json) - p);
+  p += sprintf(p, ",\"rtsp\":");
+  p += rtsp_server_stats_json(p, json + sizeof(json) - p);
+  p += sprintf(p, ",\"multicast\":");
+  p += mcast_stream_stats_json(p, json + sizeof(json) - p);
+  p += sprintf(p, ",\"change_gate\":");
+  p += change_gate_stats_json(p, json + sizeof(json) - p);
+  p += sprintf(p, ",\"xform\":");
+  p += xform_stats_json(p, json + sizeof(json) - p);
+  p += sprintf(p, ",\"substream\":");
+  p += substream_stats_json(p, json + sizeof(json) - p);
+  p += sprintf(p, ",\"power\":");
+  p += power_gov_stats_json(p, json + sizeof(json) - p);
+  p += sprintf(p, ",\"dlog\":");
+  p += dlog_stats_json(p, json + sizeof(json) - p);
+  p += sprintf(p, ",\"events\":");
+  p += events_stats_json(p, json + sizeof(json) - p);
+  p += sprintf(p, ",\"capture\":");
+  p += capture_stats_json(p, json + sizeof(json) - p);
+  p += sprintf(p, ",\"memory\":");
+  p += mem_gov_stats_json(p, json + sizeof(json) - p);
+  p += sprintf(p, ",\"sessions\":");
+  p += sessions_stats_json(p, json + sizeof(json) - p);
+  p += sprintf(p, ",\"replay\":");
+  p += replay_stats_json(p, json + sizeof(json) - p);
+  p += sprintf(p, ",\"recorder\":");
+  p += recorder_stats_json(p, json + sizeof(json) - p);
+  p += sprintf(p, ",\"recordings\":");
+  p += recordings_stats_json(p, json + sizeof(json) - p);
+  p += sprintf(p, ",\"profiles\":");
+  p += profiles_stats_json(p, json + sizeof(json) - p);
+  *p++ = ',';
 
   sensor_t *s = esp_camera_sensor_get();
   if (s) {
@@ -760,9 +1699,90 @@ static esp_err_t captive_handler(httpd_req_t *req, httpd_err_code_t err) {
   return httpd_resp_send(req, "Redirecting to camera...", HTTPD_RESP_USE_STRLEN);
 }
 
-void startCameraServer() {
+/* Every new connection is pending work: step the governor up before it is read. */
+static esp_err_t power_open_fn(httpd_handle_t hd, int sockfd) {
+  power_gov_kick();
+  return ESP_OK;
+}
+
+typedef struct {
+  int fd;
+  uint32_t seq;  // open order, 0 for a free entry
+} control_sock_t;
+
+// Open control server sockets; only its task touches them.
+static control_sock_t control_socks[CONTROL_SOCKETS];
+static uint32_t control_opened;
+
+/*
+ * Records the new socket and, once it makes more than CONTROL_UI_SOCKETS
+ * page/API connections, closes the oldest of the others, so at most
+ * CONTROL_UI_SOCKETS are open after each accept. Sockets held by /events or
+ * a download are never picked.
+ */
+static esp_err_t control_open_fn(httpd_handle_t hd, int sockfd) {
+  power_gov_kick();
+  int oldest = -1;
+  int ui = 1;  // the new socket counts toward CONTROL_UI_SOCKETS
+  bool stored = false;
+  for (int i = 0; i < CONTROL_SOCKETS; i++) {
+    control_sock_t *c = &control_socks[i];
+    if (!c->seq) {
+      if (!stored) {
+        c->fd = sockfd;
+        c->seq = ++control_opened;
+        stored = true;
+      }
+      continue;
+    }
+    if (c->fd == sockfd || events_holds(c->fd) || recordings_holds(c->fd)) {
+      continue;
+    }
+    ui++;
+    if (oldest < 0 || c->seq < control_socks[oldest].seq) {
+      oldest = i;
+    }
+  }
+  if (ui > CONTROL_UI_SOCKETS && oldest >= 0) {
+    httpd_sess_trigger_close(hd, control_socks[oldest].fd);
+  }
+  return ESP_OK;
+}
+
+static void control_close_fn(httpd_handle_t hd, int sockfd) {
+  for (int i = 0; i < CONTROL_SOCKETS; i++) {
+    if (control_socks[i].seq && control_socks[i].fd == sockfd) {
+      control_socks[i].seq = 0;
+    }
+  }
+  close(sockfd);
+}
+
+static httpd_config_t httpd_profile_config(const httpd_profile_t *profile) {
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-  config.max_uri_handlers = 16;
+  config.server_port = profile->server_port;
+  config.ctrl_port = profile->ctrl_port;
+  config.core_id = profile->core_id;
+  config.task_priority = profile->task_priority;
+  config.stack_size = profile->stack_size;
+  config.max_open_sockets = profile->max_open_sockets;
+  config.backlog_conn = profile->backlog_conn;
+  config.lru_purge_enable = profile->lru_purge_enable;
+  config.recv_wait_timeout = profile->recv_wait_timeout;
+  config.send_wait_timeout = profile->send_wait_timeout;
+  config.keep_alive_enable = profile->keep_alive_enable;
+  config.enable_so_linger = profile->linger_zero;
+  config.linger_timeout = 0;
+  config.open_fn = power_open_fn;
+  return config;
+}
+
+void startCameraServer() {
+  httpd_config_t config = httpd_profile_config(&control_profile);
+  config.open_fn = control_open_fn;
+  config.close_fn = control_close_fn;
+  config.max_uri_handlers = 24;
+  config.uri_match_fn = httpd_uri_match_wildcard;  // /recordings/*
 
   httpd_uri_t index_uri = {
     .uri = "/",
@@ -819,7 +1839,7 @@ void startCameraServer() {
   httpd_uri_t stream_uri = {
     .uri = "/stream",
     .method = HTTP_GET,
-    .handler = stream_handler,
+    .handler = stream_dispatch,
     .user_ctx = NULL
 #ifdef CONFIG_HTTPD_WS_SUPPORT
     ,
@@ -907,6 +1927,175 @@ void startCameraServer() {
 #endif
   };
 
+  httpd_uri_t admission_uri = {
+    .uri = "/admission",
+    .method = HTTP_GET,
+    .handler = admission_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t multicast_uri = {
+    .uri = "/multicast",
+    .method = HTTP_GET,
+    .handler = multicast_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t events_uri = {
+    .uri = "/events",
+    .method = HTTP_GET,
+    .handler = events_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t sessions_uri = {
+    .uri = "/sessions",
+    .method = HTTP_GET,
+    .handler = sessions_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t replay_uri = {
+    .uri = "/replay",
+    .method = HTTP_GET,
+    .handler = replay_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t record_uri = {
+    .uri = "/record",
+    .method = HTTP_GET,
+    .handler = record_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t recordings_uri = {
+    .uri = "/recordings",
+    .method = HTTP_GET,
+    .handler = recordings_list,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t recording_uri = {
+    .uri = "/recordings/*",
+    .method = HTTP_GET,
+    .handler = recordings_serve,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t recording_head_uri = {
+    .uri = "/recordings/*",
+    .method = HTTP_HEAD,
+    .handler = recordings_serve,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t clock_uri = {
+    .uri = "/clock",
+    .method = HTTP_GET,
+    .handler = clock_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t profile_uri = {
+    .uri = "/profile",
+    .method = HTTP_GET,
+    .handler = profile_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t profile_upload_uri = {
+    .uri = "/profile",
+    .method = HTTP_POST,
+    .handler = profile_upload_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
+  httpd_uri_t logs_uri = {
+    .uri = "/logs",
+    .method = HTTP_GET,
+    .handler = logs_handler,
+    .user_ctx = NULL
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = NULL
+#endif
+  };
+
   httpd_uri_t info_uri = {
     .uri = "/info",
     .method = HTTP_GET,
@@ -920,7 +2109,12 @@ void startCameraServer() {
 #endif
   };
 
-  ra_filter_init(&ra_filter, 20);
+  if (events_init() != ESP_OK) {
+    log_e("Failed to start event push task");
+  }
+  if (sessions_init() != ESP_OK) {
+    log_e("Failed to set up the session table");
+  }
 
   log_i("Starting web server on port: '%d'", config.server_port);
   if (httpd_start(&camera_httpd, &config) == ESP_OK) {
@@ -937,10 +2131,29 @@ void startCameraServer() {
     httpd_register_uri_handler(camera_httpd, &pll_uri);
     httpd_register_uri_handler(camera_httpd, &win_uri);
     httpd_register_uri_handler(camera_httpd, &info_uri);
+    httpd_register_uri_handler(camera_httpd, &admission_uri);
+    httpd_register_uri_handler(camera_httpd, &multicast_uri);
+    httpd_register_uri_handler(camera_httpd, &logs_uri);
+    httpd_register_uri_handler(camera_httpd, &clock_uri);
+    httpd_register_uri_handler(camera_httpd, &events_uri);
+    httpd_register_uri_handler(camera_httpd, &sessions_uri);
+    httpd_register_uri_handler(camera_httpd, &replay_uri);
+    httpd_register_uri_handler(camera_httpd, &record_uri);
+    httpd_register_uri_handler(camera_httpd, &recordings_uri);
+    httpd_register_uri_handler(camera_httpd, &recording_uri);
+    httpd_register_uri_handler(camera_httpd, &recording_head_uri);
+    httpd_register_uri_handler(camera_httpd, &profile_uri);
+    httpd_register_uri_handler(camera_httpd, &profile_upload_uri);
   }
 
-  config.server_port += 1;
-  config.ctrl_port += 1;
+  if (!start_stream_workers()) {
+    log_e("Failed to start stream workers");
+    return;
+  }
+  if (substream_init() != ESP_OK) {
+    log_e("Failed to start substream producer");
+  }
+  config = httpd_profile_config(&stream_profile);
   log_i("Starting stream server on port: '%d'", config.server_port);
   if (httpd_start(&stream_httpd, &config) == ESP_OK) {
     httpd_register_uri_handler(stream_httpd, &stream_uri);
@@ -0,0 +1,298 @@
+/**
+ * AVI muxer.
+ *
+ * The header is fixed at AVI_MUX_HEADER_SIZE bytes (hdrl with avih, one
+ * MJPG video strl, then the movi list) and is rewritten whole at every
+ * sync and on close; it sits in the file's first sector. idx1 offsets are
+ * relative to the movi fourcc, as most players expect.
+ *
+ * Write order at a sync is data, then the header that counts it, then the
+ * side index, each made durable before the next, so a synced header or
+ * index entry never points past what is on the card.
+ */
+#include "avi_mux.h"
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define MOVI_FOURCC     220            // offset of 'movi'; idx1 offsets count from here
+#define AVIF_HASINDEX   0x10
+#define AVIIF_KEYFRAME  0x10
+#define INDEX_ENTRY     AVI_MUX_INDEX_ENTRY
+#define COPY_CHUNK      512
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t frame_period(const avi_mux_t *m) {
+  if (m->frames > 1 && m->last_ts_us > m->first_ts_us) {
+    return (uint32_t)((m->last_ts_us - m->first_ts_us) / (m->frames - 1));
+  }
+  return m->frame_us;
+}
+
+/* The whole header for the current state; riff_end is the file size it describes. */
+static void build_header(const avi_mux_t *m, uint8_t *h, uint32_t riff_end, bool indexed) {
+  uint32_t us = frame_period(m);
+  uint32_t buf_size = m->max_frame + 8;
+  memset(h, 0, AVI_MUX_HEADER_SIZE);
+
+  memcpy(h, "RIFF", 4);
+  put32(h + 4, riff_end - 8);
+  memcpy(h + 8, "AVI ", 4);
+  memcpy(h + 12, "LIST", 4);
+  put32(h + 16, 192);
+  memcpy(h + 20, "hdrl", 4);
+
+  memcpy(h + 24, "avih", 4);
+  put32(h + 28, 56);
+  put32(h + 32, us);
+  put32(h + 36, us ? (uint32_t)((uint64_t)buf_size * 1000000 / us) : 0);
+  put32(h + 44, indexed ? AVIF_HASINDEX : 0);
+  put32(h + 48, m->frames);
+  put32(h + 56, 1);                // streams
+  put32(h + 60, buf_size);
+  put32(h + 64, m->width);
+  put32(h + 68, m->height);
+
+  memcpy(h + 88, "LIST", 4);
+  put32(h + 92, 116);
+  memcpy(h + 96, "strl", 4);
+  memcpy(h + 100, "strh", 4);
+  put32(h + 104, 56);
+  memcpy(h + 108, "vids", 4);
+  memcpy(h + 112, "MJPG", 4);
+  put32(h + 128, us);              // scale / rate = seconds per frame
+  put32(h + 132, 1000000);
+  put32(h + 140, m->frames);
+  put32(h + 144, buf_size);
+  put32(h + 148, UINT32_MAX);      // quality: default
+  put16(h + 160, m->width);        // rcFrame right, bottom
+  put16(h + 162, m->height);
+
+  memcpy(h + 164, "strf", 4);
+  put32(h + 168, 40);
+  put32(h + 172, 40);
+  put32(h + 176, m->width);
+  put32(h + 180, m->height);
+  put16(h + 184, 1);
+  put16(h + 186, 24);
+  memcpy(h + 188, "MJPG", 4);
+  put32(h + 192, (uint32_t)m->width * m->height * 3);
+
+  memcpy(h + 212, "LIST", 4);
+  put32(h + 216, m->end - MOVI_FOURCC);
+  memcpy(h + 220, "movi", 4);
+}
+
+/* Rewrites the header and leaves the file positioned at resume. */
+static bool write_header(avi_mux_t *m, uint32_t riff_end, bool indexed, uint32_t resume) {
+  uint8_t h[AVI_MUX_HEADER_SIZE];
+  build_header(m, h, riff_end, indexed);
+  bool ok = fseek(m->f, 0, SEEK_SET) == 0 && fwrite(h, 1, sizeof(h), m->f) == sizeof(h);
+  return fseek(m->f, resume, SEEK_SET) == 0 && ok;
+}
+
+static bool flush(FILE *f) {
+  return fflush(f) == 0 && fsync(fileno(f)) == 0;
+}
+
+void avi_mux_index_path(const char *path, char *out, size_t len) {
+  size_t n = strlen(path);
+  if (n > 4 && !strcasecmp(path + n - 4, ".avi")) {
+    n -= 4;
+  }
+  snprintf(out, len, "%.*s.idx", (int)n, path);
+}
+
+bool avi_mux_open(avi_mux_t *m, const char *path, uint16_t width, uint16_t height, uint32_t frame_us) {
+  char idx_path[AVI_MUX_PATH_MAX + 4];
+  memset(m, 0, sizeof(*m));
+  snprintf(m->path, sizeof(m->path), "%s", path);
+  m->width = width;
+  m->height = height;
+  m->frame_us = frame_us;
+  m->end = AVI_MUX_HEADER_SIZE;
+
+  avi_mux_index_path(m->path, idx_path, sizeof(idx_path));
+  m->idx = fopen(idx_path, "w+b");
+  m->f = m->idx ? fopen(m->path, "w+b") : NULL;
+  if (m->f && write_header(m, m->end, false, m->end) && flush(m->f) && flush(m->idx)) {
+    return true;
+  }
+  if (m->f) {
+    fclose(m->f);
+    remove(m->path);
+  }
+  if (m->idx) {
+    fclose(m->idx);
+    remove(idx_path);
+  }
+  m->f = m->idx = NULL;
+  return false;
+}
+
+bool avi_mux_write(avi_mux_t *m, const uint8_t *jpg, size_t len, int64_t ts_us) {
+  uint32_t chunk = 8 + len + (len & 1);
+  if (!m->f || (uint64_t)m->end + chunk + 8 + (uint64_t)(m->frames + 1) * INDEX_ENTRY > AVI_MUX_MAX_BYTES) {
+    return false;
+  }
+  uint8_t h[8];
+  memcpy(h, "00dc", 4);
+  put32(h + 4, len);
+  uint8_t e[INDEX_ENTRY];
+  memcpy(e, "00dc", 4);
+  put32(e + 4, AVIIF_KEYFRAME);
+  put32(e + 8, m->end - MOVI_FOURCC);
+  put32(e + 12, len);
+
+  static const uint8_t pad = 0;
+  bool ok = fwrite(h, 1, sizeof(h), m->f) == sizeof(h) && fwrite(jpg, 1, len, m->f) == len && (!(len & 1) || fwrite(&pad, 1, 1, m->f) == 1);
+  ok = ok && fwrite(e, 1, sizeof(e), m->idx) == sizeof(e);
+  if (!ok) {
+    // The next frame goes over the torn one; neither the header nor the index count it.
+    fseek(m->f, m->end, SEEK_SET);
+    fseek(m->idx, (long)m->frames * INDEX_ENTRY, SEEK_SET);
+    return false;
+  }
+
+  m->end += chunk;
+  if (!m->frames++) {
+    m->first_ts_us = ts_us;
+    m->synced_ts_us = ts_us;
+  }
+  m->last_ts_us = ts_us;
+  if (len > m->max_frame) {
+    m->max_frame = len;
+  }
+  if (ts_us - m->synced_ts_us >= (int64_t)AVI_MUX_SYNC_MS * 1000) {
+    avi_mux_sync(m);
+  }
+  return true;
+}
+
+bool avi_mux_sync(avi_mux_t *m) {
+  if (!m->f) {
+    return false;
+  }
+  m->synced_ts_us = m->last_ts_us;
+  m->syncs++;
+  return flush(m->f) && write_header(m, m->end, false, m->end) && flush(m->f) && flush(m->idx);
+}
+
+bool avi_mux_close(avi_mux_t *m) {
+  if (!m->f) {
+    return false;
+  }
+  uint32_t idx_len = m->frames * INDEX_ENTRY;
+  uint8_t buf[COPY_CHUNK];
+  memcpy(buf, "idx1", 4);
+  put32(buf + 4, idx_len);
+  bool ok = fflush(m->idx) == 0 && fseek(m->idx, 0, SEEK_SET) == 0 && fseek(m->f, m->end, SEEK_SET) == 0 && fwrite(buf, 1, 8, m->f) == 8;
+  for (uint32_t left = idx_len; ok && left;) {
+    size_t n = left < sizeof(buf) ? left : sizeof(buf);
+    ok = fread(buf, 1, n, m->idx) == n && fwrite(buf, 1, n, m->f) == n;
+    left -= n;
+  }
+  uint32_t riff_end = m->end + 8 + idx_len;
+  ok = ok && write_header(m, riff_end, true, riff_end) && flush(m->f);
+
+  char idx_path[AVI_MUX_PATH_MAX + 4];
+  avi_mux_index_path(m->path, idx_path, sizeof(idx_path));
+  fclose(m->f);
+  fclose(m->idx);
+  m->f = m->idx = NULL;
+  if (ok) {
+    remove(idx_path);  // what marked the file unclosed
+  }
+  return ok;
+}
+
+/* True if a complete frame chunk of len bytes starts at off. */
+static bool frame_at(FILE *f, uint32_t off, uint32_t size, uint32_t *len) {
+  uint8_t c[8];
+  if (off + 8 > size || fseek(f, off, SEEK_SET) != 0 || fread(c, 1, sizeof(c), f) != sizeof(c) || memcmp(c, "00dc", 4)) {
+    return false;
+  }
+  *len = get32(c + 4);
+  return (uint64_t)off + 8 + *len <= size;
+}
+
+bool avi_mux_repair(const char *path, uint32_t *frames) {
+  char idx_path[AVI_MUX_PATH_MAX + 4];
+  avi_mux_t m;
+  memset(&m, 0, sizeof(m));
+  snprintf(m.path, sizeof(m.path), "%s", path);
+  avi_mux_index_path(m.path, idx_path, sizeof(idx_path));
+  *frames = 0;
+
+  m.idx = fopen(idx_path, "r+b");
+  if (!m.idx) {
+    return false;
+  }
+  m.f = fopen(m.path, "r+b");
+  uint8_t h[AVI_MUX_HEADER_SIZE];
+  if (!m.f || fread(h, 1, sizeof(h), m.f) != sizeof(h) || memcmp(h, "RIFF", 4) || memcmp(h + 8, "AVI ", 4) || memcmp(h + MOVI_FOURCC, "movi", 4)) {
+    if (m.f) {
+      fclose(m.f);
+    }
+    fclose(m.idx);
+    if (!m.f) {
+      remove(idx_path);  // its recording is gone
+    }
+    return false;
+  }
+  m.frame_us = get32(h + 32);
+  m.width = get32(h + 64);
+  m.height = get32(h + 68);
+  fseek(m.f, 0, SEEK_END);
+  uint32_t size = (uint32_t)ftell(m.f);
+  m.end = AVI_MUX_HEADER_SIZE;
+
+  // Entries the side index has, while the frames they describe are whole and in sequence.
+  uint8_t e[INDEX_ENTRY];
+  uint32_t len;
+  while (fread(e, 1, sizeof(e), m.idx) == sizeof(e)) {
+    if (get32(e + 8) + MOVI_FOURCC != m.end || !frame_at(m.f, m.end, size, &len) || len != get32(e + 12)) {
+      break;
+    }
+    m.end += 8 + len + (len & 1);
+    m.frames++;
+    m.max_frame = len > m.max_frame ? len : m.max_frame;
+  }
+  // Whole frames written after the index was last flushed.
+  bool ok = fseek(m.idx, (long)m.frames * INDEX_ENTRY, SEEK_SET) == 0;
+  while (ok && frame_at(m.f, m.end, size, &len)) {
+    memcpy(e, "00dc", 4);
+    put32(e + 4, AVIIF_KEYFRAME);
+    put32(e + 8, m.end - MOVI_FOURCC);
+    put32(e + 12, len);
+    ok = fwrite(e, 1, sizeof(e), m.idx) == sizeof(e);
+    m.end += 8 + len + (len & 1);
+    m.frames++;
+    m.max_frame = len > m.max_frame ? len : m.max_frame;
+  }
+  // Drop the torn tail: a partial frame, or an idx1 a failed close left.
+  ok = ok && fflush(m.idx) == 0 && ftruncate(fileno(m.idx), (off_t)m.frames * INDEX_ENTRY) == 0;
+  ok = ok && fflush(m.f) == 0 && ftruncate(fileno(m.f), m.end) == 0;
+  if (!ok) {
+    fclose(m.f);
+    fclose(m.idx);
+    return false;
+  }
+  *frames = m.frames;
+  return avi_mux_close(&m);
+}
@@ -0,0 +1,193 @@
+/**
+ * Captive-portal DNS responder task.
+ *
+ * Every reply is the query header and question echoed back with a fixed
+ * answer record appended. The answer (name pointer, type A, class IN, TTL,
+ * address) never changes, so it is built once at start-up and copied into
+ * each response.
+ */
+#include "captive_dns.h"
+#include <Arduino.h>
+#include <string.h>
+#include "lwip/sockets.h"
+#include "esp_timer.h"
+
+#define DNS_TASK_STACK   3072
+#define DNS_TASK_PRIO    5
+#define DNS_MAX_PACKET   512
+#define DNS_HEADER_LEN   12
+#define DNS_ANSWER_LEN   16
+#define DNS_TTL_S        60
+
+#define DNS_FLAG_QR      0x8000
+#define DNS_FLAG_AA      0x0400
+#define DNS_FLAG_RD      0x0100
+#define DNS_OPCODE_MASK  0x7800
+#define DNS_RCODE_NOTIMP 0x0004
+
+#define DNS_TYPE_A       1
+#define DNS_TYPE_ANY     255
+#define DNS_CLASS_IN     1
+
+typedef struct {
+  uint32_t queries;
+  uint32_t answered;
+  uint32_t ignored;
+  uint32_t send_errors;
+  uint64_t latency_sum_us;
+  uint32_t latency_max_us;
+} dns_stats_t;
+
+static uint8_t answer_template[DNS_ANSWER_LEN];
+static dns_stats_t stats;
+static int dns_sock = -1;
+static TaskHandle_t dns_task_handle = NULL;
+
+static void build_answer_template(uint32_t ip) {
+  uint8_t *a = answer_template;
+  *a++ = 0xC0;  // name: pointer to the question name at offset 12
+  *a++ = DNS_HEADER_LEN;
+  *a++ = 0;
+  *a++ = DNS_TYPE_A;
+  *a++ = 0;
+  *a++ = DNS_CLASS_IN;
+  *a++ = (DNS_TTL_S >> 24) & 0xFF;
+  *a++ = (DNS_TTL_S >> 16) & 0xFF;
+  *a++ = (DNS_TTL_S >> 8) & 0xFF;
+  *a++ = DNS_TTL_S & 0xFF;
+  *a++ = 0;
+  *a++ = 4;
+  memcpy(a, &ip, 4);  // already network order
+}
+
+static inline uint16_t rd16(const uint8_t *p) {
+  return (p[0] << 8) | p[1];
+}
+
+static inline void wr16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v & 0xFF;
+}
+
+/*
+ * Rewrites the query in buf into a response in place. Returns the response
+ * length, or 0 if the packet should be dropped.
+ */
+static size_t build_response(uint8_t *buf, size_t len) {
+  if (len < DNS_HEADER_LEN) {
+    return 0;
+  }
+  uint16_t flags = rd16(buf + 2);
+  if ((flags & DNS_FLAG_QR) || rd16(buf + 4) != 1) {
+    return 0;
+  }
+
+  // Walk the question name; compression is not allowed in a query.
+  size_t off = DNS_HEADER_LEN;
+  while (off < len && buf[off] != 0) {
+    if (buf[off] & 0xC0) {
+      return 0;
+    }
+    off += buf[off] + 1;
+  }
+  off += 1 + 4;  // terminating zero, qtype, qclass
+  if (off > len) {
+    return 0;
+  }
+  uint16_t qtype = rd16(buf + off - 4);
+  uint16_t qclass = rd16(buf + off - 2);
+
+  uint16_t rflags = DNS_FLAG_QR | DNS_FLAG_AA | (flags & (DNS_OPCODE_MASK | DNS_FLAG_RD));
+  bool answer = false;
+  if (flags & DNS_OPCODE_MASK) {
+    rflags |= DNS_RCODE_NOTIMP;
+  } else {
+    answer = (qtype == DNS_TYPE_A || qtype == DNS_TYPE_ANY) && qclass == DNS_CLASS_IN;
+  }
+
+  wr16(buf + 2, rflags);
+  wr16(buf + 6, answer ? 1 : 0);  // ancount
+  wr16(buf + 8, 0);               // nscount
+  wr16(buf + 10, 0);              // arcount; drops any EDNS record after the question
+  if (answer) {
+    memcpy(buf + off, answer_template, DNS_ANSWER_LEN);
+    off += DNS_ANSWER_LEN;
+  }
+  return off;
+}
+
+static void dns_task(void *arg) {
+  static uint8_t buf[DNS_MAX_PACKET + DNS_ANSWER_LEN];
+  struct sockaddr_in from;
+
+  while (true) {
+    socklen_t from_len = sizeof(from);
+    int len = recvfrom(dns_sock, buf, DNS_MAX_PACKET, 0, (struct sockaddr *)&from, &from_len);
+    if (len < 0) {
+      log_e("DNS recvfrom failed: %d", errno);
+      vTaskDelay(100 / portTICK_PERIOD_MS);
+      continue;
+    }
+    int64_t t_recv = esp_timer_get_time();
+    stats.queries++;
+
+    size_t rlen = build_response(buf, len);
+    if (!rlen) {
+      stats.ignored++;
+      continue;
+    }
+    if (sendto(dns_sock, buf, rlen, 0, (struct sockaddr *)&from, from_len) < 0) {
+      stats.send_errors++;
+      continue;
+    }
+
+    uint32_t lat = (uint32_t)(esp_timer_get_time() - t_recv);
+    stats.answered++;
+    stats.latency_sum_us += lat;
+    if (lat > stats.latency_max_us) {
+      stats.latency_max_us = lat;
+    }
+  }
+}
+
+esp_err_t captive_dns_start(uint16_t port, uint32_t ip) {
+  if (dns_task_handle) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  build_answer_template(ip);
+
+  dns_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (dns_sock < 0) {
+    log_e("DNS socket failed: %d", errno);
+    return ESP_FAIL;
+  }
+
+  // Bind to the AP address only so STA-side lookups are never hijacked.
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = ip;
+  if (bind(dns_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    log_e("DNS bind failed: %d", errno);
+    close(dns_sock);
+    dns_sock = -1;
+    return ESP_FAIL;
+  }
+
+  if (xTaskCreatePinnedToCore(dns_task, "captive_dns", DNS_TASK_STACK, NULL, DNS_TASK_PRIO, &dns_task_handle, tskNO_AFFINITY) != pdPASS) {
+    close(dns_sock);
+    dns_sock = -1;
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+int captive_dns_stats_json(char *buf, size_t len) {
+  uint32_t answered = stats.answered;
+  uint32_t avg = answered ? (uint32_t)(stats.latency_sum_us / answered) : 0;
+  return snprintf(
+    buf, len, "{\"queries\":%u,\"answered\":%u,\"ignored\":%u,\"send_errors\":%u,\"latency_avg_us\":%u,\"latency_max_us\":%u}", stats.queries, answered,
+    stats.ignored, stats.send_errors, avg, stats.latency_max_us
+  );
+}
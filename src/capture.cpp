@@ -0,0 +1,799 @@
+/**
+ * Capture front end, rate control glue and resolution switching.
+ *
+ * The controller runs on whichever consumer task fetched the frame; the new
+ * quality is written to the sensor outside the lock.
+ *
+ * A resolution switch closes the gate (new capture_fb_get calls wait), waits
+ * for the frames in use to come back, then works on the camera alone:
+ *
+ *   fits the buffers:  set_framesize, drain frames until one has the new size
+ *   larger:            deinit, init with the new frame size, restore settings
+ *
+ * and reopens the gate. The gap is measured from closing the gate to the
+ * first new-size frame a consumer receives.
+ *
+ * The supervisor task uses the same gate to recover a wedged camera: after
+ * CAPTURE_FAIL_LIMIT failed captures in a row, from any consumers, or a
+ * capture that has not returned for CAPTURE_STALL_MS, it restarts the camera
+ * trying the XCLK that last worked and then the boot fallbacks, and restores
+ * the sensor settings. If every attempt fails the camera is OFFLINE and is
+ * retried with a growing delay. Recovery time runs from the first failure to
+ * the first good frame after the restart.
+ *
+ * The XCLK is set here too, under the switch mutex: cam_config holds the one
+ * the camera runs at and restarts with, and the power governor's slower idle
+ * clock is kept on top of it and re-applied after every restart.
+ *
+ * Switching to or from a replayed file goes through the gate as well, so
+ * capture_fb_return always knows which source a returned frame came from,
+ * and so do sensor register batches, which then drop the frames that were
+ * already in the pipeline.
+ */
+#include "capture.h"
+#include <Arduino.h>
+#include "esp_timer.h"
+#include "events.h"
+#include "jpeg_dct.h"
+
+#define RATE_MIN_QUALITY 4
+#define RATE_MAX_QUALITY 40
+#define DRAIN_MAX_FRAMES 6
+#define GATE_POLL_MS     5
+#define GATE_WAIT_MS     1000  // a consumer gets NULL after waiting this long at a closed gate
+#define SUPERVISOR_STACK 4096
+#define SUPERVISOR_PRIO  2
+#define SUPERVISOR_MS    1000
+#define INIT_RETRY_MS    200   // settle time between XCLK attempts
+
+const int capture_xclk_hz[CAPTURE_XCLK_COUNT] = {10000000, 20000000, 16000000};
+static const char *state_names[] = {"ok", "switching", "recovering", "offline"};
+
+typedef struct {
+  uint32_t switches;
+  uint32_t reallocs;
+  uint32_t failures;
+  uint32_t drained;          // stale frames discarded
+  uint32_t last_gap_ms;
+  uint32_t max_gap_ms;
+  uint32_t last_switch_ms;   // gate closed, including the wait for frames in use
+  uint32_t capture_failures;
+  uint32_t stalls;
+  uint32_t recoveries;
+  uint32_t recovery_attempts; // camera inits tried while recovering
+  uint32_t recovery_failures; // rounds that ended OFFLINE
+  uint32_t last_recovery_ms;
+  uint32_t max_recovery_ms;
+  uint32_t batches;          // capture_sensor_batch runs
+  uint32_t last_batch_ms;    // gate closed for the last one
+} capture_stats_t;
+
+static rate_control_config_t rate_cfg = {
+  .mode = RATE_CONTROL_OFF,
+  .target = 0,
+  .min_quality = RATE_MIN_QUALITY,
+  .max_quality = RATE_MAX_QUALITY,
+};
+static rate_control_t rate;
+static uint32_t rate_gen;        // bumped whenever rate is replaced
+static portMUX_TYPE capture_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static camera_config_t cam_config;
+static bool have_config;
+static framesize_t alloc_size;   // largest frame size the buffers were sized for
+static size_t fb_count;
+static uint32_t held;            // frames handed out and not yet returned
+static bool switching;
+static bool replaying;           // frames come from replay.h, not the camera
+static int64_t gap_start_us;     // set while a switch's first frame is pending
+static framesize_t gap_size;
+static capture_stats_t stats;
+static SemaphoreHandle_t switch_mutex = NULL;
+
+static capture_state_t state;
+static uint32_t fail_streak;
+static int64_t fail_since_us;    // first failure of the current streak
+static uint32_t in_get;          // consumers inside esp_camera_fb_get
+static int64_t busy_since_us;    // in_get went from 0 to 1
+static int64_t last_good_us;
+static int64_t recover_start_us; // set while a recovery's first frame is pending
+static uint32_t sensor_epoch;    // bumped whenever the sensor may have been reprogrammed
+static int idle_xclk_mhz;        // the power governor's slowed XCLK, 0 for cam_config's
+static camera_status_t saved_status;
+static bool have_status;
+static TaskHandle_t supervisor = NULL;
+
+static void supervisor_task(void *arg);
+
+esp_err_t capture_init(const camera_config_t *config) {
+  cam_config = *config;
+  have_config = true;
+  alloc_size = config->frame_size;
+  fb_count = config->fb_count;
+  last_good_us = esp_timer_get_time();
+  if (!switch_mutex) {
+    switch_mutex = xSemaphoreCreateMutex();
+  }
+  if (!switch_mutex) {
+    return ESP_ERR_NO_MEM;
+  }
+  if (!supervisor && xTaskCreatePinnedToCore(supervisor_task, "capture_sup", SUPERVISOR_STACK, NULL, SUPERVISOR_PRIO, &supervisor, tskNO_AFFINITY) != pdPASS) {
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+capture_state_t capture_state() {
+  portENTER_CRITICAL(&capture_lock);
+  capture_state_t st = state == CAPTURE_OK && switching ? CAPTURE_SWITCHING : state;
+  portEXIT_CRITICAL(&capture_lock);
+  return st;
+}
+
+/* The camera is up; a switch in progress does not count against it. */
+static bool camera_ok() {
+  portENTER_CRITICAL(&capture_lock);
+  bool ok = state == CAPTURE_OK;
+  portEXIT_CRITICAL(&capture_lock);
+  return ok;
+}
+
+/* Hands the camera to the supervisor; call with capture_lock held. */
+static bool enter_recovery(int64_t since_us) {
+  if (state != CAPTURE_OK) {
+    return false;
+  }
+  state = CAPTURE_RECOVERING;
+  recover_start_us = since_us;
+  return true;
+}
+
+/*
+ * The driver fills fb->width/height from the framesize in force when the
+ * frame is handed out, not the one it was exposed at, so around a switch
+ * they can describe the wrong frame. Takes them from the JPEG's SOF instead;
+ * false if the frame has none.
+ */
+static bool frame_dimensions(camera_fb_t *fb) {
+  uint16_t width, height;
+  if (fb->format != PIXFORMAT_JPEG || !jpeg_size(fb->buf, fb->len, &width, &height)) {
+    return false;
+  }
+  fb->width = width;
+  fb->height = height;
+  return true;
+}
+
+static void account_gap(const camera_fb_t *fb) {
+  if (!gap_start_us || fb->width != resolution[gap_size].width || fb->height != resolution[gap_size].height) {
+    return;
+  }
+  uint32_t gap_ms = (uint32_t)((esp_timer_get_time() - gap_start_us) / 1000);
+  portENTER_CRITICAL(&capture_lock);
+  if (gap_start_us) {
+    gap_start_us = 0;
+    stats.last_gap_ms = gap_ms;
+    if (gap_ms > stats.max_gap_ms) {
+      stats.max_gap_ms = gap_ms;
+    }
+  }
+  portEXIT_CRITICAL(&capture_lock);
+}
+
+camera_fb_t *capture_fb_get() {
+  int64_t wait_start = esp_timer_get_time();
+  bool replay;
+  while (true) {
+    portENTER_CRITICAL(&capture_lock);
+    replay = replaying;
+    bool offline = state == CAPTURE_OFFLINE && !switching && !replay;
+    bool open = !switching && !offline;
+    if (open) {
+      held++;
+      if (!replay && !in_get++) {
+        busy_since_us = esp_timer_get_time();
+      }
+    }
+    portEXIT_CRITICAL(&capture_lock);
+    if (open) {
+      break;
+    }
+    if (offline || esp_timer_get_time() - wait_start >= (int64_t)GATE_WAIT_MS * 1000) {
+      return NULL;
+    }
+    vTaskDelay(pdMS_TO_TICKS(GATE_POLL_MS));
+  }
+
+  if (replay) {
+    camera_fb_t *fb = replay_fb_get(GATE_WAIT_MS);
+    if (!fb) {
+      portENTER_CRITICAL(&capture_lock);
+      held--;
+      portEXIT_CRITICAL(&capture_lock);
+    }
+    return fb;
+  }
+
+  camera_fb_t *fb = esp_camera_fb_get();
+  int64_t now = esp_timer_get_time();
+  bool wake = false;
+  portENTER_CRITICAL(&capture_lock);
+  in_get--;
+  if (!fb) {
+    held--;
+    stats.capture_failures++;
+    if (!fail_streak++) {
+      fail_since_us = now;
+    }
+    wake = fail_streak >= CAPTURE_FAIL_LIMIT && enter_recovery(fail_since_us);
+  } else {
+    fail_streak = 0;
+    last_good_us = now;
+    if (recover_start_us && state == CAPTURE_OK) {
+      uint32_t recovery_ms = (uint32_t)((now - recover_start_us) / 1000);
+      recover_start_us = 0;
+      stats.last_recovery_ms = recovery_ms;
+      if (recovery_ms > stats.max_recovery_ms) {
+        stats.max_recovery_ms = recovery_ms;
+      }
+    }
+  }
+  portEXIT_CRITICAL(&capture_lock);
+  if (wake) {
+    xTaskNotifyGive(supervisor);
+  }
+  if (!fb || !frame_dimensions(fb)) {
+    return fb;
+  }
+  account_gap(fb);
+
+  // The update (logf, powf) runs on a copy, outside the spinlock; the copy
+  // is published only if nothing replaced the state meanwhile, otherwise
+  // this one sample is dropped.
+  int64_t ts_us = (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+  portENTER_CRITICAL(&capture_lock);
+  rate_control_config_t cfg = rate_cfg;
+  rate_control_t rc = rate;
+  uint32_t gen = rate_gen;
+  portEXIT_CRITICAL(&capture_lock);
+  uint8_t before = rc.quality;
+  uint8_t quality = rate_control_update(&rc, &cfg, fb->len, ts_us);
+  portENTER_CRITICAL(&capture_lock);
+  bool published = gen == rate_gen;
+  if (published) {
+    rate = rc;
+    rate_gen++;
+  }
+  portEXIT_CRITICAL(&capture_lock);
+
+  if (published && quality != before) {
+    sensor_t *s = esp_camera_sensor_get();
+    if (s) {
+      s->set_quality(s, quality);
+    }
+  }
+  return fb;
+}
+
+void capture_fb_return(camera_fb_t *fb) {
+  portENTER_CRITICAL(&capture_lock);
+  bool replay = replaying;  // cannot change while a frame is held
+  portEXIT_CRITICAL(&capture_lock);
+  if (replay) {
+    replay_fb_return(fb);
+  } else {
+    esp_camera_fb_return(fb);
+  }
+  portENTER_CRITICAL(&capture_lock);
+  held--;
+  portEXIT_CRITICAL(&capture_lock);
+}
+
+void capture_restore_status(sensor_t *s, const camera_status_t *st) {
+  s->set_quality(s, st->quality);
+  s->set_brightness(s, st->brightness);
+  s->set_contrast(s, st->contrast);
+  s->set_saturation(s, st->saturation);
+  s->set_sharpness(s, st->sharpness);
+  s->set_denoise(s, st->denoise);
+  s->set_special_effect(s, st->special_effect);
+  s->set_whitebal(s, st->awb);
+  s->set_awb_gain(s, st->awb_gain);
+  s->set_wb_mode(s, st->wb_mode);
+  s->set_exposure_ctrl(s, st->aec);
+  s->set_aec2(s, st->aec2);
+  s->set_ae_level(s, st->ae_level);
+  s->set_aec_value(s, st->aec_value);
+  s->set_gain_ctrl(s, st->agc);
+  s->set_agc_gain(s, st->agc_gain);
+  s->set_gainceiling(s, (gainceiling_t)st->gainceiling);
+  s->set_bpc(s, st->bpc);
+  s->set_wpc(s, st->wpc);
+  s->set_raw_gma(s, st->raw_gma);
+  s->set_lenc(s, st->lenc);
+  s->set_hmirror(s, st->hmirror);
+  s->set_vflip(s, st->vflip);
+  s->set_dcw(s, st->dcw);
+  s->set_colorbar(s, st->colorbar);
+}
+
+/* Puts the sensor on cam_config's XCLK, or the idle one below it; call with switch_mutex held. */
+static esp_err_t apply_xclk() {
+  sensor_t *s = esp_camera_sensor_get();
+  if (!s) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  int mhz = cam_config.xclk_freq_hz / 1000000;
+  if (idle_xclk_mhz && idle_xclk_mhz < mhz) {
+    mhz = idle_xclk_mhz;
+  }
+  if (s->xclk_freq_hz == mhz * 1000000) {
+    return ESP_OK;
+  }
+  if (s->set_xclk(s, LEDC_TIMER_0, mhz) != 0) {
+    return ESP_FAIL;
+  }
+  portENTER_CRITICAL(&capture_lock);
+  sensor_epoch++;
+  portEXIT_CRITICAL(&capture_lock);
+  return ESP_OK;
+}
+
+static bool fits(framesize_t a, framesize_t b) {
+  return (uint32_t)resolution[a].width * resolution[a].height <= (uint32_t)resolution[b].width * resolution[b].height;
+}
+
+/*
+ * Restarts the camera with buffers for alloc_to, fb_count of them, and the
+ * sensor at framesize; the gate is closed. On failure the previous
+ * allocation is brought back so consumers are not left without a camera.
+ */
+static esp_err_t restart(framesize_t alloc_to, size_t count, framesize_t framesize) {
+  sensor_t *s = esp_camera_sensor_get();
+  camera_status_t saved = s->status;
+  camera_config_t cfg = cam_config;
+  cfg.frame_size = alloc_to;
+  cfg.fb_count = count;
+  cfg.jpeg_quality = saved.quality;
+  if (count == 1) {
+    cfg.grab_mode = CAMERA_GRAB_WHEN_EMPTY;  // LATEST needs a spare buffer
+  }
+
+  esp_camera_deinit();
+  esp_err_t err = esp_camera_init(&cfg);
+  if (err != ESP_OK) {
+    log_e("Camera restart (framesize %d, %u buffers) failed: 0x%x", alloc_to, count, err);
+    cfg.frame_size = alloc_size;
+    cfg.fb_count = fb_count;
+    cfg.grab_mode = fb_count == 1 ? CAMERA_GRAB_WHEN_EMPTY : cam_config.grab_mode;
+    if (esp_camera_init(&cfg) != ESP_OK) {
+      saved_status = saved;
+      have_status = true;
+      portENTER_CRITICAL(&capture_lock);
+      bool wake = enter_recovery(esp_timer_get_time());
+      portEXIT_CRITICAL(&capture_lock);
+      if (wake && supervisor) {
+        xTaskNotifyGive(supervisor);
+      }
+      return err;
+    }
+    framesize = saved.framesize;
+  }
+  s = esp_camera_sensor_get();
+  capture_restore_status(s, &saved);
+  s->set_framesize(s, framesize);
+  apply_xclk();
+  if (err == ESP_OK) {
+    alloc_size = alloc_to;
+    fb_count = count;
+  }
+  return err;
+}
+
+/* Discards frames captured before the switch. */
+static uint32_t drain_stale(framesize_t framesize) {
+  uint32_t drained = 0;
+  for (int i = 0; i < DRAIN_MAX_FRAMES; i++) {
+    camera_fb_t *fb = esp_camera_fb_get();
+    if (!fb) {
+      continue;
+    }
+    bool fresh = frame_dimensions(fb) && fb->width == resolution[framesize].width && fb->height == resolution[framesize].height;
+    esp_camera_fb_return(fb);
+    if (fresh) {
+      break;
+    }
+    drained++;
+  }
+  return drained;
+}
+
+/* Discards frames captured before a batch of register writes. */
+static uint32_t drain_frames(uint32_t count) {
+  uint32_t drained = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    camera_fb_t *fb = esp_camera_fb_get();
+    if (fb) {
+      esp_camera_fb_return(fb);
+      drained++;
+    }
+  }
+  return drained;
+}
+
+/* Stops new captures and waits for a frame boundary: every consumer has given its buffer back. */
+static bool close_gate(int64_t start, uint32_t timeout_ms) {
+  portENTER_CRITICAL(&capture_lock);
+  switching = true;
+  portEXIT_CRITICAL(&capture_lock);
+
+  while (true) {
+    portENTER_CRITICAL(&capture_lock);
+    bool quiet = held == 0;
+    portEXIT_CRITICAL(&capture_lock);
+    if (quiet) {
+      return true;
+    }
+    if (esp_timer_get_time() - start >= (int64_t)timeout_ms * 1000) {
+      return false;
+    }
+    vTaskDelay(pdMS_TO_TICKS(GATE_POLL_MS));
+  }
+}
+
+/* Reopens the gate; on success the rate controller starts over, frame sizes having changed. */
+static void open_gate(esp_err_t err, int64_t start, bool restarted, uint32_t drained) {
+  sensor_t *s = esp_camera_sensor_get();  // a restart replaces the sensor
+  uint8_t quality = s ? s->status.quality : RATE_MAX_QUALITY;
+  portENTER_CRITICAL(&capture_lock);
+  if (err == ESP_OK) {
+    sensor_epoch++;
+    stats.switches++;
+    stats.reallocs += restarted;
+    stats.drained += drained;
+    gap_start_us = start;
+    gap_size = s ? (framesize_t)s->status.framesize : alloc_size;
+    rate_control_reset(&rate, quality);
+    rate_gen++;
+  } else {
+    stats.failures++;
+  }
+  stats.last_switch_ms = (uint32_t)((esp_timer_get_time() - start) / 1000);
+  switching = false;
+  portEXIT_CRITICAL(&capture_lock);
+}
+
+/*
+ * One recovery round: restart the camera at the XCLK that last worked, then
+ * at the other boot options, with the current allocation and the last known
+ * sensor settings. The gate stays closed throughout.
+ */
+static bool recover() {
+  xSemaphoreTake(switch_mutex, portMAX_DELAY);
+  int64_t start = esp_timer_get_time();
+  bool ok = false;
+  uint32_t attempts = 0;
+  // Consumers stuck in esp_camera_fb_get come back when its own timeout ends.
+  if (close_gate(start, CAPTURE_RECOVER_QUIESCE_MS)) {
+    sensor_t *s = esp_camera_sensor_get();
+    if (s) {
+      saved_status = s->status;
+      have_status = true;
+    }
+    esp_camera_deinit();
+
+    int order[CAPTURE_XCLK_COUNT + 1];
+    int n = 0;
+    order[n++] = cam_config.xclk_freq_hz;
+    for (int i = 0; i < CAPTURE_XCLK_COUNT; i++) {
+      if (capture_xclk_hz[i] != cam_config.xclk_freq_hz) {
+        order[n++] = capture_xclk_hz[i];
+      }
+    }
+    camera_config_t cfg = cam_config;
+    cfg.frame_size = alloc_size;
+    cfg.fb_count = fb_count;
+    if (fb_count == 1) {
+      cfg.grab_mode = CAMERA_GRAB_WHEN_EMPTY;
+    }
+    for (int i = 0; i < n && !ok; i++) {
+      cfg.xclk_freq_hz = order[i];
+      attempts++;
+      esp_err_t err = esp_camera_init(&cfg);
+      ok = err == ESP_OK;
+      if (!ok) {
+        log_e("Camera recovery at XCLK %d MHz failed: 0x%x", order[i] / 1000000, err);
+        esp_camera_deinit();
+        vTaskDelay(pdMS_TO_TICKS(INIT_RETRY_MS));
+      }
+    }
+    if (ok) {
+      cam_config.xclk_freq_hz = cfg.xclk_freq_hz;
+      s = esp_camera_sensor_get();
+      if (have_status) {
+        capture_restore_status(s, &saved_status);
+        s->set_framesize(s, (framesize_t)saved_status.framesize);
+      }
+      apply_xclk();
+    }
+  }
+
+  sensor_t *s = esp_camera_sensor_get();
+  uint8_t quality = s ? s->status.quality : RATE_MAX_QUALITY;
+  portENTER_CRITICAL(&capture_lock);
+  stats.recovery_attempts += attempts;
+  if (ok) {
+    stats.recoveries++;
+    sensor_epoch++;
+    state = CAPTURE_OK;
+    fail_streak = 0;
+    last_good_us = esp_timer_get_time();
+    rate_control_reset(&rate, quality);
+    rate_gen++;
+  } else if (attempts) {
+    stats.recovery_failures++;
+    state = CAPTURE_OFFLINE;
+  }
+  // No attempt: a frame was never returned; the next round tries again.
+  switching = false;
+  portEXIT_CRITICAL(&capture_lock);
+  xSemaphoreGive(switch_mutex);
+
+  log_i("Camera recovery: %s after %u attempts, %ums", ok ? "ok" : "failed", attempts, (uint32_t)((esp_timer_get_time() - start) / 1000));
+  char ev[64];
+  snprintf(ev, sizeof(ev), "{\"state\":\"%s\",\"attempts\":%u,\"xclk_mhz\":%d}", ok ? "ok" : "offline", attempts, cam_config.xclk_freq_hz / 1000000);
+  events_publish("capture", ev);
+  return ok;
+}
+
+static void supervisor_task(void *arg) {
+  uint32_t retry_ms = CAPTURE_RETRY_MS;
+  capture_state_t last = CAPTURE_OK;
+
+  while (true) {
+    capture_state_t st = capture_state();
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(st == CAPTURE_OFFLINE ? retry_ms : SUPERVISOR_MS));
+
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&capture_lock);
+    // A consumer has been inside esp_camera_fb_get with no good frame for too long.
+    bool stalled = state == CAPTURE_OK && !switching && in_get && now - (busy_since_us > last_good_us ? busy_since_us : last_good_us) > (int64_t)CAPTURE_STALL_MS * 1000;
+    if (stalled) {
+      stats.stalls++;
+      enter_recovery(last_good_us > busy_since_us ? last_good_us : busy_since_us);
+    }
+    st = state;
+    portEXIT_CRITICAL(&capture_lock);
+
+    if (st == CAPTURE_OK) {
+      retry_ms = CAPTURE_RETRY_MS;
+      last = st;
+      continue;
+    }
+    if (last == CAPTURE_OK) {
+      log_e("Capture %s, recovering the camera", stalled ? "stalled" : "failing");
+      events_publish("capture", "{\"state\":\"recovering\"}");
+    }
+    last = st;
+    if (!recover() && capture_state() == CAPTURE_OFFLINE && st == CAPTURE_OFFLINE) {
+      retry_ms = retry_ms * 2 < CAPTURE_RETRY_MAX_MS ? retry_ms * 2 : CAPTURE_RETRY_MAX_MS;
+    }
+  }
+}
+
+esp_err_t capture_set_framesize(framesize_t framesize) {
+  sensor_t *s = esp_camera_sensor_get();
+  if (!s || !switch_mutex) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (s->pixformat != PIXFORMAT_JPEG || framesize >= FRAMESIZE_INVALID) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (!camera_ok()) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  xSemaphoreTake(switch_mutex, portMAX_DELAY);
+  if (s->status.framesize == framesize) {
+    xSemaphoreGive(switch_mutex);
+    return ESP_OK;
+  }
+
+  int64_t start = esp_timer_get_time();
+  esp_err_t err = ESP_ERR_TIMEOUT;
+  uint32_t drained = 0;
+  bool realloc = false;
+  if (close_gate(start, CAPTURE_QUIESCE_MS)) {
+    realloc = have_config && !fits(framesize, alloc_size);
+    if (realloc) {
+      err = restart(framesize, fb_count, framesize);
+    } else {
+      err = s->set_framesize(s, framesize) == 0 ? ESP_OK : ESP_FAIL;
+    }
+    if (err == ESP_OK) {
+      drained = drain_stale(framesize);
+    }
+  }
+  open_gate(err, start, realloc, drained);
+  xSemaphoreGive(switch_mutex);
+
+  log_i("Framesize %d: %s in %ums (%s, %u stale frames)", framesize, err == ESP_OK ? "switched" : "failed",
+        (uint32_t)((esp_timer_get_time() - start) / 1000), realloc ? "reallocated" : "in place", drained);
+  return err;
+}
+
+esp_err_t capture_set_fb_count(size_t count) {
+  if (!esp_camera_sensor_get() || !switch_mutex || !have_config || !camera_ok()) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (!count || count > CAPTURE_MAX_FB_COUNT) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  xSemaphoreTake(switch_mutex, portMAX_DELAY);
+  if (count == fb_count) {
+    xSemaphoreGive(switch_mutex);
+    return ESP_OK;
+  }
+
+  int64_t start = esp_timer_get_time();
+  esp_err_t err = ESP_ERR_TIMEOUT;
+  if (close_gate(start, CAPTURE_QUIESCE_MS)) {
+    err = restart(alloc_size, count, (framesize_t)esp_camera_sensor_get()->status.framesize);
+  }
+  open_gate(err, start, true, 0);
+  xSemaphoreGive(switch_mutex);
+
+  log_i("Frame buffers: %u %s", count, err == ESP_OK ? "allocated" : "failed");
+  return err;
+}
+
+esp_err_t capture_set_source(const replay_config_t *replay) {
+  if (!switch_mutex) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  xSemaphoreTake(switch_mutex, portMAX_DELAY);
+  int64_t start = esp_timer_get_time();
+  esp_err_t err = ESP_ERR_TIMEOUT;
+  if (close_gate(start, CAPTURE_QUIESCE_MS)) {
+    if (replaying) {
+      replay_close();
+    }
+    err = replay ? replay_open(replay) : ESP_OK;
+    portENTER_CRITICAL(&capture_lock);
+    replaying = replay && err == ESP_OK;
+    portEXIT_CRITICAL(&capture_lock);
+  }
+  portENTER_CRITICAL(&capture_lock);
+  switching = false;
+  portEXIT_CRITICAL(&capture_lock);
+  xSemaphoreGive(switch_mutex);
+
+  log_i("Frame source: %s%s", replay && err == ESP_OK ? "replay " : "camera", replay && err == ESP_OK ? replay->path : "");
+  return err;
+}
+
+esp_err_t capture_sensor_batch(capture_batch_fn_t fn, void *arg, uint32_t *burst_us, uint32_t *gap_us) {
+  sensor_t *s = esp_camera_sensor_get();
+  if (!s || !switch_mutex || !camera_ok()) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  xSemaphoreTake(switch_mutex, portMAX_DELAY);
+  int64_t start = esp_timer_get_time();
+  esp_err_t err = ESP_ERR_TIMEOUT;
+  uint32_t drained = 0;
+  *burst_us = 0;
+  if (close_gate(start, CAPTURE_QUIESCE_MS)) {
+    int64_t t0 = esp_timer_get_time();
+    err = fn(s, arg) == 0 ? ESP_OK : ESP_FAIL;
+    *burst_us = (uint32_t)(esp_timer_get_time() - t0);
+    // The queued frames and the one being exposed saw the old settings, or both.
+    if (!replaying) {
+      drained = drain_frames(fb_count + 1);
+    }
+  }
+  *gap_us = (uint32_t)(esp_timer_get_time() - start);
+  portENTER_CRITICAL(&capture_lock);
+  stats.batches += err == ESP_OK;
+  stats.failures += err != ESP_OK;
+  stats.drained += drained;
+  stats.last_batch_ms = *gap_us / 1000;
+  switching = false;
+  portEXIT_CRITICAL(&capture_lock);
+  xSemaphoreGive(switch_mutex);
+  return err;
+}
+
+esp_err_t capture_set_xclk(int mhz) {
+  if (!switch_mutex || !have_config) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (mhz <= 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  xSemaphoreTake(switch_mutex, portMAX_DELAY);
+  int prev = cam_config.xclk_freq_hz;
+  cam_config.xclk_freq_hz = mhz * 1000000;
+  esp_err_t err = apply_xclk();
+  if (err != ESP_OK) {
+    cam_config.xclk_freq_hz = prev;
+  }
+  xSemaphoreGive(switch_mutex);
+  return err;
+}
+
+esp_err_t capture_set_idle_xclk(int mhz, bool wait) {
+  if (!switch_mutex || !have_config) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (xSemaphoreTake(switch_mutex, wait ? portMAX_DELAY : 0) != pdTRUE) {
+    return ESP_ERR_TIMEOUT;
+  }
+  idle_xclk_mhz = mhz;
+  esp_err_t err = apply_xclk();
+  xSemaphoreGive(switch_mutex);
+  return err;
+}
+
+uint32_t capture_sensor_epoch() {
+  portENTER_CRITICAL(&capture_lock);
+  uint32_t epoch = sensor_epoch;
+  portEXIT_CRITICAL(&capture_lock);
+  return epoch;
+}
+
+size_t capture_get_fb_count() {
+  return fb_count;
+}
+
+void capture_rate_get_config(rate_control_config_t *config) {
+  portENTER_CRITICAL(&capture_lock);
+  *config = rate_cfg;
+  portEXIT_CRITICAL(&capture_lock);
+}
+
+esp_err_t capture_rate_set_config(const rate_control_config_t *config) {
+  if (config->min_quality > config->max_quality || config->max_quality > 63 || (config->mode != RATE_CONTROL_OFF && !config->target)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  sensor_t *s = esp_camera_sensor_get();
+  uint8_t quality = s ? s->status.quality : RATE_MAX_QUALITY;
+  portENTER_CRITICAL(&capture_lock);
+  rate_cfg = *config;
+  rate_control_reset(&rate, quality);
+  rate_gen++;
+  portEXIT_CRITICAL(&capture_lock);
+  return ESP_OK;
+}
+
+int capture_rate_json(char *buf, size_t len) {
+  portENTER_CRITICAL(&capture_lock);
+  rate_control_config_t c = rate_cfg;
+  rate_control_t r = rate;
+  portEXIT_CRITICAL(&capture_lock);
+  return snprintf(
+    buf, len,
+    "{\"mode\":\"%s\",\"target\":%u,\"min_quality\":%u,\"max_quality\":%u,\"quality\":%u,\"avg_bytes\":%u,\"kbps\":%u,\"fps\":%u.%u,"
+    "\"target_bytes\":%u,\"elasticity\":%.2f,\"adjustments\":%u,\"settling\":%s}",
+    rate_control_mode_name(c.mode), c.target, c.min_quality, c.max_quality, r.quality, r.avg_bytes, r.kbps, r.fps_x10 / 10, r.fps_x10 % 10,
+    r.target_bytes, r.elasticity, r.adjustments, r.settle ? "true" : "false"
+  );
+}
+
+int capture_stats_json(char *buf, size_t len) {
+  portENTER_CRITICAL(&capture_lock);
+  capture_stats_t s = stats;
+  uint32_t h = held;
+  framesize_t a = alloc_size;
+  size_t n = fb_count;
+  capture_state_t st = state == CAPTURE_OK && switching ? CAPTURE_SWITCHING : state;
+  bool replay = replaying;
+  int xclk = cam_config.xclk_freq_hz;
+  portEXIT_CRITICAL(&capture_lock);
+  return snprintf(
+    buf, len,
+    "{\"state\":\"%s\",\"source\":\"%s\",\"xclk_mhz\":%d,\"held\":%u,\"alloc_framesize\":%u,\"fb_count\":%u,\"switches\":%u,\"reallocs\":%u,\"failures\":%u,"
+    "\"drained\":%u,\"last_gap_ms\":%u,\"max_gap_ms\":%u,\"last_switch_ms\":%u,\"capture_failures\":%u,\"stalls\":%u,\"recoveries\":%u,"
+    "\"recovery_attempts\":%u,\"recovery_failures\":%u,\"last_recovery_ms\":%u,\"max_recovery_ms\":%u,\"batches\":%u,\"last_batch_ms\":%u}",
+    state_names[st], replay ? "replay" : "camera", xclk / 1000000, h, a, n, s.switches, s.reallocs, s.failures, s.drained, s.last_gap_ms, s.max_gap_ms, s.last_switch_ms,
+    s.capture_failures, s.stalls, s.recoveries, s.recovery_attempts, s.recovery_failures, s.last_recovery_ms, s.max_recovery_ms, s.batches, s.last_batch_ms
+  );
+}
@@ -0,0 +1,297 @@
+/**
+ * Recording catalog.
+ *
+ * Catalog header: "RCAT", version (16 bits), record size (16 bits), 8
+ * reserved bytes. Record: start_us, end_us (64 bits each), seq, frames,
+ * bytes, index_offset, motion_frames (32 bits each), width, height, flags
+ * (16 bits each), 6 reserved bytes.
+ *
+ * Seek table header: "RSEK", flags, entry size (16 bits each), start_us
+ * (64 bits), width, height (16 bits each), 4 reserved bytes. Entry: dt_us,
+ * offset, size (32 bits each).
+ *
+ * Records are written whole with one fwrite and a flush, so a reader that
+ * sizes the file finds whole records only, except after a power cut in the
+ * middle of one; catalog_check trims that at the next boot.
+ */
+#include "catalog.h"
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define CATALOG_VERSION 1
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static void put64(uint8_t *p, int64_t v) {
+  put32(p, (uint32_t)v);
+  put32(p + 4, (uint32_t)((uint64_t)v >> 32));
+}
+
+static uint16_t get16(const uint8_t *p) {
+  return p[0] | p[1] << 8;
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int64_t get64(const uint8_t *p) {
+  return (int64_t)((uint64_t)get32(p + 4) << 32 | get32(p));
+}
+
+static bool flush(FILE *f) {
+  return fflush(f) == 0 && fsync(fileno(f)) == 0;
+}
+
+static long file_size(FILE *f) {
+  return fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+}
+
+static void encode(const catalog_entry_t *e, uint8_t *r) {
+  memset(r, 0, CATALOG_ENTRY_SIZE);
+  put64(r, e->start_us);
+  put64(r + 8, e->end_us);
+  put32(r + 16, e->seq);
+  put32(r + 20, e->frames);
+  put32(r + 24, e->bytes);
+  put32(r + 28, e->index_offset);
+  put32(r + 32, e->motion_frames);
+  put16(r + 36, e->width);
+  put16(r + 38, e->height);
+  put16(r + 40, e->flags);
+}
+
+bool catalog_read(FILE *f, uint32_t i, catalog_entry_t *e) {
+  uint8_t r[CATALOG_ENTRY_SIZE];
+  if (fseek(f, CATALOG_HEADER_SIZE + (long)i * CATALOG_ENTRY_SIZE, SEEK_SET) != 0 || fread(r, 1, sizeof(r), f) != sizeof(r)) {
+    return false;
+  }
+  e->start_us = get64(r);
+  e->end_us = get64(r + 8);
+  e->seq = get32(r + 16);
+  e->frames = get32(r + 20);
+  e->bytes = get32(r + 24);
+  e->index_offset = get32(r + 28);
+  e->motion_frames = get32(r + 32);
+  e->width = get16(r + 36);
+  e->height = get16(r + 38);
+  e->flags = get16(r + 40);
+  return true;
+}
+
+uint32_t catalog_count(FILE *f) {
+  long size = file_size(f);
+  return size > CATALOG_HEADER_SIZE ? (uint32_t)((size - CATALOG_HEADER_SIZE) / CATALOG_ENTRY_SIZE) : 0;
+}
+
+bool catalog_check(const char *path, uint32_t *count, catalog_entry_t *last) {
+  uint8_t h[CATALOG_HEADER_SIZE];
+  *count = 0;
+  FILE *f = fopen(path, "r+b");
+  if (f) {
+    long size = file_size(f);
+    if (size >= CATALOG_HEADER_SIZE && fseek(f, 0, SEEK_SET) == 0 && fread(h, 1, sizeof(h), f) == sizeof(h) && !memcmp(h, "RCAT", 4)
+        && get16(h + 4) == CATALOG_VERSION && get16(h + 6) == CATALOG_ENTRY_SIZE) {
+      uint32_t n = (size - CATALOG_HEADER_SIZE) / CATALOG_ENTRY_SIZE;
+      long whole = CATALOG_HEADER_SIZE + (long)n * CATALOG_ENTRY_SIZE;
+      bool ok = size == whole || (fflush(f) == 0 && ftruncate(fileno(f), whole) == 0);
+      ok = ok && (!n || catalog_read(f, n - 1, last));
+      fclose(f);
+      *count = ok ? n : 0;
+      return ok;
+    }
+    fclose(f);
+  }
+
+  // Missing, or not a catalog this build can read: start over.
+  f = fopen(path, "wb");
+  if (!f) {
+    return false;
+  }
+  memset(h, 0, sizeof(h));
+  memcpy(h, "RCAT", 4);
+  put16(h + 4, CATALOG_VERSION);
+  put16(h + 6, CATALOG_ENTRY_SIZE);
+  bool ok = fwrite(h, 1, sizeof(h), f) == sizeof(h) && flush(f);
+  fclose(f);
+  return ok;
+}
+
+bool catalog_append(const char *path, catalog_entry_t *e) {
+  FILE *f = fopen(path, "r+b");
+  if (!f) {
+    return false;
+  }
+  uint32_t n = catalog_count(f);
+  catalog_entry_t last;
+  if (n && catalog_read(f, n - 1, &last) && e->start_us < last.end_us) {
+    int64_t shift = last.end_us - e->start_us;
+    e->start_us += shift;
+    e->end_us += shift;
+    e->flags |= CATALOG_SHIFTED;
+  }
+  uint8_t r[CATALOG_ENTRY_SIZE];
+  encode(e, r);
+  // At n, not at the end: a torn record from a failed append is overwritten.
+  bool ok = fseek(f, CATALOG_HEADER_SIZE + (long)n * CATALOG_ENTRY_SIZE, SEEK_SET) == 0 && fwrite(r, 1, sizeof(r), f) == sizeof(r) && flush(f);
+  fclose(f);
+  return ok;
+}
+
+uint32_t catalog_find(FILE *f, uint32_t count, int64_t t_us) {
+  uint32_t lo = 0, hi = count;
+  catalog_entry_t e;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (!catalog_read(f, mid, &e)) {
+      return count;
+    }
+    if (e.end_us < t_us) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+void catalog_seek_path(const char *avi_path, char *out, size_t len) {
+  size_t n = strlen(avi_path);
+  if (n > 4 && !strcasecmp(avi_path + n - 4, ".avi")) {
+    n -= 4;
+  }
+  snprintf(out, len, "%.*s.sek", (int)n, avi_path);
+}
+
+FILE *catalog_seek_create(const char *path, const catalog_entry_t *e) {
+  uint8_t h[CATALOG_SEEK_HEADER];
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    return NULL;
+  }
+  memset(h, 0, sizeof(h));
+  memcpy(h, "RSEK", 4);
+  put16(h + 4, e->flags);
+  put16(h + 6, CATALOG_SEEK_ENTRY);
+  put64(h + 8, e->start_us);
+  put16(h + 16, e->width);
+  put16(h + 18, e->height);
+  if (fwrite(h, 1, sizeof(h), f) != sizeof(h)) {
+    fclose(f);
+    remove(path);
+    return NULL;
+  }
+  return f;
+}
+
+bool catalog_seek_append(FILE *f, const catalog_frame_t *frame) {
+  uint8_t r[CATALOG_SEEK_ENTRY];
+  put32(r, frame->dt_us);
+  put32(r + 4, frame->offset);
+  put32(r + 8, frame->size);
+  return fwrite(r, 1, sizeof(r), f) == sizeof(r);
+}
+
+bool catalog_seek_sync(FILE *f) {
+  return flush(f);
+}
+
+bool catalog_seek_info(FILE *f, catalog_entry_t *e, uint32_t *frames) {
+  uint8_t h[CATALOG_SEEK_HEADER];
+  long size = file_size(f);
+  if (size < CATALOG_SEEK_HEADER || fseek(f, 0, SEEK_SET) != 0 || fread(h, 1, sizeof(h), f) != sizeof(h) || memcmp(h, "RSEK", 4)
+      || get16(h + 6) != CATALOG_SEEK_ENTRY) {
+    return false;
+  }
+  e->flags = get16(h + 4);
+  e->start_us = get64(h + 8);
+  e->width = get16(h + 16);
+  e->height = get16(h + 18);
+  *frames = (size - CATALOG_SEEK_HEADER) / CATALOG_SEEK_ENTRY;
+  return true;
+}
+
+bool catalog_seek_summary(FILE *f, uint32_t frames, catalog_entry_t *e) {
+  uint32_t have;
+  if (!catalog_seek_info(f, e, &have) || !have) {
+    return false;
+  }
+  frames = frames < have ? frames : have;
+  if (!frames) {
+    return false;  // no last frame to end at
+  }
+  // One sequential pass; this runs once per repaired recording.
+  catalog_frame_t fr;
+  e->frames = frames;
+  e->motion_frames = 0;
+  e->flags &= ~CATALOG_MOTION;
+  bool ok = fseek(f, CATALOG_SEEK_HEADER, SEEK_SET) == 0;
+  for (uint32_t i = 0; ok && i < frames; i++) {
+    uint8_t r[CATALOG_SEEK_ENTRY];
+    ok = fread(r, 1, sizeof(r), f) == sizeof(r);
+    fr.dt_us = get32(r);
+    fr.offset = get32(r + 4);
+    fr.size = get32(r + 8);
+    e->motion_frames += (fr.size & CATALOG_FRAME_MOTION) != 0;
+  }
+  if (!ok) {
+    return false;
+  }
+  e->end_us = e->start_us + fr.dt_us;
+  if (e->motion_frames) {
+    e->flags |= CATALOG_MOTION;
+  }
+  return true;
+}
+
+bool catalog_seek_read(FILE *f, uint32_t i, catalog_frame_t *frame) {
+  uint8_t r[CATALOG_SEEK_ENTRY];
+  if (fseek(f, CATALOG_SEEK_HEADER + (long)i * CATALOG_SEEK_ENTRY, SEEK_SET) != 0 || fread(r, 1, sizeof(r), f) != sizeof(r)) {
+    return false;
+  }
+  frame->dt_us = get32(r);
+  frame->offset = get32(r + 4);
+  frame->size = get32(r + 8);
+  return true;
+}
+
+bool catalog_seek_nearest(FILE *f, uint32_t frames, uint32_t dt_us, uint32_t *index, catalog_frame_t *frame) {
+  uint32_t lo = 0, hi = frames;
+  catalog_frame_t fr;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (!catalog_seek_read(f, mid, &fr)) {
+      return false;
+    }
+    if (fr.dt_us < dt_us) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  // lo is the first frame at or after dt_us; the one before it may be nearer.
+  if (!frames) {
+    return false;
+  }
+  uint32_t i = lo < frames ? lo : frames - 1;
+  if (!catalog_seek_read(f, i, frame)) {
+    return false;
+  }
+  if (i > 0 && frame->dt_us > dt_us && catalog_seek_read(f, i - 1, &fr) && dt_us - fr.dt_us <= frame->dt_us - dt_us) {
+    *frame = fr;
+    i--;
+  }
+  *index = i;
+  return true;
+}
@@ -0,0 +1,161 @@
+/**
+ * Luma DC fingerprint gate.
+ *
+ * Only the Huffman scan is walked; AC coefficients are decoded and dropped.
+ * The thumbnail is the mean of the luma block DCs of each MCU, dequantised so
+ * frames encoded at different qualities compare correctly.
+ */
+#include "change_gate.h"
+#include <Arduino.h>
+#include "esp_timer.h"
+
+typedef struct {
+  uint32_t sessions;
+  uint32_t checked;
+  uint32_t skipped;
+  uint32_t keepalives;
+  uint32_t undecodable;
+  uint64_t bytes_saved;
+  uint32_t check_us_avg;
+  uint32_t check_us_max;
+} change_gate_stats_t;
+
+static change_gate_stats_t stats;
+static portMUX_TYPE gate_lock = portMUX_INITIALIZER_UNLOCKED;
+
+esp_err_t change_gate_init(change_gate_t *gate) {
+  memset(gate, 0, sizeof(*gate));
+  gate->info = (jpeg_info_t *)malloc(sizeof(jpeg_info_t));
+  if (!gate->info) {
+    return ESP_ERR_NO_MEM;
+  }
+  portENTER_CRITICAL(&gate_lock);
+  stats.sessions++;
+  portEXIT_CRITICAL(&gate_lock);
+  return ESP_OK;
+}
+
+void change_gate_free(change_gate_t *gate) {
+  free(gate->info);
+  free(gate->ref);
+  free(gate->cur);
+  gate->info = NULL;
+  gate->ref = NULL;
+  gate->cur = NULL;
+}
+
+/* Fills thumb with one value per MCU; false if the frame cannot be walked. */
+static bool luma_thumbnail(const jpeg_info_t *info, int16_t *thumb) {
+  const jpeg_component_t *y = &info->comp[0];
+  int luma_blocks = y->h * y->v;
+  int q0 = info->qt[y->tq][0];
+  uint32_t mcus = (uint32_t)info->mcus_x * info->mcus_y;
+  int16_t dc[JPEG_MAX_MCU_BLOCKS];
+  jpeg_scan_reader_t r;
+
+  jpeg_scan_begin(&r, info);
+  for (uint32_t m = 0; m < mcus; m++) {
+    if (!jpeg_scan_mcu(&r, NULL, dc)) {
+      return false;
+    }
+    int sum = 0;
+    for (int b = 0; b < luma_blocks; b++) {
+      sum += dc[b];
+    }
+    thumb[m] = sum * q0 / luma_blocks;
+  }
+  return true;
+}
+
+static change_gate_result_t decide(change_gate_t *gate, const uint8_t *jpg, size_t len, int64_t now_us) {
+  jpeg_info_t *info = gate->info;
+  uint32_t mcus = 0;
+  if (jpeg_parse(jpg, len, info)) {
+    mcus = (uint32_t)info->mcus_x * info->mcus_y;
+    if (mcus != gate->ref_mcus || info->width != gate->ref_width || info->height != gate->ref_height) {
+      // New geometry: start over with a fresh reference.
+      free(gate->ref);
+      free(gate->cur);
+      gate->ref = (int16_t *)malloc(mcus * sizeof(int16_t));
+      gate->cur = (int16_t *)malloc(mcus * sizeof(int16_t));
+      gate->ref_mcus = 0;
+      if (gate->ref && gate->cur && luma_thumbnail(info, gate->ref)) {
+        gate->ref_mcus = mcus;
+        gate->ref_width = info->width;
+        gate->ref_height = info->height;
+      }
+      return CHANGE_GATE_CHANGED;
+    }
+  }
+  if (!mcus || !luma_thumbnail(info, gate->cur)) {
+    portENTER_CRITICAL(&gate_lock);
+    stats.undecodable++;
+    portEXIT_CRITICAL(&gate_lock);
+    return CHANGE_GATE_CHANGED;
+  }
+
+  uint32_t need = mcus * CHANGE_GATE_MIN_PERMILLE / 1000 + 1;
+  uint32_t changed = 0;
+  for (uint32_t m = 0; m < mcus && changed < need; m++) {
+    if (abs(gate->cur[m] - gate->ref[m]) > CHANGE_GATE_DC_THRESHOLD) {
+      changed++;
+    }
+  }
+  if (changed >= need) {
+    // The new frame becomes the reference. Keepalives do not, so slow drift
+    // accumulates against the last real change until it counts as one.
+    int16_t *t = gate->ref;
+    gate->ref = gate->cur;
+    gate->cur = t;
+    return CHANGE_GATE_CHANGED;
+  }
+  if (now_us - gate->last_sent_us >= (int64_t)CHANGE_GATE_KEEPALIVE_MS * 1000) {
+    return CHANGE_GATE_KEEPALIVE;
+  }
+  return CHANGE_GATE_SKIP;
+}
+
+change_gate_result_t change_gate_check(change_gate_t *gate, const uint8_t *jpg, size_t len, int64_t now_us) {
+  int64_t start = esp_timer_get_time();
+  change_gate_result_t res = decide(gate, jpg, len, now_us);
+  uint32_t check_us = (uint32_t)(esp_timer_get_time() - start);
+
+  if (res == CHANGE_GATE_SKIP) {
+    gate->skipped++;
+    gate->skipped_run++;
+    gate->bytes_saved += len;
+  } else {
+    gate->sent++;
+    gate->skipped_run = 0;
+    gate->last_sent_us = now_us;
+    if (res == CHANGE_GATE_KEEPALIVE) {
+      gate->keepalives++;
+    }
+  }
+
+  portENTER_CRITICAL(&gate_lock);
+  stats.checked++;
+  if (res == CHANGE_GATE_SKIP) {
+    stats.skipped++;
+    stats.bytes_saved += len;
+  } else if (res == CHANGE_GATE_KEEPALIVE) {
+    stats.keepalives++;
+  }
+  stats.check_us_avg = stats.check_us_avg ? (stats.check_us_avg * 7 + check_us) / 8 : check_us;
+  if (check_us > stats.check_us_max) {
+    stats.check_us_max = check_us;
+  }
+  portEXIT_CRITICAL(&gate_lock);
+  return res;
+}
+
+int change_gate_stats_json(char *buf, size_t len) {
+  portENTER_CRITICAL(&gate_lock);
+  change_gate_stats_t s = stats;
+  portEXIT_CRITICAL(&gate_lock);
+  return snprintf(
+    buf, len,
+    "{\"sessions\":%u,\"checked\":%u,\"skipped\":%u,\"keepalives\":%u,\"undecodable\":%u,\"bytes_saved\":%llu,\"check_us_avg\":%u,\"check_us_max\":%u}",
+    s.sessions, s.checked, s.skipped, s.keepalives, s.undecodable, s.bytes_saved, s.check_us_avg, s.check_us_max
+  );
+}
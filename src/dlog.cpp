@@ -0,0 +1,278 @@
+/**
+ * Deferred logger ring and drain task.
+ *
+ * The ring is a bounded multi-producer queue with a sequence number per slot:
+ * a producer claims a slot by advancing head with a compare-and-swap, fills
+ * it, then publishes it by setting the slot's sequence to pos + 1. The single
+ * consumer reads slots in order and hands them back by setting the sequence
+ * to pos + DLOG_RING_SLOTS. No producer ever waits for another or for the
+ * drain task, and the statistics are plain atomics for the same reason: a
+ * spinlock there would make every hot-path call contend across both cores.
+ */
+#include "dlog.h"
+#include <Arduino.h>
+#include "SPIFFS.h"
+#include "esp_cpu.h"
+#include "esp_timer.h"
+
+#define DLOG_TASK_STACK   4096
+#define DLOG_TASK_PRIO    1
+#define DLOG_DRAIN_MS     100
+#define DLOG_LINE_MAX     160
+#define DLOG_BATCH_BYTES  1024
+#define DLOG_FILE         "/dlog.txt"
+#define DLOG_FILE_OLD     "/dlog.old"
+#define DLOG_FILE_MAX     (64 * 1024)
+
+typedef struct {
+  uint32_t seq;
+  uint32_t ts_ms;
+  const char *fmt;
+  uint8_t level;
+  uint8_t nargs;
+  uint32_t args[DLOG_MAX_ARGS];
+} dlog_record_t;
+
+typedef struct {
+  uint32_t records;
+  uint32_t dropped;
+  uint32_t formatted;
+  uint32_t high_water;     // most records waiting at once
+  uint32_t cycles_avg;     // cost of dlog_write
+  uint32_t cycles_max;
+  uint32_t file_errors;
+} dlog_stats_t;
+
+static dlog_record_t *ring = NULL;
+static uint32_t head;      // next slot to claim
+static uint32_t tail;      // next slot to drain; drain task only
+static uint8_t sinks;
+static dlog_stats_t stats;  // each field updated atomically
+
+static char tail_buf[DLOG_TAIL_BYTES];
+static size_t tail_pos;    // next write offset
+static bool tail_wrapped;
+static SemaphoreHandle_t tail_mutex = NULL;
+
+static void stat_max(uint32_t *stat, uint32_t value) {
+  uint32_t cur = __atomic_load_n(stat, __ATOMIC_RELAXED);
+  while (value > cur && !__atomic_compare_exchange_n(stat, &cur, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+void dlog_write(dlog_level_t level, const char *fmt, uint8_t nargs, const uint32_t *args) {
+  uint32_t start = esp_cpu_get_cycle_count();
+  bool stored = false;
+
+  if (ring) {
+    uint32_t pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    while (true) {
+      dlog_record_t *r = &ring[pos & (DLOG_RING_SLOTS - 1)];
+      int32_t dif = (int32_t)(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - pos);
+      if (dif == 0) {
+        if (__atomic_compare_exchange_n(&head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+          r->ts_ms = (uint32_t)(esp_timer_get_time() / 1000);
+          r->fmt = fmt;
+          r->level = level;
+          r->nargs = nargs;
+          memcpy(r->args, args, nargs * sizeof(uint32_t));
+          __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+          stored = true;
+          break;
+        }
+        // pos was reloaded by the failed CAS
+      } else if (dif < 0) {
+        break;  // full
+      } else {
+        pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+      }
+    }
+  }
+
+  uint32_t cycles = esp_cpu_get_cycle_count() - start;
+  __atomic_fetch_add(stored ? &stats.records : &stats.dropped, 1, __ATOMIC_RELAXED);
+  uint32_t avg = __atomic_load_n(&stats.cycles_avg, __ATOMIC_RELAXED);
+  // A lost race only skips one sample of the average.
+  __atomic_compare_exchange_n(&stats.cycles_avg, &avg, avg ? (avg * 15 + cycles) / 16 : cycles, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  stat_max(&stats.cycles_max, cycles);
+}
+
+static void tail_append(const char *text, size_t len) {
+  xSemaphoreTake(tail_mutex, portMAX_DELAY);
+  while (len) {
+    size_t n = DLOG_TAIL_BYTES - tail_pos;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(tail_buf + tail_pos, text, n);
+    tail_pos += n;
+    text += n;
+    len -= n;
+    if (tail_pos == DLOG_TAIL_BYTES) {
+      tail_pos = 0;
+      tail_wrapped = true;
+    }
+  }
+  xSemaphoreGive(tail_mutex);
+}
+
+static void file_append(const char *text, size_t len) {
+  File f = SPIFFS.open(DLOG_FILE, FILE_APPEND);
+  if (!f) {
+    __atomic_fetch_add(&stats.file_errors, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  bool full = f.size() + len > DLOG_FILE_MAX;
+  if (!full) {
+    f.write((const uint8_t *)text, len);
+  }
+  f.close();
+  if (full) {
+    SPIFFS.remove(DLOG_FILE_OLD);
+    SPIFFS.rename(DLOG_FILE, DLOG_FILE_OLD);
+    f = SPIFFS.open(DLOG_FILE, FILE_WRITE);
+    if (f) {
+      f.write((const uint8_t *)text, len);
+      f.close();
+    }
+  }
+}
+
+static void flush_batch(const char *text, size_t len) {
+  uint8_t s = __atomic_load_n(&sinks, __ATOMIC_RELAXED);
+  if (!len) {
+    return;
+  }
+  if (s & DLOG_SINK_SERIAL) {
+    Serial.write((const uint8_t *)text, len);
+  }
+  if (s & DLOG_SINK_MEMORY) {
+    tail_append(text, len);
+  }
+  if (s & DLOG_SINK_SPIFFS) {
+    file_append(text, len);
+  }
+}
+
+static void drain_task(void *arg) {
+  static char batch[DLOG_BATCH_BYTES];
+
+  while (true) {
+    size_t len = 0;
+    uint32_t drained = 0;
+    uint32_t waiting = __atomic_load_n(&head, __ATOMIC_RELAXED) - tail;
+    stat_max(&stats.high_water, waiting);
+
+    while (true) {
+      dlog_record_t *r = &ring[tail & (DLOG_RING_SLOTS - 1)];
+      if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != tail + 1) {
+        break;
+      }
+      dlog_record_t rec = *r;
+      __atomic_store_n(&r->seq, tail + DLOG_RING_SLOTS, __ATOMIC_RELEASE);
+      tail++;
+      drained++;
+
+      if (len + DLOG_LINE_MAX > sizeof(batch)) {
+        flush_batch(batch, len);
+        len = 0;
+      }
+      const uint32_t *a = rec.args;
+      int n = snprintf(batch + len, DLOG_LINE_MAX, "[%6u.%03u][%c] ", rec.ts_ms / 1000, rec.ts_ms % 1000, rec.level == DLOG_ERROR ? 'E' : 'I');
+      n += snprintf(batch + len + n, DLOG_LINE_MAX - n, rec.fmt, a[0], a[1], a[2], a[3], a[4], a[5]);
+      if (n > DLOG_LINE_MAX - 2) {
+        n = DLOG_LINE_MAX - 2;
+      }
+      batch[len + n++] = '\n';
+      len += n;
+    }
+    flush_batch(batch, len);
+
+    if (drained) {
+      __atomic_fetch_add(&stats.formatted, drained, __ATOMIC_RELAXED);
+    } else {
+      vTaskDelay(pdMS_TO_TICKS(DLOG_DRAIN_MS));
+    }
+  }
+}
+
+esp_err_t dlog_init(uint8_t initial_sinks) {
+  if (ring) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  dlog_record_t *r = (dlog_record_t *)calloc(DLOG_RING_SLOTS, sizeof(dlog_record_t));
+  tail_mutex = xSemaphoreCreateMutex();
+  if (!r || !tail_mutex) {
+    free(r);
+    return ESP_ERR_NO_MEM;
+  }
+  for (uint32_t i = 0; i < DLOG_RING_SLOTS; i++) {
+    r[i].seq = i;
+  }
+  sinks = initial_sinks;
+  __atomic_store_n(&ring, r, __ATOMIC_RELEASE);
+  if (xTaskCreatePinnedToCore(drain_task, "dlog", DLOG_TASK_STACK, NULL, DLOG_TASK_PRIO, NULL, tskNO_AFFINITY) != pdPASS) {
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+uint8_t dlog_get_sinks() {
+  return __atomic_load_n(&sinks, __ATOMIC_RELAXED);
+}
+
+void dlog_set_sinks(uint8_t s) {
+  __atomic_store_n(&sinks, s, __ATOMIC_RELAXED);
+}
+
+size_t dlog_tail(char *buf, size_t len) {
+  if (!tail_mutex || !len) {
+    return 0;
+  }
+  xSemaphoreTake(tail_mutex, portMAX_DELAY);
+  size_t start = tail_wrapped ? tail_pos : 0;
+  size_t avail = tail_wrapped ? DLOG_TAIL_BYTES : tail_pos;
+  bool partial = tail_wrapped;
+  if (avail > len) {
+    partial = true;
+    start = (start + avail - len) % DLOG_TAIL_BYTES;
+    avail = len;
+  }
+  size_t first = DLOG_TAIL_BYTES - start;
+  if (first > avail) {
+    first = avail;
+  }
+  memcpy(buf, tail_buf + start, first);
+  memcpy(buf + first, tail_buf, avail - first);
+  xSemaphoreGive(tail_mutex);
+
+  // Start at a line boundary when the oldest line may be cut.
+  size_t skip = 0;
+  if (partial) {
+    while (skip < avail && buf[skip] != '\n') {
+      skip++;
+    }
+    skip = skip < avail ? skip + 1 : 0;
+    memmove(buf, buf + skip, avail - skip);
+  }
+  return avail - skip;
+}
+
+int dlog_stats_json(char *buf, size_t len) {
+  dlog_stats_t s;
+  s.records = __atomic_load_n(&stats.records, __ATOMIC_RELAXED);
+  s.dropped = __atomic_load_n(&stats.dropped, __ATOMIC_RELAXED);
+  s.formatted = __atomic_load_n(&stats.formatted, __ATOMIC_RELAXED);
+  s.high_water = __atomic_load_n(&stats.high_water, __ATOMIC_RELAXED);
+  s.cycles_avg = __atomic_load_n(&stats.cycles_avg, __ATOMIC_RELAXED);
+  s.cycles_max = __atomic_load_n(&stats.cycles_max, __ATOMIC_RELAXED);
+  s.file_errors = __atomic_load_n(&stats.file_errors, __ATOMIC_RELAXED);
+  uint8_t k = dlog_get_sinks();
+  return snprintf(
+    buf, len,
+    "{\"records\":%u,\"dropped\":%u,\"formatted\":%u,\"high_water\":%u,\"slots\":%u,\"cycles_avg\":%u,\"cycles_max\":%u,\"file_errors\":%u,"
+    "\"serial\":%s,\"spiffs\":%s,\"memory\":%s}",
+    s.records, s.dropped, s.formatted, s.high_water, DLOG_RING_SLOTS, s.cycles_avg, s.cycles_max, s.file_errors,
+    (k & DLOG_SINK_SERIAL) ? "true" : "false", (k & DLOG_SINK_SPIFFS) ? "true" : "false", (k & DLOG_SINK_MEMORY) ? "true" : "false"
+  );
+}
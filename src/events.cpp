@@ -0,0 +1,475 @@
+/**
+ * SSE session task.
+ *
+ * New sessions arrive on a queue from the httpd task; from then on only the
+ * events task touches them. Each loop it samples the settings once, builds
+ * the metrics sections once if any client is due, and writes each client's
+ * pending deltas as one chunk. A failed write ends that session.
+ *
+ * Every session socket gets a short send timeout, so a client that stops
+ * reading holds the task for at most EVENTS_SEND_TIMEOUT_MS before it is
+ * dropped and the other clients are served.
+ */
+#include "events.h"
+#include <stdarg.h>
+#include <Arduino.h>
+#include <WiFi.h>
+#include "lwip/sockets.h"
+#include "esp_camera.h"
+#include "esp_timer.h"
+#include "capture.h"
+#include "power_gov.h"
+#include "stream_admission.h"
+#include "sta_link.h"
+#include "rtsp_server.h"
+#include "mcast_stream.h"
+#include "substream.h"
+#include "dlog.h"
+#include "mem_gov.h"
+#include "sessions.h"
+#include "replay.h"
+#include "recorder.h"
+#include "recordings.h"
+#include "profiles.h"
+
+#define EVENTS_TASK_STACK 6144
+#define EVENTS_TASK_PRIO  3
+#define EVENTS_TICK_MS    50
+#define EVENTS_MSG_MAX    4096
+#define EVENTS_SECTION_MAX 768
+#define EVENTS_SEND_TIMEOUT_MS 200
+
+typedef int (*section_fn_t)(char *buf, size_t len);
+
+static int system_json(char *buf, size_t len) {
+  return snprintf(
+    buf, len, "{\"free_heap\":%u,\"min_free_heap\":%u,\"psram_free\":%u,\"ap_clients\":%d}", (unsigned)ESP.getFreeHeap(),
+    (unsigned)ESP.getMinFreeHeap(), (unsigned)ESP.getFreePsram(), WiFi.softAPgetStationNum()
+  );
+}
+
+typedef struct {
+  const char *name;
+  section_fn_t fn;
+} section_t;
+
+static const section_t sections[] = {
+  {"system", system_json},
+  {"rate_ctl", capture_rate_json},
+  {"capture", capture_stats_json},
+  {"memory", mem_gov_stats_json},
+  {"sessions", sessions_stats_json},
+  {"replay", replay_stats_json},
+  {"recorder", recorder_stats_json},
+  {"recordings", recordings_stats_json},
+  {"profiles", profiles_stats_json},
+  {"power", power_gov_stats_json},
+  {"admission", stream_admission_stats_json},
+  {"sta_link", sta_link_stats_json},
+  {"rtsp", rtsp_server_stats_json},
+  {"multicast", mcast_stream_stats_json},
+  {"substream", substream_stats_json},
+  {"dlog", dlog_stats_json},
+};
+#define SECTIONS (sizeof(sections) / sizeof(sections[0]))
+
+// Same names as /status.
+static const char *setting_names[] = {
+  "xclk", "pixformat", "framesize", "quality", "brightness", "contrast", "saturation", "sharpness", "special_effect",
+  "wb_mode", "awb", "awb_gain", "aec", "aec2", "ae_level", "aec_value", "agc", "agc_gain", "gainceiling",
+  "bpc", "wpc", "raw_gma", "lenc", "hmirror", "vflip", "dcw", "colorbar",
+};
+#define SETTINGS (sizeof(setting_names) / sizeof(setting_names[0]))
+
+typedef struct {
+  uint32_t seq;
+  char type[16];
+  char data[EVENTS_DATA_MAX];
+} event_t;
+
+typedef struct {
+  httpd_req_t *req;
+  uint32_t min_interval_us;
+  uint32_t metrics_us;
+  int64_t last_push_us;
+  int64_t last_metrics_us;
+  int64_t last_write_us;
+  uint32_t next_event;       // seq of the next discrete event to send
+  bool started;              // headers sent
+  bool deferred;             // an update is waiting for min_interval_us
+  bool have_settings;
+  int32_t settings[SETTINGS];
+  uint32_t section_hash[SECTIONS];
+} client_t;
+
+typedef struct {
+  uint32_t sessions;
+  uint32_t rejected;
+  uint32_t messages;
+  uint32_t coalesced;        // updates held back for max_hz
+  uint32_t timeouts;         // clients dropped for not reading
+  uint32_t events;
+  uint32_t events_lost;      // discrete events overwritten before a client got them
+  uint64_t bytes;
+} events_stats_t;
+
+static client_t clients[EVENTS_MAX_CLIENTS];
+static uint8_t client_count;   // events task only
+static uint8_t slots_used;     // attached or queued
+static int held_fds[EVENTS_MAX_CLIENTS];  // their sockets, -1 if free
+static event_t ring[EVENTS_RING];
+static uint32_t ring_seq;    // seq of the next event published
+static events_stats_t stats;
+static portMUX_TYPE events_lock = portMUX_INITIALIZER_UNLOCKED;
+static QueueHandle_t attach_queue = NULL;
+static TaskHandle_t events_task_handle = NULL;
+
+typedef struct {
+  httpd_req_t *req;
+  uint8_t max_hz;
+  uint32_t metrics_ms;
+} attach_t;
+
+static uint32_t fnv1a(const char *s, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (uint8_t)s[i]) * 16777619u;
+  }
+  return h ? h : 1;  // 0 means "never sent"
+}
+
+static bool read_settings(int32_t *v) {
+  sensor_t *s = esp_camera_sensor_get();
+  if (!s) {
+    return false;
+  }
+  const camera_status_t *st = &s->status;
+  int32_t all[SETTINGS] = {
+    s->xclk_freq_hz / 1000000, s->pixformat, st->framesize, st->quality, st->brightness, st->contrast, st->saturation, st->sharpness,
+    st->special_effect, st->wb_mode, st->awb, st->awb_gain, st->aec, st->aec2, st->ae_level, st->aec_value, st->agc, st->agc_gain,
+    st->gainceiling, st->bpc, st->wpc, st->raw_gma, st->lenc, st->hmirror, st->vflip, st->dcw, st->colorbar,
+  };
+  memcpy(v, all, sizeof(all));
+  return true;
+}
+
+/* Appends to msg at *pos; false (and nothing written) if it does not fit. */
+static bool append(char *msg, size_t *pos, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(msg + *pos, EVENTS_MSG_MAX - *pos, fmt, ap);
+  va_end(ap);
+  if (n < 0 || *pos + n >= EVENTS_MSG_MAX) {
+    msg[*pos] = '\0';
+    return false;
+  }
+  *pos += n;
+  return true;
+}
+
+/*
+ * The delta builders leave the client's state alone when the message is
+ * full, so whatever did not fit goes out with the next message.
+ */
+static size_t settings_delta(client_t *c, const int32_t *now_v, char *msg, size_t pos) {
+  size_t start = pos;
+  bool any = false;
+  for (size_t i = 0; i < SETTINGS; i++) {
+    if (c->have_settings && c->settings[i] == now_v[i]) {
+      continue;
+    }
+    if (!append(msg, &pos, any ? ",\"%s\":%d" : "event: settings\ndata: {\"%s\":%d", setting_names[i], now_v[i])) {
+      return start;
+    }
+    any = true;
+  }
+  if (any && !append(msg, &pos, "}\n\n")) {
+    return start;
+  }
+  memcpy(c->settings, now_v, sizeof(c->settings));
+  c->have_settings = true;
+  return pos;
+}
+
+static size_t metrics_delta(client_t *c, char (*text)[EVENTS_SECTION_MAX], const uint32_t *hash, char *msg, size_t pos, bool *complete) {
+  size_t start = pos;
+  *complete = false;
+  bool sent[SECTIONS] = {};
+  bool any = false;
+  int left = 0;               // changed sections that did not fit
+  for (size_t i = 0; i < SECTIONS; i++) {
+    if (!hash[i] || c->section_hash[i] == hash[i]) {
+      continue;
+    }
+    // Leave room for the closing brace; a section that does not fit waits.
+    size_t before = pos;
+    if (!append(msg, &pos, any ? ",\"%s\":%s" : "event: metrics\ndata: {\"%s\":%s", sections[i].name, text[i]) || pos + 4 >= EVENTS_MSG_MAX) {
+      pos = before;
+      msg[pos] = '\0';
+      left++;
+      continue;
+    }
+    sent[i] = true;
+    any = true;
+  }
+  if (!any) {
+    *complete = !left;
+    return start;
+  }
+  if (!append(msg, &pos, "}\n\n")) {
+    return start;
+  }
+  *complete = !left;
+  for (size_t i = 0; i < SECTIONS; i++) {
+    if (sent[i]) {
+      c->section_hash[i] = hash[i];
+    }
+  }
+  return pos;
+}
+
+static size_t pending_events(client_t *c, char *msg, size_t pos) {
+  portENTER_CRITICAL(&events_lock);
+  uint32_t head = ring_seq;
+  portEXIT_CRITICAL(&events_lock);
+  if (head - c->next_event > EVENTS_RING) {
+    portENTER_CRITICAL(&events_lock);
+    stats.events_lost += head - c->next_event - EVENTS_RING;
+    portEXIT_CRITICAL(&events_lock);
+    c->next_event = head - EVENTS_RING;
+  }
+  while (c->next_event != head) {
+    event_t e;
+    portENTER_CRITICAL(&events_lock);
+    e = ring[c->next_event % EVENTS_RING];
+    portEXIT_CRITICAL(&events_lock);
+    if (e.seq == c->next_event && !append(msg, &pos, "event: %s\nid: %u\ndata: %s\n\n", e.type, e.seq, e.data)) {
+      break;  // rest next time
+    }
+    c->next_event++;
+  }
+  return pos;
+}
+
+static bool client_send(client_t *c, const char *msg, size_t len) {
+  if (!c->started) {
+    httpd_resp_set_type(c->req, "text/event-stream");
+    httpd_resp_set_hdr(c->req, "Cache-Control", "no-cache");
+    httpd_resp_set_hdr(c->req, "Access-Control-Allow-Origin", "*");
+    c->started = true;
+  }
+  if (httpd_resp_send_chunk(c->req, msg, len) != ESP_OK) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      portENTER_CRITICAL(&events_lock);
+      stats.timeouts++;
+      portEXIT_CRITICAL(&events_lock);
+    }
+    return false;
+  }
+  portENTER_CRITICAL(&events_lock);
+  stats.messages++;
+  stats.bytes += len;
+  portEXIT_CRITICAL(&events_lock);
+  return true;
+}
+
+/* Frees fd's held_fds entry; with fd -1, takes a free one for new_fd. */
+static void hold(int fd, int new_fd) {
+  portENTER_CRITICAL(&events_lock);
+  for (size_t i = 0; i < EVENTS_MAX_CLIENTS; i++) {
+    if (held_fds[i] == fd) {
+      held_fds[i] = new_fd;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&events_lock);
+}
+
+/* Only on a failed write: the chunked response is cut, so the socket goes too. */
+static void client_drop(size_t i) {
+  int fd = httpd_req_to_sockfd(clients[i].req);
+  hold(fd, -1);
+  httpd_sess_trigger_close(clients[i].req->handle, fd);
+  httpd_req_async_handler_complete(clients[i].req);
+  clients[i] = clients[--client_count];
+  portENTER_CRITICAL(&events_lock);
+  slots_used--;
+  portEXIT_CRITICAL(&events_lock);
+}
+
+static void take_new_clients(int64_t now) {
+  attach_t a;
+  while (xQueueReceive(attach_queue, &a, 0) == pdTRUE) {
+    client_t *c = &clients[client_count++];
+    memset(c, 0, sizeof(*c));
+    c->req = a.req;
+    c->min_interval_us = 1000000 / a.max_hz;
+    c->metrics_us = a.metrics_ms * 1000;
+    c->last_push_us = now - c->min_interval_us;
+    c->last_metrics_us = now - c->metrics_us;
+    portENTER_CRITICAL(&events_lock);
+    c->next_event = ring_seq;
+    portEXIT_CRITICAL(&events_lock);
+    struct timeval tv = {0, EVENTS_SEND_TIMEOUT_MS * 1000};
+    setsockopt(httpd_req_to_sockfd(c->req), SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  }
+}
+
+/* True if the client has something to receive that max_hz holds back. */
+static bool update_waiting(const client_t *c, const int32_t *settings, bool have_settings) {
+  if (have_settings && (!c->have_settings || memcmp(c->settings, settings, sizeof(c->settings)))) {
+    return true;
+  }
+  portENTER_CRITICAL(&events_lock);
+  bool events = c->next_event != ring_seq;
+  portEXIT_CRITICAL(&events_lock);
+  return events;
+}
+
+static void events_task(void *arg) {
+  static char msg[EVENTS_MSG_MAX];
+  static char text[SECTIONS][EVENTS_SECTION_MAX];
+  uint32_t hash[SECTIONS];
+  int32_t settings[SETTINGS];
+
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(EVENTS_TICK_MS));
+    int64_t now = esp_timer_get_time();
+    take_new_clients(now);
+    if (!client_count) {
+      continue;
+    }
+
+    bool have_settings = read_settings(settings);
+    bool built = false;
+    for (size_t i = 0; i < client_count;) {
+      client_t *c = &clients[i];
+      size_t len = 0;
+      if (now - c->last_push_us < c->min_interval_us) {
+        if (!c->deferred && update_waiting(c, settings, have_settings)) {
+          c->deferred = true;
+          portENTER_CRITICAL(&events_lock);
+          stats.coalesced++;
+          portEXIT_CRITICAL(&events_lock);
+        }
+        i++;
+        continue;
+      }
+      c->deferred = false;
+      if (have_settings) {
+        len = settings_delta(c, settings, msg, len);
+      }
+      if (now - c->last_metrics_us >= c->metrics_us) {
+        if (!built) {
+          for (size_t k = 0; k < SECTIONS; k++) {
+            int n = sections[k].fn(text[k], EVENTS_SECTION_MAX);
+            hash[k] = n > 0 && n < EVENTS_SECTION_MAX ? fnv1a(text[k], n) : 0;
+          }
+          built = true;
+        }
+        bool complete;
+        len = metrics_delta(c, text, hash, msg, len, &complete);
+        if (complete) {
+          c->last_metrics_us = now;  // otherwise the rest goes with the next message
+        }
+      }
+      len = pending_events(c, msg, len);
+      if (!len && now - c->last_write_us >= (int64_t)EVENTS_PING_MS * 1000) {
+        append(msg, &len, ": ping\n\n");
+      }
+      if (len) {
+        if (!client_send(c, msg, len)) {
+          client_drop(i);
+          continue;
+        }
+        c->last_push_us = now;
+        c->last_write_us = now;
+      }
+      i++;
+    }
+  }
+}
+
+esp_err_t events_init() {
+  if (events_task_handle) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  for (size_t i = 0; i < EVENTS_MAX_CLIENTS; i++) {
+    held_fds[i] = -1;
+  }
+  attach_queue = xQueueCreate(EVENTS_MAX_CLIENTS, sizeof(attach_t));
+  if (!attach_queue) {
+    return ESP_ERR_NO_MEM;
+  }
+  if (xTaskCreatePinnedToCore(events_task, "events", EVENTS_TASK_STACK, NULL, EVENTS_TASK_PRIO, &events_task_handle, 0) != pdPASS) {
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+esp_err_t events_attach(httpd_req_t *req, uint8_t max_hz, uint32_t metrics_ms) {
+  if (!events_task_handle) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  portENTER_CRITICAL(&events_lock);
+  bool full = slots_used >= EVENTS_MAX_CLIENTS;
+  if (!full) {
+    slots_used++;
+  }
+  portEXIT_CRITICAL(&events_lock);
+  attach_t a;
+  a.max_hz = max_hz < 1 ? 1 : max_hz > EVENTS_MAX_HZ ? EVENTS_MAX_HZ : max_hz;
+  a.metrics_ms = metrics_ms < 1000 / a.max_hz ? 1000 / a.max_hz : metrics_ms;
+  if (full || httpd_req_async_handler_begin(req, &a.req) != ESP_OK) {
+    portENTER_CRITICAL(&events_lock);
+    stats.rejected++;
+    if (!full) {
+      slots_used--;
+    }
+    portEXIT_CRITICAL(&events_lock);
+    return ESP_ERR_NO_MEM;
+  }
+  hold(-1, httpd_req_to_sockfd(a.req));
+  // Cannot fail: the queue holds EVENTS_MAX_CLIENTS and slots_used bounds it.
+  xQueueSend(attach_queue, &a, 0);
+  portENTER_CRITICAL(&events_lock);
+  stats.sessions++;
+  portEXIT_CRITICAL(&events_lock);
+  xTaskNotifyGive(events_task_handle);
+  return ESP_OK;
+}
+
+bool events_holds(int fd) {
+  bool held = false;
+  portENTER_CRITICAL(&events_lock);
+  for (size_t i = 0; i < EVENTS_MAX_CLIENTS; i++) {
+    held = held || (fd >= 0 && held_fds[i] == fd);
+  }
+  portEXIT_CRITICAL(&events_lock);
+  return held;
+}
+
+void events_publish(const char *type, const char *data) {
+  event_t e;
+  snprintf(e.type, sizeof(e.type), "%s", type);
+  snprintf(e.data, sizeof(e.data), "%s", data);
+  portENTER_CRITICAL(&events_lock);
+  e.seq = ring_seq++;
+  ring[e.seq % EVENTS_RING] = e;
+  stats.events++;
+  portEXIT_CRITICAL(&events_lock);
+  if (events_task_handle) {
+    xTaskNotifyGive(events_task_handle);
+  }
+}
+
+int events_stats_json(char *buf, size_t len) {
+  portENTER_CRITICAL(&events_lock);
+  events_stats_t s = stats;
+  portEXIT_CRITICAL(&events_lock);
+  return snprintf(
+    buf, len,
+    "{\"clients\":%u,\"sessions\":%u,\"rejected\":%u,\"messages\":%u,\"coalesced\":%u,\"timeouts\":%u,\"events\":%u,\"events_lost\":%u,\"bytes\":%llu}",
+    client_count, s.sessions, s.rejected, s.messages, s.coalesced, s.timeouts, s.events, s.events_lost, s.bytes
+  );
+}
@@ -0,0 +1,557 @@
+/**
+ * Baseline JPEG header parser and Huffman scan decoder.
+ *
+ * The decoder keeps a 32-bit MSB-aligned bit buffer and resolves codes of up
+ * to 9 bits with a single table lookup; longer codes fall back to the
+ * canonical maxcode walk. Restart markers are consumed between intervals.
+ */
+#include "jpeg_dct.h"
+#include <string.h>
+
+const uint8_t jpeg_zigzag[64] = {
+  0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,  12, 19, 26, 33, 40, 48,
+  41, 34, 27, 20, 13, 6,  7,  14, 21, 28, 35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23,
+  30, 37, 44, 51, 58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+const uint8_t jpeg_unzigzag[64] = {
+  0,  1,  5,  6,  14, 15, 27, 28, 2,  4,  7,  13, 16, 26, 29, 42, 3,  8,  12, 17, 25, 30,
+  41, 43, 9,  11, 18, 24, 31, 40, 44, 53, 10, 19, 23, 32, 39, 45, 52, 54, 20, 22, 33, 38,
+  46, 51, 55, 60, 21, 34, 37, 47, 50, 56, 59, 61, 35, 36, 48, 49, 57, 58, 62, 63,
+};
+
+static inline uint16_t rd16(const uint8_t *p) {
+  return (p[0] << 8) | p[1];
+}
+
+static bool build_huff(jpeg_huff_t *h, const uint8_t *bits, const uint8_t *vals) {
+  uint16_t count = 0;
+  for (int l = 1; l <= 16; l++) {
+    count += bits[l - 1];
+  }
+  if (count > 256) {
+    return false;
+  }
+  h->bits[0] = 0;
+  memcpy(h->bits + 1, bits, 16);
+  memcpy(h->vals, vals, count);
+  h->count = count;
+  memset(h->look_len, 0, sizeof(h->look_len));
+
+  uint32_t code = 0;
+  uint16_t k = 0;
+  for (int l = 1; l <= 16; l++) {
+    h->valoffset[l] = (int32_t)k - (int32_t)code;
+    for (int i = 0; i < h->bits[l]; i++, k++, code++) {
+      if (l <= 9) {
+        uint32_t first = code << (9 - l);
+        for (uint32_t j = 0; j < (1u << (9 - l)); j++) {
+          h->look_len[first + j] = l;
+          h->look_sym[first + j] = h->vals[k];
+        }
+      }
+    }
+    h->maxcode[l] = h->bits[l] ? (int32_t)code - 1 : -1;
+    if (code > (1u << l)) {
+      return false;
+    }
+    code <<= 1;
+  }
+  h->maxcode[17] = 0x7FFFFFFF;  // sentinel: ends the slow-path walk
+  return true;
+}
+
+bool jpeg_parse(const uint8_t *jpg, size_t len, jpeg_info_t *info) {
+  bool have_sof = false;
+  bool have_dc[2] = {false, false};
+  bool have_ac[2] = {false, false};
+
+  memset(info, 0, offsetof(jpeg_info_t, dc));
+  info->scan = NULL;
+  info->scan_len = 0;
+  if (len < 4 || jpg[0] != 0xFF || jpg[1] != 0xD8) {
+    return false;
+  }
+
+  size_t off = 2;
+  while (off + 4 <= len) {
+    if (jpg[off] != 0xFF) {
+      return false;
+    }
+    uint8_t marker = jpg[off + 1];
+    if (marker == 0xFF) {  // fill byte
+      off++;
+      continue;
+    }
+    size_t seg_len = rd16(jpg + off + 2);
+    if (seg_len < 2 || off + 2 + seg_len > len) {
+      return false;
+    }
+    const uint8_t *seg = jpg + off + 4;
+    size_t body = seg_len - 2;
+
+    if (marker == 0xDB) {  // DQT
+      for (size_t i = 0; i < body; i += 65) {
+        uint8_t tq = seg[i] & 0x0F;
+        if ((seg[i] >> 4) != 0 || tq > 3 || i + 65 > body) {
+          return false;
+        }
+        info->qt[tq] = seg + i + 1;
+      }
+    } else if (marker == 0xC4) {  // DHT, possibly several tables
+      size_t i = 0;
+      while (i + 17 <= body) {
+        uint8_t tc = seg[i] >> 4;
+        uint8_t th = seg[i] & 0x0F;
+        size_t n = 0;
+        for (int l = 0; l < 16; l++) {
+          n += seg[i + 1 + l];
+        }
+        if (tc > 1 || th > 1 || i + 17 + n > body) {
+          return false;
+        }
+        jpeg_huff_t *h = tc ? &info->ac[th] : &info->dc[th];
+        if (!build_huff(h, seg + i + 1, seg + i + 17)) {
+          return false;
+        }
+        (tc ? have_ac : have_dc)[th] = true;
+        i += 17 + n;
+      }
+    } else if (marker == 0xC0) {  // SOF0
+      if (body < 6 || seg[0] != 8) {
+        return false;
+      }
+      info->height = rd16(seg + 1);
+      info->width = rd16(seg + 3);
+      info->ncomp = seg[5];
+      if (!info->width || !info->height || (info->ncomp != 1 && info->ncomp != 3) || body < 6 + 3u * info->ncomp) {
+        return false;
+      }
+      info->hmax = info->vmax = 1;
+      for (int c = 0; c < info->ncomp; c++) {
+        jpeg_component_t *comp = &info->comp[c];
+        comp->id = seg[6 + 3 * c];
+        comp->h = info->ncomp == 1 ? 1 : seg[7 + 3 * c] >> 4;
+        comp->v = info->ncomp == 1 ? 1 : seg[7 + 3 * c] & 0x0F;
+        comp->tq = seg[8 + 3 * c];
+        if (comp->h < 1 || comp->h > 4 || comp->v < 1 || comp->v > 4 || comp->tq > 3) {
+          return false;
+        }
+        info->hmax = comp->h > info->hmax ? comp->h : info->hmax;
+        info->vmax = comp->v > info->vmax ? comp->v : info->vmax;
+        info->mcu_blocks += comp->h * comp->v;
+      }
+      if (info->mcu_blocks > JPEG_MAX_MCU_BLOCKS) {
+        return false;
+      }
+      info->mcus_x = (info->width + 8 * info->hmax - 1) / (8 * info->hmax);
+      info->mcus_y = (info->height + 8 * info->vmax - 1) / (8 * info->vmax);
+      for (int c = 0; c < info->ncomp; c++) {
+        info->comp[c].bw = info->mcus_x * info->comp[c].h;
+        info->comp[c].bh = info->mcus_y * info->comp[c].v;
+      }
+      have_sof = true;
+    } else if (marker >= 0xC1 && marker <= 0xCF && marker != 0xC8 && marker != 0xCC) {
+      return false;  // progressive, lossless, arithmetic...
+    } else if (marker == 0xDD) {  // DRI
+      if (body < 2) {
+        return false;
+      }
+      info->restart_interval = rd16(seg);
+    } else if (marker == 0xDA) {  // SOS
+      if (!have_sof || body < 1 || seg[0] != info->ncomp || body < 4 + 2u * info->ncomp) {
+        return false;  // only single-scan, fully interleaved frames
+      }
+      for (int c = 0; c < info->ncomp; c++) {
+        jpeg_component_t *comp = &info->comp[c];
+        if (seg[1 + 2 * c] != comp->id) {
+          return false;
+        }
+        comp->td = seg[2 + 2 * c] >> 4;
+        comp->ta = seg[2 + 2 * c] & 0x0F;
+        if (comp->td > 1 || comp->ta > 1 || !have_dc[comp->td] || !have_ac[comp->ta] || !info->qt[comp->tq]) {
+          return false;
+        }
+      }
+
+      size_t start = off + 2 + seg_len;
+      size_t end = len;
+      // The sensor may pad the buffer after EOI.
+      while (end >= start + 2 && !(jpg[end - 2] == 0xFF && jpg[end - 1] == 0xD9)) {
+        end--;
+      }
+      end = end < start + 2 ? len : end - 2;
+      info->scan = jpg + start;
+      info->scan_len = end - start;
+      return info->scan_len > 0;
+    }
+    off += 2 + seg_len;
+  }
+  return false;
+}
+
+bool jpeg_size(const uint8_t *p, size_t len, uint16_t *width, uint16_t *height) {
+  if (len < 4 || p[0] != 0xFF || p[1] != 0xD8) {
+    return false;
+  }
+  size_t i = 2;
+  while (i + 9 <= len) {
+    if (p[i] != 0xFF) {
+      return false;
+    }
+    uint8_t m = p[i + 1];
+    if (m == 0xFF) {
+      i++;  // fill byte
+      continue;
+    }
+    if (m >= 0xC0 && m <= 0xCF && m != 0xC4 && m != 0xC8 && m != 0xCC) {
+      *height = rd16(p + i + 5);
+      *width = rd16(p + i + 7);
+      return *width && *height;
+    }
+    if (m == 0xDA || m == 0xD9) {
+      return false;
+    }
+    i += 2 + rd16(p + i + 2);
+  }
+  return false;
+}
+
+void jpeg_scan_begin(jpeg_scan_reader_t *r, const jpeg_info_t *info) {
+  memset(r, 0, sizeof(*r));
+  r->info = info;
+  r->p = info->scan;
+  r->end = info->scan + info->scan_len;
+}
+
+static inline void fill(jpeg_scan_reader_t *r) {
+  while (r->bits <= 24) {
+    uint32_t b = 0;
+    if (!r->marker && r->p < r->end) {
+      b = *r->p++;
+      if (b == 0xFF) {
+        if (r->p < r->end && *r->p == 0x00) {
+          r->p++;  // stuffed zero
+        } else {
+          r->p--;  // leave the marker for restart handling
+          r->marker = true;
+          b = 0;
+        }
+      }
+    }
+    r->acc |= b << (24 - r->bits);
+    r->bits += 8;
+  }
+}
+
+static inline uint32_t get_bits(jpeg_scan_reader_t *r, int n) {
+  uint32_t v = r->acc >> (32 - n);
+  r->acc <<= n;
+  r->bits -= n;
+  return v;
+}
+
+static inline int extend(uint32_t v, int s) {
+  return v < (1u << (s - 1)) ? (int)v - (1 << s) + 1 : (int)v;
+}
+
+static inline int decode_huff(jpeg_scan_reader_t *r, const jpeg_huff_t *h) {
+  fill(r);
+  uint32_t idx = r->acc >> (32 - 9);
+  int l = h->look_len[idx];
+  if (l) {
+    r->acc <<= l;
+    r->bits -= l;
+    return h->look_sym[idx];
+  }
+  for (l = 10; l <= 16; l++) {
+    int32_t code = r->acc >> (32 - l);
+    if (code <= h->maxcode[l]) {
+      r->acc <<= l;
+      r->bits -= l;
+      return h->vals[h->valoffset[l] + code];
+    }
+  }
+  return -1;
+}
+
+static bool decode_block(jpeg_scan_reader_t *r, const jpeg_component_t *comp, int c, int16_t *coef, int16_t *dc) {
+  const jpeg_info_t *info = r->info;
+  int s = decode_huff(r, &info->dc[comp->td]);
+  if (s < 0 || s > 11) {
+    return false;
+  }
+  int diff = 0;
+  if (s) {
+    fill(r);
+    diff = extend(get_bits(r, s), s);
+  }
+  r->pred[c] += diff;
+  *dc = r->pred[c];
+
+  const jpeg_huff_t *ac = &info->ac[comp->ta];
+  if (coef) {
+    memset(coef, 0, 64 * sizeof(int16_t));
+    coef[0] = r->pred[c];
+  }
+  for (int k = 1; k < 64;) {
+    int rs = decode_huff(r, ac);
+    if (rs < 0) {
+      return false;
+    }
+    int run = rs >> 4;
+    s = rs & 0x0F;
+    if (!s) {
+      if (run != 15) {
+        break;  // EOB
+      }
+      k += 16;
+      continue;
+    }
+    k += run;
+    if (k > 63) {
+      return false;
+    }
+    fill(r);
+    uint32_t v = get_bits(r, s);
+    if (coef) {
+      coef[k] = extend(v, s);
+    }
+    k++;
+  }
+  return true;
+}
+
+static bool restart(jpeg_scan_reader_t *r) {
+  // Byte-align and step over the RSTn marker the bit reader stopped at.
+  r->acc = 0;
+  r->bits = 0;
+  r->marker = false;
+  while (r->p + 1 < r->end && r->p[0] == 0xFF && r->p[1] == 0xFF) {
+    r->p++;
+  }
+  if (r->p + 1 >= r->end || r->p[0] != 0xFF || (r->p[1] & 0xF8) != 0xD0) {
+    return false;
+  }
+  r->p += 2;
+  memset(r->pred, 0, sizeof(r->pred));
+  return true;
+}
+
+void jpeg_scan_tell(const jpeg_scan_reader_t *r, jpeg_scan_pos_t *pos) {
+  pos->p = r->p;
+  pos->acc = r->acc;
+  pos->bits = r->bits;
+  pos->marker = r->marker;
+  memcpy(pos->pred, r->pred, sizeof(pos->pred));
+}
+
+void jpeg_scan_seek(jpeg_scan_reader_t *r, const jpeg_scan_pos_t *pos, uint32_t mcu) {
+  r->p = pos->p;
+  r->acc = pos->acc;
+  r->bits = pos->bits;
+  r->marker = pos->marker;
+  memcpy(r->pred, pos->pred, sizeof(r->pred));
+  r->mcu = mcu;
+}
+
+bool jpeg_scan_mcu(jpeg_scan_reader_t *r, int16_t (*blocks)[64], int16_t *dc) {
+  const jpeg_info_t *info = r->info;
+  if (r->mcu >= (uint32_t)info->mcus_x * info->mcus_y) {
+    return false;
+  }
+  if (info->restart_interval && r->mcu && r->mcu % info->restart_interval == 0 && !restart(r)) {
+    return false;
+  }
+  int b = 0;
+  for (int c = 0; c < info->ncomp; c++) {
+    const jpeg_component_t *comp = &info->comp[c];
+    for (int i = 0; i < comp->h * comp->v; i++, b++) {
+      if (!decode_block(r, comp, c, blocks ? blocks[b] : NULL, &dc[b])) {
+        return false;
+      }
+    }
+  }
+  r->mcu++;
+  return true;
+}
+
+void jpeg_huff_enc_build(jpeg_huff_enc_t *enc, const jpeg_huff_t *h) {
+  memset(enc->size, 0, sizeof(enc->size));
+  uint32_t code = 0;
+  uint16_t k = 0;
+  for (int l = 1; l <= 16; l++) {
+    for (int i = 0; i < h->bits[l]; i++, k++, code++) {
+      enc->code[h->vals[k]] = code;
+      enc->size[h->vals[k]] = l;
+    }
+    code <<= 1;
+  }
+}
+
+void jpeg_bw_init(jpeg_bit_writer_t *w, uint8_t *buf, size_t cap) {
+  w->start = w->p = buf;
+  w->end = buf + cap;
+  w->acc = 0;
+  w->bits = 0;
+  w->overflow = false;
+}
+
+static inline void put_byte(jpeg_bit_writer_t *w, uint8_t b) {
+  if (w->p < w->end) {
+    *w->p++ = b;
+  } else {
+    w->overflow = true;
+  }
+}
+
+static inline void put_bits(jpeg_bit_writer_t *w, uint32_t v, int n) {
+  w->acc = (w->acc << n) | (v & ((1u << n) - 1));
+  w->bits += n;
+  while (w->bits >= 8) {
+    uint8_t b = w->acc >> (w->bits - 8);
+    put_byte(w, b);
+    if (b == 0xFF) {
+      put_byte(w, 0x00);
+    }
+    w->bits -= 8;
+  }
+}
+
+static inline int magnitude(int v) {
+  int a = v < 0 ? -v : v;
+  return a ? 32 - __builtin_clz(a) : 0;
+}
+
+bool jpeg_encode_block(jpeg_bit_writer_t *w, const int16_t *coef, int dc_diff, const jpeg_huff_enc_t *dc, const jpeg_huff_enc_t *ac) {
+  int s = magnitude(dc_diff);
+  if (s > 11 || !dc->size[s]) {
+    return false;
+  }
+  put_bits(w, dc->code[s], dc->size[s]);
+  if (s) {
+    put_bits(w, dc_diff < 0 ? dc_diff - 1 : dc_diff, s);
+  }
+
+  int run = 0;
+  for (int k = 1; k < 64; k++) {
+    int v = coef[k];
+    if (!v) {
+      run++;
+      continue;
+    }
+    while (run > 15) {
+      if (!ac->size[0xF0]) {
+        return false;
+      }
+      put_bits(w, ac->code[0xF0], ac->size[0xF0]);
+      run -= 16;
+    }
+    s = magnitude(v);
+    int rs = (run << 4) | s;
+    if (s > 10 || !ac->size[rs]) {
+      return false;
+    }
+    put_bits(w, ac->code[rs], ac->size[rs]);
+    put_bits(w, v < 0 ? v - 1 : v, s);
+    run = 0;
+  }
+  if (run) {
+    if (!ac->size[0x00]) {
+      return false;
+    }
+    put_bits(w, ac->code[0x00], ac->size[0x00]);
+  }
+  return true;
+}
+
+size_t jpeg_bw_finish(jpeg_bit_writer_t *w) {
+  if (w->bits) {
+    put_bits(w, 0xFF, 8 - w->bits);  // pad with ones
+  }
+  put_byte(w, 0xFF);
+  put_byte(w, 0xD9);
+  return w->overflow ? 0 : w->p - w->start;
+}
+
+static uint8_t *put_segment(uint8_t *p, uint8_t marker, size_t body) {
+  *p++ = 0xFF;
+  *p++ = marker;
+  *p++ = (body + 2) >> 8;
+  *p++ = (body + 2) & 0xFF;
+  return p;
+}
+
+size_t jpeg_write_header(uint8_t *out, size_t cap, const jpeg_info_t *info, uint16_t width, uint16_t height, bool transpose) {
+  size_t need = 2 + 4 * 69 + 12 + 3 * info->ncomp + 6 + 2 * info->ncomp;
+  for (int t = 0; t < 2; t++) {
+    need += 2 * 21 + info->dc[t].count + info->ac[t].count;
+  }
+  if (cap < need) {
+    return 0;
+  }
+
+  uint8_t *p = out;
+  *p++ = 0xFF;
+  *p++ = 0xD8;
+  for (int t = 0; t < 4; t++) {
+    if (info->qt[t]) {
+      p = put_segment(p, 0xDB, 65);
+      *p++ = t;
+      if (transpose) {
+        for (int k = 0; k < 64; k++) {
+          uint8_t n = jpeg_zigzag[k];
+          p[k] = info->qt[t][jpeg_unzigzag[(n & 7) * 8 + (n >> 3)]];
+        }
+      } else {
+        memcpy(p, info->qt[t], 64);
+      }
+      p += 64;
+    }
+  }
+
+  p = put_segment(p, 0xC0, 6 + 3 * info->ncomp);
+  *p++ = 8;
+  *p++ = height >> 8;
+  *p++ = height & 0xFF;
+  *p++ = width >> 8;
+  *p++ = width & 0xFF;
+  *p++ = info->ncomp;
+  for (int c = 0; c < info->ncomp; c++) {
+    *p++ = info->comp[c].id;
+    *p++ = transpose ? (info->comp[c].v << 4) | info->comp[c].h : (info->comp[c].h << 4) | info->comp[c].v;
+    *p++ = info->comp[c].tq;
+  }
+
+  bool used_dc[2] = {false, false};
+  bool used_ac[2] = {false, false};
+  for (int c = 0; c < info->ncomp; c++) {
+    used_dc[info->comp[c].td] = true;
+    used_ac[info->comp[c].ta] = true;
+  }
+  for (int tc = 0; tc < 2; tc++) {
+    for (int th = 0; th < 2; th++) {
+      const jpeg_huff_t *h = tc ? &info->ac[th] : &info->dc[th];
+      if (!(tc ? used_ac : used_dc)[th]) {
+        continue;
+      }
+      p = put_segment(p, 0xC4, 17 + h->count);
+      *p++ = (tc << 4) | th;
+      memcpy(p, h->bits + 1, 16);
+      p += 16;
+      memcpy(p, h->vals, h->count);
+      p += h->count;
+    }
+  }
+
+  p = put_segment(p, 0xDA, 4 + 2 * info->ncomp);
+  *p++ = info->ncomp;
+  for (int c = 0; c < info->ncomp; c++) {
+    *p++ = info->comp[c].id;
+    *p++ = (info->comp[c].td << 4) | info->comp[c].ta;
+  }
+  *p++ = 0;   // Ss
+  *p++ = 63;  // Se
+  *p++ = 0;   // Ah/Al
+  return p - out;
+}
@@ -0,0 +1,378 @@
+/**
+ * Compressed-domain transforms.
+ *
+ * Blocks that are kept are re-emitted with the source Huffman tables: for the
+ * AC part that reproduces the source bits exactly, and only the DC
+ * difference is recomputed against the new neighbour. This avoids splicing
+ * bit ranges across byte-stuffing boundaries.
+ *
+ * Flips and rotations map each output MCU onto exactly one source MCU, so
+ * rather than buffering the coefficients of a whole frame (about 2 MB at
+ * SVGA) the scan is walked once to checkpoint the reader at every MCU, and
+ * the MCUs are then decoded again in output order.
+ *
+ * Downscaling follows Dugad and Ahuja: the low 4x4 coefficients of an 8x8
+ * block, halved, are the 4x4 DCT of the block at half resolution, and four
+ * such 4x4 DCTs combine into one 8x8 DCT with two fixed 8x4 matrices. Two
+ * source MCU rows are buffered per output MCU row.
+ */
+#include "jpeg_xform.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool jpeg_rect_parse(const char *s, jpeg_rect_t *rect) {
+  unsigned v[4];
+  for (int i = 0; i < 4; i++) {
+    char *end;
+    unsigned long n = strtoul(s, &end, 10);
+    if (end == s || n > 0xFFFF || *end != (i < 3 ? ',' : '\0')) {
+      return false;
+    }
+    v[i] = n;
+    s = end + 1;
+  }
+  rect->x = v[0];
+  rect->y = v[1];
+  rect->w = v[2];
+  rect->h = v[3];
+  return rect->w && rect->h;
+}
+
+static const char *orient_names[] = {"none", "hflip", "vflip", "rot90", "rot180", "rot270"};
+
+static float dct_basis(int n, int k, int x) {
+  return (k ? sqrtf(2.0f / n) : sqrtf(1.0f / n)) * cosf((2 * x + 1) * k * (float)M_PI / (2 * n));
+}
+
+void jpeg_xform_init(jpeg_xform_t *x) {
+  x->mcu_pos = NULL;
+  x->mcu_pos_cap = 0;
+  x->rows = NULL;
+  x->rows_cap = 0;
+  // half[i] = D8[:, 4i..4i+3] * D4^T with D8, D4 the orthonormal DCT matrices.
+  for (int i = 0; i < 2; i++) {
+    for (int k = 0; k < 8; k++) {
+      for (int j = 0; j < 4; j++) {
+        float sum = 0;
+        for (int t = 0; t < 4; t++) {
+          sum += dct_basis(8, k, 4 * i + t) * dct_basis(4, j, t);
+        }
+        x->half[i][k][j] = sum;
+      }
+    }
+  }
+}
+
+void jpeg_xform_free(jpeg_xform_t *x) {
+  free(x->mcu_pos);
+  free(x->rows);
+  x->mcu_pos = NULL;
+  x->mcu_pos_cap = 0;
+  x->rows = NULL;
+  x->rows_cap = 0;
+}
+
+bool jpeg_orient_parse(const char *s, jpeg_orient_t *orient) {
+  for (int i = JPEG_ORIENT_HFLIP; i <= JPEG_ORIENT_ROT270; i++) {
+    if (!strcmp(s, orient_names[i])) {
+      *orient = (jpeg_orient_t)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *jpeg_orient_name(jpeg_orient_t orient) {
+  return orient_names[orient];
+}
+
+static void build_encoders(jpeg_xform_t *x) {
+  for (int t = 0; t < 2; t++) {
+    jpeg_huff_enc_build(&x->dc_enc[t], &x->info.dc[t]);
+    jpeg_huff_enc_build(&x->ac_enc[t], &x->info.ac[t]);
+  }
+}
+
+size_t jpeg_crop(jpeg_xform_t *x, const uint8_t *jpg, size_t len, const jpeg_rect_t *roi, uint8_t *out, size_t cap) {
+  jpeg_info_t *info = &x->info;
+  if (!jpeg_parse(jpg, len, info) || roi->x >= info->width || roi->y >= info->height) {
+    return 0;
+  }
+  uint16_t mcu_w = 8 * info->hmax;
+  uint16_t mcu_h = 8 * info->vmax;
+  uint32_t right = (uint32_t)roi->x + roi->w < info->width ? roi->x + roi->w : info->width;
+  uint32_t bottom = (uint32_t)roi->y + roi->h < info->height ? roi->y + roi->h : info->height;
+  uint16_t mx0 = roi->x / mcu_w;
+  uint16_t my0 = roi->y / mcu_h;
+  uint16_t mx1 = (right + mcu_w - 1) / mcu_w;
+  uint16_t my1 = (bottom + mcu_h - 1) / mcu_h;
+  uint32_t out_right = (uint32_t)mx1 * mcu_w < info->width ? mx1 * mcu_w : info->width;
+  uint32_t out_bottom = (uint32_t)my1 * mcu_h < info->height ? my1 * mcu_h : info->height;
+
+  size_t hlen = jpeg_write_header(out, cap, info, out_right - mx0 * mcu_w, out_bottom - my0 * mcu_h, false);
+  if (!hlen) {
+    return 0;
+  }
+  build_encoders(x);
+
+  jpeg_bit_writer_t w;
+  jpeg_bw_init(&w, out + hlen, cap - hlen);
+  jpeg_scan_reader_t r;
+  jpeg_scan_begin(&r, info);
+  int16_t dc[JPEG_MAX_MCU_BLOCKS];
+  int16_t pred[JPEG_MAX_COMPONENTS] = {0, 0, 0};
+
+  for (uint16_t my = 0; my < my1; my++) {
+    for (uint16_t mx = 0; mx < info->mcus_x; mx++) {
+      bool keep = my >= my0 && mx >= mx0 && mx < mx1;
+      if (!jpeg_scan_mcu(&r, keep ? x->blocks : NULL, dc)) {
+        return 0;
+      }
+      if (!keep) {
+        continue;
+      }
+      int b = 0;
+      for (int c = 0; c < info->ncomp; c++) {
+        const jpeg_component_t *comp = &info->comp[c];
+        for (int i = 0; i < comp->h * comp->v; i++, b++) {
+          if (!jpeg_encode_block(&w, x->blocks[b], dc[b] - pred[c], &x->dc_enc[comp->td], &x->ac_enc[comp->ta])) {
+            return 0;
+          }
+          pred[c] = dc[b];
+        }
+      }
+      if (w.overflow) {
+        return 0;
+      }
+    }
+  }
+  size_t slen = jpeg_bw_finish(&w);
+  return slen ? hlen + slen : 0;
+}
+
+size_t jpeg_orient(jpeg_xform_t *x, const uint8_t *jpg, size_t len, jpeg_orient_t orient, uint8_t *out, size_t cap) {
+  jpeg_info_t *info = &x->info;
+  if (orient == JPEG_ORIENT_NONE || !jpeg_parse(jpg, len, info)) {
+    return 0;
+  }
+  // Every orientation is an optional transpose followed by output flips.
+  bool transpose = orient == JPEG_ORIENT_ROT90 || orient == JPEG_ORIENT_ROT270;
+  bool hflip = orient == JPEG_ORIENT_HFLIP || orient == JPEG_ORIENT_ROT90 || orient == JPEG_ORIENT_ROT180;
+  bool vflip = orient == JPEG_ORIENT_VFLIP || orient == JPEG_ORIENT_ROT270 || orient == JPEG_ORIENT_ROT180;
+  bool mirror_sx = transpose ? vflip : hflip;  // source axes that get reversed
+  bool mirror_sy = transpose ? hflip : vflip;
+
+  uint16_t mcu_w = 8 * info->hmax;
+  uint16_t mcu_h = 8 * info->vmax;
+  uint16_t src_mx = mirror_sx ? info->width / mcu_w : info->mcus_x;
+  uint16_t src_my = mirror_sy ? info->height / mcu_h : info->mcus_y;
+  uint16_t src_w = mirror_sx ? src_mx * mcu_w : info->width;
+  uint16_t src_h = mirror_sy ? src_my * mcu_h : info->height;
+  if (!src_mx || !src_my) {
+    return 0;
+  }
+
+  // Pass 1: checkpoint the reader at each MCU that will be kept.
+  uint32_t mcus = (uint32_t)info->mcus_x * src_my;
+  if (x->mcu_pos_cap < mcus) {
+    free(x->mcu_pos);
+    x->mcu_pos = (jpeg_scan_pos_t *)malloc(mcus * sizeof(jpeg_scan_pos_t));
+    x->mcu_pos_cap = x->mcu_pos ? mcus : 0;
+    if (!x->mcu_pos) {
+      return 0;
+    }
+  }
+  jpeg_scan_reader_t r;
+  int16_t dc[JPEG_MAX_MCU_BLOCKS];
+  jpeg_scan_begin(&r, info);
+  for (uint32_t m = 0; m < mcus; m++) {
+    jpeg_scan_tell(&r, &x->mcu_pos[m]);
+    if (!jpeg_scan_mcu(&r, NULL, dc)) {
+      return 0;
+    }
+  }
+
+  // Output coefficient k (zigzag) comes from source coefficient src_k[k].
+  uint8_t src_k[64];
+  bool negate[64];
+  for (int k = 0; k < 64; k++) {
+    int n = jpeg_zigzag[k];
+    int row = n >> 3, col = n & 7;
+    negate[k] = ((hflip && (col & 1)) != (vflip && (row & 1)));
+    src_k[k] = jpeg_unzigzag[transpose ? col * 8 + row : n];
+  }
+
+  size_t hlen = jpeg_write_header(out, cap, info, transpose ? src_h : src_w, transpose ? src_w : src_h, transpose);
+  if (!hlen) {
+    return 0;
+  }
+  build_encoders(x);
+
+  jpeg_bit_writer_t w;
+  jpeg_bw_init(&w, out + hlen, cap - hlen);
+  uint16_t out_mx = transpose ? src_my : src_mx;
+  uint16_t out_my = transpose ? src_mx : src_my;
+  int16_t pred[JPEG_MAX_COMPONENTS] = {0, 0, 0};
+  int16_t coef[64];
+
+  // Pass 2: decode source MCUs in output order and re-emit them.
+  for (uint16_t oy = 0; oy < out_my; oy++) {
+    for (uint16_t ox = 0; ox < out_mx; ox++) {
+      uint16_t fx = hflip ? out_mx - 1 - ox : ox;
+      uint16_t fy = vflip ? out_my - 1 - oy : oy;
+      uint16_t sx = transpose ? fy : fx;
+      uint16_t sy = transpose ? fx : fy;
+      uint32_t m = (uint32_t)sy * info->mcus_x + sx;
+      jpeg_scan_seek(&r, &x->mcu_pos[m], m);
+      if (!jpeg_scan_mcu(&r, x->blocks, dc)) {
+        return 0;
+      }
+
+      int base = 0;
+      for (int c = 0; c < info->ncomp; c++) {
+        const jpeg_component_t *comp = &info->comp[c];
+        int oh = transpose ? comp->v : comp->h;
+        int ov = transpose ? comp->h : comp->v;
+        for (int j = 0; j < ov; j++) {
+          for (int i = 0; i < oh; i++) {
+            // Same inverse mapping as for MCUs, inside the MCU.
+            int bi = hflip ? oh - 1 - i : i;
+            int bj = vflip ? ov - 1 - j : j;
+            int si = transpose ? bj : bi;
+            int sj = transpose ? bi : bj;
+            const int16_t *src = x->blocks[base + sj * comp->h + si];
+            for (int k = 1; k < 64; k++) {
+              coef[k] = negate[k] ? -src[src_k[k]] : src[src_k[k]];
+            }
+            if (!jpeg_encode_block(&w, coef, src[0] - pred[c], &x->dc_enc[comp->td], &x->ac_enc[comp->ta])) {
+              return 0;
+            }
+            pred[c] = src[0];
+          }
+        }
+        base += comp->h * comp->v;
+      }
+      if (w.overflow) {
+        return 0;
+      }
+    }
+  }
+  size_t slen = jpeg_bw_finish(&w);
+  return slen ? hlen + slen : 0;
+}
+
+/* Builds one output block (zigzag, quantised) from four source blocks. */
+static void downscale_block(const jpeg_xform_t *x, const int16_t *const src[2][2], const uint8_t *qt, int16_t *coef) {
+  float f[8][8];
+  memset(f, 0, sizeof(f));
+  for (int i = 0; i < 2; i++) {
+    for (int j = 0; j < 2; j++) {
+      float b[4][4];
+      for (int v = 0; v < 4; v++) {
+        for (int u = 0; u < 4; u++) {
+          int k = jpeg_unzigzag[v * 8 + u];
+          b[v][u] = 0.5f * src[i][j][k] * qt[k];
+        }
+      }
+      // f += half[i] * b * half[j]^T
+      float t[8][4];
+      for (int r = 0; r < 8; r++) {
+        for (int c = 0; c < 4; c++) {
+          t[r][c] = x->half[i][r][0] * b[0][c] + x->half[i][r][1] * b[1][c] + x->half[i][r][2] * b[2][c] + x->half[i][r][3] * b[3][c];
+        }
+      }
+      for (int r = 0; r < 8; r++) {
+        for (int c = 0; c < 8; c++) {
+          f[r][c] += t[r][0] * x->half[j][c][0] + t[r][1] * x->half[j][c][1] + t[r][2] * x->half[j][c][2] + t[r][3] * x->half[j][c][3];
+        }
+      }
+    }
+  }
+  for (int k = 0; k < 64; k++) {
+    int n = jpeg_zigzag[k];
+    int q = lrintf(f[n >> 3][n & 7] / qt[k]);
+    int lim = k ? 1023 : 2047;
+    coef[k] = q > lim ? lim : q < -lim ? -lim : q;
+  }
+}
+
+size_t jpeg_downscale(jpeg_xform_t *x, const uint8_t *jpg, size_t len, uint8_t *out, size_t cap) {
+  jpeg_info_t *info = &x->info;
+  if (!jpeg_parse(jpg, len, info)) {
+    return 0;
+  }
+  uint16_t width = (info->width + 1) / 2;
+  uint16_t height = (info->height + 1) / 2;
+  uint16_t out_mx = (width + 8 * info->hmax - 1) / (8 * info->hmax);
+  uint16_t out_my = (height + 8 * info->vmax - 1) / (8 * info->vmax);
+  size_t row_blocks = (size_t)info->mcus_x * info->mcu_blocks;
+  if (x->rows_cap < 2 * row_blocks) {
+    free(x->rows);
+    x->rows = (int16_t *)malloc(2 * row_blocks * 64 * sizeof(int16_t));
+    x->rows_cap = x->rows ? 2 * row_blocks : 0;
+    if (!x->rows) {
+      return 0;
+    }
+  }
+
+  size_t hlen = jpeg_write_header(out, cap, info, width, height, false);
+  if (!hlen) {
+    return 0;
+  }
+  build_encoders(x);
+
+  jpeg_bit_writer_t w;
+  jpeg_bw_init(&w, out + hlen, cap - hlen);
+  jpeg_scan_reader_t r;
+  jpeg_scan_begin(&r, info);
+  int16_t dc[JPEG_MAX_MCU_BLOCKS];
+  int16_t pred[JPEG_MAX_COMPONENTS] = {0, 0, 0};
+  int16_t coef[64];
+
+  for (uint16_t omy = 0; omy < out_my; omy++) {
+    // Decode source MCU rows 2*omy and 2*omy+1; a missing last row repeats.
+    int rows = 0;
+    for (int sr = 0; sr < 2 && 2 * omy + sr < info->mcus_y; sr++, rows++) {
+      int16_t(*dst)[64] = (int16_t(*)[64])(x->rows + sr * row_blocks * 64);
+      for (uint16_t mx = 0; mx < info->mcus_x; mx++) {
+        if (!jpeg_scan_mcu(&r, dst + mx * info->mcu_blocks, dc)) {
+          return 0;
+        }
+      }
+    }
+
+    for (uint16_t omx = 0; omx < out_mx; omx++) {
+      int base = 0;
+      for (int c = 0; c < info->ncomp; c++) {
+        const jpeg_component_t *comp = &info->comp[c];
+        for (int j = 0; j < comp->v; j++) {
+          for (int i = 0; i < comp->h; i++) {
+            const int16_t *src[2][2];
+            for (int dy = 0; dy < 2; dy++) {
+              for (int dx = 0; dx < 2; dx++) {
+                int sbx = 2 * (omx * comp->h + i) + dx;  // source block column in the component grid
+                int sby = 2 * j + dy;                    // source block row within the buffered rows
+                sbx = sbx < comp->bw ? sbx : comp->bw - 1;
+                sby = sby < rows * comp->v ? sby : rows * comp->v - 1;
+                size_t blk = ((size_t)(sby / comp->v) * info->mcus_x + sbx / comp->h) * info->mcu_blocks + base + (sby % comp->v) * comp->h + sbx % comp->h;
+                src[dy][dx] = x->rows + blk * 64;
+              }
+            }
+            downscale_block(x, src, info->qt[comp->tq], coef);
+            if (!jpeg_encode_block(&w, coef, coef[0] - pred[c], &x->dc_enc[comp->td], &x->ac_enc[comp->ta])) {
+              return 0;
+            }
+            pred[c] = coef[0];
+          }
+        }
+        base += comp->h * comp->v;
+      }
+      if (w.overflow) {
+        return 0;
+      }
+    }
+  }
+  size_t slen = jpeg_bw_finish(&w);
+  return slen ? hlen + slen : 0;
+}
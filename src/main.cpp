@@ -10,10 +10,20 @@
 #include <Arduino.h>
 #include "esp_camera.h"
 #include <WiFi.h>
-#include <DNSServer.h>
 #include "SD_MMC.h"
 #include "SPIFFS.h"
 #include "board_config.h"
+#include "captive_dns.h"
+#include "sta_link.h"
+#include "rtsp_server.h"
+#include "mcast_stream.h"
+#include "power_gov.h"
+#include "dlog.h"
+#include "capture.h"
+#include "mem_gov.h"
+#include "recorder.h"
+#include "recordings.h"
+#include "profiles.h"
 
 #ifdef __has_include
 #if __has_include("wifi_config.h")
@@ -34,8 +44,8 @@
 #define STA_CONNECT_TIMEOUT_MS 15000
 #define AP_CHANNEL 1
 #define AP_MAX_CONN 4
-#define RECONNECT_INTERVAL_MS 30000
 #define DNS_PORT 53
+#define RTSP_PORT 554
 
 static const IPAddress AP_IP(4, 3, 2, 1);
 static const IPAddress AP_GATEWAY(4, 3, 2, 1);
@@ -45,8 +55,6 @@ void startCameraServer();
 void setupLedFlash();
 
 static camera_config_t cam_cfg;
-static bool sta_configured = false;
-static DNSServer dnsServer;
 
 static const char *camera_model_name() {
 #if defined(CAMERA_MODEL_WROVER_KIT)
@@ -153,7 +161,6 @@ static void init_wifi() {
   WiFi.disconnect();
   delay(100);
   WiFi.mode(WIFI_AP_STA);
-  WiFi.setSleep(false);
 
   WiFi.softAPConfig(AP_IP, AP_GATEWAY, AP_SUBNET);
 
@@ -165,7 +172,9 @@ static void init_wifi() {
   WiFi.softAP(ap_ssid, AP_PASSWORD, AP_CHANNEL, 0, AP_MAX_CONN);
   delay(100);
 
-  dnsServer.start(DNS_PORT, "*", AP_IP);
+  if (captive_dns_start(DNS_PORT, (uint32_t)AP_IP) != ESP_OK) {
+    Serial.println("[WiFi AP] Captive DNS failed to start");
+  }
 
   Serial.printf("\n[WiFi AP] SSID: '%s'  Pass: '%s'\n", ap_ssid, AP_PASSWORD);
   Serial.printf("[WiFi AP] IP:   %s\n", WiFi.softAPIP().toString().c_str());
@@ -173,22 +182,14 @@ static void init_wifi() {
 
   String ssid = WIFI_SSID;
   if (ssid.length() > 0 && ssid != "********") {
-    sta_configured = true;
-    Serial.printf("[WiFi STA] Connecting to '%s'", WIFI_SSID);
-    WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
-
-    unsigned long start = millis();
-    while (WiFi.status() != WL_CONNECTED && (millis() - start) < STA_CONNECT_TIMEOUT_MS) {
-      delay(500);
-      Serial.print(".");
-    }
-    Serial.println();
+    Serial.printf("[WiFi STA] Connecting to '%s'\n", WIFI_SSID);
+    sta_link_begin(WIFI_SSID, WIFI_PASSWORD);
 
-    if (WiFi.status() == WL_CONNECTED) {
+    if (sta_link_wait_up(STA_CONNECT_TIMEOUT_MS)) {
       Serial.printf("[WiFi STA] Connected! IP: %s\n", WiFi.localIP().toString().c_str());
       Serial.printf("[WiFi STA] RSSI: %d dBm\n", WiFi.RSSI());
     } else {
-      Serial.println("[WiFi STA] Connection failed - AP only for now");
+      Serial.println("[WiFi STA] Not connected yet - retrying in background");
     }
   } else {
     Serial.println("[WiFi STA] No SSID configured - AP-only mode");
@@ -231,6 +232,11 @@ void setup() {
   Serial.begin(115200);
   Serial.setDebugOutput(true);
   Serial.println("[Serial] Baud=115200");
+  // Hot-path logging goes through the deferred logger; the SPIFFS sink is
+  // opt-in via /logs?spiffs=1.
+  if (dlog_init(DLOG_SINK_SERIAL | DLOG_SINK_MEMORY) != ESP_OK) {
+    Serial.println("[Log] Deferred logger failed to start");
+  }
   delay(500);
 
   print_board_info();
@@ -241,12 +247,11 @@ void setup() {
   esp_err_t err = ESP_FAIL;
   bool camera_ok = false;
 
-  static const int xclk_options[] = { 10000000, 20000000, 16000000 };
-  for (int attempt = 0; attempt < 3 && !camera_ok; attempt++) {
-    cam_cfg.xclk_freq_hz = xclk_options[attempt];
+  for (int attempt = 0; attempt < CAPTURE_XCLK_COUNT && !camera_ok; attempt++) {
+    cam_cfg.xclk_freq_hz = capture_xclk_hz[attempt];
     if (attempt > 0) {
-      Serial.printf("[Camera] Retry %d/3 – trying XCLK %d MHz...\n",
-                    attempt + 1, cam_cfg.xclk_freq_hz / 1000000);
+      Serial.printf("[Camera] Retry %d/%d – trying XCLK %d MHz...\n",
+                    attempt + 1, CAPTURE_XCLK_COUNT, cam_cfg.xclk_freq_hz / 1000000);
       delay(1000);
     } else {
       Serial.printf("  XCLK: %d MHz\n", cam_cfg.xclk_freq_hz / 1000000);
@@ -260,6 +265,9 @@ void setup() {
   }
 
   if (camera_ok) {
+    if (capture_init(&cam_cfg) != ESP_OK) {
+      Serial.println("[Camera] Capture supervisor failed to start");
+    }
     sensor_t *s = esp_camera_sensor_get();
     if (s) {
       Serial.printf("\n[Camera OK] PID=0x%02X VER=0x%02X MIDH=0x%02X MIDL=0x%02X\n",
@@ -280,11 +288,33 @@ void setup() {
 
   // Bring network and storage up after camera probe.
   init_wifi();
-  init_sdcard();
-  init_spiffs();
+  bool sd_ok = init_sdcard();
+  bool spiffs_ok = init_spiffs();
+  if (spiffs_ok && profiles_init() != ESP_OK) {
+    Serial.println("[Profiles] Failed to load");
+  }
 
   setupLedFlash();
   startCameraServer();
+  if (camera_ok && rtsp_server_start(RTSP_PORT) != ESP_OK) {
+    Serial.println("[RTSP] Failed to start");
+  }
+  if (camera_ok && mcast_stream_init() != ESP_OK) {
+    Serial.println("[Multicast] Failed to start");
+  }
+  if (sd_ok && recorder_init() != ESP_OK) {
+    Serial.println("[Recorder] Failed to start");
+  }
+  if (sd_ok && recordings_init() != ESP_OK) {
+    Serial.println("[Recordings] Download worker failed to start");
+  }
+  // Modem sleep and CPU clock are the governor's from here on.
+  if (power_gov_init() != ESP_OK) {
+    Serial.println("[Power] Governor failed to start");
+  }
+  if (mem_gov_init() != ESP_OK) {
+    Serial.println("[Memory] Governor failed to start");
+  }
 
   Serial.println("\n============================================");
   Serial.println("         NohJEye Server Ready");
@@ -292,10 +322,12 @@ void setup() {
   Serial.println("  AP:     http://4.3.2.1  (captive portal)");
   if (WiFi.status() == WL_CONNECTED)
     Serial.printf("  STA:    http://%s\n", WiFi.localIP().toString().c_str());
-  if (camera_ok)
+  if (camera_ok) {
     Serial.println("  Stream: :81/stream");
-  else
+    Serial.printf("  RTSP:   rtsp://4.3.2.1:%d/\n", RTSP_PORT);
+  } else {
     Serial.println("  Camera: OFFLINE - check wiring / PSRAM");
+  }
   Serial.println("  Info:   /info");
   Serial.println("============================================\n");
 
@@ -304,16 +336,6 @@ void setup() {
 }
 
 void loop() {
-  dnsServer.processNextRequest();
-
-  static unsigned long lastCheck = 0;
-  unsigned long now = millis();
-  if (sta_configured && (now - lastCheck > RECONNECT_INTERVAL_MS)) {
-    lastCheck = now;
-    if (WiFi.status() != WL_CONNECTED) {
-      Serial.println("[WiFi STA] Reconnecting...");
-      WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
-    }
-  }
-  delay(10);
+  // DNS and STA recovery are event driven; nothing left to poll.
+  vTaskDelay(portMAX_DELAY);
 }
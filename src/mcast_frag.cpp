@@ -0,0 +1,39 @@
+/**
+ * Multicast frame datagrams: header and payload split.
+ */
+#include "mcast_frag.h"
+#include <string.h>
+
+static inline void wr16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v & 0xFF;
+}
+
+static inline void wr32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = (v >> 16) & 0xFF;
+  p[2] = (v >> 8) & 0xFF;
+  p[3] = v & 0xFF;
+}
+
+uint16_t mcast_frag_count(size_t len, uint16_t payload) {
+  return (len + payload - 1) / payload;
+}
+
+size_t mcast_frag_build(uint8_t *pkt, const uint8_t *frame, size_t len, uint32_t frame_id, uint32_t ts_ms, uint16_t payload, uint16_t index) {
+  uint16_t count = mcast_frag_count(len, payload);
+  uint32_t off = (uint32_t)index * payload;
+  size_t n = len - off < payload ? len - off : payload;
+
+  wr16(pkt, MCAST_MAGIC);
+  pkt[2] = MCAST_VERSION;
+  pkt[3] = index + 1 == count ? MCAST_FLAG_LAST : 0;
+  wr32(pkt + 4, frame_id);
+  wr16(pkt + 8, index);
+  wr16(pkt + 10, count);
+  wr32(pkt + 12, len);
+  wr32(pkt + 16, off);
+  wr32(pkt + 20, ts_ms);
+  memcpy(pkt + MCAST_HEADER_LEN, frame + off, n);
+  return MCAST_HEADER_LEN + n;
+}
@@ -0,0 +1,206 @@
+/**
+ * Multicast sender task.
+ *
+ * Idle (blocked on a task notification) until enabled. While enabled and the
+ * STA link is up it grabs a frame, sends it as fragments to the group and
+ * returns the buffer. The outgoing interface is pinned to the STA address so
+ * the AP side never carries the group traffic.
+ */
+#include "mcast_stream.h"
+#include <Arduino.h>
+#include "lwip/sockets.h"
+#include "esp_camera.h"
+#include "capture.h"
+#include "power_gov.h"
+#include "esp_timer.h"
+#include "sta_link.h"
+
+#define MCAST_TASK_STACK   4096
+#define MCAST_TASK_PRIO    5
+#define MCAST_MAX_PAYLOAD  1448
+#define MCAST_MIN_PAYLOAD  256
+#define MCAST_SEND_RETRIES 3
+
+typedef struct {
+  uint32_t frames;
+  uint32_t datagrams;
+  uint64_t bytes;
+  uint32_t dropped;      // datagrams lost to full TX buffers
+  uint32_t send_errors;
+  uint32_t last_frame_us;
+} mcast_stats_t;
+
+static mcast_config_t cfg = {
+  .enabled = false,
+  .group = 0,
+  .port = 5004,
+  .ttl = 1,
+  .max_fps = 0,
+  .payload = 1400 - MCAST_HEADER_LEN,
+};
+static mcast_stats_t stats;
+static portMUX_TYPE mcast_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t mcast_task_handle = NULL;
+
+static int send_datagram(int sock, const uint8_t *buf, size_t len, const struct sockaddr_in *dest) {
+  for (int i = 0; i < MCAST_SEND_RETRIES; i++) {
+    if (sendto(sock, buf, len, 0, (const struct sockaddr *)dest, sizeof(*dest)) >= 0) {
+      return 0;
+    }
+    if (errno != ENOMEM && errno != EAGAIN) {
+      return -1;
+    }
+    vTaskDelay(1);  // let the WiFi driver drain its TX queue
+  }
+  return 1;
+}
+
+static void send_frame(int sock, const mcast_config_t *c, camera_fb_t *fb, uint32_t frame_id) {
+  static uint8_t pkt[MCAST_HEADER_LEN + MCAST_MAX_PAYLOAD];
+  struct sockaddr_in dest;
+  memset(&dest, 0, sizeof(dest));
+  dest.sin_family = AF_INET;
+  dest.sin_port = htons(c->port);
+  dest.sin_addr.s_addr = c->group;
+
+  uint16_t count = mcast_frag_count(fb->len, c->payload);
+  uint32_t ts_ms = fb->timestamp.tv_sec * 1000 + fb->timestamp.tv_usec / 1000;
+  uint32_t sent = 0, dropped = 0, errors = 0;
+
+  for (uint16_t i = 0; i < count; i++) {
+    size_t n = mcast_frag_build(pkt, fb->buf, fb->len, frame_id, ts_ms, c->payload, i);
+    int r = send_datagram(sock, pkt, n, &dest);
+    if (r == 0) {
+      sent++;
+    } else if (r > 0) {
+      dropped++;
+    } else {
+      errors++;
+    }
+  }
+
+  portENTER_CRITICAL(&mcast_lock);
+  stats.frames++;
+  stats.datagrams += sent;
+  stats.bytes += fb->len;
+  stats.dropped += dropped;
+  stats.send_errors += errors;
+  portEXIT_CRITICAL(&mcast_lock);
+}
+
+static void mcast_task(void *arg) {
+  int sock = -1;
+  uint32_t if_ip = 0;
+  uint8_t ttl = 0;      // set on sock
+  uint32_t frame_id = 0;
+  bool powered = false;
+
+  while (true) {
+    mcast_config_t c;
+    mcast_stream_get_config(&c);
+    if (c.enabled != powered) {
+      powered = c.enabled;
+      if (powered) {
+        power_gov_acquire();
+      } else {
+        power_gov_release();
+      }
+    }
+    if (!c.enabled) {
+      if (sock >= 0) {
+        close(sock);
+        sock = -1;
+      }
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      continue;
+    }
+    if (!sta_link_wait_up(1000)) {
+      continue;
+    }
+
+    uint32_t ip = sta_link_ip();
+    if (sock < 0 || ip != if_ip || c.ttl != ttl) {
+      if (sock < 0) {
+        sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if_ip = 0;
+        ttl = 0;
+      }
+      struct in_addr iface;
+      iface.s_addr = ip;
+      if (sock < 0 || (ip != if_ip && setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface)) != 0)
+          || (c.ttl != ttl && setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &c.ttl, sizeof(c.ttl)) != 0)) {
+        log_e("Multicast socket setup failed: %d", errno);
+        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        continue;
+      }
+      if_ip = ip;
+      ttl = c.ttl;  // /multicast?ttl= applies from the next frame
+    }
+
+    int64_t start = esp_timer_get_time();
+    camera_fb_t *fb = capture_fb_get();
+    if (!fb) {
+      vTaskDelay(50 / portTICK_PERIOD_MS);
+      continue;
+    }
+    send_frame(sock, &c, fb, frame_id++);
+    capture_fb_return(fb);
+
+    int64_t elapsed = esp_timer_get_time() - start;
+    stats.last_frame_us = (uint32_t)elapsed;
+    if (c.max_fps && elapsed < 1000000 / c.max_fps) {
+      vTaskDelay(pdMS_TO_TICKS((1000000 / c.max_fps - elapsed) / 1000));
+    }
+  }
+}
+
+esp_err_t mcast_stream_init() {
+  if (mcast_task_handle) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  cfg.group = inet_addr("239.255.42.1");
+  if (xTaskCreatePinnedToCore(mcast_task, "mcast", MCAST_TASK_STACK, NULL, MCAST_TASK_PRIO, &mcast_task_handle, tskNO_AFFINITY) != pdPASS) {
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+void mcast_stream_get_config(mcast_config_t *config) {
+  portENTER_CRITICAL(&mcast_lock);
+  *config = cfg;
+  portEXIT_CRITICAL(&mcast_lock);
+}
+
+esp_err_t mcast_stream_set_config(const mcast_config_t *config) {
+  uint8_t first_octet = ntohl(config->group) >> 24;
+  if (first_octet < 224 || first_octet > 239 || !config->port || !config->ttl || config->payload < MCAST_MIN_PAYLOAD
+      || config->payload > MCAST_MAX_PAYLOAD) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  portENTER_CRITICAL(&mcast_lock);
+  cfg = *config;
+  portEXIT_CRITICAL(&mcast_lock);
+  if (mcast_task_handle) {
+    xTaskNotifyGive(mcast_task_handle);
+  }
+  return ESP_OK;
+}
+
+int mcast_stream_stats_json(char *buf, size_t len) {
+  mcast_config_t c;
+  mcast_stream_get_config(&c);
+  portENTER_CRITICAL(&mcast_lock);
+  mcast_stats_t s = stats;
+  portEXIT_CRITICAL(&mcast_lock);
+
+  char group[16];
+  struct in_addr addr;
+  addr.s_addr = c.group;
+  inet_ntop(AF_INET, &addr, group, sizeof(group));
+  return snprintf(
+    buf, len,
+    "{\"enabled\":%s,\"group\":\"%s\",\"port\":%u,\"ttl\":%u,\"max_fps\":%u,\"payload\":%u,\"frames\":%u,\"datagrams\":%u,\"bytes\":%llu,"
+    "\"dropped\":%u,\"send_errors\":%u,\"frame_us\":%u}",
+    c.enabled ? "true" : "false", group, c.port, c.ttl, c.max_fps, c.payload, s.frames, s.datagrams, s.bytes, s.dropped, s.send_errors, s.last_frame_us
+  );
+}
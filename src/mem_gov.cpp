@@ -0,0 +1,274 @@
+/**
+ * Memory governor sampling task.
+ *
+ * Stepping down to SHALLOW_RING frees a frame buffer, which alone can lift
+ * the heap back over the recovery margin; stepping up again re-allocates it.
+ * To keep that from cycling, every degradation that follows a recovery
+ * within MEM_GOV_FLAP_MS doubles the recovery delay, up to
+ * MEM_GOV_RECOVER_MAX_MS, and a quiet period resets it.
+ */
+#include "mem_gov.h"
+#include <Arduino.h>
+#include "esp_camera.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "capture.h"
+#include "substream.h"
+
+#define MEM_GOV_TASK_STACK     3072
+#define MEM_GOV_TASK_PRIO      1
+#define MEM_GOV_FLAP_MS        60000
+#define MEM_GOV_RECOVER_MAX_MS 160000
+
+typedef enum {
+  HEAP_INTERNAL,
+  HEAP_PSRAM,
+  HEAPS,
+} heap_id_t;
+
+static const char *heap_names[HEAPS] = {"internal", "psram"};
+static const uint32_t heap_caps[HEAPS] = {MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT};
+static const char *level_names[MEM_GOV_LEVELS] = {"normal", "no_bmp", "few_substreams", "shallow_ring"};
+
+typedef struct {
+  uint32_t free;
+  uint32_t largest;
+  uint32_t min_free;      // low water since boot, from the allocator
+  uint32_t min_largest;   // low water of our samples
+  uint8_t frag_pct;       // share of the free memory outside the largest block
+  uint8_t max_frag_pct;
+} heap_sample_t;
+
+typedef struct {
+  mem_gov_level_t level;
+  int64_t level_since_us;
+  heap_sample_t heaps[HEAPS];
+  bool has_psram;
+  uint32_t bmp_need;           // bytes frame2bmp needs at the current frame size
+  uint32_t entered[MEM_GOV_LEVELS];
+  uint32_t recoveries;
+  uint32_t denied_bmp;
+  uint32_t denied_substream;
+  uint32_t ooms;
+  uint32_t ring_errors;
+  uint32_t recover_ms;
+  int64_t last_recovery_us;
+} mem_gov_t;
+
+static mem_gov_t gov;
+static portMUX_TYPE gov_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t gov_task_handle = NULL;
+static size_t boot_fb_count;
+
+static void sample() {
+  heap_sample_t cur[HEAPS];
+  for (int i = 0; i < HEAPS; i++) {
+    cur[i].free = heap_caps_get_free_size(heap_caps[i]);
+    cur[i].largest = heap_caps_get_largest_free_block(heap_caps[i]);
+    cur[i].min_free = heap_caps_get_minimum_free_size(heap_caps[i]);
+    cur[i].frag_pct = cur[i].free ? 100 - (uint8_t)((uint64_t)cur[i].largest * 100 / cur[i].free) : 0;
+  }
+  sensor_t *s = esp_camera_sensor_get();
+  uint32_t bmp_need = 0;
+  if (s && s->status.framesize < FRAMESIZE_INVALID) {
+    const resolution_info_t *r = &resolution[s->status.framesize];
+    bmp_need = (uint32_t)r->width * r->height * 3 + 54;
+  }
+
+  portENTER_CRITICAL(&gov_lock);
+  for (int i = 0; i < HEAPS; i++) {
+    heap_sample_t *h = &gov.heaps[i];
+    cur[i].min_largest = h->min_largest && h->min_largest < cur[i].largest ? h->min_largest : cur[i].largest;
+    cur[i].max_frag_pct = h->max_frag_pct > cur[i].frag_pct ? h->max_frag_pct : cur[i].frag_pct;
+    *h = cur[i];
+  }
+  gov.bmp_need = bmp_need;
+  portEXIT_CRITICAL(&gov_lock);
+}
+
+static bool below(uint32_t largest, uint32_t threshold, uint32_t margin_pct) {
+  return (uint64_t)largest * 100 < (uint64_t)threshold * (100 + margin_pct);
+}
+
+/* The level the current sample calls for; margin_pct raises every threshold. */
+static mem_gov_level_t level_for(uint32_t margin_pct) {
+  portENTER_CRITICAL(&gov_lock);
+  uint32_t internal = gov.heaps[HEAP_INTERNAL].largest;
+  uint32_t psram = gov.has_psram ? gov.heaps[HEAP_PSRAM].largest : UINT32_MAX;
+  uint32_t bmp_need = gov.bmp_need;
+  portEXIT_CRITICAL(&gov_lock);
+
+  if (below(internal, MEM_GOV_INTERNAL_SHALLOW, margin_pct) || below(psram, MEM_GOV_PSRAM_SHALLOW, margin_pct)) {
+    return MEM_GOV_SHALLOW_RING;
+  }
+  if (below(internal, MEM_GOV_INTERNAL_FEW, margin_pct) || below(psram, MEM_GOV_PSRAM_FEW, margin_pct)) {
+    return MEM_GOV_FEW_SUBSTREAMS;
+  }
+  // frame2bmp takes PSRAM when there is any, internal memory otherwise.
+  uint32_t bmp_block = gov.has_psram ? psram : internal;
+  if (bmp_need && below(bmp_block, bmp_need, margin_pct)) {
+    return MEM_GOV_NO_BMP;
+  }
+  return MEM_GOV_NORMAL;
+}
+
+static uint8_t substream_limit(mem_gov_level_t level) {
+  return level >= MEM_GOV_SHALLOW_RING ? 0 : level >= MEM_GOV_FEW_SUBSTREAMS ? 1 : SUBSTREAM_COUNT;
+}
+
+/*
+ * Moves to level; false, with nothing changed, when capture is in the middle
+ * of a switch or recovery and the ring could not be resized yet.
+ */
+static bool set_level(mem_gov_level_t level) {
+  portENTER_CRITICAL(&gov_lock);
+  mem_gov_level_t prev = gov.level;
+  portEXIT_CRITICAL(&gov_lock);
+
+  bool shallow = level >= MEM_GOV_SHALLOW_RING;
+  if (shallow != (prev >= MEM_GOV_SHALLOW_RING) && boot_fb_count > 1) {
+    esp_err_t err = capture_set_fb_count(shallow ? 1 : boot_fb_count);
+    if (err == ESP_ERR_INVALID_STATE || err == ESP_ERR_TIMEOUT) {
+      return false;  // the next sample tries again
+    }
+    if (err != ESP_OK) {
+      portENTER_CRITICAL(&gov_lock);
+      gov.ring_errors++;
+      portEXIT_CRITICAL(&gov_lock);
+    }
+  }
+
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&gov_lock);
+  gov.level = level;
+  gov.level_since_us = now;
+  if (level > prev) {
+    gov.entered[level]++;
+    if (gov.last_recovery_us && now - gov.last_recovery_us < (int64_t)MEM_GOV_FLAP_MS * 1000) {
+      gov.recover_ms = gov.recover_ms * 2 < MEM_GOV_RECOVER_MAX_MS ? gov.recover_ms * 2 : MEM_GOV_RECOVER_MAX_MS;
+    }
+  } else {
+    gov.recoveries++;
+    gov.last_recovery_us = now;
+  }
+  portEXIT_CRITICAL(&gov_lock);
+
+  log_i("Memory level %s -> %s", level_names[prev], level_names[level]);
+  substream_set_limit(substream_limit(level));
+  return true;
+}
+
+static void gov_task(void *arg) {
+  int64_t clear_since = 0;
+
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(MEM_GOV_SAMPLE_MS));
+    sample();
+
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&gov_lock);
+    mem_gov_level_t level = gov.level;
+    uint32_t recover_ms = gov.recover_ms;
+    if (gov.last_recovery_us && now - gov.last_recovery_us > (int64_t)MEM_GOV_FLAP_MS * 1000 && level == MEM_GOV_NORMAL) {
+      gov.recover_ms = MEM_GOV_RECOVER_MS;
+    }
+    portEXIT_CRITICAL(&gov_lock);
+
+    if (level_for(0) > level) {
+      clear_since = 0;
+      set_level((mem_gov_level_t)(level + 1));
+    } else if (level_for(MEM_GOV_MARGIN_PCT) < level) {
+      if (!clear_since) {
+        clear_since = now;
+      } else if (now - clear_since >= (int64_t)recover_ms * 1000 && set_level((mem_gov_level_t)(level - 1))) {
+        clear_since = 0;  // the next step waits again
+      }
+    } else {
+      clear_since = 0;
+    }
+  }
+}
+
+esp_err_t mem_gov_init() {
+  if (gov_task_handle) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  boot_fb_count = capture_get_fb_count();
+  gov.has_psram = heap_caps_get_total_size(MALLOC_CAP_SPIRAM) > 0;
+  gov.level_since_us = esp_timer_get_time();
+  gov.recover_ms = MEM_GOV_RECOVER_MS;
+  sample();
+  if (xTaskCreatePinnedToCore(gov_task, "mem_gov", MEM_GOV_TASK_STACK, NULL, MEM_GOV_TASK_PRIO, &gov_task_handle, tskNO_AFFINITY) != pdPASS) {
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+mem_gov_level_t mem_gov_level() {
+  portENTER_CRITICAL(&gov_lock);
+  mem_gov_level_t level = gov.level;
+  portEXIT_CRITICAL(&gov_lock);
+  return level;
+}
+
+bool mem_gov_allow_bmp() {
+  portENTER_CRITICAL(&gov_lock);
+  bool allow = gov.level < MEM_GOV_NO_BMP;
+  if (!allow) {
+    gov.denied_bmp++;
+  }
+  portEXIT_CRITICAL(&gov_lock);
+  return allow;
+}
+
+bool mem_gov_allow_substream(uint8_t variant) {
+  portENTER_CRITICAL(&gov_lock);
+  bool allow = variant < substream_limit(gov.level);
+  if (!allow) {
+    gov.denied_substream++;
+  }
+  portEXIT_CRITICAL(&gov_lock);
+  return allow;
+}
+
+void mem_gov_report_oom() {
+  portENTER_CRITICAL(&gov_lock);
+  gov.ooms++;
+  portEXIT_CRITICAL(&gov_lock);
+  if (gov_task_handle) {
+    xTaskNotifyGive(gov_task_handle);
+  }
+}
+
+int mem_gov_stats_json(char *buf, size_t len) {
+  portENTER_CRITICAL(&gov_lock);
+  mem_gov_t g = gov;
+  portEXIT_CRITICAL(&gov_lock);
+
+  int n = snprintf(
+    buf, len,
+    "{\"level\":\"%s\",\"level_s\":%u,\"bmp_need\":%u,\"degradations\":{\"no_bmp\":%u,\"few_substreams\":%u,\"shallow_ring\":%u},"
+    "\"recoveries\":%u,\"recover_ms\":%u,\"denied_bmp\":%u,\"denied_substream\":%u,\"ooms\":%u,\"ring_errors\":%u",
+    level_names[g.level], (uint32_t)((esp_timer_get_time() - g.level_since_us) / 1000000), g.bmp_need, g.entered[MEM_GOV_NO_BMP],
+    g.entered[MEM_GOV_FEW_SUBSTREAMS], g.entered[MEM_GOV_SHALLOW_RING], g.recoveries, g.recover_ms, g.denied_bmp, g.denied_substream, g.ooms,
+    g.ring_errors
+  );
+  for (int i = 0; i < HEAPS && n < (int)len; i++) {
+    if (i == HEAP_PSRAM && !g.has_psram) {
+      continue;
+    }
+    const heap_sample_t *h = &g.heaps[i];
+    n += snprintf(
+      buf + n, len - n, ",\"%s\":{\"free\":%u,\"largest\":%u,\"min_free\":%u,\"min_largest\":%u,\"frag_pct\":%u,\"max_frag_pct\":%u}", heap_names[i], h->free,
+      h->largest, h->min_free, h->min_largest, h->frag_pct, h->max_frag_pct
+    );
+  }
+  if (n < (int)len) {
+    n += snprintf(buf + n, len - n, "}");
+  }
+  // Truncated: report only what is in buf, so a caller appending after it stays inside.
+  if (n >= (int)len) {
+    n = len ? len - 1 : 0;
+  }
+  return n;
+}
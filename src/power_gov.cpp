@@ -0,0 +1,268 @@
+/**
+ * Power governor state machine.
+ *
+ *   IDLE --acquire/kick--> ACTIVE --no sessions, linger expired--> IDLE
+ *
+ * Stepping up happens inline in acquire/kick; stepping down only from the
+ * periodic tick, so a burst of short requests does not flap the radio. With
+ * CONFIG_PM_ENABLE the CPU clock is left to esp_pm, and ACTIVE just holds a
+ * CPU_FREQ_MAX lock; without it the clock is set directly. Light sleep is
+ * never enabled: the AP has to keep answering beacons and the camera DMA
+ * keeps running. The sensor clock goes through capture, which serialises it
+ * with camera restarts and knows which XCLK to go back to.
+ */
+#include "power_gov.h"
+#include "dlog.h"
+#include <Arduino.h>
+#include <WiFi.h>
+#include "capture.h"
+#include "esp_timer.h"
+#ifdef CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
+
+#define POWER_GOV_TICK_MS  500
+#define FIRST_FRAME_COLD_US 1000000  // a stream that starts this soon after a wake counts as cold
+
+typedef enum {
+  POWER_IDLE,
+  POWER_ACTIVE,
+  POWER_STATES,
+} power_state_t;
+
+static const char *state_names[] = {"idle", "active"};
+
+typedef struct {
+  power_state_t state;
+  uint32_t sessions;
+  uint32_t activity_seq;       // bumped by every acquire/kick
+  int64_t last_activity_us;
+  int64_t state_since_us;
+  int64_t last_wake_us;
+  uint64_t time_in_us[POWER_STATES];
+  uint32_t transitions;
+  uint32_t wake_us_last;
+  uint32_t wake_us_max;
+  uint32_t wake_us_avg;
+  uint32_t cold_first_frames;
+  uint32_t cold_first_us_avg;
+  uint32_t cold_first_us_max;
+  uint32_t warm_first_frames;
+  uint32_t warm_first_us_avg;
+  uint32_t warm_first_us_max;
+} power_gov_t;
+
+static power_gov_t gov;
+static portMUX_TYPE gov_lock = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t switch_mutex = NULL;  // serialises the slow hardware changes
+static esp_timer_handle_t tick_timer = NULL;
+#ifdef CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t cpu_lock = NULL;
+#endif
+
+static void set_cpu_fast(bool fast) {
+#ifdef CONFIG_PM_ENABLE
+  if (cpu_lock) {
+    if (fast) {
+      esp_pm_lock_acquire(cpu_lock);
+    } else {
+      esp_pm_lock_release(cpu_lock);
+    }
+    return;
+  }
+#endif
+  setCpuFrequencyMhz(fast ? POWER_GOV_MAX_CPU_MHZ : POWER_GOV_IDLE_CPU_MHZ);
+}
+
+static void enter_state(power_state_t next, int64_t now) {
+  portENTER_CRITICAL(&gov_lock);
+  gov.time_in_us[gov.state] += now - gov.state_since_us;
+  gov.state = next;
+  gov.state_since_us = now;
+  gov.transitions++;
+  portEXIT_CRITICAL(&gov_lock);
+}
+
+/*
+ * Called with switch_mutex held. Without wait, returns false, having changed
+ * nothing, while capture is busy with a switch.
+ */
+static bool wake(bool wait) {
+  int64_t start = esp_timer_get_time();
+  if (capture_set_idle_xclk(0, wait) == ESP_ERR_TIMEOUT) {
+    return false;
+  }
+  set_cpu_fast(true);
+  WiFi.setSleep(false);
+  int64_t now = esp_timer_get_time();
+  uint32_t us = (uint32_t)(now - start);
+  enter_state(POWER_ACTIVE, now);
+
+  portENTER_CRITICAL(&gov_lock);
+  gov.last_wake_us = now;
+  gov.wake_us_last = us;
+  gov.wake_us_avg = gov.wake_us_avg ? (gov.wake_us_avg * 7 + us) / 8 : us;
+  if (us > gov.wake_us_max) {
+    gov.wake_us_max = us;
+  }
+  portEXIT_CRITICAL(&gov_lock);
+  dlog_i("Power: active (wake %u us)", us);
+  return true;
+}
+
+/* Called with switch_mutex held; false while capture is busy with a switch, to be retried. */
+static bool sleep_idle() {
+  if (capture_set_idle_xclk(POWER_GOV_IDLE_XCLK_MHZ, false) == ESP_ERR_TIMEOUT) {
+    return false;
+  }
+  WiFi.setSleep(true);
+  set_cpu_fast(false);
+  enter_state(POWER_IDLE, esp_timer_get_time());
+  dlog_i("Power: idle");
+  return true;
+}
+
+static void step_up() {
+  if (!switch_mutex) {
+    return;
+  }
+  xSemaphoreTake(switch_mutex, portMAX_DELAY);
+  if (gov.state != POWER_ACTIVE) {
+    wake(true);
+  }
+  xSemaphoreGive(switch_mutex);
+}
+
+static void tick_cb(void *arg) {
+  // Never block the esp_timer task; a busy mutex means a wake is in flight.
+  if (xSemaphoreTake(switch_mutex, 0) != pdTRUE) {
+    return;
+  }
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&gov_lock);
+  bool busy = gov.sessions || now - gov.last_activity_us <= (int64_t)POWER_GOV_LINGER_MS * 1000;
+  power_state_t st = gov.state;
+  uint32_t seq = gov.activity_seq;
+  portEXIT_CRITICAL(&gov_lock);
+  if (st == POWER_ACTIVE && !busy && sleep_idle()) {
+    // Activity that arrived mid-switch saw ACTIVE and did not step up itself.
+    portENTER_CRITICAL(&gov_lock);
+    bool missed = gov.activity_seq != seq;
+    portEXIT_CRITICAL(&gov_lock);
+    if (missed) {
+      wake(false);  // if capture is busy, a later tick retries
+    }
+  } else if (st == POWER_IDLE && busy) {
+    wake(false);
+  }
+  xSemaphoreGive(switch_mutex);
+}
+
+esp_err_t power_gov_init() {
+  if (switch_mutex) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  switch_mutex = xSemaphoreCreateMutex();
+  if (!switch_mutex) {
+    return ESP_ERR_NO_MEM;
+  }
+#ifdef CONFIG_PM_ENABLE
+  esp_pm_config_t pm = {
+    .max_freq_mhz = POWER_GOV_MAX_CPU_MHZ,
+    .min_freq_mhz = POWER_GOV_IDLE_CPU_MHZ,
+    .light_sleep_enable = false,
+  };
+  if (esp_pm_configure(&pm) != ESP_OK || esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "power_gov", &cpu_lock) != ESP_OK) {
+    log_e("esp_pm unavailable, setting the CPU clock directly");
+    cpu_lock = NULL;
+  }
+#endif
+
+  // Boot counts as activity: start ACTIVE and let the linger run out.
+  int64_t now = esp_timer_get_time();
+  gov.state = POWER_ACTIVE;
+  gov.state_since_us = now;
+  gov.last_activity_us = now;
+  set_cpu_fast(true);
+  WiFi.setSleep(false);
+
+  const esp_timer_create_args_t args = {
+    .callback = tick_cb,
+    .arg = NULL,
+    .dispatch_method = ESP_TIMER_TASK,
+    .name = "power_gov",
+    .skip_unhandled_events = true,
+  };
+  if (esp_timer_create(&args, &tick_timer) != ESP_OK) {
+    return ESP_ERR_NO_MEM;
+  }
+  return esp_timer_start_periodic(tick_timer, POWER_GOV_TICK_MS * 1000);
+}
+
+void power_gov_acquire() {
+  portENTER_CRITICAL(&gov_lock);
+  gov.sessions++;
+  gov.activity_seq++;
+  gov.last_activity_us = esp_timer_get_time();
+  bool idle = gov.state != POWER_ACTIVE;
+  portEXIT_CRITICAL(&gov_lock);
+  if (idle) {
+    step_up();
+  }
+}
+
+void power_gov_release() {
+  portENTER_CRITICAL(&gov_lock);
+  if (gov.sessions) {
+    gov.sessions--;
+  }
+  gov.last_activity_us = esp_timer_get_time();
+  portEXIT_CRITICAL(&gov_lock);
+}
+
+void power_gov_kick() {
+  portENTER_CRITICAL(&gov_lock);
+  gov.activity_seq++;
+  gov.last_activity_us = esp_timer_get_time();
+  bool idle = gov.state != POWER_ACTIVE;
+  portEXIT_CRITICAL(&gov_lock);
+  if (idle) {
+    step_up();
+  }
+}
+
+void power_gov_first_frame(uint32_t us) {
+  int64_t started = esp_timer_get_time() - us;
+  portENTER_CRITICAL(&gov_lock);
+  if (gov.last_wake_us && started - gov.last_wake_us < FIRST_FRAME_COLD_US) {
+    gov.cold_first_frames++;
+    gov.cold_first_us_avg = gov.cold_first_us_avg ? (gov.cold_first_us_avg * 7 + us) / 8 : us;
+    if (us > gov.cold_first_us_max) {
+      gov.cold_first_us_max = us;
+    }
+  } else {
+    gov.warm_first_frames++;
+    gov.warm_first_us_avg = gov.warm_first_us_avg ? (gov.warm_first_us_avg * 7 + us) / 8 : us;
+    if (us > gov.warm_first_us_max) {
+      gov.warm_first_us_max = us;
+    }
+  }
+  portEXIT_CRITICAL(&gov_lock);
+}
+
+int power_gov_stats_json(char *buf, size_t len) {
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&gov_lock);
+  power_gov_t g = gov;
+  portEXIT_CRITICAL(&gov_lock);
+  g.time_in_us[g.state] += now - g.state_since_us;
+  return snprintf(
+    buf, len,
+    "{\"state\":\"%s\",\"sessions\":%u,\"cpu_mhz\":%u,\"modem_sleep\":%s,\"idle_ms\":%llu,\"active_ms\":%llu,\"transitions\":%u,"
+    "\"wake_us_last\":%u,\"wake_us_avg\":%u,\"wake_us_max\":%u,"
+    "\"first_frame_cold\":{\"count\":%u,\"us_avg\":%u,\"us_max\":%u},\"first_frame_warm\":{\"count\":%u,\"us_avg\":%u,\"us_max\":%u}}",
+    state_names[g.state], g.sessions, getCpuFrequencyMhz(), g.state == POWER_IDLE ? "true" : "false", g.time_in_us[POWER_IDLE] / 1000,
+    g.time_in_us[POWER_ACTIVE] / 1000, g.transitions, g.wake_us_last, g.wake_us_avg, g.wake_us_max, g.cold_first_frames, g.cold_first_us_avg,
+    g.cold_first_us_max, g.warm_first_frames, g.warm_first_us_avg, g.warm_first_us_max
+  );
+}
@@ -0,0 +1,541 @@
+/**
+ * Sensor profile store and apply.
+ *
+ * Stored form, PROFILES_DIR/<name>: "SPRF", version, register count, sensor
+ * PID (16 bits), then per register its number (16 bits), mask and value;
+ * little endian.
+ *
+ * The shadow holds the last value known to be in each of the 512 banked
+ * registers. It is filled by the reads before an apply and by snapshots,
+ * updated by the applied writes and dropped on profiles_invalidate or a new
+ * capture_sensor_epoch. The gain, exposure and AWB gain registers are left
+ * out of the diff: while AGC, AEC or AWB runs, the sensor rewrites them every
+ * frame, so a profile's value for them is always written. Everything but
+ * the stats is used from the control server task only.
+ */
+#include "profiles.h"
+#include <Arduino.h>
+#include "SPIFFS.h"
+#include "esp_camera.h"
+#include "capture.h"
+#include "events.h"
+
+#define PROFILES_VERSION   1
+#define PROFILES_HEADER    8
+#define PROFILES_SOURCE_MAX (PROFILES_REGS_MAX * 2)   // lines before merging
+#define SHADOW_REGS        512
+#define REG_BANK_SEL       0xff
+#define REG_QS             0x044                      // DSP bank: JPEG quality, the rate controller's
+
+typedef struct {
+  char name[PROFILES_NAME_MAX];   // empty for a free slot
+  uint16_t pid;
+  uint8_t count;
+  profile_reg_t regs[PROFILES_REGS_MAX];
+} profile_t;
+
+typedef struct {
+  const profile_reg_t *regs[PROFILES_REGS_MAX];
+  uint16_t count;
+  uint16_t done;
+} batch_t;
+
+typedef struct {
+  uint32_t applies;
+  uint32_t unchanged;      // applies that found nothing to write
+  uint32_t failures;
+  uint32_t reads;
+  uint32_t writes;
+  uint32_t skipped;
+  uint32_t max_burst_us;
+  profile_result_t last;
+} profiles_stats_t;
+
+/*
+ * OV2640 tuning registers a snapshot takes: white balance and pixel
+ * correction in the DSP bank; exposure and gain control, AE targets, frame
+ * timing and banding in the sensor bank. COM8 comes first so a profile
+ * with manual exposure turns AEC off before it sets the exposure. The
+ * brightness, contrast and saturation controls sit behind the indirect
+ * SDE registers, which cannot be read back, and are not included.
+ */
+static const profile_reg_t snapshot_regs[] = {
+  {0x0c3, 0xff, 0},  // CTRL1: AWB, AWB gain, raw gamma, lens correction
+  {0x087, 0xc0, 0},  // CTRL3: BPC, WPC
+  {0x0c7, 0x40, 0},  // AWB manual
+  {0x0cc, 0xff, 0},  // AWB gains R, G, B
+  {0x0cd, 0xff, 0},
+  {0x0ce, 0xff, 0},
+  {0x113, 0xff, 0},  // COM8: banding filter, AGC, AEC
+  {0x100, 0xff, 0},  // GAIN
+  {0x114, 0xe0, 0},  // COM9: AGC gain ceiling
+  {0x104, 0x03, 0},  // REG04: AEC[1:0]
+  {0x110, 0xff, 0},  // AEC[9:2]
+  {0x145, 0x3f, 0},  // REG45: AEC[15:10]
+  {0x124, 0xff, 0},  // AEW, AEB, VV: AE targets
+  {0x125, 0xff, 0},
+  {0x126, 0xff, 0},
+  {0x111, 0xff, 0},  // CLKRC: frame rate divider
+  {0x12a, 0xff, 0},  // REG2A, FRARL: dummy pixels
+  {0x12b, 0xff, 0},
+  {0x12d, 0xff, 0},  // ADVFL, ADVFH: dummy lines
+  {0x12e, 0xff, 0},
+  {0x146, 0xff, 0},  // FLL, FLH: frame length
+  {0x147, 0xff, 0},
+  {0x10c, 0xff, 0},  // COM3: banding
+  {0x14f, 0xff, 0},  // BD50, BD60
+  {0x150, 0xff, 0},
+};
+
+static profile_t profiles[PROFILES_MAX];
+static uint8_t shadow[SHADOW_REGS];
+static uint32_t known[SHADOW_REGS / 32];
+static uint32_t shadow_epoch;
+static char active[PROFILES_NAME_MAX];
+static bool active_modified;     // registers were written by others since it was applied
+static profiles_stats_t stats;
+static portMUX_TYPE profiles_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static bool valid_name(const char *name) {
+  size_t n = strlen(name);
+  if (!n || n >= PROFILES_NAME_MAX) {
+    return false;
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (!isalnum((uint8_t)name[i]) && name[i] != '_' && name[i] != '-') {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Registers a profile may write: not the bank select, not the rate controller's. */
+static bool valid_reg(long reg) {
+  return reg >= 0 && reg < SHADOW_REGS && (reg & 0xff) != REG_BANK_SEL && reg != REG_QS;
+}
+
+static int find(const char *name) {
+  for (int i = 0; i < PROFILES_MAX; i++) {
+    if (profiles[i].name[0] && !strcmp(profiles[i].name, name)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Registers the sensor's own AGC, AEC and AWB loops write; never diffed against the shadow. */
+static bool auto_reg(uint16_t reg) {
+  switch (reg) {
+    case 0x0cc:  // AWB gains R, G, B
+    case 0x0cd:
+    case 0x0ce:
+    case 0x100:  // GAIN
+    case 0x104:  // AEC[1:0]
+    case 0x110:  // AEC[9:2]
+    case 0x145:  // AEC[15:10]
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool shadow_known(uint16_t reg) {
+  return known[reg / 32] & (1u << (reg % 32));
+}
+
+static void shadow_set(uint16_t reg, uint8_t val) {
+  shadow[reg] = val;
+  known[reg / 32] |= 1u << (reg % 32);
+}
+
+static void shadow_drop() {
+  memset(known, 0, sizeof(known));
+}
+
+/* Drops the shadow if the camera was restarted or switched since it was filled. */
+static void shadow_check() {
+  uint32_t epoch = capture_sensor_epoch();
+  if (epoch != shadow_epoch) {
+    shadow_drop();
+    shadow_epoch = epoch;
+  }
+}
+
+/*
+ * The compile step: each register once with its writes' bits merged (later
+ * lines win), DSP bank before sensor bank, first appearance order within a
+ * bank. False if there are more than PROFILES_REGS_MAX registers.
+ */
+static bool merge(const profile_reg_t *in, int n, profile_t *out) {
+  out->count = 0;
+  for (int bank = 0; bank < 2; bank++) {
+    for (int i = 0; i < n; i++) {
+      if (in[i].reg >> 8 != bank || !in[i].mask) {
+        continue;
+      }
+      int j = 0;
+      while (j < out->count && out->regs[j].reg != in[i].reg) {
+        j++;
+      }
+      if (j == out->count) {
+        if (out->count == PROFILES_REGS_MAX) {
+          return false;
+        }
+        out->regs[out->count++] = {in[i].reg, 0, 0};
+      }
+      profile_reg_t *r = &out->regs[j];
+      r->val = (r->val & ~in[i].mask) | (in[i].val & in[i].mask);
+      r->mask |= in[i].mask;
+    }
+  }
+  return true;
+}
+
+static bool store(const profile_t *p) {
+  char path[32];
+  uint8_t buf[PROFILES_HEADER + PROFILES_REGS_MAX * 4];
+  memcpy(buf, "SPRF", 4);
+  buf[4] = PROFILES_VERSION;
+  buf[5] = p->count;
+  buf[6] = p->pid;
+  buf[7] = p->pid >> 8;
+  for (int i = 0; i < p->count; i++) {
+    uint8_t *e = buf + PROFILES_HEADER + i * 4;
+    e[0] = p->regs[i].reg;
+    e[1] = p->regs[i].reg >> 8;
+    e[2] = p->regs[i].mask;
+    e[3] = p->regs[i].val;
+  }
+  snprintf(path, sizeof(path), PROFILES_DIR "/%s", p->name);
+  File f = SPIFFS.open(path, FILE_WRITE);
+  if (!f) {
+    return false;
+  }
+  size_t len = PROFILES_HEADER + p->count * 4;
+  bool ok = f.write(buf, len) == len;
+  f.close();
+  return ok;
+}
+
+static bool load(File &f, profile_t *p) {
+  uint8_t buf[PROFILES_HEADER + PROFILES_REGS_MAX * 4];
+  size_t len = f.read(buf, sizeof(buf));
+  if (len < PROFILES_HEADER || memcmp(buf, "SPRF", 4) || buf[4] != PROFILES_VERSION || buf[5] > PROFILES_REGS_MAX || len != PROFILES_HEADER + buf[5] * 4u) {
+    return false;
+  }
+  p->count = buf[5];
+  p->pid = buf[6] | buf[7] << 8;
+  for (int i = 0; i < p->count; i++) {
+    const uint8_t *e = buf + PROFILES_HEADER + i * 4;
+    p->regs[i] = {(uint16_t)(e[0] | e[1] << 8), e[2], e[3]};
+  }
+  return true;
+}
+
+/* Stores p and puts it in its slot, replacing a profile of the same name. */
+static esp_err_t save(const profile_t *p) {
+  int i = find(p->name);
+  for (int j = 0; i < 0 && j < PROFILES_MAX; j++) {
+    if (!profiles[j].name[0]) {
+      i = j;
+    }
+  }
+  if (i < 0) {
+    return ESP_ERR_NO_MEM;
+  }
+  if (!store(p)) {
+    return ESP_FAIL;
+  }
+  profiles[i] = *p;
+  log_i("Profile %s saved: %u registers", p->name, p->count);
+  return ESP_OK;
+}
+
+esp_err_t profiles_init() {
+  File dir = SPIFFS.open(PROFILES_DIR);
+  if (!dir || !dir.isDirectory()) {
+    return ESP_OK;  // none saved yet
+  }
+  int n = 0;
+  for (File f = dir.openNextFile(); f && n < PROFILES_MAX; f = dir.openNextFile()) {
+    const char *name = strrchr(f.name(), '/');
+    name = name ? name + 1 : f.name();
+    if (valid_name(name) && load(f, &profiles[n])) {
+      snprintf(profiles[n].name, sizeof(profiles[n].name), "%s", name);
+      n++;
+    } else {
+      log_e("Profile %s is not readable, ignored", f.name());
+    }
+    f.close();
+  }
+  dir.close();
+  log_i("Profiles: %d loaded", n);
+  return ESP_OK;
+}
+
+esp_err_t profiles_snapshot(const char *name) {
+  if (!valid_name(name)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  sensor_t *s = esp_camera_sensor_get();
+  capture_state_t st = capture_state();
+  if (!s || (st != CAPTURE_OK && st != CAPTURE_SWITCHING)) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (s->id.PID != OV2640_PID) {
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+  const int n = sizeof(snapshot_regs) / sizeof(snapshot_regs[0]);
+  profile_reg_t in[n];
+  shadow_check();
+  for (int i = 0; i < n; i++) {
+    int v = s->get_reg(s, snapshot_regs[i].reg, 0xff);
+    if (v < 0) {
+      return ESP_FAIL;
+    }
+    shadow_set(snapshot_regs[i].reg, v);
+    in[i] = {snapshot_regs[i].reg, snapshot_regs[i].mask, (uint8_t)(v & snapshot_regs[i].mask)};
+  }
+  profile_t p = {};
+  snprintf(p.name, sizeof(p.name), "%s", name);
+  p.pid = s->id.PID;
+  merge(in, n, &p);
+  return save(&p);
+}
+
+/* One line of profile source: "reg [mask] val", numbers in C notation. 0 for blank, -1 if bad. */
+static int parse_line(const char *line, size_t len, profile_reg_t *out) {
+  char buf[64];
+  if (len >= sizeof(buf)) {
+    return -1;
+  }
+  memcpy(buf, line, len);
+  buf[len] = 0;
+  char *hash = strchr(buf, '#');
+  if (hash) {
+    *hash = 0;
+  }
+  long v[3];
+  int k = 0;
+  char *p = buf;
+  while (true) {
+    while (*p == ' ' || *p == '\t' || *p == ',' || *p == '\r') {
+      p++;
+    }
+    if (!*p) {
+      break;
+    }
+    char *end;
+    if (k == 3 || (v[k] = strtol(p, &end, 0), end == p)) {
+      return -1;
+    }
+    k++;
+    p = end;
+  }
+  if (!k) {
+    return 0;
+  }
+  long mask = k == 3 ? v[1] : 0xff;
+  long val = v[k - 1];
+  if (k < 2 || !valid_reg(v[0]) || mask < 0 || mask > 0xff || val < 0 || val > 0xff) {
+    return -1;
+  }
+  *out = {(uint16_t)v[0], (uint8_t)mask, (uint8_t)val};
+  return 1;
+}
+
+esp_err_t profiles_compile(const char *name, const char *text, int *bad_line) {
+  *bad_line = 0;
+  if (!valid_name(name)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  sensor_t *s = esp_camera_sensor_get();
+  if (!s) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  profile_reg_t in[PROFILES_SOURCE_MAX];
+  int n = 0;
+  int line = 1;
+  for (const char *p = text; *p; line++) {
+    const char *eol = strchr(p, '\n');
+    size_t len = eol ? (size_t)(eol - p) : strlen(p);
+    int res = parse_line(p, len, &in[n]);
+    if (res < 0 || (res && n == PROFILES_SOURCE_MAX)) {
+      *bad_line = line;
+      return ESP_ERR_INVALID_ARG;
+    }
+    n += res;
+    p = eol ? eol + 1 : p + len;
+  }
+  profile_t prof = {};
+  snprintf(prof.name, sizeof(prof.name), "%s", name);
+  prof.pid = s->id.PID;
+  if (!n || !merge(in, n, &prof)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  return save(&prof);
+}
+
+static int write_batch(sensor_t *s, void *arg) {
+  batch_t *b = (batch_t *)arg;
+  for (b->done = 0; b->done < b->count; b->done++) {
+    const profile_reg_t *r = b->regs[b->done];
+    if (s->set_reg(s, r->reg, r->mask, r->val) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+esp_err_t profiles_apply(const char *name, profile_result_t *result) {
+  memset(result, 0, sizeof(*result));
+  int i = find(name);
+  if (i < 0) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  const profile_t *p = &profiles[i];
+  sensor_t *s = esp_camera_sensor_get();
+  capture_state_t st = capture_state();
+  if (!s || (st != CAPTURE_OK && st != CAPTURE_SWITCHING)) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (s->id.PID != p->pid) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  // Learn what the shadow is missing while frames still flow; reads change nothing.
+  shadow_check();
+  esp_err_t err = ESP_OK;
+  result->regs = p->count;
+  for (int j = 0; j < p->count && err == ESP_OK; j++) {
+    if (!auto_reg(p->regs[j].reg) && !shadow_known(p->regs[j].reg)) {
+      int v = s->get_reg(s, p->regs[j].reg, 0xff);
+      err = v < 0 ? ESP_FAIL : ESP_OK;
+      if (err == ESP_OK) {
+        shadow_set(p->regs[j].reg, v);
+        result->reads++;
+      }
+    }
+  }
+
+  batch_t batch;
+  batch.count = 0;
+  batch.done = 0;
+  for (int j = 0; j < p->count && err == ESP_OK; j++) {
+    const profile_reg_t *r = &p->regs[j];
+    if (!auto_reg(r->reg) && (shadow[r->reg] & r->mask) == (r->val & r->mask)) {
+      result->skipped++;
+    } else {
+      batch.regs[batch.count++] = r;
+    }
+  }
+  if (err == ESP_OK && batch.count) {
+    err = capture_sensor_batch(write_batch, &batch, &result->burst_us, &result->gap_us);
+  }
+  result->writes = batch.done;
+  for (int j = 0; j < batch.done; j++) {
+    const profile_reg_t *r = batch.regs[j];
+    shadow_set(r->reg, (shadow[r->reg] & ~r->mask) | (r->val & r->mask));
+  }
+  if (err != ESP_OK || capture_sensor_epoch() != shadow_epoch) {
+    shadow_drop();  // a failed burst, or a restart since the reads
+  }
+
+  portENTER_CRITICAL(&profiles_lock);
+  if (err == ESP_OK) {
+    stats.applies++;
+    stats.unchanged += !batch.count;
+    snprintf(active, sizeof(active), "%s", name);
+    active_modified = false;
+  } else {
+    stats.failures++;
+  }
+  stats.reads += result->reads;
+  stats.writes += result->writes;
+  stats.skipped += result->skipped;
+  if (result->burst_us > stats.max_burst_us) {
+    stats.max_burst_us = result->burst_us;
+  }
+  stats.last = *result;
+  portEXIT_CRITICAL(&profiles_lock);
+
+  log_i("Profile %s: %s, %u of %u registers written (%u read) in %uus, %ums without frames", name, err == ESP_OK ? "applied" : "failed", result->writes,
+        result->regs, result->reads, result->burst_us, result->gap_us / 1000);
+  if (err == ESP_OK) {
+    char ev[EVENTS_DATA_MAX];
+    snprintf(ev, sizeof(ev), "{\"name\":\"%s\",\"writes\":%u,\"skipped\":%u,\"burst_us\":%u,\"gap_ms\":%u}", name, result->writes, result->skipped,
+             result->burst_us, result->gap_us / 1000);
+    events_publish("profile", ev);
+  }
+  return err;
+}
+
+esp_err_t profiles_delete(const char *name) {
+  int i = find(name);
+  if (i < 0) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  char path[32];
+  snprintf(path, sizeof(path), PROFILES_DIR "/%s", name);
+  if (!SPIFFS.remove(path)) {
+    return ESP_FAIL;
+  }
+  profiles[i].name[0] = 0;
+  portENTER_CRITICAL(&profiles_lock);
+  if (!strcmp(active, name)) {
+    active[0] = 0;
+  }
+  portEXIT_CRITICAL(&profiles_lock);
+  return ESP_OK;
+}
+
+void profiles_invalidate() {
+  shadow_drop();
+  portENTER_CRITICAL(&profiles_lock);
+  active_modified = active[0] != 0;
+  portEXIT_CRITICAL(&profiles_lock);
+}
+
+int profiles_json(const char *name, char *buf, size_t len) {
+  char act[PROFILES_NAME_MAX];
+  portENTER_CRITICAL(&profiles_lock);
+  memcpy(act, active, sizeof(act));
+  bool modified = active_modified;
+  portEXIT_CRITICAL(&profiles_lock);
+
+  int i = name ? find(name) : -1;
+  if (i >= 0) {
+    // In source form, so it can be edited and uploaded again.
+    const profile_t *p = &profiles[i];
+    int n = snprintf(buf, len, "{\"name\":\"%s\",\"pid\":\"0x%02X\",\"active\":%s,\"regs\":[", p->name, p->pid, strcmp(act, p->name) ? "false" : "true");
+    for (int j = 0; j < p->count && n < (int)len; j++) {
+      n += snprintf(buf + n, len - n, "%s\"0x%03x 0x%02x 0x%02x\"", j ? "," : "", p->regs[j].reg, p->regs[j].mask, p->regs[j].val);
+    }
+    return n < (int)len ? n + snprintf(buf + n, len - n, "]}") : n;
+  }
+  int n = snprintf(buf, len, "{\"active\":\"%s\",\"modified\":%s,\"profiles\":[", act, modified ? "true" : "false");
+  bool first = true;
+  for (int j = 0; j < PROFILES_MAX && n < (int)len; j++) {
+    if (profiles[j].name[0]) {
+      n += snprintf(buf + n, len - n, "%s{\"name\":\"%s\",\"pid\":\"0x%02X\",\"regs\":%u}", first ? "" : ",", profiles[j].name, profiles[j].pid, profiles[j].count);
+      first = false;
+    }
+  }
+  return n < (int)len ? n + snprintf(buf + n, len - n, "]}") : n;
+}
+
+int profiles_stats_json(char *buf, size_t len) {
+  portENTER_CRITICAL(&profiles_lock);
+  profiles_stats_t s = stats;
+  char act[PROFILES_NAME_MAX];
+  memcpy(act, active, sizeof(act));
+  bool modified = active_modified;
+  portEXIT_CRITICAL(&profiles_lock);
+  return snprintf(
+    buf, len,
+    "{\"active\":\"%s\",\"modified\":%s,\"applies\":%u,\"unchanged\":%u,\"failures\":%u,\"reads\":%u,\"writes\":%u,\"skipped\":%u,\"max_burst_us\":%u,"
+    "\"last_regs\":%u,\"last_reads\":%u,\"last_writes\":%u,\"last_skipped\":%u,\"last_burst_us\":%u,\"last_gap_ms\":%u}",
+    act, modified ? "true" : "false", s.applies, s.unchanged, s.failures, s.reads, s.writes, s.skipped, s.max_burst_us, s.last.regs, s.last.reads,
+    s.last.writes, s.last.skipped, s.last.burst_us, s.last.gap_us / 1000
+  );
+}
@@ -0,0 +1,99 @@
+/**
+ * Rate controller.
+ *
+ * Frame size is modelled as size ~ quality^-e. Each adjustment solves for the
+ * quality that hits the target under the current e, limited to
+ * RATE_CONTROL_MAX_STEP and the configured range; once the window has
+ * refilled after a change, e is re-estimated from the sizes on either side
+ * of it, so the loop tightens on sensors and scenes that respond weakly.
+ */
+#include "rate_control.h"
+#include <math.h>
+#include <string.h>
+
+static const char *mode_names[] = {"off", "bytes", "kbps"};
+
+void rate_control_reset(rate_control_t *rc, uint8_t quality) {
+  memset(rc, 0, sizeof(*rc));
+  rc->quality = quality;
+  rc->elasticity = 1.0f;
+}
+
+const char *rate_control_mode_name(rate_control_mode_t mode) {
+  return mode_names[mode];
+}
+
+uint8_t rate_control_update(rate_control_t *rc, const rate_control_config_t *cfg, uint32_t len, int64_t ts_us) {
+  if (rc->settle) {
+    rc->settle--;
+    return rc->quality;
+  }
+
+  rc->len[rc->head] = len;
+  rc->ts_us[rc->head] = ts_us;
+  rc->head = (rc->head + 1) % RATE_CONTROL_WINDOW;
+  if (rc->count < RATE_CONTROL_WINDOW) {
+    rc->count++;
+  }
+
+  uint64_t sum = 0;
+  for (int i = 0; i < rc->count; i++) {
+    sum += rc->len[i];
+  }
+  rc->avg_bytes = sum / rc->count;
+  int oldest = rc->count < RATE_CONTROL_WINDOW ? 0 : rc->head;
+  int newest = (rc->head + RATE_CONTROL_WINDOW - 1) % RATE_CONTROL_WINDOW;
+  int64_t span = rc->ts_us[newest] - rc->ts_us[oldest];
+  rc->fps_x10 = span > 0 ? (uint32_t)((rc->count - 1) * 10000000LL / span) : 0;
+  rc->kbps = (uint32_t)((uint64_t)rc->avg_bytes * 8 * rc->fps_x10 / 10000);
+
+  if (cfg->mode == RATE_CONTROL_OFF || !cfg->target || rc->count < RATE_CONTROL_MIN_FRAMES) {
+    return rc->quality;
+  }
+  if (cfg->mode == RATE_CONTROL_KBPS) {
+    if (!rc->fps_x10) {
+      return rc->quality;
+    }
+    rc->target_bytes = (uint32_t)((uint64_t)cfg->target * 1000 / 8 * 10 / rc->fps_x10);
+    if (!rc->target_bytes) {
+      rc->target_bytes = 1;  // a bitrate below a byte per frame at this rate
+    }
+  } else {
+    rc->target_bytes = cfg->target;
+  }
+
+  uint32_t high = rc->target_bytes + rc->target_bytes * RATE_CONTROL_BAND_PCT / 100;
+  uint32_t low = rc->target_bytes - rc->target_bytes * RATE_CONTROL_BAND_PCT / 100;
+  if (rc->avg_bytes <= high && rc->avg_bytes >= low) {
+    return rc->quality;
+  }
+
+  if (rc->prev_avg && rc->prev_quality != rc->quality) {
+    float e = -logf((float)rc->avg_bytes / rc->prev_avg) / logf((float)rc->quality / rc->prev_quality);
+    rc->elasticity = e < 0.2f ? 0.2f : e > 2.0f ? 2.0f : e;
+  }
+  rc->prev_avg = 0;
+
+  // Solve avg * (q'/q)^-e = target; always move at least one step.
+  int q = rc->quality ? rc->quality : 1;
+  float want = q * powf((float)rc->avg_bytes / rc->target_bytes, 1.0f / rc->elasticity);
+  int step = (int)lrintf(fminf(fmaxf(want - q, -RATE_CONTROL_MAX_STEP), RATE_CONTROL_MAX_STEP));
+  if (!step) {
+    step = rc->avg_bytes > high ? 1 : -1;
+  }
+  step = step > RATE_CONTROL_MAX_STEP ? RATE_CONTROL_MAX_STEP : step < -RATE_CONTROL_MAX_STEP ? -RATE_CONTROL_MAX_STEP : step;
+  q += step;
+  q = q < cfg->min_quality ? cfg->min_quality : q > cfg->max_quality ? cfg->max_quality : q;
+  if (q == rc->quality) {
+    return rc->quality;  // pinned at a limit
+  }
+
+  rc->prev_avg = rc->avg_bytes;
+  rc->prev_quality = rc->quality;
+  rc->quality = q;
+  rc->adjustments++;
+  rc->count = 0;
+  rc->head = 0;
+  rc->settle = RATE_CONTROL_SETTLE;
+  return rc->quality;
+}
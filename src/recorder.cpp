@@ -0,0 +1,417 @@
+/**
+ * Recorder task.
+ *
+ * Idle (blocked on a task notification) until enabled. While enabled it
+ * paces itself to the configured rate, copies each frame into its own PSRAM
+ * buffer and returns the camera buffer before touching the card. Write time
+ * is measured per frame; a card that cannot keep up shows as frames behind
+ * schedule rather than as a growing backlog.
+ *
+ * Motion flags come from a change gate of the recorder's own, fed the frames
+ * it records; it costs one Huffman walk per recorded frame.
+ */
+#include "recorder.h"
+#include <Arduino.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "esp_camera.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "avi_mux.h"
+#include "capture.h"
+#include "change_gate.h"
+#include "events.h"
+#include "power_gov.h"
+
+#define RECORDER_TASK_STACK 4096
+#define RECORDER_TASK_PRIO  4
+#define RECORDER_RETRY_MS   5000   // after a segment could not be created
+#define RECORDER_REPAIR_MAX 8      // unclosed recordings repaired per boot; a power cut leaves one
+
+typedef struct {
+  uint32_t segments;
+  uint32_t frames;
+  uint64_t bytes;
+  uint32_t behind;         // frames that started late by more than a frame period
+  uint32_t oversize;       // frames over RECORDER_FRAME_MAX, skipped
+  uint32_t capture_failures;
+  uint32_t write_errors;
+  uint32_t open_errors;
+  uint32_t repaired;       // unclosed recordings fixed at init
+  uint32_t motion_frames;
+  uint32_t catalog_entries;
+  uint32_t catalog_errors;   // failed appends and seek table writes
+  uint32_t write_us;       // averaged per frame
+  uint32_t write_us_max;
+  uint64_t write_us_total;
+} recorder_stats_t;
+
+static recorder_config_t cfg = {
+  .enabled = false,
+  .fps = RECORDER_DEFAULT_FPS,
+  .segment_s = RECORDER_SEGMENT_S,
+};
+static recorder_stats_t stats;
+static portMUX_TYPE rec_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t rec_task_handle = NULL;
+static avi_mux_t mux;            // recorder task only
+static uint32_t next_seq;
+static char segment[AVI_MUX_PATH_MAX];
+static int64_t segment_start_us;
+static FILE *seek_file;          // the open segment's seek table
+static catalog_entry_t entry;    // its catalog record, filled in as it grows
+static change_gate_t gate;
+static int64_t clock_base_us;    // catalog time at boot, while the clock is unset
+
+/* A "recording" event; file and its counts only when file is given. */
+static void publish_event(const char *state, const char *file, uint32_t frames, uint32_t bytes) {
+  char ev[EVENTS_DATA_MAX];
+  if (file) {
+    snprintf(ev, sizeof(ev), "{\"state\":\"%s\",\"file\":\"%s\",\"frames\":%u,\"bytes\":%u}", state, file, frames, bytes);
+  } else {
+    snprintf(ev, sizeof(ev), "{\"state\":\"%s\"}", state);
+  }
+  events_publish("recording", ev);
+}
+
+static void catalog_add(catalog_entry_t *e) {
+  if (e->motion_frames) {
+    e->flags |= CATALOG_MOTION;
+  }
+  bool ok = catalog_append(RECORDER_CATALOG, e);
+  portENTER_CRITICAL(&rec_lock);
+  stats.catalog_entries += ok;
+  stats.catalog_errors += !ok;
+  portEXIT_CRITICAL(&rec_lock);
+  if (!ok) {
+    log_e("Recording: cannot add %06u to the catalog", e->seq);
+  }
+}
+
+static void close_segment() {
+  if (!mux.f) {
+    return;
+  }
+  uint32_t frames = mux.frames;
+  uint32_t bytes = mux.end;
+  entry.frames = frames;
+  entry.index_offset = mux.end;
+  entry.bytes = mux.end + 8 + frames * AVI_MUX_INDEX_ENTRY;
+  entry.end_us = entry.start_us + (mux.last_ts_us - mux.first_ts_us);
+  bool ok = avi_mux_close(&mux);
+  if (seek_file) {
+    fclose(seek_file);
+    seek_file = NULL;
+  }
+  portENTER_CRITICAL(&rec_lock);
+  stats.segments += ok;
+  stats.write_errors += !ok;
+  portEXIT_CRITICAL(&rec_lock);
+  log_i("Recording %s closed: %u frames, %u bytes%s", segment, frames, bytes, ok ? "" : ", close failed");
+  publish_event(ok ? "segment" : "error", segment, frames, bytes);
+  // One that did not close is repaired, and catalogued, at the next boot.
+  if (ok && frames) {
+    catalog_add(&entry);
+  }
+}
+
+/* Opens the next segment, whose first frame is at ts_us. */
+static bool open_segment(uint16_t width, uint16_t height, uint8_t fps, int64_t ts_us) {
+  snprintf(segment, sizeof(segment), RECORDER_DIR "/" RECORDER_SEGMENT_NAME, next_seq);
+  if (!avi_mux_open(&mux, segment, width, height, 1000000 / fps)) {
+    portENTER_CRITICAL(&rec_lock);
+    stats.open_errors++;
+    portEXIT_CRITICAL(&rec_lock);
+    log_e("Recording: cannot create %s", segment);
+    publish_event("error", segment, 0, 0);
+    return false;
+  }
+  bool wall;
+  memset(&entry, 0, sizeof(entry));
+  entry.seq = next_seq;
+  entry.start_us = recorder_clock_us(ts_us, &wall);
+  entry.width = width;
+  entry.height = height;
+  entry.flags = wall ? CATALOG_WALL : 0;
+  char path[AVI_MUX_PATH_MAX + 4];
+  catalog_seek_path(segment, path, sizeof(path));
+  seek_file = catalog_seek_create(path, &entry);
+  if (!seek_file) {
+    portENTER_CRITICAL(&rec_lock);
+    stats.catalog_errors++;
+    portEXIT_CRITICAL(&rec_lock);
+    log_e("Recording: cannot create %s", path);
+  }
+  next_seq++;
+  segment_start_us = esp_timer_get_time();
+  return true;
+}
+
+static void rec_task(void *arg) {
+  uint8_t *buf = NULL;
+  bool was_enabled = false;
+  int64_t next_us = 0;
+
+  while (true) {
+    recorder_config_t c;
+    recorder_get_config(&c);
+    if (c.enabled != was_enabled) {
+      was_enabled = c.enabled;
+      if (c.enabled) {
+        buf = (uint8_t *)heap_caps_malloc(RECORDER_FRAME_MAX, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (change_gate_init(&gate) != ESP_OK) {
+          change_gate_free(&gate);  // recording goes on without motion flags
+        }
+        power_gov_acquire();
+        next_us = esp_timer_get_time();
+        publish_event("started", NULL, 0, 0);
+      } else {
+        close_segment();
+        free(buf);
+        buf = NULL;
+        change_gate_free(&gate);
+        power_gov_release();
+        publish_event("stopped", NULL, 0, 0);
+      }
+    }
+    if (!c.enabled || !buf) {
+      if (c.enabled) {
+        log_e("Recording: no memory for the frame buffer");
+        portENTER_CRITICAL(&rec_lock);
+        cfg.enabled = false;
+        portEXIT_CRITICAL(&rec_lock);
+        continue;
+      }
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      continue;
+    }
+
+    uint32_t period_us = 1000000 / c.fps;
+    int64_t now = esp_timer_get_time();
+    if (next_us - now >= 1000) {
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS((next_us - now) / 1000));
+      continue;  // woken early by a config change, or on time: either way look again
+    }
+    if (now - next_us > (int64_t)period_us) {
+      portENTER_CRITICAL(&rec_lock);
+      stats.behind++;
+      portEXIT_CRITICAL(&rec_lock);
+      next_us = now;  // do not try to catch up
+    }
+    next_us += period_us;
+
+    camera_fb_t *fb = capture_fb_get();
+    if (!fb) {
+      bool gap = capture_state() == CAPTURE_SWITCHING;  // planned, not a failure
+      portENTER_CRITICAL(&rec_lock);
+      stats.capture_failures += !gap;
+      portEXIT_CRITICAL(&rec_lock);
+      continue;
+    }
+    size_t len = fb->len;
+    uint16_t width = fb->width;
+    uint16_t height = fb->height;
+    int64_t ts_us = (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+    bool usable = fb->format == PIXFORMAT_JPEG && len <= RECORDER_FRAME_MAX;
+    if (usable) {
+      memcpy(buf, fb->buf, len);
+    }
+    capture_fb_return(fb);
+    if (!usable) {
+      portENTER_CRITICAL(&rec_lock);
+      stats.oversize++;
+      portEXIT_CRITICAL(&rec_lock);
+      continue;
+    }
+
+    if (mux.f && (width != mux.width || height != mux.height || esp_timer_get_time() - segment_start_us >= (int64_t)c.segment_s * 1000000)) {
+      close_segment();
+    }
+    if (!mux.f && !open_segment(width, height, c.fps, ts_us)) {
+      next_us = esp_timer_get_time() + (int64_t)RECORDER_RETRY_MS * 1000;
+      continue;
+    }
+
+    bool motion = false;
+    if (gate.info) {
+      bool primed = gate.sent > 0;  // the first frame is "changed" against nothing
+      motion = change_gate_check(&gate, buf, len, ts_us) == CHANGE_GATE_CHANGED && primed;
+    }
+
+    uint32_t at = mux.end;
+    uint32_t syncs = mux.syncs;
+    int64_t start = esp_timer_get_time();
+    bool ok = avi_mux_write(&mux, buf, len, ts_us);
+    uint32_t write_us = (uint32_t)(esp_timer_get_time() - start);
+    bool seek_ok = true;
+    if (ok && seek_file) {
+      catalog_frame_t fr = {(uint32_t)(ts_us - mux.first_ts_us), at + 8, (uint32_t)len | (motion ? CATALOG_FRAME_MOTION : 0)};
+      // Synced with the AVI, so a repaired recording has its seek table up to the same point.
+      seek_ok = catalog_seek_append(seek_file, &fr) && (mux.syncs == syncs || catalog_seek_sync(seek_file));
+      if (!seek_ok) {
+        fclose(seek_file);  // what is there stays usable
+        seek_file = NULL;
+      }
+    }
+    if (ok) {
+      entry.motion_frames += motion;
+    }
+    portENTER_CRITICAL(&rec_lock);
+    stats.catalog_errors += !seek_ok;
+    if (ok) {
+      stats.frames++;
+      stats.motion_frames += motion;
+      stats.bytes += len;
+      stats.write_us = stats.frames > 1 ? (stats.write_us * 7 + write_us) / 8 : write_us;
+      stats.write_us_total += write_us;
+      if (write_us > stats.write_us_max) {
+        stats.write_us_max = write_us;
+      }
+    }
+    portEXIT_CRITICAL(&rec_lock);
+    if (!ok) {
+      // Full or failing: what is there stays valid; carry on in a new segment.
+      close_segment();
+    }
+  }
+}
+
+/* The catalog record of a repaired recording, from its seek table. */
+static void catalog_repaired(uint32_t seq, uint32_t frames) {
+  char path[AVI_MUX_PATH_MAX + 4];
+  catalog_entry_t e;
+  struct stat st;
+  if (!frames) {
+    return;  // nothing to find in it, as close_segment decides
+  }
+  catalog_seek_path(segment, path, sizeof(path));
+  FILE *f = fopen(path, "rb");
+  bool ok = f && stat(segment, &st) == 0 && catalog_seek_summary(f, frames, &e);
+  if (f) {
+    fclose(f);
+  }
+  if (!ok) {
+    log_e("Recording %s has no seek table; it stays out of the catalog", segment);
+    return;
+  }
+  // The AVI may hold a few frames past the last seek table sync.
+  e.seq = seq;
+  e.frames = frames;
+  e.bytes = st.st_size;
+  e.index_offset = st.st_size - 8 - frames * AVI_MUX_INDEX_ENTRY;
+  e.flags |= CATALOG_REPAIRED;
+  catalog_add(&e);
+}
+
+/*
+ * Finds the next segment number, checks the catalog and repairs the
+ * recordings whose side index survived. Repairs run after the listing,
+ * since they delete the side files.
+ */
+static void scan_dir() {
+  uint32_t unclosed[RECORDER_REPAIR_MAX];
+  int count = 0;
+  DIR *dir = opendir(RECORDER_DIR);
+  if (!dir) {
+    mkdir(RECORDER_DIR, 0775);
+  } else {
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+      unsigned seq;
+      char ext[4];
+      if (sscanf(de->d_name, "%u.%3s", &seq, ext) != 2) {
+        continue;
+      }
+      if (seq >= next_seq) {
+        next_seq = seq + 1;
+      }
+      if (!strcasecmp(ext, "idx") && count < RECORDER_REPAIR_MAX) {
+        unclosed[count++] = seq;
+      }
+    }
+    closedir(dir);
+  }
+
+  uint32_t entries;
+  catalog_entry_t last;
+  if (!catalog_check(RECORDER_CATALOG, &entries, &last)) {
+    log_e("Recording: cannot create " RECORDER_CATALOG);
+  }
+  for (int i = 0; i < count; i++) {
+    uint32_t frames;
+    snprintf(segment, sizeof(segment), RECORDER_DIR "/" RECORDER_SEGMENT_NAME, unclosed[i]);
+    if (avi_mux_repair(segment, &frames)) {
+      stats.repaired++;
+      log_i("Recording %s repaired: %u frames", segment, frames);
+      publish_event("repaired", segment, frames, 0);
+      catalog_repaired(unclosed[i], frames);
+    } else {
+      log_e("Recording %s could not be repaired", segment);
+    }
+  }
+  // Without a clock, catalog time carries on a second after the last record.
+  if (catalog_check(RECORDER_CATALOG, &entries, &last) && entries) {
+    clock_base_us = last.end_us + 1000000;
+  }
+  stats.catalog_entries = entries;
+}
+
+esp_err_t recorder_init() {
+  if (rec_task_handle) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  scan_dir();
+  if (xTaskCreatePinnedToCore(rec_task, "recorder", RECORDER_TASK_STACK, NULL, RECORDER_TASK_PRIO, &rec_task_handle, tskNO_AFFINITY) != pdPASS) {
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+void recorder_get_config(recorder_config_t *config) {
+  portENTER_CRITICAL(&rec_lock);
+  *config = cfg;
+  portEXIT_CRITICAL(&rec_lock);
+}
+
+esp_err_t recorder_set_config(const recorder_config_t *config) {
+  if (!rec_task_handle) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (!config->fps || config->fps > RECORDER_MAX_FPS || !config->segment_s || config->segment_s > RECORDER_MAX_SEGMENT_S) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  portENTER_CRITICAL(&rec_lock);
+  cfg = *config;
+  portEXIT_CRITICAL(&rec_lock);
+  xTaskNotifyGive(rec_task_handle);
+  return ESP_OK;
+}
+
+int64_t recorder_clock_us(int64_t mono_us, bool *wall) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  *wall = tv.tv_sec >= RECORDER_WALL_MIN_S;
+  if (*wall) {
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec - esp_timer_get_time() + mono_us;
+  }
+  return clock_base_us + mono_us;
+}
+
+int recorder_stats_json(char *buf, size_t len) {
+  recorder_config_t c;
+  recorder_get_config(&c);
+  portENTER_CRITICAL(&rec_lock);
+  recorder_stats_t s = stats;
+  portEXIT_CRITICAL(&rec_lock);
+  // Sustained card rate while writing, KB/s (bytes per ms).
+  uint32_t write_kBps = s.write_us_total ? (uint32_t)(s.bytes * 1000 / s.write_us_total) : 0;
+  return snprintf(
+    buf, len,
+    "{\"enabled\":%s,\"fps\":%u,\"segment_s\":%u,\"next_segment\":%u,\"segments\":%u,\"frames\":%u,\"bytes\":%llu,\"write_us\":%u,"
+    "\"write_us_max\":%u,\"write_kBps\":%u,\"behind\":%u,\"oversize\":%u,\"capture_failures\":%u,\"write_errors\":%u,\"open_errors\":%u,"
+    "\"repaired\":%u,\"motion_frames\":%u,\"catalog_entries\":%u,\"catalog_errors\":%u}",
+    c.enabled ? "true" : "false", c.fps, c.segment_s, next_seq, s.segments, s.frames, s.bytes, s.write_us, s.write_us_max, write_kBps, s.behind,
+    s.oversize, s.capture_failures, s.write_errors, s.open_errors, s.repaired, s.motion_frames, s.catalog_entries, s.catalog_errors
+  );
+}
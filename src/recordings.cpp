@@ -0,0 +1,540 @@
+/**
+ * Recording download worker.
+ *
+ * Responses are written with httpd_send so GET and HEAD carry the real
+ * Content-Length (httpd_resp_send would count the empty HEAD body) and a
+ * download needs no chunked framing. Time is split into card reads and
+ * socket sends, so the download rate can be set against the card's own
+ * from ?bench.
+ */
+#include "recordings.h"
+#include <Arduino.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "avi_mux.h"
+#include "catalog.h"
+#include "recorder.h"
+
+#define RECORDINGS_WORKER_STACK 4096
+#define RECORDINGS_WORKER_PRIO  3    // below the control server (5) and the stream workers (6)
+#define RECORDINGS_WORKER_CORE  0
+#define RECORDINGS_RETRY_S      5
+
+typedef struct {
+  httpd_req_t *req;
+  char path[AVI_MUX_PATH_MAX];
+  uint32_t start;
+  uint32_t end;            // inclusive
+  uint32_t size;
+  bool partial;
+  bool bench;
+} job_t;
+
+typedef struct {
+  uint32_t downloads;
+  uint32_t ranges;
+  uint32_t heads;
+  uint32_t busy;           // refused with 503
+  uint32_t aborted;        // client went away
+  uint32_t read_errors;
+  uint64_t bytes;
+  uint64_t read_us;
+  uint64_t send_us;
+  uint32_t last_kBps;      // last download, end to end
+  uint32_t bench_kBps;     // last ?bench, card only
+  uint32_t bench_bytes;
+  uint32_t lookups;        // ?from=&to= and ?at=
+  uint32_t lookup_misses;
+  uint32_t lookup_us;      // averaged
+  uint32_t lookup_us_max;
+} recordings_stats_t;
+
+static recordings_stats_t stats;
+static portMUX_TYPE rec_dl_lock = portMUX_INITIALIZER_UNLOCKED;
+static QueueHandle_t job_queue = NULL;
+static SemaphoreHandle_t idle_worker = NULL;
+static uint8_t *buf = NULL;
+static int held_fd = -1;       // the worker's connection
+
+static bool send_all(httpd_req_t *req, const char *data, size_t len) {
+  while (len) {
+    int n = httpd_send(req, data, len);
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+static const char *content_type(const char *path) {
+  size_t n = strlen(path);
+  return n > 4 && !strcasecmp(path + n - 4, ".avi") ? "video/x-msvideo" : "application/octet-stream";
+}
+
+static bool send_head(httpd_req_t *req, const job_t *job) {
+  char head[320];
+  int n = snprintf(
+    head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %u\r\nAccept-Ranges: bytes\r\nAccess-Control-Allow-Origin: *\r\n",
+    job->partial ? "206 Partial Content" : "200 OK", content_type(job->path), job->size ? job->end - job->start + 1 : 0
+  );
+  if (job->partial) {
+    n += snprintf(head + n, sizeof(head) - n, "Content-Range: bytes %u-%u/%u\r\n", job->start, job->end, job->size);
+  }
+  n += snprintf(head + n, sizeof(head) - n, "\r\n");
+  return send_all(req, head, n);
+}
+
+/* Reads [start, end] in aligned pieces; sends them unless benchmarking. */
+static void transfer(const job_t *job) {
+  FILE *f = fopen(job->path, "rb");
+  if (!f) {
+    portENTER_CRITICAL(&rec_dl_lock);
+    stats.read_errors++;
+    portEXIT_CRITICAL(&rec_dl_lock);
+    // Gone since the handler's stat; the worker completes the request after this.
+    httpd_resp_send_err(job->req, HTTPD_404_NOT_FOUND, "no such recording");
+    return;
+  }
+  setvbuf(f, NULL, _IONBF, 0);  // no second copy through a stdio buffer
+
+  int64_t begin = esp_timer_get_time();
+  uint64_t read_us = 0, send_us = 0, bytes = 0;
+  bool ok = job->bench || send_head(job->req, job);
+  bool read_ok = fseek(f, job->start, SEEK_SET) == 0;
+  uint32_t pos = job->start;
+  while (ok && read_ok && job->size && pos <= job->end) {
+    uint32_t n = job->end + 1 - pos;
+    n = n < RECORDINGS_BUF_SIZE ? n : RECORDINGS_BUF_SIZE;
+    if (pos % RECORDINGS_ALIGN && n > RECORDINGS_ALIGN - pos % RECORDINGS_ALIGN) {
+      n = RECORDINGS_ALIGN - pos % RECORDINGS_ALIGN;  // a Range start: get back onto the grid
+    }
+    int64_t t0 = esp_timer_get_time();
+    read_ok = fread(buf, 1, n, f) == n;
+    int64_t t1 = esp_timer_get_time();
+    read_us += t1 - t0;
+    if (read_ok && !job->bench) {
+      ok = send_all(job->req, (const char *)buf, n);
+      send_us += esp_timer_get_time() - t1;
+    }
+    if (read_ok && ok) {
+      bytes += n;
+      pos += n;
+    }
+  }
+  fclose(f);
+  uint32_t elapsed_us = (uint32_t)(esp_timer_get_time() - begin);
+  uint32_t kBps = elapsed_us ? (uint32_t)(bytes * 1000 / elapsed_us) : 0;
+
+  portENTER_CRITICAL(&rec_dl_lock);
+  stats.read_errors += !read_ok;
+  if (job->bench) {
+    stats.bench_kBps = read_us ? (uint32_t)(bytes * 1000 / read_us) : 0;
+    stats.bench_bytes = bytes;
+  } else {
+    stats.downloads++;
+    stats.ranges += job->partial;
+    stats.aborted += !ok;
+    stats.bytes += bytes;
+    stats.read_us += read_us;
+    stats.send_us += send_us;
+    stats.last_kBps = kBps;
+  }
+  portEXIT_CRITICAL(&rec_dl_lock);
+
+  if (job->bench) {
+    char json[160];
+    snprintf(json, sizeof(json), "{\"file\":\"%s\",\"bytes\":%llu,\"read_ms\":%u,\"read_kBps\":%u,\"ok\":%s}", job->path, bytes, (uint32_t)(read_us / 1000),
+             read_us ? (uint32_t)(bytes * 1000 / read_us) : 0, read_ok ? "true" : "false");
+    httpd_resp_set_type(job->req, "application/json");
+    httpd_resp_set_hdr(job->req, "Access-Control-Allow-Origin", "*");
+    httpd_resp_send(job->req, json, strlen(json));
+  } else {
+    log_i("Download %s: %llu bytes, %u kB/s%s", job->path, bytes, kBps, ok && read_ok ? "" : " (cut short)");
+  }
+}
+
+static void worker(void *arg) {
+  job_t job;
+  while (true) {
+    if (xQueueReceive(job_queue, &job, portMAX_DELAY) != pdTRUE) {
+      continue;
+    }
+    transfer(&job);
+    portENTER_CRITICAL(&rec_dl_lock);
+    held_fd = -1;
+    portEXIT_CRITICAL(&rec_dl_lock);
+    httpd_req_async_handler_complete(job.req);
+    xSemaphoreGive(idle_worker);
+  }
+}
+
+esp_err_t recordings_init() {
+  if (job_queue) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  buf = (uint8_t *)heap_caps_aligned_alloc(RECORDINGS_BUF_ALIGN, RECORDINGS_BUF_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  job_queue = xQueueCreate(1, sizeof(job_t));
+  idle_worker = xSemaphoreCreateBinary();
+  if (!buf || !job_queue || !idle_worker) {
+    return ESP_ERR_NO_MEM;
+  }
+  xSemaphoreGive(idle_worker);
+  if (xTaskCreatePinnedToCore(worker, "rec_dl", RECORDINGS_WORKER_STACK, NULL, RECORDINGS_WORKER_PRIO, NULL, RECORDINGS_WORKER_CORE) != pdPASS) {
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+/* Plain names only: no directories, nothing hidden. */
+static bool valid_name(const char *name) {
+  if (!name[0] || name[0] == '.') {
+    return false;
+  }
+  for (const char *p = name; *p; p++) {
+    if (!isalnum((uint8_t)*p) && *p != '.' && *p != '_' && *p != '-') {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Fills the job's path and size; false if there is no such file. */
+static bool find_file(const char *name, job_t *job) {
+  struct stat st;
+  if (!valid_name(name)) {
+    return false;
+  }
+  snprintf(job->path, sizeof(job->path), RECORDER_DIR "/%s", name);
+  if (stat(job->path, &st) != 0 || !S_ISREG(st.st_mode)) {
+    return false;
+  }
+  job->size = st.st_size;
+  job->start = 0;
+  job->end = job->size ? job->size - 1 : 0;
+  return true;
+}
+
+/* Digits only, nothing after them. */
+static bool parse_number(const char *s, uint32_t *v) {
+  if (!isdigit((uint8_t)*s)) {
+    return false;
+  }
+  char *end;
+  *v = strtoul(s, &end, 10);
+  return !*end;
+}
+
+/*
+ * A single "bytes=a-b", "bytes=a-" or "bytes=-n" range. Anything else,
+ * including a bound that is not a number, is ignored and the whole file is
+ * sent, as RFC 9110 allows. False if the range cannot be satisfied.
+ */
+static bool parse_range(httpd_req_t *req, job_t *job) {
+  char range[48];
+  if (httpd_req_get_hdr_value_str(req, "Range", range, sizeof(range)) != ESP_OK || strncmp(range, "bytes=", 6) || strchr(range, ',')) {
+    return true;
+  }
+  char *dash = strchr(range + 6, '-');
+  if (!dash) {
+    return true;
+  }
+  *dash = 0;
+  const char *first = range + 6;
+  const char *last = dash + 1;
+  if (!*first && !*last) {
+    return true;
+  }
+  // Parsed into locals: the job changes only for a range that is served.
+  uint32_t start;
+  uint32_t end = job->end;
+  if (!*first) {
+    uint32_t n;
+    if (!parse_number(last, &n)) {
+      return true;
+    }
+    if (!n || !job->size) {
+      return false;
+    }
+    start = n < job->size ? job->size - n : 0;
+  } else {
+    if (!parse_number(first, &start)) {
+      return true;
+    }
+    if (*last) {
+      uint32_t e;
+      if (!parse_number(last, &e) || e < start) {
+        return true;  // invalid: ignored, the whole file goes out
+      }
+      end = e < end ? e : end;
+    }
+  }
+  if (start >= job->size) {
+    return false;
+  }
+  job->start = start;
+  job->end = end;
+  job->partial = true;
+  return true;
+}
+
+static esp_err_t busy(httpd_req_t *req) {
+  char retry[12];
+  snprintf(retry, sizeof(retry), "%u", RECORDINGS_RETRY_S);
+  portENTER_CRITICAL(&rec_dl_lock);
+  stats.busy++;
+  portEXIT_CRITICAL(&rec_dl_lock);
+  httpd_resp_set_status(req, "503 Service Unavailable");
+  httpd_resp_set_hdr(req, "Retry-After", retry);
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, "download in progress", HTTPD_RESP_USE_STRLEN);
+}
+
+/* Hands the request to the worker. */
+static esp_err_t dispatch(httpd_req_t *req, job_t *job) {
+  if (!job_queue) {
+    return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "downloads not available");
+  }
+  if (xSemaphoreTake(idle_worker, 0) != pdTRUE) {
+    return busy(req);
+  }
+  if (httpd_req_async_handler_begin(req, &job->req) != ESP_OK) {
+    xSemaphoreGive(idle_worker);
+    return httpd_resp_send_500(req);
+  }
+  portENTER_CRITICAL(&rec_dl_lock);
+  held_fd = httpd_req_to_sockfd(job->req);
+  portEXIT_CRITICAL(&rec_dl_lock);
+  xQueueSend(job_queue, job, portMAX_DELAY);
+  return ESP_OK;
+}
+
+bool recordings_holds(int fd) {
+  portENTER_CRITICAL(&rec_dl_lock);
+  bool held = fd >= 0 && fd == held_fd;
+  portEXIT_CRITICAL(&rec_dl_lock);
+  return held;
+}
+
+esp_err_t recordings_serve(httpd_req_t *req) {
+  static const char prefix[] = "/recordings/";
+  char name[RECORDINGS_NAME_MAX];
+  const char *p = req->uri + sizeof(prefix) - 1;
+  size_t n = strcspn(p, "?");
+  job_t job = {};
+  if (n >= sizeof(name)) {
+    return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "no such recording");
+  }
+  memcpy(name, p, n);
+  name[n] = 0;
+  if (!find_file(name, &job)) {
+    return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "no such recording");
+  }
+  if (!parse_range(req, &job)) {
+    char head[160];
+    int len = snprintf(head, sizeof(head), "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%u\r\nContent-Length: 0\r\n\r\n", job.size);
+    return send_all(req, head, len) ? ESP_OK : ESP_FAIL;
+  }
+  if (req->method == HTTP_HEAD) {
+    portENTER_CRITICAL(&rec_dl_lock);
+    stats.heads++;
+    portEXIT_CRITICAL(&rec_dl_lock);
+    return send_head(req, &job) ? ESP_OK : ESP_FAIL;
+  }
+  return dispatch(req, &job);
+}
+
+static uint32_t lookup_done(int64_t start, bool found) {
+  uint32_t us = (uint32_t)(esp_timer_get_time() - start);
+  portENTER_CRITICAL(&rec_dl_lock);
+  stats.lookups++;
+  stats.lookup_misses += !found;
+  stats.lookup_us = stats.lookups > 1 ? (stats.lookup_us * 7 + us) / 8 : us;
+  if (us > stats.lookup_us_max) {
+    stats.lookup_us_max = us;
+  }
+  portEXIT_CRITICAL(&rec_dl_lock);
+  return us;
+}
+
+static int entry_json(char *buf, size_t len, const catalog_entry_t *e) {
+  return snprintf(
+    buf, len,
+    "{\"file\":\"" RECORDER_SEGMENT_NAME "\",\"start_ms\":%lld,\"end_ms\":%lld,\"frames\":%u,\"bytes\":%u,\"index_offset\":%u,\"motion_frames\":%u,"
+    "\"width\":%u,\"height\":%u,\"wall\":%s,\"repaired\":%s,\"shifted\":%s}",
+    e->seq, e->start_us / 1000, e->end_us / 1000, e->frames, e->bytes, e->index_offset, e->motion_frames, e->width, e->height,
+    e->flags & CATALOG_WALL ? "true" : "false", e->flags & CATALOG_REPAIRED ? "true" : "false", e->flags & CATALOG_SHIFTED ? "true" : "false"
+  );
+}
+
+/* The catalogued segments that overlap [from_us, to_us], in time order. */
+static esp_err_t catalog_span(httpd_req_t *req, int64_t from_us, int64_t to_us) {
+  int64_t start = esp_timer_get_time();
+  FILE *f = fopen(RECORDER_CATALOG, "rb");
+  if (!f) {
+    return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "no catalog");
+  }
+  uint32_t n = catalog_count(f);
+  uint32_t i = catalog_find(f, n, from_us);
+  uint32_t lookup_us = lookup_done(start, i < n);
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  char chunk[768];
+  int len = snprintf(chunk, sizeof(chunk), "{\"catalogued\":%u,\"lookup_us\":%u,\"segments\":[", n, lookup_us);
+  catalog_entry_t e;
+  uint32_t listed = 0;
+  esp_err_t err = ESP_OK;
+  bool more = false;
+  while (err == ESP_OK && i < n && catalog_read(f, i, &e) && e.start_us <= to_us) {
+    if (listed == RECORDINGS_SPAN_MAX) {
+      more = true;
+      break;
+    }
+    len += snprintf(chunk + len, sizeof(chunk) - len, "%s", listed ? "," : "");
+    len += entry_json(chunk + len, sizeof(chunk) - len, &e);
+    listed++;
+    i++;
+    if (len > (int)sizeof(chunk) - 320) {
+      err = httpd_resp_send_chunk(req, chunk, len);
+      len = 0;
+    }
+  }
+  fclose(f);
+  if (err != ESP_OK) {
+    return err;
+  }
+  len += snprintf(chunk + len, sizeof(chunk) - len, "],\"more\":%s}", more ? "true" : "false");
+  httpd_resp_send_chunk(req, chunk, len);
+  return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+/* The recorded frame nearest t_us, from the catalog and one seek table. */
+static esp_err_t catalog_at(httpd_req_t *req, int64_t t_us) {
+  int64_t start = esp_timer_get_time();
+  FILE *f = fopen(RECORDER_CATALOG, "rb");
+  if (!f) {
+    return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "no catalog");
+  }
+  uint32_t n = catalog_count(f);
+  uint32_t i = catalog_find(f, n, t_us);
+  catalog_entry_t e, prev;
+  bool found = i < n && catalog_read(f, i, &e);
+  // Between segments or after the last one: take the nearer in time.
+  if (i > 0 && catalog_read(f, i - 1, &prev) && (!found || (e.start_us > t_us && t_us - prev.end_us < e.start_us - t_us))) {
+    e = prev;
+    found = true;
+  }
+  fclose(f);
+
+  char path[AVI_MUX_PATH_MAX];
+  char seek_path[AVI_MUX_PATH_MAX + 4];
+  catalog_entry_t info;
+  catalog_frame_t fr;
+  uint32_t have, index;
+  f = NULL;
+  if (found) {
+    snprintf(path, sizeof(path), RECORDER_DIR "/" RECORDER_SEGMENT_NAME, e.seq);
+    catalog_seek_path(path, seek_path, sizeof(seek_path));
+    f = fopen(seek_path, "rb");
+  }
+  int64_t dt = t_us - (found ? e.start_us : 0);
+  dt = dt < 0 ? 0 : dt > UINT32_MAX ? UINT32_MAX : dt;
+  bool ok = f && catalog_seek_info(f, &info, &have) && catalog_seek_nearest(f, have < e.frames ? have : e.frames, (uint32_t)dt, &index, &fr);
+  if (f) {
+    fclose(f);
+  }
+  uint32_t lookup_us = lookup_done(start, ok);
+  if (!ok) {
+    return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, found ? "no seek table for that recording" : "nothing recorded");
+  }
+
+  uint32_t size = fr.size & CATALOG_FRAME_SIZE;
+  char json[384];
+  snprintf(
+    json, sizeof(json),
+    "{\"file\":\"" RECORDER_SEGMENT_NAME "\",\"frame\":%u,\"frames\":%u,\"ts_ms\":%lld,\"offset\":%u,\"size\":%u,\"range\":\"bytes=%u-%u\","
+    "\"motion\":%s,\"segment_start_ms\":%lld,\"segment_end_ms\":%lld,\"lookup_us\":%u}",
+    e.seq, index, e.frames, (e.start_us + fr.dt_us) / 1000, fr.offset, size, fr.offset, fr.offset + size - 1, fr.size & CATALOG_FRAME_MOTION ? "true" : "false",
+    e.start_us / 1000, e.end_us / 1000, lookup_us
+  );
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  return httpd_resp_send(req, json, strlen(json));
+}
+
+esp_err_t recordings_list(httpd_req_t *req) {
+  char query[96];
+  char name[RECORDINGS_NAME_MAX];
+  char from[24], to[24];
+  bool have_query = httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK;
+  if (have_query && httpd_query_key_value(query, "at", from, sizeof(from)) == ESP_OK) {
+    return catalog_at(req, strtoll(from, NULL, 10) * 1000);
+  }
+  bool span_from = have_query && httpd_query_key_value(query, "from", from, sizeof(from)) == ESP_OK;
+  bool span_to = have_query && httpd_query_key_value(query, "to", to, sizeof(to)) == ESP_OK;
+  if (span_from || span_to) {
+    return catalog_span(req, span_from ? strtoll(from, NULL, 10) * 1000 : INT64_MIN, span_to ? strtoll(to, NULL, 10) * 1000 : INT64_MAX);
+  }
+  if (have_query && httpd_query_key_value(query, "bench", name, sizeof(name)) == ESP_OK) {
+    job_t job = {};
+    if (!find_file(name, &job)) {
+      return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "no such recording");
+    }
+    job.bench = true;
+    return dispatch(req, &job);
+  }
+
+  DIR *dir = opendir(RECORDER_DIR);
+  if (!dir) {
+    return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "no recordings");
+  }
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  char chunk[512];
+  char path[AVI_MUX_PATH_MAX];
+  int len = snprintf(chunk, sizeof(chunk), "{\"dir\":\"%s\",\"files\":[", RECORDER_DIR);
+  bool first = true;
+  esp_err_t err = ESP_OK;
+  struct dirent *de;
+  while (err == ESP_OK && (de = readdir(dir)) != NULL) {
+    struct stat st;
+    snprintf(path, sizeof(path), RECORDER_DIR "/%s", de->d_name);
+    if (!valid_name(de->d_name) || stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    len += snprintf(chunk + len, sizeof(chunk) - len, "%s{\"name\":\"%s\",\"bytes\":%lu}", first ? "" : ",", de->d_name, (unsigned long)st.st_size);
+    first = false;
+    if (len > (int)sizeof(chunk) - 96) {
+      err = httpd_resp_send_chunk(req, chunk, len);
+      len = 0;
+    }
+  }
+  closedir(dir);
+  if (err != ESP_OK) {
+    return err;
+  }
+  len += snprintf(chunk + len, sizeof(chunk) - len, "]}");
+  httpd_resp_send_chunk(req, chunk, len);
+  return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+int recordings_stats_json(char *buf, size_t len) {
+  portENTER_CRITICAL(&rec_dl_lock);
+  recordings_stats_t s = stats;
+  portEXIT_CRITICAL(&rec_dl_lock);
+  return snprintf(
+    buf, len,
+    "{\"downloads\":%u,\"ranges\":%u,\"heads\":%u,\"busy\":%u,\"aborted\":%u,\"read_errors\":%u,\"bytes\":%llu,\"read_kBps\":%u,\"send_kBps\":%u,"
+    "\"last_kBps\":%u,\"bench_kBps\":%u,\"bench_bytes\":%u,\"lookups\":%u,\"lookup_misses\":%u,\"lookup_us\":%u,\"lookup_us_max\":%u}",
+    s.downloads, s.ranges, s.heads, s.busy, s.aborted, s.read_errors, s.bytes, s.read_us ? (uint32_t)(s.bytes * 1000 / s.read_us) : 0,
+    s.send_us ? (uint32_t)(s.bytes * 1000 / s.send_us) : 0, s.last_kBps, s.bench_kBps, s.bench_bytes, s.lookups, s.lookup_misses, s.lookup_us,
+    s.lookup_us_max
+  );
+}
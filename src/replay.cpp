@@ -0,0 +1,593 @@
+/**
+ * Replay reader task and frame slots.
+ *
+ * The reader fills a free slot from the file, waits for the frame's time
+ * (or, REPLAY_FAST, for the published frame to be taken), then publishes it
+ * and pulses the event group bit like the substream producer does. The
+ * published slot holds one reference of its own and every consumer one
+ * more; a slot is refilled only when nothing references it.
+ *
+ * Consumers wake the reader through the wake semaphore, never through a task
+ * notification: the task deletes itself at the end of a non-looping file
+ * while consumers may still hold frames, and a semaphore outlives it.
+ *
+ * The MJPEG scanner looks for SOI and EOI markers only, which is enough for
+ * camera output: entropy-coded data cannot contain 0xFF 0xD9 and the sensor
+ * writes no embedded thumbnails. Text between frames is read line by line
+ * for an X-Timestamp header.
+ */
+#include "replay.h"
+#include <Arduino.h>
+#include <limits.h>
+#include <stdio.h>
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "events.h"
+#include "jpeg_dct.h"
+
+#define REPLAY_TASK_STACK 4096
+#define REPLAY_TASK_PRIO  5
+#define REPLAY_POLL_MS    100
+#define REPLAY_LATE_MS    250    // a timed frame this late rebases the clock instead of bursting
+#define FRAME_BIT         1
+
+typedef enum {
+  FORMAT_MJPEG,
+  FORMAT_AVI,
+} replay_format_t;
+
+typedef enum {
+  REPLAY_IDLE,
+  REPLAY_PLAYING,
+  REPLAY_ENDED,
+} replay_state_t;
+
+static const char *format_names[] = {"mjpeg", "avi"};
+static const char *pace_names[] = {"timed", "fast"};
+static const char *state_names[] = {"idle", "playing", "ended"};
+
+typedef struct {
+  FILE *f;
+  replay_format_t format;
+  uint8_t *rd;             // MJPEG read-ahead
+  size_t rd_pos;
+  size_t rd_len;
+  char line[40];           // header line between MJPEG parts
+  uint8_t line_len;
+  int64_t part_ts_us;      // X-Timestamp of the next part, -1 if none
+  int64_t first_ts_us;     // first X-Timestamp of this pass, -1 if none
+  long movi_start;         // AVI
+  long movi_end;
+  long pos;
+  uint32_t frame_us;       // nominal frame period
+  uint32_t index;          // frames read this pass
+} reader_t;
+
+typedef struct {
+  camera_fb_t fb;
+  uint8_t *buf;
+  uint32_t refs;
+} slot_t;
+
+typedef struct {
+  uint32_t frames;         // published
+  uint32_t loops;
+  uint64_t bytes;          // frame bytes published
+  uint64_t read_bytes;     // bytes read from the file
+  uint64_t read_us;        // time spent reading
+  uint32_t oversize;       // frames over REPLAY_FRAME_MAX, skipped
+  uint32_t bad;            // frames without a readable frame header, skipped
+  uint32_t late;           // timed frames that missed their time by REPLAY_LATE_MS
+  uint32_t slot_waits;     // every slot held by consumers
+  uint32_t last_ts_ms;     // recorded time of the last published frame
+  int64_t start_us;
+} replay_stats_t;
+
+static portMUX_TYPE replay_lock = portMUX_INITIALIZER_UNLOCKED;
+static replay_config_t cfg;
+static reader_t reader;
+static slot_t slots[REPLAY_SLOTS];
+static int current = -1;
+static uint32_t seq;
+static bool taken;
+static bool stop;
+static replay_state_t state;
+static replay_stats_t stats;
+static EventGroupHandle_t frame_events = NULL;
+static SemaphoreHandle_t done = NULL;
+static SemaphoreHandle_t wake = NULL;   // consumers -> reader task
+static TaskHandle_t replay_task_handle = NULL;
+
+static uint32_t le32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static bool read_exact(FILE *f, void *buf, size_t len) {
+  return fread(buf, 1, len, f) == len;
+}
+
+static esp_err_t avi_open(reader_t *r) {
+  uint8_t h[12];
+  fseek(r->f, 12, SEEK_SET);
+  while (read_exact(r->f, h, 8)) {
+    uint32_t size = le32(h + 4);
+    long body = ftell(r->f);
+    if (!memcmp(h, "LIST", 4) && read_exact(r->f, h + 8, 4)) {
+      if (!memcmp(h + 8, "movi", 4)) {
+        r->movi_start = body + 4;
+        r->movi_end = size ? body + size : LONG_MAX;  // never finalised: play to the end of the file
+        r->pos = r->movi_start;
+        return ESP_OK;
+      }
+      uint8_t avih[12];
+      if (!memcmp(h + 8, "hdrl", 4) && read_exact(r->f, avih, sizeof(avih)) && !memcmp(avih, "avih", 4) && le32(avih + 8)) {
+        r->frame_us = le32(avih + 8);
+      }
+    }
+    fseek(r->f, body + size + (size & 1), SEEK_SET);
+  }
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+static size_t avi_next(reader_t *r, uint8_t *out, size_t cap) {
+  uint8_t h[8];
+  while (r->pos + 8 <= r->movi_end) {
+    if (!read_exact(r->f, h, sizeof(h))) {
+      return 0;
+    }
+    uint32_t size = le32(h + 4);
+    if (!memcmp(h, "LIST", 4)) {
+      r->pos += 12;  // 'rec ' groups: read their chunks in line
+      fseek(r->f, r->pos, SEEK_SET);
+      continue;
+    }
+    long next = r->pos + 8 + size + (size & 1);
+    if (h[2] == 'd' && (h[3] == 'c' || h[3] == 'b') && size) {
+      if (size <= cap) {
+        if (!read_exact(r->f, out, size)) {
+          return 0;  // cut short
+        }
+        r->pos = next;
+        if (size & 1) {
+          fseek(r->f, next, SEEK_SET);
+        }
+        return size;
+      }
+      stats.oversize++;
+    }
+    r->pos = next;
+    fseek(r->f, next, SEEK_SET);
+  }
+  return 0;
+}
+
+static bool fill(reader_t *r) {
+  r->rd_pos = 0;
+  r->rd_len = fread(r->rd, 1, REPLAY_READ_CHUNK, r->f);
+  return r->rd_len > 0;
+}
+
+static void header_byte(reader_t *r, uint8_t b) {
+  if (b != '\n') {
+    if (b != '\r' && r->line_len < sizeof(r->line) - 1) {
+      r->line[r->line_len++] = b;
+    }
+    return;
+  }
+  r->line[r->line_len] = 0;
+  r->line_len = 0;
+  long sec, usec;
+  if (!strncasecmp(r->line, "X-Timestamp:", 12) && sscanf(r->line + 12, " %ld.%ld", &sec, &usec) == 2) {
+    r->part_ts_us = (int64_t)sec * 1000000 + usec;
+  }
+}
+
+/* The next complete SOI..EOI run; ts_us gets the part's X-Timestamp, or -1. */
+static size_t mjpeg_next(reader_t *r, uint8_t *out, size_t cap, int64_t *ts_us) {
+  bool in_frame = false;
+  bool prev_ff = false;
+  bool oversize = false;
+  size_t n = 0;
+
+  while (true) {
+    if (r->rd_pos == r->rd_len && !fill(r)) {
+      return 0;  // a frame cut short by the end of the file is dropped
+    }
+    const uint8_t *p = r->rd + r->rd_pos;
+    size_t avail = r->rd_len - r->rd_pos;
+
+    if (!in_frame) {
+      uint8_t b = *p;
+      r->rd_pos++;
+      if (prev_ff && b == 0xD8) {
+        in_frame = true;
+        oversize = false;
+        prev_ff = false;
+        out[0] = 0xFF;
+        out[1] = 0xD8;
+        n = 2;
+        *ts_us = r->part_ts_us;
+        r->part_ts_us = -1;
+        continue;
+      }
+      prev_ff = b == 0xFF;
+      header_byte(r, b);
+      continue;
+    }
+
+    size_t take;
+    bool end = false;
+    if (prev_ff) {
+      take = 1;
+      end = *p == 0xD9;
+      prev_ff = *p == 0xFF;
+    } else {
+      const uint8_t *ff = (const uint8_t *)memchr(p, 0xFF, avail);
+      take = ff ? ff - p + 1 : avail;
+      prev_ff = ff != NULL;
+    }
+    if (n + take <= cap) {
+      memcpy(out + n, p, take);
+      n += take;
+    } else {
+      oversize = true;
+    }
+    r->rd_pos += take;
+    if (end) {
+      if (!oversize) {
+        return n;
+      }
+      stats.oversize++;
+      in_frame = false;
+      prev_ff = false;
+    }
+  }
+}
+
+static void rewind_reader(reader_t *r) {
+  if (r->format == FORMAT_AVI) {
+    r->pos = r->movi_start;
+    fseek(r->f, r->pos, SEEK_SET);
+  } else {
+    fseek(r->f, 0, SEEK_SET);
+    r->rd_pos = r->rd_len = 0;
+  }
+  r->line_len = 0;
+  r->part_ts_us = -1;
+  r->first_ts_us = -1;
+  r->index = 0;
+}
+
+/* Reads the next frame into out and its time from the start of the pass. */
+static size_t next_frame(reader_t *r, uint8_t *out, size_t cap, int64_t *ts_us) {
+  int64_t part_ts = -1;
+  int64_t start = esp_timer_get_time();
+  long before = ftell(r->f);
+  size_t len = r->format == FORMAT_AVI ? avi_next(r, out, cap) : mjpeg_next(r, out, cap, &part_ts);
+  long after = ftell(r->f);
+  portENTER_CRITICAL(&replay_lock);
+  stats.read_us += esp_timer_get_time() - start;
+  stats.read_bytes += after > before ? after - before : 0;
+  portEXIT_CRITICAL(&replay_lock);
+  if (!len) {
+    return 0;
+  }
+  if (part_ts >= 0) {
+    if (r->first_ts_us < 0) {
+      r->first_ts_us = part_ts;
+    }
+    *ts_us = part_ts - r->first_ts_us;
+  } else {
+    *ts_us = (int64_t)r->index * r->frame_us;
+  }
+  r->index++;
+  return len;
+}
+
+static int free_slot() {
+  int found = -1;
+  portENTER_CRITICAL(&replay_lock);
+  for (int i = 0; i < REPLAY_SLOTS && found < 0; i++) {
+    if (!slots[i].refs) {
+      found = i;
+    }
+  }
+  portEXIT_CRITICAL(&replay_lock);
+  return found;
+}
+
+static bool stopping() {
+  portENTER_CRITICAL(&replay_lock);
+  bool s = stop;
+  portEXIT_CRITICAL(&replay_lock);
+  return s;
+}
+
+/* REPLAY_FAST: nothing is published over a frame nobody has picked up yet. */
+static bool published_taken() {
+  portENTER_CRITICAL(&replay_lock);
+  bool t = current < 0 || taken;
+  portEXIT_CRITICAL(&replay_lock);
+  return t;
+}
+
+static void publish(int slot, int64_t ts_us) {
+  int64_t now = esp_timer_get_time();
+  camera_fb_t *fb = &slots[slot].fb;
+  fb->timestamp.tv_sec = now / 1000000;
+  fb->timestamp.tv_usec = now % 1000000;
+  portENTER_CRITICAL(&replay_lock);
+  if (current >= 0) {
+    slots[current].refs--;
+  }
+  current = slot;
+  slots[slot].refs++;
+  taken = false;
+  seq++;
+  stats.frames++;
+  stats.bytes += fb->len;
+  stats.last_ts_ms = ts_us / 1000;
+  portEXIT_CRITICAL(&replay_lock);
+  xEventGroupSetBits(frame_events, FRAME_BIT);
+  xEventGroupClearBits(frame_events, FRAME_BIT);
+}
+
+static void replay_task(void *arg) {
+  int64_t epoch = esp_timer_get_time();
+  int64_t last_due = epoch;
+  bool ended = false;
+
+  while (!stopping()) {
+    int slot = free_slot();
+    if (slot < 0) {
+      portENTER_CRITICAL(&replay_lock);
+      stats.slot_waits++;
+      portEXIT_CRITICAL(&replay_lock);
+      xSemaphoreTake(wake, pdMS_TO_TICKS(REPLAY_POLL_MS));
+      continue;
+    }
+    int64_t ts_us;
+    size_t len = next_frame(&reader, slots[slot].buf, REPLAY_FRAME_MAX, &ts_us);
+    if (!len) {
+      if (!cfg.loop || !reader.index) {
+        ended = true;  // a pass without a single frame would spin
+        break;
+      }
+      rewind_reader(&reader);
+      epoch = last_due + reader.frame_us;
+      portENTER_CRITICAL(&replay_lock);
+      stats.loops++;
+      portEXIT_CRITICAL(&replay_lock);
+      continue;
+    }
+    camera_fb_t *fb = &slots[slot].fb;
+    uint16_t width, height;
+    if (!jpeg_size(slots[slot].buf, len, &width, &height)) {
+      portENTER_CRITICAL(&replay_lock);
+      stats.bad++;
+      portEXIT_CRITICAL(&replay_lock);
+      continue;
+    }
+    fb->len = len;
+    fb->width = width;
+    fb->height = height;
+
+    if (cfg.pace == REPLAY_TIMED) {
+      int64_t due = epoch + ts_us;
+      int64_t wait;
+      while ((wait = due - esp_timer_get_time()) >= 1000 && !stopping()) {
+        xSemaphoreTake(wake, pdMS_TO_TICKS(wait / 1000));
+      }
+      if (wait < -(int64_t)REPLAY_LATE_MS * 1000) {
+        epoch -= wait;
+        due -= wait;
+        portENTER_CRITICAL(&replay_lock);
+        stats.late++;
+        portEXIT_CRITICAL(&replay_lock);
+      }
+      last_due = due;
+    } else {
+      while (!published_taken() && !stopping()) {
+        xSemaphoreTake(wake, pdMS_TO_TICKS(REPLAY_POLL_MS));
+      }
+    }
+    if (stopping()) {
+      break;
+    }
+    publish(slot, ts_us);
+  }
+
+  portENTER_CRITICAL(&replay_lock);
+  state = ended ? REPLAY_ENDED : REPLAY_IDLE;
+  uint32_t frames = stats.frames;
+  portEXIT_CRITICAL(&replay_lock);
+  if (ended) {
+    log_i("Replay of %s ended after %u frames", cfg.path, frames);
+    char ev[48];
+    snprintf(ev, sizeof(ev), "{\"state\":\"ended\",\"frames\":%u}", frames);
+    events_publish("replay", ev);
+  }
+  xSemaphoreGive(done);
+  vTaskDelete(NULL);
+}
+
+static void free_slots() {
+  for (int i = 0; i < REPLAY_SLOTS; i++) {
+    free(slots[i].buf);
+    memset(&slots[i], 0, sizeof(slots[i]));
+  }
+  free(reader.rd);
+  reader.rd = NULL;
+  if (reader.f) {
+    fclose(reader.f);
+    reader.f = NULL;
+  }
+}
+
+/* Format from the first bytes; an MJPEG file has to show a SOI early on. */
+static esp_err_t probe(reader_t *r) {
+  uint8_t head[12];
+  size_t n = fread(head, 1, sizeof(head), r->f);
+  if (n == sizeof(head) && !memcmp(head, "RIFF", 4) && !memcmp(head + 8, "AVI ", 4)) {
+    r->format = FORMAT_AVI;
+    return avi_open(r);
+  }
+  r->format = FORMAT_MJPEG;
+  rewind_reader(r);
+  if (!fill(r)) {
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+  for (size_t i = 0; i + 1 < r->rd_len; i++) {
+    if (r->rd[i] == 0xFF && r->rd[i + 1] == 0xD8) {
+      rewind_reader(r);
+      return ESP_OK;
+    }
+  }
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t replay_open(const replay_config_t *config) {
+  if (replay_task_handle) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (!frame_events) {
+    frame_events = xEventGroupCreate();
+    done = xSemaphoreCreateBinary();
+    wake = xSemaphoreCreateBinary();
+  }
+  if (!frame_events || !done || !wake) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  cfg = *config;
+  cfg.path[sizeof(cfg.path) - 1] = 0;
+  memset(&reader, 0, sizeof(reader));
+  reader.frame_us = 1000000 / (cfg.fps ? cfg.fps : REPLAY_DEFAULT_FPS);
+  reader.part_ts_us = -1;
+  reader.first_ts_us = -1;
+  reader.f = fopen(cfg.path, "rb");
+  if (!reader.f) {
+    log_e("Replay: cannot open %s", cfg.path);
+    return ESP_ERR_NOT_FOUND;
+  }
+  reader.rd = (uint8_t *)heap_caps_malloc(REPLAY_READ_CHUNK, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  bool ok = reader.rd != NULL;
+  for (int i = 0; i < REPLAY_SLOTS && ok; i++) {
+    slots[i].buf = (uint8_t *)heap_caps_malloc(REPLAY_FRAME_MAX, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    slots[i].fb.buf = slots[i].buf;
+    slots[i].fb.format = PIXFORMAT_JPEG;
+    ok = slots[i].buf != NULL;
+  }
+  if (!ok) {
+    free_slots();
+    return ESP_ERR_NO_MEM;
+  }
+  esp_err_t err = probe(&reader);
+  if (err != ESP_OK) {
+    log_e("Replay: %s is not an MJPEG or AVI file", cfg.path);
+    free_slots();
+    return err;
+  }
+
+  portENTER_CRITICAL(&replay_lock);
+  memset(&stats, 0, sizeof(stats));
+  stats.start_us = esp_timer_get_time();
+  current = -1;
+  taken = false;
+  stop = false;
+  state = REPLAY_PLAYING;
+  portEXIT_CRITICAL(&replay_lock);
+  xSemaphoreTake(done, 0);
+  xSemaphoreTake(wake, 0);
+  if (xTaskCreatePinnedToCore(replay_task, "replay", REPLAY_TASK_STACK, NULL, REPLAY_TASK_PRIO, &replay_task_handle, tskNO_AFFINITY) != pdPASS) {
+    replay_task_handle = NULL;
+    state = REPLAY_IDLE;
+    free_slots();
+    return ESP_ERR_NO_MEM;
+  }
+  log_i("Replay: %s (%s, %s%s)", cfg.path, format_names[reader.format], pace_names[cfg.pace], cfg.loop ? ", loop" : "");
+  return ESP_OK;
+}
+
+void replay_close() {
+  if (!replay_task_handle) {
+    return;
+  }
+  portENTER_CRITICAL(&replay_lock);
+  stop = true;
+  portEXIT_CRITICAL(&replay_lock);
+  xSemaphoreGive(wake);
+  xSemaphoreTake(done, portMAX_DELAY);  // given once the task is done with the file, also after it ended
+  replay_task_handle = NULL;
+
+  portENTER_CRITICAL(&replay_lock);
+  current = -1;
+  state = REPLAY_IDLE;
+  portEXIT_CRITICAL(&replay_lock);
+  free_slots();
+}
+
+camera_fb_t *replay_fb_get(uint32_t timeout_ms) {
+  int64_t deadline = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+  bool entered = false;
+  uint32_t last_seq = 0;
+  while (true) {
+    portENTER_CRITICAL(&replay_lock);
+    int slot = -1;
+    if (current >= 0 && (!taken || (entered && seq != last_seq))) {
+      slot = current;
+      slots[slot].refs++;
+      taken = true;
+    }
+    if (!entered) {
+      entered = true;
+      last_seq = seq;
+    }
+    portEXIT_CRITICAL(&replay_lock);
+    if (slot >= 0) {
+      if (cfg.pace == REPLAY_FAST) {
+        xSemaphoreGive(wake);
+      }
+      return &slots[slot].fb;
+    }
+    int64_t left_ms = (deadline - esp_timer_get_time()) / 1000;
+    if (left_ms <= 0) {
+      return NULL;
+    }
+    xEventGroupWaitBits(frame_events, FRAME_BIT, pdFALSE, pdFALSE, pdMS_TO_TICKS(left_ms < REPLAY_POLL_MS ? left_ms : REPLAY_POLL_MS));
+  }
+}
+
+void replay_fb_return(camera_fb_t *fb) {
+  for (int i = 0; i < REPLAY_SLOTS; i++) {
+    if (fb == &slots[i].fb) {
+      portENTER_CRITICAL(&replay_lock);
+      slots[i].refs--;
+      portEXIT_CRITICAL(&replay_lock);
+      if (cfg.pace == REPLAY_FAST) {
+        xSemaphoreGive(wake);  // may have been waiting for a slot
+      }
+      return;
+    }
+  }
+}
+
+int replay_stats_json(char *buf, size_t len) {
+  portENTER_CRITICAL(&replay_lock);
+  replay_stats_t s = stats;
+  replay_state_t st = state;
+  portEXIT_CRITICAL(&replay_lock);
+  if (st == REPLAY_IDLE && !replay_task_handle) {
+    return snprintf(buf, len, "{\"state\":\"idle\"}");
+  }
+  uint32_t elapsed_ms = (uint32_t)((esp_timer_get_time() - s.start_us) / 1000);
+  uint32_t fps_x10 = elapsed_ms ? (uint32_t)((uint64_t)s.frames * 10000 / elapsed_ms) : 0;
+  uint32_t read_kbps = s.read_us ? (uint32_t)(s.read_bytes * 1000 / s.read_us) : 0;  // bytes per ms = KB/s
+  return snprintf(
+    buf, len,
+    "{\"state\":\"%s\",\"path\":\"%s\",\"format\":\"%s\",\"pace\":\"%s\",\"loop\":%s,\"frame_us\":%u,\"frames\":%u,\"loops\":%u,\"fps\":%u.%u,"
+    "\"bytes\":%llu,\"read_bytes\":%llu,\"read_kBps\":%u,\"oversize\":%u,\"bad\":%u,\"late\":%u,\"slot_waits\":%u,\"position_ms\":%u}",
+    state_names[st], cfg.path, format_names[reader.format], pace_names[cfg.pace], cfg.loop ? "true" : "false", reader.frame_us, s.frames, s.loops,
+    fps_x10 / 10, fps_x10 % 10, s.bytes, s.read_bytes, read_kbps, s.oversize, s.bad, s.late, s.slot_waits, s.last_ts_ms
+  );
+}
@@ -0,0 +1,185 @@
+/**
+ * RTP/JPEG packetiser (RFC 2435).
+ *
+ * Only baseline YCbCr JPEGs with 8-bit tables and 2x1 or 2x2 luma
+ * subsampling map onto types 0/1; that is what the camera produces. The
+ * receiver assumes the standard Huffman tables from the JPEG spec, which the
+ * sensor's encoder also uses.
+ */
+#include "rtp_jpeg.h"
+#include <string.h>
+
+#define RTP_JPEG_MAX_PACKET 1500
+#define JPEG_Q_DYNAMIC      255
+
+static inline uint16_t rd16(const uint8_t *p) {
+  return (p[0] << 8) | p[1];
+}
+
+bool rtp_jpeg_parse(const uint8_t *jpg, size_t len, rtp_jpeg_frame_t *frame) {
+  const uint8_t *qt_by_id[4] = {NULL, NULL, NULL, NULL};
+  uint8_t comp_tq[3] = {0, 0, 0};
+  uint8_t luma_sampling = 0;
+  bool chroma_ok = false;
+  bool have_sof = false;
+
+  memset(frame, 0, sizeof(*frame));
+  if (len < 4 || jpg[0] != 0xFF || jpg[1] != 0xD8) {
+    return false;
+  }
+
+  size_t off = 2;
+  while (off + 4 <= len) {
+    if (jpg[off] != 0xFF) {
+      return false;
+    }
+    uint8_t marker = jpg[off + 1];
+    if (marker == 0xFF) {  // fill byte
+      off++;
+      continue;
+    }
+    size_t seg_len = rd16(jpg + off + 2);
+    if (seg_len < 2 || off + 2 + seg_len > len) {
+      return false;
+    }
+    const uint8_t *seg = jpg + off + 4;
+    size_t body = seg_len - 2;
+
+    if (marker == 0xDB) {  // DQT, possibly several tables
+      for (size_t i = 0; i < body; i += 65) {
+        uint8_t pq = seg[i] >> 4;
+        uint8_t tq = seg[i] & 0x0F;
+        if (pq != 0 || tq > 3 || i + 65 > body) {
+          return false;
+        }
+        qt_by_id[tq] = seg + i + 1;
+      }
+    } else if (marker == 0xC0) {  // SOF0
+      if (body < 15 || seg[0] != 8 || seg[5] != 3) {
+        return false;
+      }
+      frame->height = rd16(seg + 1);
+      frame->width = rd16(seg + 3);
+      luma_sampling = seg[7];
+      comp_tq[0] = seg[8];
+      comp_tq[1] = seg[11];
+      comp_tq[2] = seg[14];
+      chroma_ok = seg[10] == 0x11 && seg[13] == 0x11 && comp_tq[1] == comp_tq[2];
+      have_sof = true;
+    } else if (marker >= 0xC1 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+      return false;  // progressive, lossless, arithmetic...
+    } else if (marker == 0xDD) {  // DRI
+      if (body < 2) {
+        return false;
+      }
+      frame->restart_interval = rd16(seg);
+    } else if (marker == 0xDA) {  // SOS: entropy-coded data follows
+      if (!have_sof || !chroma_ok || comp_tq[0] > 3 || comp_tq[1] > 3) {
+        return false;
+      }
+      if (luma_sampling == 0x21) {
+        frame->type = 0;
+      } else if (luma_sampling == 0x22) {
+        frame->type = 1;
+      } else {
+        return false;
+      }
+      if (frame->restart_interval) {
+        frame->type += 64;
+      }
+      frame->qt[0] = qt_by_id[comp_tq[0]];
+      frame->qt[1] = qt_by_id[comp_tq[1]];
+      if (!frame->qt[0] || !frame->qt[1] || !frame->width || !frame->height || frame->width > 2040 || frame->height > 2040) {
+        return false;
+      }
+
+      size_t start = off + 2 + seg_len;
+      size_t end = len;
+      // The sensor may pad the buffer after EOI.
+      while (end >= start + 2 && !(jpg[end - 2] == 0xFF && jpg[end - 1] == 0xD9)) {
+        end--;
+      }
+      if (end < start + 2) {
+        end = len;
+      } else {
+        end -= 2;
+      }
+      frame->scan = jpg + start;
+      frame->scan_len = end - start;
+      return frame->scan_len > 0;
+    }
+    off += 2 + seg_len;
+  }
+  return false;
+}
+
+int rtp_jpeg_send_frame(rtp_jpeg_stream_t *stream, const rtp_jpeg_frame_t *frame, uint32_t timestamp, rtp_jpeg_send_cb cb, void *ctx) {
+  uint8_t buf[RTP_JPEG_HEADROOM + RTP_JPEG_MAX_PACKET];
+  uint8_t *pkt = buf + RTP_JPEG_HEADROOM;
+  size_t mtu = stream->mtu < RTP_JPEG_MAX_PACKET ? stream->mtu : RTP_JPEG_MAX_PACKET;
+  bool restart = frame->type >= 64;
+  size_t offset = 0;
+  int packets = 0;
+
+  while (offset < frame->scan_len) {
+    uint8_t *p = pkt;
+
+    *p++ = 0x80;  // V=2
+    *p++ = RTP_JPEG_PAYLOAD_TYPE;
+    *p++ = stream->seq >> 8;
+    *p++ = stream->seq & 0xFF;
+    *p++ = timestamp >> 24;
+    *p++ = (timestamp >> 16) & 0xFF;
+    *p++ = (timestamp >> 8) & 0xFF;
+    *p++ = timestamp & 0xFF;
+    *p++ = stream->ssrc >> 24;
+    *p++ = (stream->ssrc >> 16) & 0xFF;
+    *p++ = (stream->ssrc >> 8) & 0xFF;
+    *p++ = stream->ssrc & 0xFF;
+
+    *p++ = 0;  // type-specific
+    *p++ = (offset >> 16) & 0xFF;
+    *p++ = (offset >> 8) & 0xFF;
+    *p++ = offset & 0xFF;
+    *p++ = frame->type;
+    *p++ = JPEG_Q_DYNAMIC;
+    *p++ = (frame->width + 7) / 8;
+    *p++ = (frame->height + 7) / 8;
+
+    if (restart) {
+      *p++ = frame->restart_interval >> 8;
+      *p++ = frame->restart_interval & 0xFF;
+      *p++ = 0xFF;  // F=1, L=1, count=0x3FFF: no chunk alignment promised
+      *p++ = 0xFF;
+    }
+
+    if (offset == 0) {
+      *p++ = 0;  // MBZ
+      *p++ = 0;  // precision: both tables 8-bit
+      *p++ = 0;
+      *p++ = 128;
+      memcpy(p, frame->qt[0], 64);
+      memcpy(p + 64, frame->qt[1], 64);
+      p += 128;
+    }
+
+    size_t room = mtu - (p - pkt);
+    size_t n = frame->scan_len - offset;
+    if (n > room) {
+      n = room;
+    }
+    memcpy(p, frame->scan + offset, n);
+    p += n;
+    offset += n;
+    if (offset == frame->scan_len) {
+      pkt[1] |= 0x80;  // marker: last packet of the frame
+    }
+
+    if (cb(ctx, pkt, p - pkt)) {
+      return -1;
+    }
+    stream->seq++;
+    packets++;
+  }
+  return packets;
+}
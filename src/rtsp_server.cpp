@@ -0,0 +1,485 @@
+/**
+ * RTSP server (RFC 2326 subset) with RTP/JPEG over UDP or interleaved TCP.
+ *
+ * A listener task accepts up to RTSP_MAX_CLIENTS connections and gives each
+ * one a task. While a client is PLAYING its task grabs a frame, packetises it
+ * and polls the control socket between frames for further requests.
+ */
+#include "rtsp_server.h"
+#include <Arduino.h>
+#include "lwip/sockets.h"
+#include "esp_camera.h"
+#include "capture.h"
+#include "power_gov.h"
+#include "sessions.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "rtp_jpeg.h"
+
+#define RTSP_MAX_CLIENTS       2
+#define RTSP_TASK_STACK        6144
+#define RTSP_TASK_PRIO         5
+#define RTSP_REQ_BUF           1024
+#define RTSP_SESSION_TIMEOUT_S 60
+#define RTSP_SEND_TIMEOUT_S    2
+#define RTSP_RTP_MTU           1400
+
+typedef struct {
+  int sock;
+  struct sockaddr_in peer;
+  struct sockaddr_in local;
+  uint32_t session_id;
+  bool setup;
+  bool playing;
+  bool tcp;
+  uint8_t rtp_channel;
+  int rtp_sock;
+  rtp_jpeg_stream_t rtp;
+  int64_t last_request_us;
+  int session;                  // sessions table slot
+  size_t buf_len;
+  char buf[RTSP_REQ_BUF];
+} rtsp_client_t;
+
+typedef struct {
+  uint32_t active;
+  uint32_t sessions;
+  uint32_t refused;
+  uint32_t frames;
+  uint32_t packets;
+  uint64_t bytes;
+  uint32_t send_errors;
+  uint32_t bad_frames;
+} rtsp_stats_t;
+
+static rtsp_stats_t stats;
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static int listen_sock = -1;
+static uint16_t rtsp_port = 0;
+
+static int send_all(int sock, const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *)data;
+  while (len) {
+    int n = send(sock, p, len, 0);
+    if (n <= 0) {
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int rtp_send_udp(void *ctx, uint8_t *pkt, size_t len) {
+  rtsp_client_t *c = (rtsp_client_t *)ctx;
+  // A full socket buffer on UDP means drop, not stall: skip the packet.
+  if (send(c->rtp_sock, pkt, len, 0) < 0 && errno != ENOMEM && errno != EAGAIN) {
+    return -1;
+  }
+  return 0;
+}
+
+static int rtp_send_tcp(void *ctx, uint8_t *pkt, size_t len) {
+  rtsp_client_t *c = (rtsp_client_t *)ctx;
+  uint8_t *frame = pkt - RTP_JPEG_HEADROOM;
+  frame[0] = '$';
+  frame[1] = c->rtp_channel;
+  frame[2] = len >> 8;
+  frame[3] = len & 0xFF;
+  return send_all(c->sock, frame, len + RTP_JPEG_HEADROOM);
+}
+
+/* Case-insensitive lookup of a header value inside the request head. */
+static bool header_value(const char *req, const char *name, char *out, size_t out_len) {
+  size_t name_len = strlen(name);
+  for (const char *line = strstr(req, "\r\n"); line; line = strstr(line, "\r\n")) {
+    line += 2;
+    if (!strncasecmp(line, name, name_len) && line[name_len] == ':') {
+      const char *v = line + name_len + 1;
+      while (*v == ' ') {
+        v++;
+      }
+      size_t n = strcspn(v, "\r\n");
+      if (n >= out_len) {
+        n = out_len - 1;
+      }
+      memcpy(out, v, n);
+      out[n] = 0;
+      return true;
+    }
+  }
+  return false;
+}
+
+static int send_response(rtsp_client_t *c, const char *status, const char *cseq, const char *extra, const char *body) {
+  char head[512];
+  int n = snprintf(head, sizeof(head), "RTSP/1.0 %s\r\nCSeq: %s\r\nServer: NohJEye\r\n", status, cseq);
+  if (c->setup) {
+    n += snprintf(head + n, sizeof(head) - n, "Session: %08X;timeout=%d\r\n", c->session_id, RTSP_SESSION_TIMEOUT_S);
+  }
+  if (extra) {
+    n += snprintf(head + n, sizeof(head) - n, "%s", extra);
+  }
+  if (body) {
+    n += snprintf(head + n, sizeof(head) - n, "Content-Length: %u\r\n", (unsigned)strlen(body));
+  }
+  n += snprintf(head + n, sizeof(head) - n, "\r\n");
+  if (n >= (int)sizeof(head) || send_all(c->sock, head, n) != 0) {
+    return -1;
+  }
+  return body ? send_all(c->sock, body, strlen(body)) : 0;
+}
+
+static int handle_describe(rtsp_client_t *c, const char *cseq) {
+  char ip[16];
+  char extra[128];
+  char sdp[256];
+  inet_ntop(AF_INET, &c->local.sin_addr, ip, sizeof(ip));
+  snprintf(extra, sizeof(extra), "Content-Base: rtsp://%s:%u/\r\nContent-Type: application/sdp\r\n", ip, rtsp_port);
+  snprintf(
+    sdp, sizeof(sdp),
+    "v=0\r\no=- %u 1 IN IP4 %s\r\ns=NohJEye\r\nc=IN IP4 0.0.0.0\r\nt=0 0\r\n"
+    "m=video 0 RTP/AVP %d\r\na=control:track1\r\n",
+    (unsigned)esp_random(), ip, RTP_JPEG_PAYLOAD_TYPE
+  );
+  return send_response(c, "200 OK", cseq, extra, sdp);
+}
+
+static int handle_setup(rtsp_client_t *c, const char *cseq, const char *req) {
+  char transport[128];
+  char extra[192];
+  unsigned a = 0, b = 0;
+
+  if (!header_value(req, "Transport", transport, sizeof(transport))) {
+    return send_response(c, "461 Unsupported Transport", cseq, NULL, NULL);
+  }
+  if (c->rtp_sock >= 0) {
+    close(c->rtp_sock);
+    c->rtp_sock = -1;
+  }
+
+  const char *il = strstr(transport, "interleaved=");
+  const char *cp = strstr(transport, "client_port=");
+  if (strstr(transport, "RTP/AVP/TCP") || il) {
+    c->tcp = true;
+    if (!il || sscanf(il, "interleaved=%u-%u", &a, &b) != 2) {
+      a = 0;
+      b = 1;
+    }
+    c->rtp_channel = a;
+    snprintf(extra, sizeof(extra), "Transport: RTP/AVP/TCP;unicast;interleaved=%u-%u;ssrc=%08X\r\n", a, b, c->rtp.ssrc);
+  } else if (cp && sscanf(cp, "client_port=%u-%u", &a, &b) >= 1) {
+    c->tcp = false;
+    c->rtp_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct sockaddr_in bind_addr;
+    memset(&bind_addr, 0, sizeof(bind_addr));
+    bind_addr.sin_family = AF_INET;
+    bind_addr.sin_addr = c->local.sin_addr;
+    socklen_t bind_len = sizeof(bind_addr);
+    struct sockaddr_in dest = c->peer;
+    dest.sin_port = htons(a);
+    if (c->rtp_sock < 0 || bind(c->rtp_sock, (struct sockaddr *)&bind_addr, sizeof(bind_addr)) != 0
+        || getsockname(c->rtp_sock, (struct sockaddr *)&bind_addr, &bind_len) != 0 || connect(c->rtp_sock, (struct sockaddr *)&dest, sizeof(dest)) != 0) {
+      return send_response(c, "500 Internal Server Error", cseq, NULL, NULL);
+    }
+    // Only the RTP port: no RTCP is sent or read, so no second port is bound to offer.
+    unsigned server_port = ntohs(bind_addr.sin_port);
+    snprintf(
+      extra, sizeof(extra), "Transport: RTP/AVP;unicast;client_port=%u-%u;server_port=%u;ssrc=%08X\r\n", a, b ? b : a + 1, server_port, c->rtp.ssrc
+    );
+  } else {
+    return send_response(c, "461 Unsupported Transport", cseq, NULL, NULL);
+  }
+  c->setup = true;
+  return send_response(c, "200 OK", cseq, extra, NULL);
+}
+
+static int handle_play(rtsp_client_t *c, const char *cseq, const char *url) {
+  char extra[192];
+  if (!c->setup) {
+    return send_response(c, "455 Method Not Valid in This State", cseq, NULL, NULL);
+  }
+  uint32_t rtptime = (uint32_t)(esp_timer_get_time() * 9 / 100);
+  snprintf(extra, sizeof(extra), "Range: npt=0.000-\r\nRTP-Info: url=%s;seq=%u;rtptime=%u\r\n", url, c->rtp.seq, rtptime);
+  c->playing = true;
+  return send_response(c, "200 OK", cseq, extra, NULL);
+}
+
+/* Handles one complete request. Returns -1 to end the session. */
+static int handle_request(rtsp_client_t *c, char *req) {
+  char method[16];
+  char url[128];
+  char cseq[12];
+
+  if (sscanf(req, "%15s %127s", method, url) != 2) {
+    return -1;
+  }
+  if (!header_value(req, "CSeq", cseq, sizeof(cseq))) {
+    strcpy(cseq, "0");
+  }
+  c->last_request_us = esp_timer_get_time();
+  log_i("RTSP %s %s", method, url);
+
+  if (!strcmp(method, "OPTIONS")) {
+    return send_response(c, "200 OK", cseq, "Public: OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, GET_PARAMETER, TEARDOWN\r\n", NULL);
+  } else if (!strcmp(method, "DESCRIBE")) {
+    return handle_describe(c, cseq);
+  } else if (!strcmp(method, "SETUP")) {
+    return handle_setup(c, cseq, req);
+  } else if (!strcmp(method, "PLAY")) {
+    return handle_play(c, cseq, url);
+  } else if (!strcmp(method, "PAUSE")) {
+    c->playing = false;
+    return send_response(c, "200 OK", cseq, NULL, NULL);
+  } else if (!strcmp(method, "GET_PARAMETER") || !strcmp(method, "SET_PARAMETER")) {
+    return send_response(c, "200 OK", cseq, NULL, NULL);
+  } else if (!strcmp(method, "TEARDOWN")) {
+    send_response(c, "200 OK", cseq, NULL, NULL);
+    return -1;
+  }
+  return send_response(c, "501 Not Implemented", cseq, NULL, NULL);
+}
+
+/*
+ * Consumes complete requests from the receive buffer. Interleaved packets
+ * from the client (RTCP receiver reports over TCP) are skipped.
+ */
+static int process_input(rtsp_client_t *c) {
+  while (c->buf_len) {
+    if (c->buf[0] == '$') {
+      if (c->buf_len < 4) {
+        return 0;
+      }
+      size_t total = 4 + (((uint8_t)c->buf[2] << 8) | (uint8_t)c->buf[3]);
+      if (total > sizeof(c->buf)) {
+        return -1;
+      }
+      if (c->buf_len < total) {
+        return 0;
+      }
+      memmove(c->buf, c->buf + total, c->buf_len - total);
+      c->buf_len -= total;
+      continue;
+    }
+
+    c->buf[c->buf_len] = 0;
+    char *end = strstr(c->buf, "\r\n\r\n");
+    if (!end) {
+      return c->buf_len < sizeof(c->buf) - 1 ? 0 : -1;
+    }
+    char content_len[12];
+    size_t head_len = end + 4 - c->buf;
+    *end = 0;
+    size_t total = head_len;
+    if (header_value(c->buf, "Content-Length", content_len, sizeof(content_len))) {
+      // Digits only, and a body that fits what is left of buf: anything else
+      // could leave total at or below what was already consumed.
+      char *num_end;
+      unsigned long body = strtoul(content_len, &num_end, 10);
+      if (!isdigit((uint8_t)content_len[0]) || *num_end || body > sizeof(c->buf) - 1 - head_len) {
+        char cseq[12];
+        if (!header_value(c->buf, "CSeq", cseq, sizeof(cseq))) {
+          strcpy(cseq, "0");
+        }
+        send_response(c, "400 Bad Request", cseq, NULL, NULL);
+        return -1;
+      }
+      total += body;
+    }
+    if (c->buf_len < total) {
+      *end = '\r';
+      return 0;
+    }
+    if (handle_request(c, c->buf) != 0) {
+      return -1;
+    }
+    memmove(c->buf, c->buf + total, c->buf_len - total);
+    c->buf_len -= total;
+  }
+  return 0;
+}
+
+static int send_frame(rtsp_client_t *c) {
+  camera_fb_t *fb = capture_fb_get();
+  if (!fb) {
+    vTaskDelay(50 / portTICK_PERIOD_MS);
+    return 0;
+  }
+
+  rtp_jpeg_frame_t frame;
+  int packets = 0;
+  int64_t send_start = esp_timer_get_time();
+  if (fb->format == PIXFORMAT_JPEG && rtp_jpeg_parse(fb->buf, fb->len, &frame)) {
+    uint64_t us = (uint64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+    uint32_t ts = (uint32_t)(us * 9 / 100);
+    packets = rtp_jpeg_send_frame(&c->rtp, &frame, ts, c->tcp ? rtp_send_tcp : rtp_send_udp, c);
+  } else {
+    portENTER_CRITICAL(&stats_lock);
+    stats.bad_frames++;
+    portEXIT_CRITICAL(&stats_lock);
+  }
+  size_t len = fb->len;
+  capture_fb_return(fb);
+  if (packets > 0) {
+    sessions_frame(c->session, len, (uint32_t)(esp_timer_get_time() - send_start));
+  } else if (packets < 0 && !sessions_kicked(c->session)) {
+    sessions_error(c->session, "send", ESP_FAIL);
+  }
+
+  portENTER_CRITICAL(&stats_lock);
+  if (packets < 0) {
+    stats.send_errors++;
+  } else if (packets > 0) {
+    stats.frames++;
+    stats.packets += packets;
+    stats.bytes += len;
+  }
+  portEXIT_CRITICAL(&stats_lock);
+  return packets < 0 ? -1 : 0;
+}
+
+static void client_task(void *arg) {
+  rtsp_client_t *c = (rtsp_client_t *)arg;
+  power_gov_acquire();
+  c->session = sessions_open(SESSION_RTSP, c->sock, NULL);
+
+  while (true) {
+    if (sessions_kicked(c->session)) {
+      break;
+    }
+    fd_set rfds;
+    FD_ZERO(&rfds);
+    FD_SET(c->sock, &rfds);
+    struct timeval tv = {c->playing ? 0 : 1, 0};
+    int ready = select(c->sock + 1, &rfds, NULL, NULL, &tv);
+    if (ready < 0) {
+      break;
+    }
+    if (ready > 0) {
+      int n = recv(c->sock, c->buf + c->buf_len, sizeof(c->buf) - 1 - c->buf_len, 0);
+      if (n <= 0) {
+        break;
+      }
+      c->buf_len += n;
+      if (process_input(c) != 0) {
+        break;
+      }
+    }
+    // UDP sessions must send keep-alives; TCP ones die with the socket.
+    if (!c->tcp && esp_timer_get_time() - c->last_request_us > (int64_t)RTSP_SESSION_TIMEOUT_S * 1000000) {
+      log_i("RTSP session timed out");
+      break;
+    }
+    if (c->playing && send_frame(c) != 0) {
+      break;
+    }
+  }
+
+  sessions_close(c->session);
+  if (c->rtp_sock >= 0) {
+    close(c->rtp_sock);
+  }
+  close(c->sock);
+  free(c);
+  portENTER_CRITICAL(&stats_lock);
+  stats.active--;
+  portEXIT_CRITICAL(&stats_lock);
+  power_gov_release();
+  vTaskDelete(NULL);
+}
+
+static void listen_task(void *arg) {
+  while (true) {
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    int sock = accept(listen_sock, (struct sockaddr *)&peer, &peer_len);
+    if (sock < 0) {
+      vTaskDelay(100 / portTICK_PERIOD_MS);
+      continue;
+    }
+
+    portENTER_CRITICAL(&stats_lock);
+    bool full = stats.active >= RTSP_MAX_CLIENTS;
+    if (full) {
+      stats.refused++;
+    } else {
+      stats.active++;
+      stats.sessions++;
+    }
+    portEXIT_CRITICAL(&stats_lock);
+    if (full) {
+      close(sock);
+      continue;
+    }
+
+    rtsp_client_t *c = (rtsp_client_t *)calloc(1, sizeof(rtsp_client_t));
+    if (c) {
+      c->sock = sock;
+      c->peer = peer;
+      socklen_t local_len = sizeof(c->local);
+      getsockname(sock, (struct sockaddr *)&c->local, &local_len);
+      c->rtp_sock = -1;
+      c->session_id = esp_random();
+      c->rtp.ssrc = esp_random();
+      c->rtp.seq = esp_random() & 0xFFFF;
+      c->rtp.mtu = RTSP_RTP_MTU;
+      c->last_request_us = esp_timer_get_time();
+
+      struct timeval tv = {RTSP_SEND_TIMEOUT_S, 0};
+      setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+      int one = 1;
+      setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if (!c || xTaskCreatePinnedToCore(client_task, "rtsp_client", RTSP_TASK_STACK, c, RTSP_TASK_PRIO, NULL, tskNO_AFFINITY) != pdPASS) {
+      log_e("RTSP client task failed");
+      free(c);
+      close(sock);
+      portENTER_CRITICAL(&stats_lock);
+      stats.active--;
+      portEXIT_CRITICAL(&stats_lock);
+    }
+  }
+}
+
+esp_err_t rtsp_server_start(uint16_t port) {
+  if (listen_sock >= 0) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (listen_sock < 0) {
+    return ESP_FAIL;
+  }
+  int one = 1;
+  setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_sock, 2) != 0) {
+    log_e("RTSP bind/listen on %u failed: %d", port, errno);
+    close(listen_sock);
+    listen_sock = -1;
+    return ESP_FAIL;
+  }
+  rtsp_port = port;
+
+  if (xTaskCreatePinnedToCore(listen_task, "rtsp_listen", 3072, NULL, RTSP_TASK_PRIO, NULL, tskNO_AFFINITY) != pdPASS) {
+    close(listen_sock);
+    listen_sock = -1;
+    return ESP_ERR_NO_MEM;
+  }
+  log_i("RTSP server on port %u", port);
+  return ESP_OK;
+}
+
+int rtsp_server_stats_json(char *buf, size_t len) {
+  portENTER_CRITICAL(&stats_lock);
+  rtsp_stats_t s = stats;
+  portEXIT_CRITICAL(&stats_lock);
+  return snprintf(
+    buf, len, "{\"port\":%u,\"active\":%u,\"sessions\":%u,\"refused\":%u,\"frames\":%u,\"packets\":%u,\"bytes\":%llu,\"send_errors\":%u,\"bad_frames\":%u}",
+    rtsp_port, s.active, s.sessions, s.refused, s.frames, s.packets, s.bytes, s.send_errors, s.bad_frames
+  );
+}
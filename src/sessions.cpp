@@ -0,0 +1,226 @@
+/**
+ * Session table.
+ *
+ * Averages are exponential (1/8 weight) over frame completions; the interval
+ * is measured between consecutive sessions_frame calls, so it includes
+ * capture, pacing and send time and matches what the client experiences.
+ */
+#include "sessions.h"
+#include <Arduino.h>
+#include <WiFi.h>
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+
+static const uint16_t hist_bounds_ms[SESSIONS_HIST_BUCKETS - 1] = {1, 2, 5, 10, 20, 50, 100};
+static const char *kind_names[] = {"mjpeg", "rtsp"};
+
+typedef struct {
+  uint32_t id;                 // 0 = free
+  session_kind_t kind;
+  int sock;
+  uint32_t remote_ip;          // network byte order
+  uint16_t remote_port;
+  bool on_sta;
+  bool kicked;
+  char detail[12];
+  int64_t start_us;
+  int64_t last_frame_us;
+  uint32_t frames;
+  uint64_t bytes;
+  uint32_t interval_us;        // averaged frame interval
+  uint32_t frame_bytes;        // averaged frame size
+  uint32_t send_us_max;
+  uint32_t hist[SESSIONS_HIST_BUCKETS];
+  char last_error[SESSIONS_ERROR_MAX];
+} session_t;
+
+typedef struct {
+  uint32_t opened;
+  uint32_t untracked;          // table full
+  uint32_t kicked;
+  uint32_t errors;
+} sessions_stats_t;
+
+static session_t table[SESSIONS_MAX];
+static sessions_stats_t stats;
+static uint32_t next_id = 1;
+static portMUX_TYPE sessions_lock = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t kick_mutex = NULL;  // a kicked socket is not closed and reused mid-shutdown
+
+esp_err_t sessions_init() {
+  if (kick_mutex) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  kick_mutex = xSemaphoreCreateMutex();
+  return kick_mutex ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+int sessions_open(session_kind_t kind, int sock, const char *detail) {
+  struct sockaddr_in peer = {};
+  struct sockaddr_in local = {};
+  socklen_t len = sizeof(peer);
+  getpeername(sock, (struct sockaddr *)&peer, &len);
+  len = sizeof(local);
+  getsockname(sock, (struct sockaddr *)&local, &len);
+  bool on_sta = local.sin_addr.s_addr && local.sin_addr.s_addr != (uint32_t)WiFi.softAPIP();
+  int64_t now = esp_timer_get_time();
+  char name[sizeof(table[0].detail)];
+  snprintf(name, sizeof(name), "%s", detail ? detail : "");
+
+  int slot = -1;
+  portENTER_CRITICAL(&sessions_lock);
+  for (int i = 0; i < SESSIONS_MAX; i++) {
+    if (!table[i].id) {
+      slot = i;
+      break;
+    }
+  }
+  if (slot >= 0) {
+    session_t *s = &table[slot];
+    memset(s, 0, sizeof(*s));
+    s->id = next_id++;
+    s->kind = kind;
+    s->sock = sock;
+    s->remote_ip = peer.sin_family == AF_INET ? peer.sin_addr.s_addr : 0;
+    s->remote_port = ntohs(peer.sin_port);
+    s->on_sta = on_sta;
+    s->start_us = now;
+    s->last_frame_us = now;
+    memcpy(s->detail, name, sizeof(name));
+    stats.opened++;
+  } else {
+    stats.untracked++;
+  }
+  portEXIT_CRITICAL(&sessions_lock);
+  return slot;
+}
+
+void sessions_close(int slot) {
+  if (slot < 0) {
+    return;
+  }
+  xSemaphoreTake(kick_mutex, portMAX_DELAY);
+  portENTER_CRITICAL(&sessions_lock);
+  table[slot].id = 0;
+  portEXIT_CRITICAL(&sessions_lock);
+  xSemaphoreGive(kick_mutex);
+}
+
+uint32_t sessions_frame(int slot, size_t bytes, uint32_t send_us) {
+  if (slot < 0) {
+    return 0;
+  }
+  int64_t now = esp_timer_get_time();
+  uint32_t ms = send_us / 1000;
+  int bucket = 0;
+  while (bucket < SESSIONS_HIST_BUCKETS - 1 && ms >= hist_bounds_ms[bucket]) {
+    bucket++;
+  }
+
+  portENTER_CRITICAL(&sessions_lock);
+  session_t *s = &table[slot];
+  uint32_t interval = (uint32_t)(now - s->last_frame_us);
+  s->last_frame_us = now;
+  s->interval_us = s->frames ? (s->interval_us * 7 + interval) / 8 : interval;
+  s->frame_bytes = s->frames ? (s->frame_bytes * 7 + bytes) / 8 : bytes;
+  s->frames++;
+  s->bytes += bytes;
+  s->hist[bucket]++;
+  if (send_us > s->send_us_max) {
+    s->send_us_max = send_us;
+  }
+  uint32_t avg = s->interval_us;
+  portEXIT_CRITICAL(&sessions_lock);
+  return avg;
+}
+
+void sessions_error(int slot, const char *what, esp_err_t err) {
+  portENTER_CRITICAL(&sessions_lock);
+  stats.errors++;
+  portEXIT_CRITICAL(&sessions_lock);
+  if (slot < 0) {
+    return;
+  }
+  // Only the owning task writes the text; a reader may see it half-updated.
+  snprintf(table[slot].last_error, sizeof(table[slot].last_error), "%s 0x%x", what, err);
+}
+
+bool sessions_kicked(int slot) {
+  if (slot < 0) {
+    return false;
+  }
+  portENTER_CRITICAL(&sessions_lock);
+  bool kicked = table[slot].kicked;
+  portEXIT_CRITICAL(&sessions_lock);
+  return kicked;
+}
+
+esp_err_t sessions_kick(uint32_t id) {
+  int sock = -1;
+  if (!kick_mutex) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  xSemaphoreTake(kick_mutex, portMAX_DELAY);
+  portENTER_CRITICAL(&sessions_lock);
+  for (int i = 0; i < SESSIONS_MAX && id; i++) {
+    if (table[i].id == id && !table[i].kicked) {
+      table[i].kicked = true;
+      sock = table[i].sock;
+      stats.kicked++;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&sessions_lock);
+  if (sock >= 0) {
+    // The owner still closes the socket; shutdown only fails its pending and later I/O.
+    shutdown(sock, SHUT_RDWR);
+  }
+  xSemaphoreGive(kick_mutex);
+  if (sock < 0) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  log_i("Session %u kicked", id);
+  return ESP_OK;
+}
+
+int sessions_json(char *buf, size_t len) {
+  int64_t now = esp_timer_get_time();
+  int n = snprintf(buf, len, "{\"send_ms_buckets\":[1,2,5,10,20,50,100],\"sessions\":[");
+  bool first = true;
+  for (int i = 0; i < SESSIONS_MAX && n < (int)len; i++) {
+    portENTER_CRITICAL(&sessions_lock);
+    session_t s = table[i];
+    portEXIT_CRITICAL(&sessions_lock);
+    if (!s.id) {
+      continue;
+    }
+    uint32_t fps_x10 = s.interval_us ? 10000000 / s.interval_us : 0;
+    uint32_t kbps = s.interval_us ? (uint32_t)((uint64_t)s.frame_bytes * 8000 / s.interval_us) : 0;
+    uint8_t *ip = (uint8_t *)&s.remote_ip;
+    n += snprintf(
+      buf + n, len - n,
+      "%s{\"id\":%u,\"kind\":\"%s\",\"detail\":\"%s\",\"remote\":\"%u.%u.%u.%u:%u\",\"iface\":\"%s\",\"age_s\":%u,\"frames\":%u,\"bytes\":%llu,"
+      "\"fps\":%u.%u,\"kbps\":%u,\"idle_ms\":%u,\"send_ms_max\":%u,\"send_hist\":[%u,%u,%u,%u,%u,%u,%u,%u],\"last_error\":\"%s\",\"kicked\":%s}",
+      first ? "" : ",", s.id, kind_names[s.kind], s.detail, ip[0], ip[1], ip[2], ip[3], s.remote_port, s.on_sta ? "sta" : "ap",
+      (uint32_t)((now - s.start_us) / 1000000), s.frames, s.bytes, fps_x10 / 10, fps_x10 % 10, kbps, (uint32_t)((now - s.last_frame_us) / 1000),
+      s.send_us_max / 1000, s.hist[0], s.hist[1], s.hist[2], s.hist[3], s.hist[4], s.hist[5], s.hist[6], s.hist[7], s.last_error,
+      s.kicked ? "true" : "false"
+    );
+    first = false;
+  }
+  if (n < (int)len) {
+    n += snprintf(buf + n, len - n, "]}");
+  }
+  return n;
+}
+
+int sessions_stats_json(char *buf, size_t len) {
+  uint32_t active = 0;
+  portENTER_CRITICAL(&sessions_lock);
+  sessions_stats_t s = stats;
+  for (int i = 0; i < SESSIONS_MAX; i++) {
+    active += table[i].id != 0;
+  }
+  portEXIT_CRITICAL(&sessions_lock);
+  return snprintf(buf, len, "{\"active\":%u,\"opened\":%u,\"untracked\":%u,\"kicked\":%u,\"errors\":%u}", active, s.opened, s.untracked, s.kicked, s.errors);
+}
@@ -0,0 +1,172 @@
+/**
+ * STA reconnection state machine.
+ *
+ *   CONNECTING --GOT_IP--> UP --DISCONNECTED--> BACKOFF --timer--> CONNECTING
+ *
+ * Every failed attempt also ends in DISCONNECTED, which doubles the backoff
+ * (with +/-25% jitter) up to STA_BACKOFF_MAX_MS. Each attempt makes the radio
+ * scan away from the AP channel, so spacing them out keeps AP clients usable
+ * while the router is gone.
+ */
+#include "sta_link.h"
+#include <Arduino.h>
+#include <WiFi.h>
+#include "esp_wifi.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+
+#define STA_BACKOFF_MIN_MS 500
+#define STA_BACKOFF_MAX_MS 60000
+#define STA_JITTER_PCT     25
+
+#define LINK_UP_BIT (1 << 0)
+
+typedef enum {
+  STA_IDLE,
+  STA_CONNECTING,
+  STA_UP,
+  STA_BACKOFF,
+} sta_state_t;
+
+static const char *state_names[] = {"idle", "connecting", "up", "backoff"};
+
+typedef struct {
+  sta_state_t state;
+  uint32_t ip;
+  uint32_t attempts;        // attempts since the link was last up
+  uint32_t backoff_ms;
+  uint32_t disconnects;
+  uint8_t last_reason;
+  int64_t down_since_us;    // 0 while up
+  uint64_t total_down_ms;
+  uint32_t last_reconnect_ms;
+  uint32_t max_reconnect_ms;
+} sta_link_t;
+
+static sta_link_t sta;
+static portMUX_TYPE link_lock = portMUX_INITIALIZER_UNLOCKED;
+static EventGroupHandle_t link_events = NULL;
+static esp_timer_handle_t retry_timer = NULL;
+
+static uint32_t next_backoff_ms(uint32_t attempts) {
+  uint32_t base = STA_BACKOFF_MIN_MS;
+  for (uint32_t i = 1; i < attempts && base < STA_BACKOFF_MAX_MS; i++) {
+    base *= 2;
+  }
+  if (base > STA_BACKOFF_MAX_MS) {
+    base = STA_BACKOFF_MAX_MS;
+  }
+  uint32_t span = base * STA_JITTER_PCT / 100;
+  return base - span + esp_random() % (2 * span + 1);
+}
+
+static void retry_cb(void *arg) {
+  portENTER_CRITICAL(&link_lock);
+  sta.state = STA_CONNECTING;
+  portEXIT_CRITICAL(&link_lock);
+  esp_wifi_connect();
+}
+
+static void on_disconnected(arduino_event_id_t event, arduino_event_info_t info) {
+  int64_t now = esp_timer_get_time();
+  uint32_t delay_ms;
+
+  portENTER_CRITICAL(&link_lock);
+  if (sta.state == STA_UP) {
+    sta.disconnects++;
+    sta.down_since_us = now;
+    sta.ip = 0;
+  }
+  sta.state = STA_BACKOFF;
+  sta.last_reason = info.wifi_sta_disconnected.reason;
+  sta.attempts++;
+  delay_ms = next_backoff_ms(sta.attempts);
+  sta.backoff_ms = delay_ms;
+  portEXIT_CRITICAL(&link_lock);
+
+  xEventGroupClearBits(link_events, LINK_UP_BIT);
+  esp_timer_stop(retry_timer);
+  esp_timer_start_once(retry_timer, (uint64_t)delay_ms * 1000);
+  log_i("STA down (reason %u), retry %u in %ums", info.wifi_sta_disconnected.reason, sta.attempts, delay_ms);
+}
+
+static void on_got_ip(arduino_event_id_t event, arduino_event_info_t info) {
+  int64_t now = esp_timer_get_time();
+
+  portENTER_CRITICAL(&link_lock);
+  if (sta.down_since_us) {
+    uint32_t down_ms = (uint32_t)((now - sta.down_since_us) / 1000);
+    sta.total_down_ms += down_ms;
+    sta.last_reconnect_ms = down_ms;
+    if (down_ms > sta.max_reconnect_ms) {
+      sta.max_reconnect_ms = down_ms;
+    }
+    sta.down_since_us = 0;
+  }
+  sta.state = STA_UP;
+  sta.ip = info.got_ip.ip_info.ip.addr;
+  sta.attempts = 0;
+  sta.backoff_ms = 0;
+  portEXIT_CRITICAL(&link_lock);
+
+  esp_timer_stop(retry_timer);
+  xEventGroupSetBits(link_events, LINK_UP_BIT);
+  log_i("STA up after %ums", sta.last_reconnect_ms);
+}
+
+esp_err_t sta_link_begin(const char *ssid, const char *password) {
+  if (link_events) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  link_events = xEventGroupCreate();
+  if (!link_events) {
+    return ESP_ERR_NO_MEM;
+  }
+  esp_timer_create_args_t args = {};
+  args.callback = retry_cb;
+  args.name = "sta_retry";
+  esp_err_t err = esp_timer_create(&args, &retry_timer);
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  // We own reconnection; the core's auto-reconnect would retry immediately.
+  WiFi.setAutoReconnect(false);
+  WiFi.onEvent(on_disconnected, ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
+  WiFi.onEvent(on_got_ip, ARDUINO_EVENT_WIFI_STA_GOT_IP);
+
+  sta.state = STA_CONNECTING;
+  WiFi.begin(ssid, password);
+  return ESP_OK;
+}
+
+bool sta_link_is_up() {
+  return link_events && (xEventGroupGetBits(link_events) & LINK_UP_BIT);
+}
+
+bool sta_link_wait_up(uint32_t timeout_ms) {
+  if (!link_events) {
+    return false;
+  }
+  EventBits_t bits = xEventGroupWaitBits(link_events, LINK_UP_BIT, pdFALSE, pdTRUE, pdMS_TO_TICKS(timeout_ms));
+  return bits & LINK_UP_BIT;
+}
+
+uint32_t sta_link_ip() {
+  return sta.ip;
+}
+
+int sta_link_stats_json(char *buf, size_t len) {
+  portENTER_CRITICAL(&link_lock);
+  sta_link_t s = sta;
+  portEXIT_CRITICAL(&link_lock);
+
+  uint32_t down_ms = s.down_since_us ? (uint32_t)((esp_timer_get_time() - s.down_since_us) / 1000) : 0;
+  return snprintf(
+    buf, len,
+    "{\"state\":\"%s\",\"down_ms\":%u,\"disconnects\":%u,\"attempts\":%u,\"backoff_ms\":%u,\"last_reason\":%u,"
+    "\"total_down_ms\":%llu,\"last_reconnect_ms\":%u,\"max_reconnect_ms\":%u}",
+    state_names[s.state], down_ms, s.disconnects, s.attempts, s.backoff_ms, s.last_reason, s.total_down_ms + down_ms, s.last_reconnect_ms,
+    s.max_reconnect_ms
+  );
+}
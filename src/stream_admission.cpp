@@ -0,0 +1,201 @@
+/**
+ * Stream admission controller.
+ *
+ * Load is estimated per slot as EWMA(send time per frame) * EWMA(fps). A new
+ * viewer is predicted to cost the average per-frame send time seen so far at
+ * the tier's frame rate. Until any frame has been measured only the viewer
+ * cap applies.
+ */
+#include "stream_admission.h"
+#include <Arduino.h>
+#include "esp_timer.h"
+
+#define ADMISSION_MAX_SLOTS 8
+#define EWMA_SHIFT          3  // new sample weight 1/8
+
+typedef struct {
+  bool used;
+  stream_tier_t tier;
+  uint32_t send_us;     // EWMA per-frame send time
+  uint32_t fps_x10;     // EWMA measured frame rate
+  int64_t last_frame_us;
+} admission_slot_t;
+
+static stream_admission_config_t cfg = {
+  .max_viewers = 3,
+  .airtime_pct = 70,
+  .full_fps = 15,
+  .low_fps = 3,
+  .low_tier = true,
+  .retry_after_s = 3,
+};
+
+static admission_slot_t slots[ADMISSION_MAX_SLOTS];
+static uint8_t slot_limit = ADMISSION_MAX_SLOTS;
+static uint32_t cost_us = 0;  // EWMA per-frame send time across all sessions
+static uint32_t admitted_total = 0;
+static uint32_t low_tier_total = 0;
+static uint32_t rejected_total = 0;
+static portMUX_TYPE admission_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static inline uint32_t ewma(uint32_t avg, uint32_t sample) {
+  return avg ? avg - (avg >> EWMA_SHIFT) + (sample >> EWMA_SHIFT) : sample;
+}
+
+// Airtime in use, in microseconds per second. Caller holds the lock.
+static uint32_t load_us_locked() {
+  uint32_t load = 0;
+  for (int i = 0; i < ADMISSION_MAX_SLOTS; i++) {
+    if (slots[i].used) {
+      load += slots[i].send_us * slots[i].fps_x10 / 10;
+    }
+  }
+  return load;
+}
+
+static uint32_t active_locked(stream_tier_t tier) {
+  uint32_t n = 0;
+  for (int i = 0; i < ADMISSION_MAX_SLOTS; i++) {
+    if (slots[i].used && slots[i].tier == tier) {
+      n++;
+    }
+  }
+  return n;
+}
+
+void stream_admission_init(uint8_t max_viewers) {
+  slot_limit = max_viewers < ADMISSION_MAX_SLOTS ? max_viewers : ADMISSION_MAX_SLOTS;
+  if (cfg.max_viewers > slot_limit) {
+    cfg.max_viewers = slot_limit;
+  }
+}
+
+void stream_admission_get_config(stream_admission_config_t *config) {
+  portENTER_CRITICAL(&admission_lock);
+  *config = cfg;
+  portEXIT_CRITICAL(&admission_lock);
+}
+
+esp_err_t stream_admission_set_config(const stream_admission_config_t *config) {
+  if (!config->max_viewers || config->max_viewers > slot_limit || !config->airtime_pct || config->airtime_pct > 100 || !config->full_fps
+      || !config->low_fps || config->low_fps > config->full_fps) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  portENTER_CRITICAL(&admission_lock);
+  cfg = *config;
+  portEXIT_CRITICAL(&admission_lock);
+  return ESP_OK;
+}
+
+bool stream_admission_request(bool want_low, stream_ticket_t *ticket, uint32_t *retry_after_s) {
+  ticket->slot = -1;
+
+  portENTER_CRITICAL(&admission_lock);
+  int free_slot = -1;
+  uint32_t used = 0;
+  for (int i = 0; i < slot_limit; i++) {
+    if (slots[i].used) {
+      used++;
+    } else if (free_slot < 0) {
+      free_slot = i;
+    }
+  }
+
+  uint32_t budget = cfg.airtime_pct * 10000;
+  uint32_t load = load_us_locked();
+  bool fits_full = cost_us == 0 || load + cost_us * cfg.full_fps <= budget;
+  bool fits_low = cost_us == 0 || load + cost_us * cfg.low_fps <= budget;
+
+  stream_tier_t tier = STREAM_TIER_FULL;
+  bool admit = free_slot >= 0 && used < cfg.max_viewers;
+  if (admit) {
+    if (want_low || !fits_full) {
+      tier = STREAM_TIER_LOW;
+      admit = fits_low && (want_low || cfg.low_tier);
+    }
+  }
+
+  if (admit) {
+    admission_slot_t *slot = &slots[free_slot];
+    memset(slot, 0, sizeof(*slot));
+    slot->used = true;
+    slot->tier = tier;
+    slot->send_us = cost_us;
+    slot->fps_x10 = (tier == STREAM_TIER_LOW ? cfg.low_fps : cfg.full_fps) * 10;
+    admitted_total++;
+    if (tier == STREAM_TIER_LOW) {
+      low_tier_total++;
+    }
+    ticket->slot = free_slot;
+    ticket->tier = tier;
+    ticket->frame_interval_us = tier == STREAM_TIER_LOW ? 1000000 / cfg.low_fps : 0;
+  } else {
+    rejected_total++;
+    *retry_after_s = cfg.retry_after_s;
+  }
+  portEXIT_CRITICAL(&admission_lock);
+  return admit;
+}
+
+void stream_admission_frame(stream_ticket_t *ticket, uint32_t send_us) {
+  if (ticket->slot < 0) {
+    return;
+  }
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&admission_lock);
+  admission_slot_t *slot = &slots[ticket->slot];
+  slot->send_us = ewma(slot->send_us, send_us);
+  if (slot->last_frame_us) {
+    uint32_t interval = (uint32_t)(now - slot->last_frame_us);
+    if (interval) {
+      slot->fps_x10 = ewma(slot->fps_x10, 10000000 / interval);
+    }
+  }
+  slot->last_frame_us = now;
+  cost_us = ewma(cost_us, send_us);
+  portEXIT_CRITICAL(&admission_lock);
+}
+
+void stream_admission_release(stream_ticket_t *ticket) {
+  if (ticket->slot < 0) {
+    return;
+  }
+  portENTER_CRITICAL(&admission_lock);
+  slots[ticket->slot].used = false;
+  portEXIT_CRITICAL(&admission_lock);
+  ticket->slot = -1;
+}
+
+void stream_admission_cancel(stream_ticket_t *ticket) {
+  if (ticket->slot < 0) {
+    return;
+  }
+  portENTER_CRITICAL(&admission_lock);
+  slots[ticket->slot].used = false;
+  admitted_total--;
+  if (ticket->tier == STREAM_TIER_LOW) {
+    low_tier_total--;
+  }
+  rejected_total++;
+  portEXIT_CRITICAL(&admission_lock);
+  ticket->slot = -1;
+}
+
+int stream_admission_stats_json(char *buf, size_t len) {
+  portENTER_CRITICAL(&admission_lock);
+  stream_admission_config_t c = cfg;
+  uint32_t full = active_locked(STREAM_TIER_FULL);
+  uint32_t low = active_locked(STREAM_TIER_LOW);
+  uint32_t load = load_us_locked();
+  uint32_t cost = cost_us;
+  uint32_t admitted = admitted_total, low_total = low_tier_total, rejected = rejected_total;
+  portEXIT_CRITICAL(&admission_lock);
+
+  return snprintf(
+    buf, len,
+    "{\"active_full\":%u,\"active_low\":%u,\"admitted\":%u,\"admitted_low\":%u,\"rejected\":%u,\"frame_cost_us\":%u,\"airtime_pct\":%u,"
+    "\"max_viewers\":%u,\"airtime_budget_pct\":%u,\"full_fps\":%u,\"low_fps\":%u,\"low_tier\":%s,\"retry_after_s\":%u}",
+    full, low, admitted, low_total, rejected, cost, load / 10000, c.max_viewers, c.airtime_pct, c.full_fps, c.low_fps, c.low_tier ? "true" : "false",
+    c.retry_after_s
+  );
+}
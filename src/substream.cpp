@@ -0,0 +1,253 @@
+/**
+ * Substream producer.
+ *
+ * Waiters block on an event group bit per variant that the producer pulses
+ * (set then clear) after publishing, which wakes everyone already waiting.
+ * A waiter that checks just before a publish and misses the pulse picks the
+ * frame up on its next, short, wait. A variant's last frame is dropped when
+ * its last subscriber leaves, so a later viewer never starts on a stale one.
+ */
+#include "substream.h"
+#include <Arduino.h>
+#include "esp_camera.h"
+#include "capture.h"
+#include "esp_timer.h"
+#include "jpeg_xform.h"
+#include "mem_gov.h"
+
+#define SUBSTREAM_TASK_STACK 4096
+#define SUBSTREAM_TASK_PRIO  5
+#define SUBSTREAM_MAX_FPS    15
+#define SUBSTREAM_POLL_MS    100
+
+typedef struct {
+  uint32_t frames;
+  uint64_t bytes;
+  uint32_t scale_us;     // EWMA of the time to derive one frame
+  uint32_t failed;
+} substream_stats_t;
+
+static const char *variant_names[SUBSTREAM_COUNT] = {"sub", "sub4"};
+
+static portMUX_TYPE sub_lock = portMUX_INITIALIZER_UNLOCKED;
+static substream_frame_t *current[SUBSTREAM_COUNT];
+static uint8_t subscribers[SUBSTREAM_COUNT];
+static substream_stats_t stats[SUBSTREAM_COUNT];
+static uint32_t captures;
+static uint8_t limit = SUBSTREAM_COUNT;
+static EventGroupHandle_t frame_events = NULL;
+static TaskHandle_t producer = NULL;
+
+bool substream_parse(const char *name, substream_id_t *id) {
+  for (int i = 0; i < SUBSTREAM_COUNT; i++) {
+    if (!strcmp(name, variant_names[i])) {
+      *id = (substream_id_t)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *substream_name(substream_id_t id) {
+  return variant_names[id];
+}
+
+void substream_set_limit(uint8_t variants) {
+  portENTER_CRITICAL(&sub_lock);
+  limit = variants < SUBSTREAM_COUNT ? variants : SUBSTREAM_COUNT;
+  portEXIT_CRITICAL(&sub_lock);
+  if (producer) {
+    xTaskNotifyGive(producer);
+  }
+}
+
+void substream_subscribe(substream_id_t id) {
+  portENTER_CRITICAL(&sub_lock);
+  subscribers[id]++;
+  portEXIT_CRITICAL(&sub_lock);
+  if (producer) {
+    xTaskNotifyGive(producer);
+  }
+}
+
+void substream_unsubscribe(substream_id_t id) {
+  substream_frame_t *stale = NULL;
+  portENTER_CRITICAL(&sub_lock);
+  if (subscribers[id] && !--subscribers[id]) {
+    stale = current[id];
+    current[id] = NULL;
+  }
+  portEXIT_CRITICAL(&sub_lock);
+  substream_release(stale);
+}
+
+void substream_release(substream_frame_t *frame) {
+  if (!frame) {
+    return;
+  }
+  portENTER_CRITICAL(&sub_lock);
+  bool last = --frame->refs == 0;
+  portEXIT_CRITICAL(&sub_lock);
+  if (last) {
+    free(frame);
+  }
+}
+
+substream_frame_t *substream_next(substream_id_t id, uint32_t last_seq, uint32_t timeout_ms) {
+  int64_t deadline = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+  while (true) {
+    portENTER_CRITICAL(&sub_lock);
+    substream_frame_t *f = current[id];
+    if (f && f->seq != last_seq) {
+      f->refs++;
+    } else {
+      f = NULL;
+    }
+    portEXIT_CRITICAL(&sub_lock);
+    if (f) {
+      return f;
+    }
+    int64_t left_ms = (deadline - esp_timer_get_time()) / 1000;
+    if (left_ms <= 0) {
+      return NULL;
+    }
+    xEventGroupWaitBits(frame_events, 1 << id, pdFALSE, pdFALSE, pdMS_TO_TICKS(left_ms < SUBSTREAM_POLL_MS ? left_ms : SUBSTREAM_POLL_MS));
+  }
+}
+
+static void publish(substream_id_t id, substream_frame_t *frame) {
+  portENTER_CRITICAL(&sub_lock);
+  substream_frame_t *old = current[id];
+  current[id] = frame;
+  portEXIT_CRITICAL(&sub_lock);
+  substream_release(old);
+  xEventGroupSetBits(frame_events, 1 << id);
+  xEventGroupClearBits(frame_events, 1 << id);
+}
+
+/* Number of variants to derive: up to the smallest one with a subscriber, within the limit. */
+static int wanted_levels() {
+  int levels = 0;
+  portENTER_CRITICAL(&sub_lock);
+  for (int i = 0; i < limit; i++) {
+    if (subscribers[i]) {
+      levels = i + 1;
+    }
+  }
+  portEXIT_CRITICAL(&sub_lock);
+  return levels;
+}
+
+static void substream_task(void *arg) {
+  jpeg_xform_t *x = (jpeg_xform_t *)arg;
+  uint32_t seq = 0;
+
+  while (true) {
+    int levels = wanted_levels();
+    if (!levels) {
+      for (int i = 0; i < SUBSTREAM_COUNT; i++) {
+        publish((substream_id_t)i, NULL);  // drop idle frames
+      }
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      continue;
+    }
+
+    int64_t start = esp_timer_get_time();
+    camera_fb_t *fb = capture_fb_get();
+    if (!fb) {
+      vTaskDelay(50 / portTICK_PERIOD_MS);
+      continue;
+    }
+    seq++;
+    portENTER_CRITICAL(&sub_lock);
+    captures++;
+    portEXIT_CRITICAL(&sub_lock);
+
+    substream_frame_t *held = NULL;  // the variant the next one is derived from
+    const uint8_t *src = fb->buf;
+    size_t src_len = fb->format == PIXFORMAT_JPEG ? fb->len : 0;
+    for (int i = 0; i < levels && src_len; i++) {
+      int64_t t0 = esp_timer_get_time();
+      size_t cap = src_len + 2048;
+      substream_frame_t *f = (substream_frame_t *)malloc(sizeof(substream_frame_t) + cap);
+      size_t out_len = f ? jpeg_downscale(x, src, src_len, (uint8_t *)(f + 1), cap) : 0;
+      uint32_t us = (uint32_t)(esp_timer_get_time() - t0);
+      if (!out_len) {
+        if (!f) {
+          mem_gov_report_oom();
+        }
+        free(f);
+        portENTER_CRITICAL(&sub_lock);
+        stats[i].failed++;
+        portEXIT_CRITICAL(&sub_lock);
+        break;
+      }
+      f->buf = (uint8_t *)(f + 1);
+      f->len = out_len;
+      f->width = (x->info.width + 1) / 2;
+      f->height = (x->info.height + 1) / 2;
+      f->timestamp = fb->timestamp;
+      f->seq = seq;
+      f->refs = 2;  // current[i], and this task until the next variant is derived
+      portENTER_CRITICAL(&sub_lock);
+      stats[i].frames++;
+      stats[i].bytes += out_len;
+      stats[i].scale_us = stats[i].scale_us ? (stats[i].scale_us * 7 + us) / 8 : us;
+      portEXIT_CRITICAL(&sub_lock);
+      publish((substream_id_t)i, f);
+      substream_release(held);
+      held = f;
+      src = f->buf;
+      src_len = f->len;
+    }
+    substream_release(held);
+    capture_fb_return(fb);
+
+    int64_t elapsed = esp_timer_get_time() - start;
+    if (elapsed < 1000000 / SUBSTREAM_MAX_FPS) {
+      vTaskDelay(pdMS_TO_TICKS((1000000 / SUBSTREAM_MAX_FPS - elapsed) / 1000));
+    }
+  }
+}
+
+esp_err_t substream_init() {
+  if (producer) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  jpeg_xform_t *x = (jpeg_xform_t *)malloc(sizeof(jpeg_xform_t));
+  frame_events = xEventGroupCreate();
+  if (!x || !frame_events) {
+    free(x);
+    return ESP_ERR_NO_MEM;
+  }
+  jpeg_xform_init(x);
+  if (xTaskCreatePinnedToCore(substream_task, "substream", SUBSTREAM_TASK_STACK, x, SUBSTREAM_TASK_PRIO, &producer, tskNO_AFFINITY) != pdPASS) {
+    jpeg_xform_free(x);
+    free(x);
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+int substream_stats_json(char *buf, size_t len) {
+  substream_stats_t s[SUBSTREAM_COUNT];
+  uint8_t subs[SUBSTREAM_COUNT];
+  portENTER_CRITICAL(&sub_lock);
+  memcpy(s, stats, sizeof(s));
+  memcpy(subs, subscribers, sizeof(subs));
+  uint32_t caps = captures;
+  uint8_t lim = limit;
+  portEXIT_CRITICAL(&sub_lock);
+
+  int n = snprintf(buf, len, "{\"captures\":%u,\"limit\":%u", caps, lim);
+  for (int i = 0; i < SUBSTREAM_COUNT && n < (int)len; i++) {
+    n += snprintf(
+      buf + n, len - n, ",\"%s\":{\"subscribers\":%u,\"frames\":%u,\"avg_bytes\":%u,\"scale_us\":%u,\"failed\":%u}", variant_names[i], subs[i], s[i].frames,
+      s[i].frames ? (uint32_t)(s[i].bytes / s[i].frames) : 0, s[i].scale_us, s[i].failed
+    );
+  }
+  if (n < (int)len) {
+    n += snprintf(buf + n, len - n, "}");
+  }
+  return n;
+}
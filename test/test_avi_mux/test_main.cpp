@@ -0,0 +1,259 @@
+/**
+ * AVI repair test.
+ *
+ * Each fixture is a recording made with the muxer and then damaged the way a
+ * power cut leaves it: a header cut short, a frame chunk torn in half, a side
+ * index that lags the data or runs past it. avi_mux_repair has to keep
+ * exactly the whole frames, byte for byte, and leave a file whose RIFF, avih,
+ * movi and idx1 all agree with each other and with the file size.
+ *
+ *   pio test -e native -f test_avi_mux
+ */
+#include <unity.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "avi_mux.h"
+
+#define AVI_PATH   "test_repair.avi"
+#define IDX_PATH   "test_repair.idx"
+#define FRAMES     12
+#define FRAME_US   100000
+#define SYNC_AFTER 5      // frames covered by the last sync before the "power cut"
+
+static uint8_t frame_buf[FRAMES][700];
+static size_t frame_len[FRAMES];
+
+static uint32_t get32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static long file_size(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return -1;
+  }
+  fseek(f, 0, SEEK_END);
+  long n = ftell(f);
+  fclose(f);
+  return n;
+}
+
+static bool exists(const char *path) {
+  return file_size(path) >= 0;
+}
+
+/* Odd and even lengths, so the pad byte is exercised. */
+static void make_frames() {
+  for (int i = 0; i < FRAMES; i++) {
+    frame_len[i] = 300 + i * 37;
+    uint8_t *p = frame_buf[i];
+    p[0] = 0xFF;
+    p[1] = 0xD8;
+    for (size_t k = 2; k < frame_len[i] - 2; k++) {
+      p[k] = (uint8_t)(i * 31 + k);
+    }
+    p[frame_len[i] - 2] = 0xFF;
+    p[frame_len[i] - 1] = 0xD9;
+  }
+}
+
+/* Frame chunk offsets in a file written by the muxer: header, then chunks. */
+static long chunk_offset(int frame) {
+  long off = AVI_MUX_HEADER_SIZE;
+  for (int i = 0; i < frame; i++) {
+    off += 8 + frame_len[i] + (frame_len[i] & 1);
+  }
+  return off;
+}
+
+/*
+ * Records every frame, syncing after SYNC_AFTER of them, and stops without
+ * avi_mux_close: the side index stays and the header counts the synced
+ * frames only, as after a power cut that lost nothing stdio had buffered.
+ */
+static void record_unclosed() {
+  avi_mux_t m;
+  TEST_ASSERT_TRUE(avi_mux_open(&m, AVI_PATH, 640, 480, FRAME_US));
+  for (int i = 0; i < FRAMES; i++) {
+    TEST_ASSERT_TRUE(avi_mux_write(&m, frame_buf[i], frame_len[i], (int64_t)i * FRAME_US));
+    if (i + 1 == SYNC_AFTER) {
+      TEST_ASSERT_TRUE(avi_mux_sync(&m));
+    }
+  }
+  fclose(m.f);
+  fclose(m.idx);
+}
+
+static void truncate_to(const char *path, long len) {
+  TEST_ASSERT_EQUAL_INT(0, truncate(path, len));
+}
+
+/* The repaired file is a closed AVI holding exactly the first `frames` frames. */
+static void check_closed_avi(uint32_t frames) {
+  TEST_ASSERT_FALSE_MESSAGE(exists(IDX_PATH), "side index left behind");
+  FILE *f = fopen(AVI_PATH, "rb");
+  TEST_ASSERT_NOT_NULL(f);
+  long size = file_size(AVI_PATH);
+  uint8_t h[AVI_MUX_HEADER_SIZE];
+  TEST_ASSERT_EQUAL(sizeof(h), fread(h, 1, sizeof(h), f));
+  TEST_ASSERT_EQUAL_MEMORY("RIFF", h, 4);
+  TEST_ASSERT_EQUAL_UINT32(size - 8, get32(h + 4));
+  TEST_ASSERT_EQUAL_UINT32(FRAME_US, get32(h + 32));  // measured period
+  TEST_ASSERT_TRUE(get32(h + 44) & 0x10);            // AVIF_HASINDEX
+  TEST_ASSERT_EQUAL_UINT32(frames, get32(h + 48));   // avih frames
+  TEST_ASSERT_EQUAL_UINT32(frames, get32(h + 140));  // strh length
+  TEST_ASSERT_EQUAL_UINT32(640, get32(h + 64));
+  TEST_ASSERT_EQUAL_UINT32(480, get32(h + 68));
+  TEST_ASSERT_EQUAL_MEMORY("movi", h + 220, 4);
+  uint32_t movi_end = 220 + get32(h + 216);
+  TEST_ASSERT_EQUAL_UINT32(chunk_offset(frames), movi_end);
+
+  uint8_t c[8];
+  fseek(f, movi_end, SEEK_SET);
+  TEST_ASSERT_EQUAL(8, fread(c, 1, 8, f));
+  TEST_ASSERT_EQUAL_MEMORY("idx1", c, 4);
+  TEST_ASSERT_EQUAL_UINT32(frames * AVI_MUX_INDEX_ENTRY, get32(c + 4));
+  TEST_ASSERT_EQUAL(movi_end + 8 + frames * AVI_MUX_INDEX_ENTRY, size);
+
+  static uint8_t data[sizeof(frame_buf[0])];
+  for (uint32_t i = 0; i < frames; i++) {
+    uint8_t e[AVI_MUX_INDEX_ENTRY];
+    fseek(f, movi_end + 8 + i * AVI_MUX_INDEX_ENTRY, SEEK_SET);
+    TEST_ASSERT_EQUAL(sizeof(e), fread(e, 1, sizeof(e), f));
+    TEST_ASSERT_EQUAL_MEMORY("00dc", e, 4);
+    TEST_ASSERT_EQUAL_UINT32(chunk_offset(i) - 220, get32(e + 8));
+    TEST_ASSERT_EQUAL_UINT32(frame_len[i], get32(e + 12));
+    fseek(f, chunk_offset(i), SEEK_SET);
+    TEST_ASSERT_EQUAL(8, fread(c, 1, 8, f));
+    TEST_ASSERT_EQUAL_MEMORY("00dc", c, 4);
+    TEST_ASSERT_EQUAL_UINT32(frame_len[i], get32(c + 4));
+    TEST_ASSERT_EQUAL(frame_len[i], fread(data, 1, frame_len[i], f));
+    TEST_ASSERT_EQUAL_MEMORY(frame_buf[i], data, frame_len[i]);
+  }
+  fclose(f);
+}
+
+void setUp() {
+  make_frames();
+  remove(AVI_PATH);
+  remove(IDX_PATH);
+}
+
+void tearDown() {
+  remove(AVI_PATH);
+  remove(IDX_PATH);
+}
+
+static void test_unclosed_keeps_every_frame() {
+  record_unclosed();
+  uint32_t frames;
+  TEST_ASSERT_TRUE(avi_mux_repair(AVI_PATH, &frames));
+  TEST_ASSERT_EQUAL_UINT32(FRAMES, frames);
+  check_closed_avi(FRAMES);
+}
+
+static void test_closed_is_left_alone() {
+  avi_mux_t m;
+  TEST_ASSERT_TRUE(avi_mux_open(&m, AVI_PATH, 640, 480, FRAME_US));
+  TEST_ASSERT_TRUE(avi_mux_write(&m, frame_buf[0], frame_len[0], 0));
+  TEST_ASSERT_TRUE(avi_mux_close(&m));
+  long size = file_size(AVI_PATH);
+  uint32_t frames = 99;
+  TEST_ASSERT_FALSE(avi_mux_repair(AVI_PATH, &frames));
+  TEST_ASSERT_EQUAL_UINT32(0, frames);
+  TEST_ASSERT_EQUAL(size, file_size(AVI_PATH));
+}
+
+static void test_truncated_header() {
+  record_unclosed();
+  truncate_to(AVI_PATH, AVI_MUX_HEADER_SIZE - 20);
+  uint32_t frames = 99;
+  TEST_ASSERT_FALSE(avi_mux_repair(AVI_PATH, &frames));
+  TEST_ASSERT_EQUAL_UINT32(0, frames);
+  // Not ours to touch: the file and the marker that it is unclosed stay.
+  TEST_ASSERT_EQUAL(AVI_MUX_HEADER_SIZE - 20, file_size(AVI_PATH));
+  TEST_ASSERT_TRUE(exists(IDX_PATH));
+}
+
+static void test_missing_recording_drops_index() {
+  record_unclosed();
+  remove(AVI_PATH);
+  uint32_t frames = 99;
+  TEST_ASSERT_FALSE(avi_mux_repair(AVI_PATH, &frames));
+  TEST_ASSERT_EQUAL_UINT32(0, frames);
+  TEST_ASSERT_FALSE(exists(IDX_PATH));
+}
+
+static void test_torn_chunk() {
+  record_unclosed();
+  // Cut inside the last frame's data, then inside the chunk header before it.
+  truncate_to(AVI_PATH, chunk_offset(FRAMES - 1) + 8 + frame_len[FRAMES - 1] / 2);
+  uint32_t frames;
+  TEST_ASSERT_TRUE(avi_mux_repair(AVI_PATH, &frames));
+  TEST_ASSERT_EQUAL_UINT32(FRAMES - 1, frames);
+  check_closed_avi(FRAMES - 1);
+
+  remove(AVI_PATH);
+  record_unclosed();
+  truncate_to(AVI_PATH, chunk_offset(FRAMES - 2) + 5);
+  TEST_ASSERT_TRUE(avi_mux_repair(AVI_PATH, &frames));
+  TEST_ASSERT_EQUAL_UINT32(FRAMES - 2, frames);
+  check_closed_avi(FRAMES - 2);
+}
+
+static void test_stale_side_index_behind() {
+  // The index was last flushed at the sync; whole frames after it are recovered.
+  record_unclosed();
+  truncate_to(IDX_PATH, SYNC_AFTER * AVI_MUX_INDEX_ENTRY + 7);  // and a torn entry
+  uint32_t frames;
+  TEST_ASSERT_TRUE(avi_mux_repair(AVI_PATH, &frames));
+  TEST_ASSERT_EQUAL_UINT32(FRAMES, frames);
+  check_closed_avi(FRAMES);
+}
+
+static void test_stale_side_index_ahead() {
+  // Entries that vouch for frames the card never got are not trusted.
+  record_unclosed();
+  truncate_to(AVI_PATH, chunk_offset(SYNC_AFTER + 2));
+  uint32_t frames;
+  TEST_ASSERT_TRUE(avi_mux_repair(AVI_PATH, &frames));
+  TEST_ASSERT_EQUAL_UINT32(SYNC_AFTER + 2, frames);
+  check_closed_avi(SYNC_AFTER + 2);
+}
+
+static void test_failed_close_leftover() {
+  // A close that wrote idx1 but died before removing the side index.
+  avi_mux_t m;
+  TEST_ASSERT_TRUE(avi_mux_open(&m, AVI_PATH, 640, 480, FRAME_US));
+  for (int i = 0; i < FRAMES; i++) {
+    TEST_ASSERT_TRUE(avi_mux_write(&m, frame_buf[i], frame_len[i], (int64_t)i * FRAME_US));
+  }
+  TEST_ASSERT_TRUE(avi_mux_sync(&m));
+  static uint8_t idx[FRAMES * AVI_MUX_INDEX_ENTRY];
+  rewind(m.idx);
+  TEST_ASSERT_EQUAL(sizeof(idx), fread(idx, 1, sizeof(idx), m.idx));
+  TEST_ASSERT_TRUE(avi_mux_close(&m));
+  FILE *f = fopen(IDX_PATH, "wb");
+  TEST_ASSERT_NOT_NULL(f);
+  fwrite(idx, 1, sizeof(idx), f);
+  fclose(f);
+
+  uint32_t frames;
+  TEST_ASSERT_TRUE(avi_mux_repair(AVI_PATH, &frames));
+  TEST_ASSERT_EQUAL_UINT32(FRAMES, frames);
+  check_closed_avi(FRAMES);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_unclosed_keeps_every_frame);
+  RUN_TEST(test_closed_is_left_alone);
+  RUN_TEST(test_truncated_header);
+  RUN_TEST(test_missing_recording_drops_index);
+  RUN_TEST(test_torn_chunk);
+  RUN_TEST(test_stale_side_index_behind);
+  RUN_TEST(test_stale_side_index_ahead);
+  RUN_TEST(test_failed_close_leftover);
+  return UNITY_END();
+}
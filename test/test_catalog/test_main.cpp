@@ -0,0 +1,261 @@
+/**
+ * Recording catalog test.
+ *
+ * Builds catalogs and seek tables the way the recorder does, damages them the
+ * way a power cut does (a record or entry cut short), and checks what the
+ * boot path and the /recordings lookups get back from them.
+ *
+ *   pio test -e native -f test_catalog
+ */
+#include <unity.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "catalog.h"
+
+#define CAT_PATH  "test_catalog.bin"
+#define SEEK_PATH "test_catalog.sek"
+#define SEGMENTS  9
+#define SEG_US    60000000    // one minute each
+#define FRAMES    50
+#define FRAME_US  100000
+
+static long file_size(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return -1;
+  }
+  fseek(f, 0, SEEK_END);
+  long n = ftell(f);
+  fclose(f);
+  return n;
+}
+
+static catalog_entry_t segment(uint32_t seq, int64_t start_us) {
+  catalog_entry_t e;
+  memset(&e, 0, sizeof(e));
+  e.start_us = start_us;
+  e.end_us = start_us + SEG_US - FRAME_US;
+  e.seq = seq;
+  e.frames = SEG_US / FRAME_US;
+  e.bytes = 1000000 + seq;
+  e.index_offset = 990000 + seq;
+  e.motion_frames = seq & 1 ? 3 : 0;
+  e.width = 800;
+  e.height = 600;
+  e.flags = CATALOG_WALL | (seq & 1 ? CATALOG_MOTION : 0);
+  return e;
+}
+
+/* SEGMENTS back to back records starting at base_us, with a 10 s gap after each. */
+static void fill_catalog(int64_t base_us) {
+  uint32_t count;
+  catalog_entry_t last;
+  TEST_ASSERT_TRUE(catalog_check(CAT_PATH, &count, &last));
+  TEST_ASSERT_EQUAL_UINT32(0, count);
+  for (uint32_t i = 0; i < SEGMENTS; i++) {
+    catalog_entry_t e = segment(i + 1, base_us + (int64_t)i * (SEG_US + 10000000));
+    TEST_ASSERT_TRUE(catalog_append(CAT_PATH, &e));
+    TEST_ASSERT_EQUAL_UINT16(0, e.flags & CATALOG_SHIFTED);
+  }
+}
+
+/* FRAMES entries, one every FRAME_US with a little jitter; every 7th marked as motion. */
+static void fill_seek(uint32_t frames) {
+  catalog_entry_t e = segment(1, 1700000000000000LL);
+  FILE *f = catalog_seek_create(SEEK_PATH, &e);
+  TEST_ASSERT_NOT_NULL(f);
+  uint32_t offset = 232;
+  for (uint32_t i = 0; i < frames; i++) {
+    catalog_frame_t fr = {i * FRAME_US + (i % 3) * 1000, offset, 5000 + i};
+    if (i % 7 == 3) {
+      fr.size |= CATALOG_FRAME_MOTION;
+    }
+    TEST_ASSERT_TRUE(catalog_seek_append(f, &fr));
+    offset += 8 + 5000 + i + ((5000 + i) & 1);
+  }
+  TEST_ASSERT_TRUE(catalog_seek_sync(f));
+  fclose(f);
+}
+
+void setUp() {
+  remove(CAT_PATH);
+  remove(SEEK_PATH);
+}
+
+void tearDown() {
+  remove(CAT_PATH);
+  remove(SEEK_PATH);
+}
+
+static void test_append_and_read_back() {
+  fill_catalog(1700000000000000LL);
+  FILE *f = fopen(CAT_PATH, "rb");
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_EQUAL_UINT32(SEGMENTS, catalog_count(f));
+  for (uint32_t i = 0; i < SEGMENTS; i++) {
+    catalog_entry_t want = segment(i + 1, 1700000000000000LL + (int64_t)i * (SEG_US + 10000000));
+    catalog_entry_t got;
+    TEST_ASSERT_TRUE(catalog_read(f, i, &got));
+    TEST_ASSERT_TRUE(want.start_us == got.start_us && want.end_us == got.end_us);
+    TEST_ASSERT_EQUAL_UINT32(want.seq, got.seq);
+    TEST_ASSERT_EQUAL_UINT32(want.frames, got.frames);
+    TEST_ASSERT_EQUAL_UINT32(want.bytes, got.bytes);
+    TEST_ASSERT_EQUAL_UINT32(want.index_offset, got.index_offset);
+    TEST_ASSERT_EQUAL_UINT32(want.motion_frames, got.motion_frames);
+    TEST_ASSERT_EQUAL_UINT16(want.width, got.width);
+    TEST_ASSERT_EQUAL_UINT16(want.height, got.height);
+    TEST_ASSERT_EQUAL_UINT16(want.flags, got.flags);
+  }
+  catalog_entry_t e;
+  TEST_ASSERT_FALSE(catalog_read(f, SEGMENTS, &e));
+  fclose(f);
+}
+
+static void test_append_shifts_overlap() {
+  fill_catalog(1000000);
+  uint32_t count;
+  catalog_entry_t last;
+  TEST_ASSERT_TRUE(catalog_check(CAT_PATH, &count, &last));
+  // The clock went back: the new segment starts inside the last one.
+  catalog_entry_t e = segment(SEGMENTS + 1, last.end_us - 5000000);
+  int64_t length = e.end_us - e.start_us;
+  TEST_ASSERT_TRUE(catalog_append(CAT_PATH, &e));
+  TEST_ASSERT_TRUE(e.flags & CATALOG_SHIFTED);
+  TEST_ASSERT_TRUE(e.start_us == last.end_us && e.end_us - e.start_us == length);
+
+  FILE *f = fopen(CAT_PATH, "rb");
+  catalog_entry_t got;
+  TEST_ASSERT_TRUE(catalog_read(f, SEGMENTS, &got));
+  TEST_ASSERT_TRUE(got.start_us == e.start_us && (got.flags & CATALOG_SHIFTED));
+  fclose(f);
+}
+
+static void test_torn_tail() {
+  fill_catalog(1000000);
+  long whole = file_size(CAT_PATH);
+  // A power cut in the middle of the next append.
+  TEST_ASSERT_EQUAL_INT(0, truncate(CAT_PATH, whole + CATALOG_ENTRY_SIZE / 2));
+  FILE *f = fopen(CAT_PATH, "r+b");
+  fseek(f, whole, SEEK_SET);
+  fwrite("torn", 1, 4, f);
+  fclose(f);
+
+  uint32_t count;
+  catalog_entry_t last;
+  TEST_ASSERT_TRUE(catalog_check(CAT_PATH, &count, &last));
+  TEST_ASSERT_EQUAL_UINT32(SEGMENTS, count);
+  TEST_ASSERT_EQUAL_UINT32(SEGMENTS, last.seq);
+  TEST_ASSERT_EQUAL(whole, file_size(CAT_PATH));
+
+  // An append after a failed one overwrites the torn bytes, too.
+  TEST_ASSERT_EQUAL_INT(0, truncate(CAT_PATH, whole + 10));
+  catalog_entry_t e = segment(SEGMENTS + 1, last.end_us + SEG_US);
+  TEST_ASSERT_TRUE(catalog_append(CAT_PATH, &e));
+  TEST_ASSERT_EQUAL(whole + CATALOG_ENTRY_SIZE, file_size(CAT_PATH));
+  TEST_ASSERT_TRUE(catalog_check(CAT_PATH, &count, &last));
+  TEST_ASSERT_EQUAL_UINT32(SEGMENTS + 1, count);
+  TEST_ASSERT_EQUAL_UINT32(SEGMENTS + 1, last.seq);
+}
+
+static void test_not_a_catalog_starts_over() {
+  FILE *f = fopen(CAT_PATH, "wb");
+  fwrite("RIFF0000AVI LIST", 1, 16, f);
+  fwrite("more bytes than a header", 1, 24, f);
+  fclose(f);
+  uint32_t count = 99;
+  catalog_entry_t last;
+  TEST_ASSERT_TRUE(catalog_check(CAT_PATH, &count, &last));
+  TEST_ASSERT_EQUAL_UINT32(0, count);
+  TEST_ASSERT_EQUAL(CATALOG_HEADER_SIZE, file_size(CAT_PATH));
+}
+
+static void test_find() {
+  const int64_t base = 1000000;
+  fill_catalog(base);
+  FILE *f = fopen(CAT_PATH, "rb");
+  uint32_t n = catalog_count(f);
+  const int64_t step = SEG_US + 10000000;
+  TEST_ASSERT_EQUAL_UINT32(0, catalog_find(f, n, 0));                             // before all
+  TEST_ASSERT_EQUAL_UINT32(0, catalog_find(f, n, base));                          // first start
+  TEST_ASSERT_EQUAL_UINT32(3, catalog_find(f, n, base + 3 * step + SEG_US / 2));  // inside one
+  TEST_ASSERT_EQUAL_UINT32(3, catalog_find(f, n, base + 3 * step + SEG_US - FRAME_US));  // its last frame
+  TEST_ASSERT_EQUAL_UINT32(4, catalog_find(f, n, base + 3 * step + SEG_US + 1));  // in the gap: the next
+  TEST_ASSERT_EQUAL_UINT32(n, catalog_find(f, n, base + n * step));               // after all
+  TEST_ASSERT_EQUAL_UINT32(0, catalog_find(f, 0, base));                          // empty
+  fclose(f);
+}
+
+static void test_seek_nearest() {
+  fill_seek(FRAMES);
+  FILE *f = fopen(SEEK_PATH, "rb");
+  catalog_entry_t e;
+  uint32_t frames;
+  TEST_ASSERT_TRUE(catalog_seek_info(f, &e, &frames));
+  TEST_ASSERT_EQUAL_UINT32(FRAMES, frames);
+  TEST_ASSERT_EQUAL_UINT16(800, e.width);
+
+  uint32_t index;
+  catalog_frame_t fr;
+  TEST_ASSERT_TRUE(catalog_seek_nearest(f, frames, 0, &index, &fr));
+  TEST_ASSERT_EQUAL_UINT32(0, index);
+  // Frame 10 is at 1.001 s, frame 11 at 1.102 s: nearest wins either side.
+  TEST_ASSERT_TRUE(catalog_seek_nearest(f, frames, 1040000, &index, &fr));
+  TEST_ASSERT_EQUAL_UINT32(10, index);
+  TEST_ASSERT_EQUAL_UINT32(1001000, fr.dt_us);
+  TEST_ASSERT_TRUE(catalog_seek_nearest(f, frames, 1070000, &index, &fr));
+  TEST_ASSERT_EQUAL_UINT32(11, index);
+  TEST_ASSERT_EQUAL_UINT32(5011, fr.size & CATALOG_FRAME_SIZE);
+  TEST_ASSERT_TRUE(catalog_seek_nearest(f, frames, 1102000, &index, &fr));  // exact
+  TEST_ASSERT_EQUAL_UINT32(11, index);
+  TEST_ASSERT_TRUE(catalog_seek_nearest(f, frames, 3600000000u, &index, &fr));  // past the end
+  TEST_ASSERT_EQUAL_UINT32(FRAMES - 1, index);
+  TEST_ASSERT_TRUE(catalog_seek_nearest(f, 20, 3600000000u, &index, &fr));  // only the first 20
+  TEST_ASSERT_EQUAL_UINT32(19, index);
+  TEST_ASSERT_FALSE(catalog_seek_nearest(f, 0, 0, &index, &fr));
+  fclose(f);
+}
+
+static void test_seek_summary() {
+  fill_seek(FRAMES);
+  // A power cut while the last entry was being written.
+  TEST_ASSERT_EQUAL_INT(0, truncate(SEEK_PATH, file_size(SEEK_PATH) - 5));
+  FILE *f = fopen(SEEK_PATH, "rb");
+  catalog_entry_t e;
+  // The repaired AVI may hold more frames than the table got.
+  TEST_ASSERT_TRUE(catalog_seek_summary(f, FRAMES + 10, &e));
+  TEST_ASSERT_EQUAL_UINT32(FRAMES - 1, e.frames);
+  TEST_ASSERT_TRUE(e.start_us == 1700000000000000LL);
+  TEST_ASSERT_TRUE(e.end_us == e.start_us + (FRAMES - 2) * FRAME_US + ((FRAMES - 2) % 3) * 1000);
+  TEST_ASSERT_EQUAL_UINT32(7, e.motion_frames);  // 3, 10, ... 45
+  TEST_ASSERT_TRUE(e.flags & CATALOG_MOTION);
+  TEST_ASSERT_TRUE(e.flags & CATALOG_WALL);
+
+  // Or fewer.
+  TEST_ASSERT_TRUE(catalog_seek_summary(f, 3, &e));
+  TEST_ASSERT_EQUAL_UINT32(3, e.frames);
+  TEST_ASSERT_TRUE(e.end_us == e.start_us + 2 * FRAME_US + 2 * 1000);
+  TEST_ASSERT_EQUAL_UINT32(0, e.motion_frames);
+  TEST_ASSERT_FALSE(e.flags & CATALOG_MOTION);
+
+  // Nothing to end at: refused, never a made-up end time.
+  TEST_ASSERT_FALSE(catalog_seek_summary(f, 0, &e));
+  fclose(f);
+
+  fill_seek(0);
+  f = fopen(SEEK_PATH, "rb");
+  TEST_ASSERT_FALSE(catalog_seek_summary(f, 10, &e));
+  fclose(f);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_append_and_read_back);
+  RUN_TEST(test_append_shifts_overlap);
+  RUN_TEST(test_torn_tail);
+  RUN_TEST(test_not_a_catalog_starts_over);
+  RUN_TEST(test_find);
+  RUN_TEST(test_seek_nearest);
+  RUN_TEST(test_seek_summary);
+  return UNITY_END();
+}
@@ -0,0 +1,92 @@
+/**
+ * Multicast fragmenter test.
+ *
+ * Every datagram carries the documented 24-byte header, the fragments tile
+ * the frame exactly once in order, and only the last one is flagged. The
+ * receiver side is covered by tools/mcast_loopback_test.py, which feeds it
+ * datagrams from this same fragmenter.
+ *
+ *   pio test -e native -f test_mcast_frag
+ */
+#include <unity.h>
+#include <string.h>
+#include "mcast_frag.h"
+
+#define PAYLOAD 1376
+
+static uint8_t frame[3 * PAYLOAD + 17];
+static uint8_t pkt[MCAST_HEADER_LEN + PAYLOAD];
+
+static uint16_t get16(const uint8_t *p) {
+  return p[0] << 8 | p[1];
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* Fragments a frame of len bytes and checks every datagram against the layout. */
+static void check_frame(size_t len, uint16_t payload, uint16_t expect_count) {
+  static uint8_t out[sizeof(frame)];
+  memset(out, 0, sizeof(out));
+  uint16_t count = mcast_frag_count(len, payload);
+  TEST_ASSERT_EQUAL_UINT16(expect_count, count);
+
+  size_t covered = 0;
+  for (uint16_t i = 0; i < count; i++) {
+    size_t n = mcast_frag_build(pkt, frame, len, 0x01020304, 123456, payload, i);
+    TEST_ASSERT_TRUE(n > MCAST_HEADER_LEN);
+    TEST_ASSERT_TRUE(n <= MCAST_HEADER_LEN + (size_t)payload);
+    TEST_ASSERT_EQUAL_HEX16(MCAST_MAGIC, get16(pkt));
+    TEST_ASSERT_EQUAL_UINT8(MCAST_VERSION, pkt[2]);
+    TEST_ASSERT_EQUAL_HEX8(i + 1 == count ? MCAST_FLAG_LAST : 0, pkt[3]);
+    TEST_ASSERT_EQUAL_HEX32(0x01020304, get32(pkt + 4));
+    TEST_ASSERT_EQUAL_UINT16(i, get16(pkt + 8));
+    TEST_ASSERT_EQUAL_UINT16(count, get16(pkt + 10));
+    TEST_ASSERT_EQUAL_UINT32(len, get32(pkt + 12));
+    TEST_ASSERT_EQUAL_UINT32(covered, get32(pkt + 16));
+    TEST_ASSERT_EQUAL_UINT32(123456, get32(pkt + 20));
+    if (i + 1 < count) {
+      TEST_ASSERT_EQUAL(MCAST_HEADER_LEN + payload, n);
+    }
+    memcpy(out + covered, pkt + MCAST_HEADER_LEN, n - MCAST_HEADER_LEN);
+    covered += n - MCAST_HEADER_LEN;
+  }
+  TEST_ASSERT_EQUAL(len, covered);
+  TEST_ASSERT_EQUAL_MEMORY(frame, out, len);
+}
+
+void setUp() {
+  for (size_t i = 0; i < sizeof(frame); i++) {
+    frame[i] = (uint8_t)(i * 7 + (i >> 8));
+  }
+}
+
+void tearDown() {}
+
+static void test_single_fragment() {
+  check_frame(300, PAYLOAD, 1);
+}
+
+static void test_exact_multiple() {
+  check_frame(PAYLOAD, PAYLOAD, 1);
+  check_frame(3 * PAYLOAD, PAYLOAD, 3);
+}
+
+static void test_short_tail() {
+  check_frame(PAYLOAD + 1, PAYLOAD, 2);
+  check_frame(sizeof(frame), PAYLOAD, 4);
+}
+
+static void test_small_payload() {
+  check_frame(sizeof(frame), 256, (sizeof(frame) + 255) / 256);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_single_fragment);
+  RUN_TEST(test_exact_multiple);
+  RUN_TEST(test_short_tail);
+  RUN_TEST(test_small_payload);
+  return UNITY_END();
+}
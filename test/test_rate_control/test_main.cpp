@@ -0,0 +1,185 @@
+/**
+ * Rate controller replay test.
+ *
+ * Each scene is a frame size trace at a reference quality, replayed through
+ * rate_control_update the way capture_fb_get feeds it: the size a frame
+ * comes out at follows size ~ quality^-e from the quality in force when it
+ * was exposed, which lags a change by the frames already in the pipeline.
+ * The traces are generated from a seed, so a failure replays exactly.
+ *
+ *   pio test -e native -f test_rate_control
+ */
+#include <unity.h>
+#include <math.h>
+#include "rate_control.h"
+
+#define REF_QUALITY   12
+#define PIPELINE      2      // frames in flight when the quality changes
+#define FRAME_US      100000 // 10 fps
+#define FRAMES        400
+#define SETTLE_FRAMES 40     // to converge, from the start or a scene change
+#define TAIL_FRAMES   100    // averaged for the final check
+
+typedef struct {
+  const char *name;
+  uint32_t ref_bytes;      // at REF_QUALITY
+  float e;                 // how strongly size responds to quality
+  float noise;             // frame to frame, +-
+  uint32_t cut_frame;      // scene change, 0 for none
+  float cut_scale;         // size after the change, relative
+} scene_t;
+
+// Shaped after day, noisy night, flat (wall, sky) scenes and a light change.
+static const scene_t day = {"day", 28000, 1.0f, 0.04f, 0, 1.0f};
+static const scene_t night = {"night", 52000, 1.3f, 0.25f, 0, 1.0f};
+static const scene_t flat = {"flat", 9000, 0.5f, 0.02f, 0, 1.0f};
+static const scene_t cut = {"cut", 20000, 0.9f, 0.06f, 200, 1.6f};
+
+typedef struct {
+  uint32_t converged_at;   // first frame the window average is in band, FRAMES if never
+  uint32_t reconverged_at; // the same after the scene change
+  uint32_t tail_avg;
+  uint32_t adjustments;
+  uint32_t late_adjustments; // in the tail
+  uint8_t quality;
+} result_t;
+
+static uint32_t seed;
+
+static float noise() {
+  seed = seed * 1664525u + 1013904223u;
+  return (float)(seed >> 8) / (1u << 24) * 2.0f - 1.0f;
+}
+
+static bool in_band(uint32_t avg, uint32_t target) {
+  return avg <= target + target * RATE_CONTROL_BAND_PCT / 100 && avg >= target - target * RATE_CONTROL_BAND_PCT / 100;
+}
+
+static result_t replay(const scene_t *sc, const rate_control_config_t *cfg, uint8_t start_quality) {
+  rate_control_t rc;
+  rate_control_reset(&rc, start_quality);
+  uint8_t pipeline[PIPELINE + 1];
+  for (int i = 0; i <= PIPELINE; i++) {
+    pipeline[i] = start_quality;
+  }
+  result_t r = {FRAMES, FRAMES, 0, 0, 0, start_quality};
+  uint64_t tail_sum = 0;
+  seed = 12345;
+  for (uint32_t i = 0; i < FRAMES; i++) {
+    float scale = sc->cut_frame && i >= sc->cut_frame ? sc->cut_scale : 1.0f;
+    uint8_t q = pipeline[0];
+    float size = sc->ref_bytes * scale * powf((float)q / REF_QUALITY, -sc->e) * (1.0f + sc->noise * noise());
+    uint32_t len = size < 100 ? 100 : (uint32_t)size;
+    uint32_t before = rc.adjustments;
+    uint8_t next = rate_control_update(&rc, cfg, len, (int64_t)i * FRAME_US);
+    for (int k = 0; k < PIPELINE; k++) {
+      pipeline[k] = pipeline[k + 1];
+    }
+    pipeline[PIPELINE] = next;
+
+    uint32_t target = rc.target_bytes ? rc.target_bytes : cfg->target;
+    bool ok = rc.count >= RATE_CONTROL_MIN_FRAMES && in_band(rc.avg_bytes, target);
+    if (ok && r.converged_at == FRAMES) {
+      r.converged_at = i;
+    }
+    if (ok && sc->cut_frame && i >= sc->cut_frame + RATE_CONTROL_WINDOW && r.reconverged_at == FRAMES) {
+      r.reconverged_at = i - sc->cut_frame;
+    }
+    if (i >= FRAMES - TAIL_FRAMES) {
+      tail_sum += len;
+      r.late_adjustments += rc.adjustments - before;
+    }
+  }
+  r.tail_avg = tail_sum / TAIL_FRAMES;
+  r.adjustments = rc.adjustments;
+  r.quality = rc.quality;
+  return r;
+}
+
+static const rate_control_config_t bytes_cfg = {RATE_CONTROL_BYTES_PER_FRAME, 12000, 4, 40};
+
+static void check_converges(const scene_t *sc, const rate_control_config_t *cfg, uint32_t target_bytes) {
+  result_t r = replay(sc, cfg, REF_QUALITY);
+  char msg[128];
+  snprintf(msg, sizeof(msg), "%s: converged at %u, tail %u B, q %u, %u adjustments", sc->name, r.converged_at, r.tail_avg, r.quality, r.adjustments);
+  TEST_ASSERT_LESS_OR_EQUAL_MESSAGE(SETTLE_FRAMES, r.converged_at, msg);
+  TEST_ASSERT_UINT32_WITHIN_MESSAGE(target_bytes * RATE_CONTROL_BAND_PCT / 100, target_bytes, r.tail_avg, msg);
+  // Holding, not hunting: noise alone moves the quality rarely once settled.
+  TEST_ASSERT_LESS_OR_EQUAL_MESSAGE(sc->noise > 0.1f ? 4 : 1, r.late_adjustments, msg);
+}
+
+void setUp() {}
+void tearDown() {}
+
+static void test_day_bytes() {
+  check_converges(&day, &bytes_cfg, 12000);
+}
+
+static void test_night_bytes() {
+  check_converges(&night, &bytes_cfg, 12000);
+}
+
+static void test_flat_bytes() {
+  // Needs a better quality than the reference and responds weakly to it.
+  check_converges(&flat, &bytes_cfg, 12000);
+}
+
+static void test_night_kbps() {
+  // 960 kbit/s at 10 fps is 12000 bytes per frame.
+  rate_control_config_t cfg = {RATE_CONTROL_KBPS, 960, 4, 40};
+  check_converges(&night, &cfg, 12000);
+}
+
+static void test_scene_change() {
+  result_t r = replay(&cut, &bytes_cfg, REF_QUALITY);
+  char msg[128];
+  snprintf(msg, sizeof(msg), "reconverged %u frames after the change, tail %u B", r.reconverged_at, r.tail_avg);
+  TEST_ASSERT_LESS_OR_EQUAL_MESSAGE(SETTLE_FRAMES, r.reconverged_at, msg);
+  TEST_ASSERT_UINT32_WITHIN_MESSAGE(12000 * RATE_CONTROL_BAND_PCT / 100, 12000, r.tail_avg, msg);
+}
+
+static void test_out_of_reach_pins() {
+  rate_control_config_t tiny = {RATE_CONTROL_BYTES_PER_FRAME, 2000, 4, 40};
+  result_t r = replay(&night, &tiny, REF_QUALITY);
+  TEST_ASSERT_EQUAL_UINT8(40, r.quality);
+  TEST_ASSERT_EQUAL_UINT32(0, r.late_adjustments);
+
+  rate_control_config_t huge = {RATE_CONTROL_BYTES_PER_FRAME, 200000, 4, 40};
+  r = replay(&flat, &huge, REF_QUALITY);
+  TEST_ASSERT_EQUAL_UINT8(4, r.quality);
+  TEST_ASSERT_EQUAL_UINT32(0, r.late_adjustments);
+}
+
+static void test_kbps_below_a_byte_per_frame() {
+  // 1 kbit/s at 1000 fps is under a byte per frame: the quality only gets worse.
+  rate_control_config_t cfg = {RATE_CONTROL_KBPS, 1, 4, 40};
+  rate_control_t rc;
+  rate_control_reset(&rc, REF_QUALITY);
+  for (int i = 0; i < 200; i++) {
+    uint8_t before = rc.quality;
+    rate_control_update(&rc, &cfg, 20000, (int64_t)i * 1000);
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT8(before, rc.quality);
+  }
+  TEST_ASSERT_EQUAL_UINT32(1, rc.target_bytes);
+  TEST_ASSERT_EQUAL_UINT8(40, rc.quality);
+}
+
+static void test_off_never_moves() {
+  rate_control_config_t off = {RATE_CONTROL_OFF, 12000, 4, 40};
+  result_t r = replay(&night, &off, REF_QUALITY);
+  TEST_ASSERT_EQUAL_UINT8(REF_QUALITY, r.quality);
+  TEST_ASSERT_EQUAL_UINT32(0, r.adjustments);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_day_bytes);
+  RUN_TEST(test_night_bytes);
+  RUN_TEST(test_flat_bytes);
+  RUN_TEST(test_night_kbps);
+  RUN_TEST(test_scene_change);
+  RUN_TEST(test_out_of_reach_pins);
+  RUN_TEST(test_kbps_below_a_byte_per_frame);
+  RUN_TEST(test_off_never_moves);
+  return UNITY_END();
+}
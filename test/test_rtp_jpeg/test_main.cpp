@@ -0,0 +1,261 @@
+/**
+ * RTP/JPEG packetiser test.
+ *
+ * A synthetic baseline JPEG laid out the way the sensor writes it (DQT, SOF0,
+ * DHT, optional DRI, SOS, scan, EOI, padding) goes through rtp_jpeg_parse
+ * and rtp_jpeg_send_frame; every packet is checked against RFC 3550 and
+ * RFC 2435 and the scan is put back together from the fragment offsets.
+ *
+ *   pio test -e native -f test_rtp_jpeg
+ */
+#include <unity.h>
+#include <string.h>
+#include "rtp_jpeg.h"
+
+#define SCAN_LEN    5000
+#define MAX_PACKETS 32
+#define JPEG_MAX    (SCAN_LEN + 1024)
+#define PACKET_MAX  1500      // the packetiser's buffer; a larger mtu is clamped to it
+
+typedef struct {
+  uint8_t data[PACKET_MAX];
+  size_t len;
+} packet_t;
+
+static packet_t packets[MAX_PACKETS];
+static int packet_count;
+static int abort_at;      // packet index the callback refuses, -1 for none
+
+static uint8_t jpeg[JPEG_MAX];
+static size_t jpeg_len;
+static uint8_t scan[SCAN_LEN];
+
+static int capture(void *ctx, uint8_t *pkt, size_t len) {
+  (void)ctx;
+  if (packet_count == abort_at) {
+    return -1;
+  }
+  // The headroom in front of the packet is the caller's to use.
+  memset(pkt - RTP_JPEG_HEADROOM, 0xAA, RTP_JPEG_HEADROOM);
+  TEST_ASSERT_LESS_OR_EQUAL(sizeof(packets[0].data), len);
+  memcpy(packets[packet_count].data, pkt, len);
+  packets[packet_count].len = len;
+  packet_count++;
+  return 0;
+}
+
+static size_t segment(uint8_t *p, uint8_t marker, const uint8_t *body, size_t len) {
+  p[0] = 0xFF;
+  p[1] = marker;
+  p[2] = (len + 2) >> 8;
+  p[3] = (len + 2) & 0xFF;
+  memcpy(p + 4, body, len);
+  return 4 + len;
+}
+
+/* sof_marker 0xC0 for baseline; luma 0x21 (4:2:2) or 0x22 (4:2:0). */
+static void make_jpeg(uint8_t sof_marker, uint8_t luma, uint16_t restart, uint16_t width, uint16_t height) {
+  uint8_t *p = jpeg;
+  *p++ = 0xFF;
+  *p++ = 0xD8;
+  uint8_t app0[14] = {'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0};
+  p += segment(p, 0xE0, app0, sizeof(app0));
+  uint8_t dqt[130];
+  dqt[0] = 0x00;
+  dqt[65] = 0x01;
+  for (int i = 0; i < 64; i++) {
+    dqt[1 + i] = 1 + i;       // luma
+    dqt[66 + i] = 100 + i;    // chroma
+  }
+  p += segment(p, 0xDB, dqt, sizeof(dqt));
+  uint8_t sof[15] = {8, (uint8_t)(height >> 8), (uint8_t)height, (uint8_t)(width >> 8), (uint8_t)width, 3, 1, luma, 0, 2, 0x11, 1, 3, 0x11, 1};
+  p += segment(p, sof_marker, sof, sizeof(sof));
+  uint8_t dht[17 + 1] = {0x00, 1};
+  p += segment(p, 0xC4, dht, sizeof(dht));
+  if (restart) {
+    uint8_t dri[2] = {(uint8_t)(restart >> 8), (uint8_t)restart};
+    p += segment(p, 0xDD, dri, sizeof(dri));
+  }
+  uint8_t sos[10] = {3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0};
+  p += segment(p, 0xDA, sos, sizeof(sos));
+  for (int i = 0; i < SCAN_LEN; i++) {
+    scan[i] = (uint8_t)(i * 7 + 3);
+    if (scan[i] == 0xFF) {
+      scan[i] = 0xFE;           // no markers inside the synthetic scan
+    }
+  }
+  memcpy(p, scan, SCAN_LEN);
+  p += SCAN_LEN;
+  *p++ = 0xFF;
+  *p++ = 0xD9;
+  memset(p, 0, 37);           // DMA padding after EOI
+  p += 37;
+  jpeg_len = p - jpeg;
+}
+
+static uint32_t get24(const uint8_t *p) {
+  return (uint32_t)p[0] << 16 | p[1] << 8 | p[2];
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* Sends the frame and checks every packet; returns the packet count. */
+static int send_and_check(const rtp_jpeg_frame_t *frame, uint16_t first_seq, size_t mtu) {
+  rtp_jpeg_stream_t st = {first_seq, 0x12345678, mtu};
+  packet_count = 0;
+  abort_at = -1;
+  int n = rtp_jpeg_send_frame(&st, frame, 0xCAFEF00D, capture, NULL);
+  TEST_ASSERT_EQUAL_INT(packet_count, n);
+  TEST_ASSERT_EQUAL_UINT16((uint16_t)(first_seq + n), st.seq);
+
+  static uint8_t out[SCAN_LEN];
+  size_t limit = mtu < PACKET_MAX ? mtu : PACKET_MAX;
+  size_t expect_offset = 0;
+  bool restart = frame->type >= 64;
+  for (int i = 0; i < n; i++) {
+    const uint8_t *pk = packets[i].data;
+    size_t len = packets[i].len;
+    TEST_ASSERT_LESS_OR_EQUAL(limit, len);
+    TEST_ASSERT_EQUAL_UINT8(0x80, pk[0]);                                      // V=2, no padding, extension or CSRCs
+    TEST_ASSERT_EQUAL_UINT8(RTP_JPEG_PAYLOAD_TYPE, pk[1] & 0x7F);
+    TEST_ASSERT_EQUAL_UINT8(i == n - 1 ? 0x80 : 0, pk[1] & 0x80);              // marker on the last only
+    TEST_ASSERT_EQUAL_UINT16((uint16_t)(first_seq + i), pk[2] << 8 | pk[3]);
+    TEST_ASSERT_EQUAL_UINT32(0xCAFEF00D, get32(pk + 4));                       // one timestamp per frame
+    TEST_ASSERT_EQUAL_UINT32(0x12345678, get32(pk + 8));
+
+    const uint8_t *jh = pk + RTP_HEADER_LEN;
+    TEST_ASSERT_EQUAL_UINT8(0, jh[0]);
+    TEST_ASSERT_EQUAL_UINT32(expect_offset, get24(jh + 1));                    // fragment offset
+    TEST_ASSERT_EQUAL_UINT8(frame->type, jh[4]);
+    TEST_ASSERT_EQUAL_UINT8(255, jh[5]);                                       // Q: tables in-band
+    TEST_ASSERT_EQUAL_UINT8((frame->width + 7) / 8, jh[6]);
+    TEST_ASSERT_EQUAL_UINT8((frame->height + 7) / 8, jh[7]);
+    const uint8_t *p = jh + 8;
+    if (restart) {
+      TEST_ASSERT_EQUAL_UINT16(frame->restart_interval, p[0] << 8 | p[1]);
+      TEST_ASSERT_EQUAL_UINT8(0xFF, p[2]);
+      TEST_ASSERT_EQUAL_UINT8(0xFF, p[3]);
+      p += 4;
+    }
+    if (i == 0) {
+      TEST_ASSERT_EQUAL_UINT8(0, p[0]);                                        // MBZ
+      TEST_ASSERT_EQUAL_UINT8(0, p[1]);                                        // 8-bit tables
+      TEST_ASSERT_EQUAL_UINT16(128, p[2] << 8 | p[3]);
+      TEST_ASSERT_EQUAL_MEMORY(frame->qt[0], p + 4, 64);
+      TEST_ASSERT_EQUAL_MEMORY(frame->qt[1], p + 68, 64);
+      p += 132;
+    }
+    size_t payload = len - (p - pk);
+    TEST_ASSERT_TRUE(payload > 0);
+    TEST_ASSERT_LESS_OR_EQUAL(SCAN_LEN, expect_offset + payload);
+    memcpy(out + expect_offset, p, payload);
+    expect_offset += payload;
+    if (i < n - 1) {
+      TEST_ASSERT_EQUAL(limit, len);                                           // only the last packet is short
+    }
+  }
+  TEST_ASSERT_EQUAL(SCAN_LEN, expect_offset);
+  TEST_ASSERT_EQUAL_MEMORY(scan, out, SCAN_LEN);
+  return n;
+}
+
+void setUp() {
+  packet_count = 0;
+  abort_at = -1;
+}
+
+void tearDown() {}
+
+static void test_parse_420() {
+  make_jpeg(0xC0, 0x22, 0, 800, 600);
+  rtp_jpeg_frame_t f;
+  TEST_ASSERT_TRUE(rtp_jpeg_parse(jpeg, jpeg_len, &f));
+  TEST_ASSERT_EQUAL_UINT8(1, f.type);
+  TEST_ASSERT_EQUAL_UINT16(800, f.width);
+  TEST_ASSERT_EQUAL_UINT16(600, f.height);
+  TEST_ASSERT_EQUAL_UINT16(0, f.restart_interval);
+  TEST_ASSERT_EQUAL_UINT8(1, f.qt[0][0]);
+  TEST_ASSERT_EQUAL_UINT8(100, f.qt[1][0]);
+  // The scan stops before EOI and the padding behind it.
+  TEST_ASSERT_EQUAL(SCAN_LEN, f.scan_len);
+  TEST_ASSERT_EQUAL_MEMORY(scan, f.scan, SCAN_LEN);
+}
+
+static void test_parse_422_restart() {
+  make_jpeg(0xC0, 0x21, 4, 1600, 1200);
+  rtp_jpeg_frame_t f;
+  TEST_ASSERT_TRUE(rtp_jpeg_parse(jpeg, jpeg_len, &f));
+  TEST_ASSERT_EQUAL_UINT8(64, f.type);
+  TEST_ASSERT_EQUAL_UINT16(4, f.restart_interval);
+}
+
+static void test_parse_rejects() {
+  rtp_jpeg_frame_t f;
+  make_jpeg(0xC2, 0x22, 0, 800, 600);       // progressive
+  TEST_ASSERT_FALSE(rtp_jpeg_parse(jpeg, jpeg_len, &f));
+  make_jpeg(0xC0, 0x11, 0, 800, 600);       // 4:4:4, no RTP/JPEG type for it
+  TEST_ASSERT_FALSE(rtp_jpeg_parse(jpeg, jpeg_len, &f));
+  make_jpeg(0xC0, 0x22, 0, 2048, 600);      // wider than the 8-bit width field
+  TEST_ASSERT_FALSE(rtp_jpeg_parse(jpeg, jpeg_len, &f));
+  make_jpeg(0xC0, 0x22, 0, 800, 600);
+  TEST_ASSERT_FALSE(rtp_jpeg_parse(jpeg, 100, &f));  // cut inside DQT
+  jpeg[1] = 0xD9;
+  TEST_ASSERT_FALSE(rtp_jpeg_parse(jpeg, jpeg_len, &f));
+}
+
+static void test_fragmentation() {
+  make_jpeg(0xC0, 0x22, 0, 800, 600);
+  rtp_jpeg_frame_t f;
+  TEST_ASSERT_TRUE(rtp_jpeg_parse(jpeg, jpeg_len, &f));
+  // 1400-byte packets: 1400 - 12 - 8 - 132 in the first, 1380 in the rest.
+  TEST_ASSERT_EQUAL_INT(4, send_and_check(&f, 100, 1400));
+  TEST_ASSERT_EQUAL_INT(13, send_and_check(&f, 100, 420));
+}
+
+static void test_fragmentation_restart() {
+  make_jpeg(0xC0, 0x21, 4, 1600, 1200);
+  rtp_jpeg_frame_t f;
+  TEST_ASSERT_TRUE(rtp_jpeg_parse(jpeg, jpeg_len, &f));
+  send_and_check(&f, 7, 1400);
+}
+
+static void test_sequence_wraps() {
+  make_jpeg(0xC0, 0x22, 0, 800, 600);
+  rtp_jpeg_frame_t f;
+  TEST_ASSERT_TRUE(rtp_jpeg_parse(jpeg, jpeg_len, &f));
+  send_and_check(&f, 0xFFFE, 1400);
+}
+
+static void test_mtu_clamped() {
+  make_jpeg(0xC0, 0x22, 0, 800, 600);
+  rtp_jpeg_frame_t f;
+  TEST_ASSERT_TRUE(rtp_jpeg_parse(jpeg, jpeg_len, &f));
+  send_and_check(&f, 1, 9000);
+  TEST_ASSERT_EQUAL(PACKET_MAX, packets[0].len);
+}
+
+static void test_abort() {
+  make_jpeg(0xC0, 0x22, 0, 800, 600);
+  rtp_jpeg_frame_t f;
+  TEST_ASSERT_TRUE(rtp_jpeg_parse(jpeg, jpeg_len, &f));
+  rtp_jpeg_stream_t st = {10, 1, 1400};
+  abort_at = 2;
+  TEST_ASSERT_EQUAL_INT(-1, rtp_jpeg_send_frame(&st, &f, 0, capture, NULL));
+  TEST_ASSERT_EQUAL_INT(2, packet_count);
+  TEST_ASSERT_EQUAL_UINT16(12, st.seq);  // the refused packet used no number
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_parse_420);
+  RUN_TEST(test_parse_422_restart);
+  RUN_TEST(test_parse_rejects);
+  RUN_TEST(test_fragmentation);
+  RUN_TEST(test_fragmentation_restart);
+  RUN_TEST(test_sequence_wraps);
+  RUN_TEST(test_mtu_clamped);
+  RUN_TEST(test_abort);
+  return UNITY_END();
+}
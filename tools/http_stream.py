@@ -0,0 +1,144 @@
+"""
+HTTP/1.1 response reading shared by the tools that talk to the camera over
+raw sockets (latency_probe.py, stream_bench.py).
+
+esp_http_server sends every response a handler writes with
+httpd_resp_send_chunk, /stream included, with Transfer-Encoding: chunked.
+The chunk framing has to come off before anything inside the body, such as
+the multipart boundaries and part headers, can be looked for. Response reads
+the status line and headers and then hands out the decoded body, whether it
+is chunked, sized by Content-Length or runs to the end of the connection;
+parts() splits a multipart/x-mixed-replace body into its parts.
+
+    s = socket.create_connection((host, 81))
+    s.sendall(b"GET /stream HTTP/1.1\\r\\nHost: cam\\r\\n\\r\\n")
+    for headers, jpeg in parts(Response(s)):
+        ...
+"""
+import socket
+
+
+class Response:
+    def __init__(self, sock):
+        self.sock = sock
+        self.buf = b""
+        self.done = False
+        self.chunk_left = 0
+        lines = self._read_until(b"\r\n\r\n").decode("latin-1").split("\r\n")
+        self.status = int(lines[0].split(" ", 2)[1])
+        self.headers = {}
+        for line in lines[1:]:
+            k, _, v = line.partition(":")
+            self.headers[k.strip().lower()] = v.strip()
+        self.chunked = "chunked" in self.headers.get("transfer-encoding", "").lower()
+        length = self.headers.get("content-length")
+        self.left = int(length) if length is not None and not self.chunked else None
+
+    def _recv(self, until_close=False):
+        data = self.sock.recv(65536)
+        if not data:
+            if until_close:
+                return False
+            raise ConnectionError("connection closed mid-response")
+        self.buf += data
+        return True
+
+    def _read_until(self, sep):
+        while True:
+            end = self.buf.find(sep)
+            if end >= 0:
+                out = self.buf[:end]
+                self.buf = self.buf[end + len(sep):]
+                return out
+            self._recv()
+
+    def _take(self, n):
+        out = self.buf[:n]
+        self.buf = self.buf[len(out):]
+        return out
+
+    def read(self):
+        """The next piece of the decoded body; b"" once it is complete."""
+        if self.done:
+            return b""
+        if self.chunked:
+            if not self.chunk_left:
+                size = int(self._read_until(b"\r\n").split(b";")[0], 16)
+                if not size:
+                    while self._read_until(b"\r\n"):  # trailers, up to the blank line
+                        pass
+                    self.done = True
+                    return b""
+                self.chunk_left = size
+            if not self.buf:
+                self._recv()
+            data = self._take(self.chunk_left)
+            self.chunk_left -= len(data)
+            if not self.chunk_left:
+                self._read_until(b"\r\n")
+            return data
+        if self.left is not None:
+            if not self.left:
+                self.done = True
+                return b""
+            if not self.buf:
+                self._recv()
+            data = self._take(self.left)
+            self.left -= len(data)
+            return data
+        if not self.buf and not self._recv(until_close=True):
+            self.done = True
+            return b""
+        return self._take(len(self.buf))
+
+    def body(self):
+        out = []
+        while True:
+            data = self.read()
+            if not data:
+                return b"".join(out)
+            out.append(data)
+
+
+def parts(resp):
+    """Yields (headers, payload) for each complete part of a multipart response."""
+    boundary = resp.headers.get("content-type", "").partition("boundary=")[2].strip('"')
+    if not boundary:
+        raise ValueError("not a multipart response")
+    delim = b"--" + boundary.encode()
+    buf = b""
+    while True:
+        start = buf.find(delim)
+        end = buf.find(b"\r\n\r\n", start) if start >= 0 else -1
+        if end < 0:
+            data = resp.read()
+            if not data:
+                return
+            buf += data
+            continue
+        headers = {}
+        for line in buf[start + len(delim):end].decode("latin-1").split("\r\n"):
+            k, _, v = line.partition(":")
+            if v:
+                headers[k.strip()] = v.strip()
+        if "Content-Length" not in headers:
+            raise ValueError("part without Content-Length")
+        length = int(headers["Content-Length"])
+        while len(buf) < end + 4 + length:
+            data = resp.read()
+            if not data:
+                return
+            buf += data
+        yield headers, buf[end + 4:end + 4 + length]
+        buf = buf[end + 4 + length:]
+
+
+def http_get(host, port, path, timeout):
+    """Returns (status, body) for one request on its own connection."""
+    s = socket.create_connection((host, port), timeout=timeout)
+    try:
+        s.sendall(f"GET {path} HTTP/1.1\r\nHost: {host}\r\nConnection: close\r\n\r\n".encode())
+        resp = Response(s)
+        return resp.status, resp.body()
+    finally:
+        s.close()
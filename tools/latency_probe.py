@@ -0,0 +1,172 @@
+#!/usr/bin/env python3
+"""
+Capture-to-receive latency of /stream, per client.
+
+Estimates the offset between the host clock and the device's esp_timer clock
+from the round trip of repeated GET /clock requests (keeping the fastest
+sample, NTP style), once before and once after the run so linear drift is
+removed. It then opens one or more /stream?latency=1 viewers and, for every
+frame, combines the device's part headers with the time the frame's last
+byte arrived:
+
+    capture   X-Timestamp        frame captured by the sensor driver
+    dequeue   X-Dequeue-Us       handed to the stream session
+    send      X-Send-Us          session starts writing the part
+    sent      X-Prev-Sent-Us     last byte handed to the socket (next part)
+    receive   host clock         last byte received, mapped to device time
+
+    python3 tools/latency_probe.py 4.3.2.1 --clients 2 --duration 30
+
+Prints one JSON object per client with percentiles (ms) of each stage.
+"""
+import argparse
+import json
+import os
+import socket
+import sys
+import threading
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from http_stream import Response, parts  # noqa: E402
+
+STAGES = [
+    ("queue", "capture", "dequeue"),
+    ("process", "dequeue", "send"),
+    ("write", "send", "sent"),
+    ("network", "sent", "receive"),
+    ("total", "capture", "receive"),
+]
+
+
+def now_us():
+    return time.time_ns() // 1000
+
+
+def clock_offset(host, port, samples, timeout):
+    """Returns (device_us - host_us, rtt_us, host_us) from the fastest sample."""
+    best = None
+    for _ in range(samples):
+        # Connect first so the handshake is not part of the round trip.
+        s = socket.create_connection((host, port), timeout=timeout)
+        s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        try:
+            t0 = now_us()
+            s.sendall(f"GET /clock HTTP/1.1\r\nHost: {host}\r\nConnection: close\r\n\r\n".encode())
+            body = Response(s).body()
+            t1 = now_us()
+        finally:
+            s.close()
+        dev = json.loads(body)["us"]
+        rtt = t1 - t0
+        mid = (t0 + t1) // 2
+        if best is None or rtt < best[1]:
+            best = (dev - mid, rtt, mid)
+        time.sleep(0.02)
+    return best
+
+
+class Viewer(threading.Thread):
+    def __init__(self, args, idx):
+        super().__init__(daemon=True)
+        self.args = args
+        self.idx = idx
+        self.frames = {}   # seq -> stage times; device clock except "receive_host"
+        self.error = None
+
+    def run(self):
+        a = self.args
+        sep = "&" if "?" in a.path else "?"
+        path = f"{a.path}{sep}latency=1"
+        try:
+            s = socket.create_connection((a.host, a.port), timeout=a.timeout)
+            s.sendall(f"GET {path} HTTP/1.1\r\nHost: {a.host}\r\n\r\n".encode())
+            self.read_parts(s, time.monotonic() + a.duration)
+            s.close()
+        except (OSError, ValueError) as e:
+            self.error = str(e)
+
+    def read_parts(self, s, deadline):
+        resp = Response(s)
+        if resp.status != 200:
+            raise ValueError(f"HTTP {resp.status}")
+        for headers, _ in parts(resp):
+            self.record(headers, now_us())
+            if time.monotonic() >= deadline:
+                break
+
+    def record(self, h, recv_host):
+        if "X-Frame-Seq" not in h:
+            raise ValueError("no latency headers; firmware without ?latency=1 support")
+        sec, _, usec = h["X-Timestamp"].partition(".")
+        seq = int(h["X-Frame-Seq"])
+        self.frames[seq] = {
+            "capture": int(sec) * 1000000 + int(usec),
+            "dequeue": int(h["X-Dequeue-Us"]),
+            "send": int(h["X-Send-Us"]),
+            "receive_host": recv_host,
+        }
+        prev = self.frames.get(seq - 1)
+        if prev is not None and int(h["X-Prev-Sent-Us"]):
+            prev["sent"] = int(h["X-Prev-Sent-Us"])
+
+
+def percentiles(values):
+    if not values:
+        return None
+    v = sorted(values)
+    pick = lambda q: v[min(len(v) - 1, int(q * len(v)))]
+    return {"n": len(v), "p50": pick(0.5), "p90": pick(0.9), "p99": pick(0.99), "max": v[-1]}
+
+
+def report(viewer, to_device):
+    stages = {name: [] for name, _, _ in STAGES}
+    for f in viewer.frames.values():
+        f["receive"] = to_device(f["receive_host"])
+        for name, a, b in STAGES:
+            if a in f and b in f:
+                stages[name].append((f[b] - f[a]) / 1000.0)
+    out = {"client": viewer.idx, "frames": len(viewer.frames)}
+    if viewer.error:
+        out["error"] = viewer.error
+    for name, values in stages.items():
+        p = percentiles(values)
+        out[name + "_ms"] = {k: round(x, 2) for k, x in p.items()} if p else None
+    return out
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    ap.add_argument("host")
+    ap.add_argument("--port", type=int, default=81, help="stream server port")
+    ap.add_argument("--ctl-port", type=int, default=80, help="control server port (/clock)")
+    ap.add_argument("--path", default="/stream", help="stream path and query, e.g. /stream?variant=sub")
+    ap.add_argument("--clients", type=int, default=1)
+    ap.add_argument("--duration", type=float, default=20.0, help="s")
+    ap.add_argument("--sync-samples", type=int, default=15)
+    ap.add_argument("--timeout", type=float, default=5.0, help="socket timeout, s")
+    args = ap.parse_args()
+
+    off0, rtt0, at0 = clock_offset(args.host, args.ctl_port, args.sync_samples, args.timeout)
+    viewers = [Viewer(args, i) for i in range(args.clients)]
+    for v in viewers:
+        v.start()
+    for v in viewers:
+        v.join(args.duration + args.timeout + 5)
+    off1, rtt1, at1 = clock_offset(args.host, args.ctl_port, args.sync_samples, args.timeout)
+
+    drift = (off1 - off0) / (at1 - at0) if at1 != at0 else 0.0
+
+    def to_device(host_us):
+        return host_us + off0 + drift * (host_us - at0)
+
+    print(json.dumps({
+        "sync": {"offset_us": off0, "rtt_us": [rtt0, rtt1], "drift_ppm": round(drift * 1e6, 1),
+                 "uncertainty_ms": round(max(rtt0, rtt1) / 2000.0, 2)},
+    }), flush=True)
+    for v in viewers:
+        print(json.dumps(report(v, to_device)), flush=True)
+
+
+if __name__ == "__main__":
+    main()
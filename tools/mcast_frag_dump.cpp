@@ -0,0 +1,53 @@
+/**
+ * Host driver for the firmware's multicast fragmenter (src/mcast_frag.cpp).
+ *
+ * Reads frames from stdin, each as a big-endian u32 frame_id, u32 ts_ms and
+ * u32 length followed by the JPEG, and writes every datagram the device
+ * would send for it to stdout as a big-endian u16 length and the datagram.
+ * tools/mcast_loopback_test.py builds and runs it; by hand:
+ *
+ *   c++ -std=gnu++17 -Iinclude src/mcast_frag.cpp tools/mcast_frag_dump.cpp -o mcast_frag_dump
+ *   ./mcast_frag_dump 1376 < frames.bin > datagrams.bin
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "mcast_frag.h"
+
+static bool read32(uint32_t *v) {
+  uint8_t b[4];
+  if (fread(b, 1, 4, stdin) != 4) {
+    return false;
+  }
+  *v = (uint32_t)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+  return true;
+}
+
+int main(int argc, char **argv) {
+  long payload = argc > 1 ? strtol(argv[1], NULL, 10) : 0;
+  if (payload <= 0 || payload > 0xFFFF - MCAST_HEADER_LEN) {
+    fprintf(stderr, "usage: %s PAYLOAD < frames > datagrams\n", argv[0]);
+    return 2;
+  }
+  std::vector<uint8_t> frame, pkt(MCAST_HEADER_LEN + payload);
+  uint32_t frame_id, ts_ms, len;
+  while (read32(&frame_id)) {
+    if (!read32(&ts_ms) || !read32(&len)) {
+      fprintf(stderr, "truncated frame header\n");
+      return 1;
+    }
+    frame.resize(len);
+    if (fread(frame.data(), 1, len, stdin) != len) {
+      fprintf(stderr, "truncated frame\n");
+      return 1;
+    }
+    uint16_t count = mcast_frag_count(len, payload);
+    for (uint16_t i = 0; i < count; i++) {
+      size_t n = mcast_frag_build(pkt.data(), frame.data(), len, frame_id, ts_ms, payload, i);
+      uint8_t h[2] = {(uint8_t)(n >> 8), (uint8_t)n};
+      fwrite(h, 1, 2, stdout);
+      fwrite(pkt.data(), 1, n, stdout);
+    }
+  }
+  return fflush(stdout) == 0 ? 0 : 1;
+}
@@ -0,0 +1,193 @@
+#!/usr/bin/env python3
+"""
+Loopback test for the multicast frame stream and tools/mcast_receiver.py.
+
+The datagrams come from the firmware's own fragmenter: src/mcast_frag.cpp,
+the code src/mcast_stream.cpp sends with, is built for the host together
+with tools/mcast_frag_dump.cpp and fed the test frames. They are sent to a
+multicast group over the loopback interface, and mcast_receiver's socket and
+Reassembler must give every frame back byte for byte. The loss cases
+(dropped, duplicated, reordered fragments, frames lost whole) feed the
+Reassembler directly, so its statistics are checked against exactly known
+losses.
+
+    python3 tools/mcast_loopback_test.py
+    python3 tools/mcast_loopback_test.py --group 239.255.42.99 --port 5104 -v
+    CXX=clang++ python3 tools/mcast_loopback_test.py
+
+Exits non-zero on failure. Everything is skipped, not failed, when no host
+C++ compiler is found; the socket case is skipped where the host cannot
+route multicast over loopback.
+"""
+import argparse
+import os
+import random
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import unittest
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from mcast_receiver import HEADER, Reassembler, open_socket  # noqa: E402
+
+GROUP = "239.255.42.99"
+PORT = 5104
+PAYLOAD = 1400 - HEADER.size  # the device default
+
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+FRAME = struct.Struct(">III")  # frame_id, ts_ms, length; see tools/mcast_frag_dump.cpp
+build_dir = None
+dump = None
+
+
+def setUpModule():
+    global build_dir, dump
+    cxx = shutil.which(os.environ.get("CXX", "c++"))
+    if not cxx:
+        raise unittest.SkipTest("no host C++ compiler to build src/mcast_frag.cpp")
+    build_dir = tempfile.mkdtemp(prefix="mcast_frag")
+    dump = os.path.join(build_dir, "mcast_frag_dump")
+    subprocess.run(
+        [cxx, "-std=gnu++17", "-I", os.path.join(ROOT, "include"), os.path.join(ROOT, "src", "mcast_frag.cpp"),
+         os.path.join(ROOT, "tools", "mcast_frag_dump.cpp"), "-o", dump],
+        check=True)
+
+
+def tearDownModule():
+    if build_dir:
+        shutil.rmtree(build_dir, ignore_errors=True)
+
+
+def fragments(frame_id, jpeg, ts_ms=0, payload=PAYLOAD):
+    """The datagrams the device sends for one frame, from the firmware's fragmenter."""
+    out = subprocess.run([dump, str(payload)], input=FRAME.pack(frame_id, ts_ms, len(jpeg)) + jpeg,
+                         stdout=subprocess.PIPE, check=True).stdout
+    grams = []
+    pos = 0
+    while pos < len(out):
+        n = int.from_bytes(out[pos:pos + 2], "big")
+        grams.append(out[pos + 2:pos + 2 + n])
+        pos += 2 + n
+    return grams
+
+
+def fake_jpeg(rng, size):
+    return b"\xff\xd8" + bytes(rng.getrandbits(8) for _ in range(size - 4)) + b"\xff\xd9"
+
+
+class ReassemblerTest(unittest.TestCase):
+    def setUp(self):
+        self.rng = random.Random(1)
+        self.frames = [fake_jpeg(self.rng, n) for n in (300, PAYLOAD, PAYLOAD + 1, 9000, 24000)]
+
+    def feed_all(self, rx, datagrams):
+        done = []
+        for i, d in enumerate(datagrams):
+            done += rx.feed(d, now=i * 0.001)
+        return done
+
+    def test_in_order(self):
+        rx = Reassembler()
+        grams = [d for fid, f in enumerate(self.frames) for d in fragments(fid, f, ts_ms=fid * 40)]
+        done = self.feed_all(rx, grams)
+        self.assertEqual([(fid, ts, jpeg) for fid, ts, jpeg in done], [(i, i * 40, f) for i, f in enumerate(self.frames)])
+        self.assertEqual(rx.loss_ratio(), 0.0)
+        self.assertEqual(rx.stats["frames"], len(self.frames))
+
+    def test_reordered_and_duplicated(self):
+        # Fragments of a frame in any order; a frame older than the last
+        # completed one would be dropped as late, as a live viewer wants.
+        rx = Reassembler(window=8)
+        grams = []
+        for fid, f in enumerate(self.frames):
+            g = fragments(fid, f)
+            self.rng.shuffle(g)
+            grams += g
+        done = self.feed_all(rx, grams + grams[:5])
+        self.assertEqual(sorted(fid for fid, _, _ in done), list(range(len(self.frames))))
+        for fid, _, jpeg in done:
+            self.assertEqual(jpeg, self.frames[fid])
+        self.assertEqual(rx.stats["duplicates"] + rx.stats["late"], 5)
+
+    def test_dropped_fragment(self):
+        rx = Reassembler(window=2)
+        grams = []
+        for fid, f in enumerate(self.frames):
+            g = fragments(fid, f)
+            if fid == 3:
+                del g[2]  # one of 7
+            grams += g
+        done = self.feed_all(rx, grams)
+        rx.expire(now=10.0)
+        self.assertNotIn(3, [fid for fid, _, _ in done])
+        self.assertEqual(rx.stats["incomplete"], 1)
+        self.assertEqual(rx.stats["fragments_lost"], 1)
+        self.assertAlmostEqual(rx.loss_ratio(), 1 / len(self.frames))
+
+    def test_missing_frame(self):
+        rx = Reassembler()
+        grams = [d for fid, f in enumerate(self.frames) if fid != 1 for d in fragments(fid, f)]
+        self.feed_all(rx, grams)
+        self.assertEqual(rx.stats["missing"], 1)
+        self.assertEqual(rx.stats["frames"], len(self.frames) - 1)
+
+    def test_bad_datagrams(self):
+        rx = Reassembler()
+        good = fragments(0, self.frames[0])[0]
+        self.feed_all(rx, [b"short", b"\x00" * HEADER.size + good[HEADER.size:], good[:2] + b"\x09" + good[3:]])
+        self.assertEqual(rx.stats["bad"], 3)
+
+
+class LoopbackTest(unittest.TestCase):
+    def test_multicast_loopback(self):
+        try:
+            rx_sock = open_socket(GROUP, PORT, "127.0.0.1")
+            tx = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+            tx.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF, socket.inet_aton("127.0.0.1"))
+            tx.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, 1)
+            tx.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_LOOP, 1)
+        except OSError as e:
+            self.skipTest(f"no multicast on loopback: {e}")
+        rx_sock.settimeout(1.0)
+        rng = random.Random(2)
+        frames = [fake_jpeg(rng, rng.randrange(2000, 30000)) for _ in range(20)]
+        rx = Reassembler(window=len(frames))
+        done = []
+        try:
+            for fid, f in enumerate(frames):
+                for d in fragments(fid, f, ts_ms=fid):
+                    tx.sendto(d, (GROUP, PORT))
+                # Drain as we go so the receive buffer never overflows.
+                while len(done) < fid + 1:
+                    try:
+                        done += rx.feed(rx_sock.recv(65536))
+                    except socket.timeout:
+                        if not done:
+                            self.skipTest("multicast datagrams do not come back over loopback")
+                        break
+        finally:
+            tx.close()
+            rx_sock.close()
+        self.assertEqual([jpeg for _, _, jpeg in done], frames)
+        self.assertEqual(rx.loss_ratio(), 0.0)
+
+
+def main():
+    global GROUP, PORT
+    ap = argparse.ArgumentParser(description="Multicast stream loopback test")
+    ap.add_argument("--group", default=GROUP)
+    ap.add_argument("--port", type=int, default=PORT)
+    ap.add_argument("-v", "--verbose", action="store_true")
+    args = ap.parse_args()
+    GROUP, PORT = args.group, args.port
+    suite = unittest.defaultTestLoader.loadTestsFromModule(sys.modules[__name__])
+    result = unittest.TextTestRunner(verbosity=2 if args.verbose else 1).run(suite)
+    sys.exit(0 if result.wasSuccessful() else 1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,174 @@
+#!/usr/bin/env python3
+"""
+Receiver for the camera's multicast frame stream (see include/mcast_frag.h).
+
+Joins the group, reassembles fragmented JPEG frames and reports loss. Usable
+as a library (Reassembler) or from the command line:
+
+    python3 tools/mcast_receiver.py --group 239.255.42.1 --port 5004 --out frames/
+    python3 tools/mcast_receiver.py --mjpeg - | ffplay -f mjpeg -
+
+Prints a JSON stats line every --interval seconds to stderr.
+"""
+import argparse
+import json
+import os
+import socket
+import struct
+import sys
+import time
+
+MAGIC = 0x4E4A
+VERSION = 1
+HEADER = struct.Struct(">HBBIHHIII")  # magic ver flags frame_id idx count len off ts_ms
+FLAG_LAST = 0x01
+
+
+class Reassembler:
+    """Collects fragments into frames.
+
+    A frame still incomplete once a frame `window` ids newer has started, or
+    after `timeout` seconds, is given up and its missing fragments counted as
+    lost. Frame ids that never show up at all count as missing frames.
+    """
+
+    def __init__(self, window=4, timeout=1.0):
+        self.window = window
+        self.timeout = timeout
+        self.pending = {}
+        self.newest = None
+        self.last_done = None
+        self.stats = {
+            "datagrams": 0,
+            "bad": 0,
+            "duplicates": 0,
+            "late": 0,
+            "frames": 0,
+            "incomplete": 0,
+            "missing": 0,
+            "fragments_lost": 0,
+            "bytes": 0,
+        }
+
+    def feed(self, data, now=None):
+        """Returns a list of (frame_id, capture_ms, jpeg) completed by data."""
+        now = time.monotonic() if now is None else now
+        self.stats["datagrams"] += 1
+        if len(data) < HEADER.size:
+            self.stats["bad"] += 1
+            return []
+        magic, ver, flags, fid, idx, count, length, off, ts = HEADER.unpack_from(data)
+        payload = data[HEADER.size:]
+        if magic != MAGIC or ver != VERSION or idx >= count or off + len(payload) > length:
+            self.stats["bad"] += 1
+            return []
+        if self.last_done is not None and fid <= self.last_done and fid not in self.pending:
+            self.stats["late"] += 1
+            return []
+
+        frame = self.pending.get(fid)
+        if frame is None:
+            frame = {"count": count, "len": length, "ts": ts, "parts": {}, "seen": now}
+            self.pending[fid] = frame
+            if self.newest is None or fid > self.newest:
+                self.newest = fid
+        if idx in frame["parts"]:
+            self.stats["duplicates"] += 1
+            return []
+        frame["parts"][idx] = (off, payload)
+
+        done = []
+        if len(frame["parts"]) == frame["count"]:
+            buf = bytearray(frame["len"])
+            for o, p in frame["parts"].values():
+                buf[o:o + len(p)] = p
+            del self.pending[fid]
+            self._finish(fid)
+            self.stats["frames"] += 1
+            self.stats["bytes"] += frame["len"]
+            done.append((fid, frame["ts"], bytes(buf)))
+        self.expire(now)
+        return done
+
+    def expire(self, now=None):
+        now = time.monotonic() if now is None else now
+        for fid in sorted(self.pending):
+            frame = self.pending[fid]
+            if self.newest - fid >= self.window or now - frame["seen"] > self.timeout:
+                self.stats["incomplete"] += 1
+                self.stats["fragments_lost"] += frame["count"] - len(frame["parts"])
+                del self.pending[fid]
+                self._finish(fid)
+
+    def _finish(self, fid):
+        if self.last_done is not None and fid > self.last_done + 1:
+            # Ids skipped entirely (every fragment lost) and not still pending.
+            gap = [i for i in range(self.last_done + 1, fid) if i not in self.pending]
+            self.stats["missing"] += len(gap)
+        if self.last_done is None or fid > self.last_done:
+            self.last_done = fid
+
+    def loss_ratio(self):
+        s = self.stats
+        total = s["frames"] + s["incomplete"] + s["missing"]
+        return (s["incomplete"] + s["missing"]) / total if total else 0.0
+
+
+def open_socket(group, port, iface):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 20)
+    s.bind(("", port))
+    mreq = socket.inet_aton(group) + socket.inet_aton(iface)
+    s.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, mreq)
+    return s
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Multicast frame receiver")
+    ap.add_argument("--group", default="239.255.42.1")
+    ap.add_argument("--port", type=int, default=5004)
+    ap.add_argument("--iface", default="0.0.0.0", help="local address to join the group on")
+    ap.add_argument("--out", help="directory to write frame_<id>.jpg files to")
+    ap.add_argument("--mjpeg", help="append frames as MJPEG to this file ('-' for stdout)")
+    ap.add_argument("--duration", type=float, default=0, help="stop after this many seconds")
+    ap.add_argument("--interval", type=float, default=5.0, help="stats period, s")
+    args = ap.parse_args()
+
+    sock = open_socket(args.group, args.port, args.iface)
+    sock.settimeout(0.5)
+    rx = Reassembler()
+    if args.out:
+        os.makedirs(args.out, exist_ok=True)
+    mjpeg = None
+    if args.mjpeg:
+        mjpeg = sys.stdout.buffer if args.mjpeg == "-" else open(args.mjpeg, "ab")
+
+    start = last_report = time.monotonic()
+    while not args.duration or time.monotonic() - start < args.duration:
+        try:
+            data = sock.recv(65536)
+            frames = rx.feed(data)
+        except socket.timeout:
+            frames = []
+            if rx.pending:
+                rx.expire()
+        for fid, ts, jpeg in frames:
+            if args.out:
+                with open(os.path.join(args.out, f"frame_{fid:08d}.jpg"), "wb") as f:
+                    f.write(jpeg)
+            if mjpeg:
+                mjpeg.write(jpeg)
+                mjpeg.flush()
+        now = time.monotonic()
+        if now - last_report >= args.interval:
+            report = dict(rx.stats, loss=round(rx.loss_ratio(), 4), fps=round(rx.stats["frames"] / (now - start), 2))
+            print(json.dumps(report), file=sys.stderr, flush=True)
+            last_report = now
+
+    report = dict(rx.stats, loss=round(rx.loss_ratio(), 4))
+    print(json.dumps({"summary": report}), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,218 @@
+#!/usr/bin/env python3
+"""
+Download benchmark for SD card recordings.
+
+Has the device read one recording off the card without sending it
+(/recordings?bench=), which gives the raw card read rate, then downloads the
+same file from /recordings/<file>: once whole and, with --piece, again as a
+run of Range requests of that size. Each download is checked against the
+advertised length and, for Range pieces, against the whole-file copy.
+
+With --stream a /stream reader runs alongside the downloads, to show what
+a download costs the viewers; its fps is reported per phase.
+
+    python3 tools/recording_bench.py 4.3.2.1
+    python3 tools/recording_bench.py 4.3.2.1 --file 000012.avi --piece 262144 --stream --out sd.json
+
+Prints (and with --out also writes) one JSON document with MB/s for the card
+and for each download mode, and download / card as a ratio.
+"""
+import argparse
+import json
+import socket
+import threading
+import time
+
+
+def request(host, port, method, path, timeout, headers=None, sink=None):
+    """One request on its own connection; returns (status, headers, body, seconds)."""
+    start = time.monotonic()
+    s = socket.create_connection((host, port), timeout=timeout)
+    try:
+        extra = "".join(f"{k}: {v}\r\n" for k, v in (headers or {}).items())
+        s.sendall(f"{method} {path} HTTP/1.1\r\nHost: {host}\r\n{extra}Connection: close\r\n\r\n".encode())
+        buf = b""
+        while b"\r\n\r\n" not in buf:
+            chunk = s.recv(65536)
+            if not chunk:
+                raise IOError("connection closed in the headers")
+            buf += chunk
+        head, _, body = buf.partition(b"\r\n\r\n")
+        lines = head.decode("latin-1").split("\r\n")
+        status = int(lines[0].split(" ", 2)[1])
+        hdrs = {k.strip().lower(): v.strip() for k, _, v in (l.partition(":") for l in lines[1:])}
+        parts = [body]
+        if method != "HEAD":
+            while True:
+                chunk = s.recv(65536)
+                if not chunk:
+                    break
+                parts.append(chunk)
+    finally:
+        s.close()
+    body = b"".join(parts)
+    if hdrs.get("transfer-encoding") == "chunked":
+        body = dechunk(body)
+    return status, hdrs, body, time.monotonic() - start
+
+
+def dechunk(data):
+    out, pos = [], 0
+    while True:
+        eol = data.index(b"\r\n", pos)
+        size = int(data[pos:eol].split(b";")[0], 16)
+        if size == 0:
+            return b"".join(out)
+        out.append(data[eol + 2:eol + 2 + size])
+        pos = eol + 2 + size + 2
+
+
+def mbps(nbytes, seconds):
+    return round(nbytes / seconds / 1e6, 3) if seconds > 0 else None
+
+
+class StreamReader(threading.Thread):
+    """Counts multipart boundaries on /stream; frames are read off in phases."""
+
+    def __init__(self, args):
+        super().__init__(daemon=True)
+        self.args = args
+        self.frames = 0
+        self.stop = threading.Event()
+        self.error = None
+
+    def run(self):
+        try:
+            s = socket.create_connection((self.args.host, self.args.stream_port), timeout=self.args.timeout)
+            s.sendall(f"GET /stream HTTP/1.1\r\nHost: {self.args.host}\r\n\r\n".encode())
+            tail = b""
+            while not self.stop.is_set():
+                chunk = s.recv(65536)
+                if not chunk:
+                    break
+                data = tail + chunk
+                self.frames += data.count(b"Content-Type: image/jpeg")
+                tail = data[-32:]
+            s.close()
+        except OSError as e:
+            self.error = str(e)
+
+    def phase(self, fn):
+        start_frames, start = self.frames, time.monotonic()
+        result = fn()
+        elapsed = time.monotonic() - start
+        result["stream_fps"] = round((self.frames - start_frames) / elapsed, 2) if elapsed > 0 else None
+        return result
+
+
+def pick_file(args):
+    status, _, body, _ = request(args.host, args.port, "GET", "/recordings", args.timeout)
+    if status != 200:
+        raise SystemExit(f"/recordings: HTTP {status}")
+    files = json.loads(body)["files"]
+    if args.file:
+        match = [f for f in files if f["name"] == args.file]
+        if not match:
+            raise SystemExit(f"{args.file} is not on the card")
+        return match[0]
+    avi = [f for f in files if f["name"].endswith(".avi")]
+    if not avi:
+        raise SystemExit("no recordings on the card")
+    return max(avi, key=lambda f: f["bytes"])
+
+
+def card(args, name):
+    status, _, body, elapsed = request(args.host, args.port, "GET", f"/recordings?bench={name}", args.timeout)
+    if status != 200:
+        return {"status": status}
+    doc = json.loads(body)
+    return {"bytes": doc["bytes"], "MBps": round(doc["read_kBps"] / 1000, 3), "wall_s": round(elapsed, 2)}
+
+
+def whole(args, name, size):
+    status, hdrs, body, elapsed = request(args.host, args.port, "GET", f"/recordings/{name}", args.timeout)
+    ok = status == 200 and len(body) == size == int(hdrs.get("content-length", -1))
+    return {"status": status, "bytes": len(body), "ok": ok, "MBps": mbps(len(body), elapsed), "_body": body}
+
+
+def ranged(args, name, size, reference):
+    total, elapsed, ok, pos, requests = 0, 0.0, True, 0, 0
+    while pos < size:
+        end = min(pos + args.piece, size) - 1
+        status, hdrs, body, t = request(args.host, args.port, "GET", f"/recordings/{name}", args.timeout,
+                                        {"Range": f"bytes={pos}-{end}"})
+        requests += 1
+        elapsed += t
+        total += len(body)
+        ok = ok and status == 206 and hdrs.get("content-range") == f"bytes {pos}-{end}/{size}"
+        if reference is not None:
+            ok = ok and body == reference[pos:end + 1]
+        if status not in (200, 206):
+            break
+        pos = end + 1
+    return {"requests": requests, "piece": args.piece, "bytes": total, "ok": ok, "MBps": mbps(total, elapsed)}
+
+
+def run(args):
+    f = pick_file(args)
+    name, size = f["name"], f["bytes"]
+    status, hdrs, _, _ = request(args.host, args.port, "HEAD", f"/recordings/{name}", args.timeout)
+    doc = {
+        "host": args.host,
+        "file": name,
+        "bytes": size,
+        "head": {"status": status, "content_length": int(hdrs.get("content-length", -1)),
+                 "accept_ranges": hdrs.get("accept-ranges")},
+    }
+
+    reader = None
+    if args.stream:
+        reader = StreamReader(args)
+        reader.start()
+        time.sleep(1.0)
+        doc["stream_idle"] = reader.phase(lambda: (time.sleep(args.idle) or {}))
+    phase = reader.phase if reader else (lambda fn: fn())
+
+    doc["card"] = phase(lambda: card(args, name))
+    doc["whole"] = phase(lambda: whole(args, name, size))
+    reference = doc["whole"].pop("_body")
+    if args.piece:
+        doc["ranged"] = phase(lambda: ranged(args, name, size, reference if doc["whole"]["ok"] else None))
+    if reader:
+        reader.stop.set()
+        if reader.error:
+            doc["stream_error"] = reader.error
+
+    card_mbps = doc["card"].get("MBps")
+    for mode in ("whole", "ranged"):
+        if mode in doc and card_mbps and doc[mode]["MBps"]:
+            doc[mode]["of_card"] = round(doc[mode]["MBps"] / card_mbps, 3)
+    status, _, body, _ = request(args.host, args.port, "GET", "/info", args.timeout)
+    if status == 200:
+        doc["device"] = json.loads(body).get("recordings")
+    return doc
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    ap.add_argument("host")
+    ap.add_argument("--port", type=int, default=80)
+    ap.add_argument("--stream-port", type=int, default=81)
+    ap.add_argument("--file", help="recording to use, default the largest .avi")
+    ap.add_argument("--piece", type=int, default=1 << 20, help="Range request size in bytes, 0 to skip")
+    ap.add_argument("--stream", action="store_true", help="keep a /stream reader open throughout")
+    ap.add_argument("--idle", type=float, default=5.0, help="stream baseline before the downloads, s")
+    ap.add_argument("--timeout", type=float, default=30.0, help="socket timeout, s")
+    ap.add_argument("--out", help="also write the result to this file")
+    args = ap.parse_args()
+
+    doc = run(args)
+    text = json.dumps(doc, indent=2)
+    print(text, flush=True)
+    if args.out:
+        with open(args.out, "w") as f:
+            f.write(text + "\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+"""
+Soak scenario: stream viewers that vanish without closing.
+
+Fills every /stream slot with viewers that receive one frame and then stop
+reading while keeping their sockets open, which is what the device sees when
+a phone walks out of range or a browser tab is frozen. It then measures how
+long a fresh viewer needs to get its first frame. With the tuned stream
+server profile this should be a few seconds (send timeout + LRU purge), not
+the minutes a TCP retransmission timeout takes.
+
+    python3 tools/soak_stale_viewers.py 4.3.2.1 --stalled 3 --rounds 5
+
+Prints one JSON object per round and a summary at the end.
+"""
+import argparse
+import json
+import socket
+import statistics
+import time
+
+
+def open_viewer(host, port, path, timeout):
+    s = socket.create_connection((host, port), timeout=timeout)
+    s.sendall(f"GET {path} HTTP/1.1\r\nHost: {host}\r\n\r\n".encode())
+    return s
+
+
+def read_first_frame(s, timeout):
+    """Returns (status, frame_bytes); frame_bytes is 0 if none arrived."""
+    deadline = time.monotonic() + timeout
+    buf = b""
+    status = None
+    while time.monotonic() < deadline:
+        s.settimeout(max(0.05, deadline - time.monotonic()))
+        try:
+            chunk = s.recv(4096)
+        except socket.timeout:
+            break
+        if not chunk:
+            break
+        buf += chunk
+        if status is None and b"\r\n" in buf:
+            status = int(buf.split(b" ", 2)[1])
+            if status != 200:
+                return status, 0
+        head_end = buf.find(b"\r\n\r\n")
+        if head_end < 0:
+            continue
+        body = buf[head_end + 4:]
+        cl = body.find(b"Content-Length: ")
+        if cl < 0:
+            continue
+        eol = body.find(b"\r\n", cl)
+        part_end = body.find(b"\r\n\r\n", cl)
+        if eol < 0 or part_end < 0:
+            continue
+        length = int(body[cl + 16:eol])
+        if len(body) - (part_end + 4) >= length:
+            return status, length
+    return status, 0
+
+
+def admit_new_viewer(args):
+    """Retries until a viewer gets a frame; returns (seconds, rejects)."""
+    start = time.monotonic()
+    rejects = 0
+    while time.monotonic() - start < args.give_up:
+        try:
+            s = open_viewer(args.host, args.port, args.path, args.timeout)
+        except OSError:
+            rejects += 1
+            time.sleep(args.retry)
+            continue
+        status, length = read_first_frame(s, args.timeout)
+        s.close()
+        if status == 200 and length:
+            return time.monotonic() - start, rejects
+        rejects += 1
+        time.sleep(args.retry)
+    return None, rejects
+
+
+def run_round(args):
+    stalled = []
+    for _ in range(args.stalled):
+        s = open_viewer(args.host, args.port, args.path, args.timeout)
+        status, length = read_first_frame(s, args.timeout)
+        if status != 200 or not length:
+            s.close()
+            break
+        # Shrink the receive window and stop reading: the device's sends stall.
+        s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1024)
+        stalled.append(s)
+    admit_s, rejects = admit_new_viewer(args)
+    for s in stalled:
+        s.close()
+    return {"stalled": len(stalled), "admit_s": admit_s, "rejects": rejects}
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    ap.add_argument("host")
+    ap.add_argument("--port", type=int, default=81)
+    ap.add_argument("--path", default="/stream")
+    ap.add_argument("--stalled", type=int, default=3, help="viewers to abandon (stream slots)")
+    ap.add_argument("--rounds", type=int, default=5)
+    ap.add_argument("--timeout", type=float, default=5.0, help="per-connection timeout, s")
+    ap.add_argument("--retry", type=float, default=0.25, help="delay between admission attempts, s")
+    ap.add_argument("--give-up", type=float, default=120.0, help="max wait for admission, s")
+    ap.add_argument("--settle", type=float, default=3.0, help="pause between rounds, s")
+    args = ap.parse_args()
+
+    results = []
+    for i in range(args.rounds):
+        r = run_round(args)
+        r["round"] = i
+        print(json.dumps(r), flush=True)
+        results.append(r)
+        time.sleep(args.settle)
+
+    admitted = [r["admit_s"] for r in results if r["admit_s"] is not None]
+    summary = {
+        "rounds": len(results),
+        "admitted": len(admitted),
+        "admit_s_median": statistics.median(admitted) if admitted else None,
+        "admit_s_max": max(admitted) if admitted else None,
+    }
+    print(json.dumps({"summary": summary}))
+
+
+if __name__ == "__main__":
+    main()
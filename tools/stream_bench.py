@@ -0,0 +1,277 @@
+#!/usr/bin/env python3
+"""
+Load generator and benchmark for the stream and control servers.
+
+Opens N concurrent /stream readers and, alongside them, drives a weighted
+mix of control-server requests at a fixed total rate:
+
+    capture   GET /capture            a full still through the capture path
+    status    GET /status             sensor state (SCCB register reads)
+    control   GET /control?var=brightness&val=<current>   a no-op setting write
+
+Each reader de-chunks and splits the multipart stream with http_stream.py
+and timestamps every complete frame, giving per-client fps, throughput and
+inter-frame jitter; every control request is timed from connect to the last
+byte.
+
+    python3 tools/stream_bench.py 4.3.2.1 --clients 3 --mix capture=1,status=4,control=1 --rps 4 --duration 60 --out build_a.json
+    python3 tools/stream_bench.py --compare build_a.json build_b.json
+
+Prints (and with --out also writes) one JSON document. --compare prints the
+headline numbers of two such documents side by side with the change in %.
+"""
+import argparse
+import json
+import os
+import random
+import socket
+import statistics
+import sys
+import threading
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from http_stream import Response, http_get, parts  # noqa: E402
+
+REQUESTS = {
+    "capture": "/capture",
+    "status": "/status",
+    "control": "/control?var=brightness&val={brightness}",
+}
+
+
+def percentiles(values):
+    if not values:
+        return None
+    v = sorted(values)
+    pick = lambda q: v[min(len(v) - 1, int(q * len(v)))]
+    return {"n": len(v), "p50": round(pick(0.5), 2), "p90": round(pick(0.9), 2), "p99": round(pick(0.99), 2),
+            "max": round(v[-1], 2)}
+
+
+class Reader(threading.Thread):
+    def __init__(self, args, idx, stop):
+        super().__init__(daemon=True)
+        self.args = args
+        self.idx = idx
+        self.stop = stop
+        self.status = None
+        self.frames = 0
+        self.bytes = 0
+        self.arrivals = []
+        self.error = None
+
+    def run(self):
+        a = self.args
+        try:
+            s = socket.create_connection((a.host, a.stream_port), timeout=a.timeout)
+            s.sendall(f"GET {a.path} HTTP/1.1\r\nHost: {a.host}\r\n\r\n".encode())
+            try:
+                self.read_parts(s)
+            finally:
+                s.close()
+        except (OSError, ValueError) as e:
+            if not self.stop.is_set():
+                self.error = str(e)
+
+    def read_parts(self, s):
+        resp = Response(s)
+        self.status = resp.status
+        if self.status != 200:
+            return
+        for _, jpeg in parts(resp):
+            self.arrivals.append(time.monotonic())
+            self.frames += 1
+            self.bytes += len(jpeg)
+            if self.stop.is_set():
+                return
+        raise ValueError("stream closed by the server")
+
+    def report(self, duration):
+        out = {"client": self.idx, "status": self.status, "frames": self.frames}
+        if self.error:
+            out["error"] = self.error
+        intervals = [(b - a) * 1000.0 for a, b in zip(self.arrivals, self.arrivals[1:])]
+        span = self.arrivals[-1] - self.arrivals[0] if len(self.arrivals) > 1 else 0
+        out["fps"] = round((len(self.arrivals) - 1) / span, 2) if span else 0.0
+        out["kbps"] = round(self.bytes * 8 / duration / 1000, 1)
+        out["interval_ms"] = percentiles(intervals)
+        out["jitter_ms"] = round(statistics.pstdev(intervals), 2) if len(intervals) > 1 else None
+        return out
+
+
+class Requester(threading.Thread):
+    def __init__(self, args, mix, rate, stop, results, lock, brightness):
+        super().__init__(daemon=True)
+        self.args = args
+        self.mix = mix
+        self.rate = rate
+        self.stop = stop
+        self.results = results
+        self.lock = lock
+        self.brightness = brightness
+
+    def run(self):
+        a = self.args
+        kinds, weights = zip(*self.mix)
+        next_at = time.monotonic()
+        while not self.stop.is_set():
+            kind = random.choices(kinds, weights)[0]
+            path = REQUESTS[kind].format(brightness=self.brightness)
+            t0 = time.monotonic()
+            try:
+                status, _ = http_get(a.host, a.ctl_port, path, a.timeout)
+                err = None if status == 200 else f"HTTP {status}"
+            except (OSError, ValueError, IndexError) as e:
+                err = type(e).__name__
+            ms = (time.monotonic() - t0) * 1000.0
+            with self.lock:
+                r = self.results.setdefault(kind, {"latency": [], "errors": {}})
+                if err:
+                    r["errors"][err] = r["errors"].get(err, 0) + 1
+                else:
+                    r["latency"].append(ms)
+            next_at += 1.0 / self.rate
+            delay = next_at - time.monotonic()
+            if delay > 0:
+                self.stop.wait(delay)
+            else:
+                next_at = time.monotonic()  # falling behind: do not burst to catch up
+
+
+def parse_mix(text):
+    mix = []
+    for item in text.split(","):
+        name, _, weight = item.partition("=")
+        if name not in REQUESTS:
+            raise SystemExit(f"unknown request type {name!r}; use {', '.join(REQUESTS)}")
+        w = float(weight or 1)
+        if w > 0:
+            mix.append((name, w))
+    return mix
+
+
+def device_info(args):
+    try:
+        status, body = http_get(args.host, args.ctl_port, "/info", args.timeout)
+        if status == 200:
+            info = json.loads(body)
+            return {k: info[k] for k in ("chip", "chip_rev", "sdk", "cpu_mhz", "free_heap", "min_free_heap", "psram_free", "framesize",
+                                          "quality") if k in info}
+    except (OSError, ValueError, IndexError):
+        pass
+    return None
+
+
+def current_brightness(args):
+    try:
+        status, body = http_get(args.host, args.ctl_port, "/status", args.timeout)
+        if status == 200:
+            return json.loads(body).get("brightness", 0)
+    except (OSError, ValueError, IndexError):
+        pass
+    return 0
+
+
+def run(args):
+    mix = parse_mix(args.mix) if args.rps > 0 else []
+    info_before = device_info(args)
+    brightness = current_brightness(args)
+    stop = threading.Event()
+    lock = threading.Lock()
+    results = {}
+
+    readers = [Reader(args, i, stop) for i in range(args.clients)]
+    for r in readers:
+        r.start()
+        time.sleep(args.stagger)
+    requesters = []
+    if mix:
+        workers = max(1, args.workers)
+        requesters = [Requester(args, mix, args.rps / workers, stop, results, lock, brightness) for _ in range(workers)]
+    start = time.monotonic()
+    for q in requesters:
+        q.start()
+    stop.wait(args.duration)
+    stop.set()
+    duration = time.monotonic() - start
+    for t in readers + requesters:
+        t.join(args.timeout + 1)
+
+    streams = [r.report(duration) for r in readers]
+    ok = [s for s in streams if s["status"] == 200 and "error" not in s]
+    jitters = [s["jitter_ms"] for s in ok if s["jitter_ms"] is not None]
+    requests = {}
+    for kind, r in sorted(results.items()):
+        n = len(r["latency"]) + sum(r["errors"].values())
+        requests[kind] = {"n": n, "rps": round(n / duration, 2), "errors": r["errors"], "latency_ms": percentiles(r["latency"])}
+    return {
+        "target": {"host": args.host, "stream_port": args.stream_port, "ctl_port": args.ctl_port, "path": args.path},
+        "load": {"clients": args.clients, "mix": args.mix if mix else None, "rps": args.rps, "duration_s": round(duration, 1)},
+        "device": {"before": info_before, "after": device_info(args)},
+        "summary": {
+            "clients_ok": len(ok),
+            "total_fps": round(sum(s["fps"] for s in ok), 2),
+            "min_fps": min((s["fps"] for s in ok), default=0.0),
+            "mean_jitter_ms": round(statistics.mean(jitters), 2) if jitters else None,
+            "request_errors": sum(sum(r["errors"].values()) for r in results.values()),
+        },
+        "streams": streams,
+        "requests": requests,
+    }
+
+
+def headline(doc):
+    out = dict(doc["summary"])
+    for kind, r in doc["requests"].items():
+        lat = r["latency_ms"] or {}
+        out[f"{kind}_p50_ms"] = lat.get("p50")
+        out[f"{kind}_p99_ms"] = lat.get("p99")
+    return out
+
+
+def compare(base_path, new_path):
+    with open(base_path) as f:
+        base = headline(json.load(f))
+    with open(new_path) as f:
+        new = headline(json.load(f))
+    rows = {}
+    for key in list(base) + [k for k in new if k not in base]:
+        a, b = base.get(key), new.get(key)
+        change = round((b - a) * 100.0 / a, 1) if isinstance(a, (int, float)) and isinstance(b, (int, float)) and a else None
+        rows[key] = {"base": a, "new": b, "change_pct": change}
+    return rows
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    ap.add_argument("host", nargs="?")
+    ap.add_argument("--stream-port", type=int, default=81)
+    ap.add_argument("--ctl-port", type=int, default=80)
+    ap.add_argument("--path", default="/stream", help="stream path and query, e.g. /stream?variant=sub")
+    ap.add_argument("--clients", type=int, default=2, help="concurrent stream readers")
+    ap.add_argument("--stagger", type=float, default=0.2, help="delay between opening readers, s")
+    ap.add_argument("--mix", default="capture=1,status=4,control=1", help="request weights")
+    ap.add_argument("--rps", type=float, default=2.0, help="total control request rate, 0 for none")
+    ap.add_argument("--workers", type=int, default=2, help="concurrent control request workers")
+    ap.add_argument("--duration", type=float, default=30.0, help="s")
+    ap.add_argument("--timeout", type=float, default=5.0, help="socket timeout, s")
+    ap.add_argument("--out", help="also write the result to this file")
+    ap.add_argument("--compare", nargs=2, metavar=("BASE", "NEW"), help="compare two result files instead of running")
+    args = ap.parse_args()
+
+    if args.compare:
+        print(json.dumps(compare(*args.compare), indent=2))
+        return
+    if not args.host:
+        ap.error("host is required unless --compare is given")
+    doc = run(args)
+    text = json.dumps(doc, indent=2)
+    print(text, flush=True)
+    if args.out:
+        with open(args.out, "w") as f:
+            f.write(text + "\n")
+
+
+if __name__ == "__main__":
+    main()